@@ -0,0 +1,59 @@
+﻿#include "backgroundworker.h"
+
+namespace dicomstitcher {
+
+BackgroundWorker::BackgroundWorker()
+    : m_thread([this]() { Run(); })
+{
+}
+
+BackgroundWorker::~BackgroundWorker()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+        m_tasks.clear();
+    }
+    m_condition.notify_all();
+    if (m_thread.joinable()) {
+        m_thread.join();
+    }
+}
+
+void BackgroundWorker::Post(std::function<void()> task)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_tasks.push_back(std::move(task));
+    }
+    m_condition.notify_one();
+}
+
+void BackgroundWorker::ClearPending()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tasks.clear();
+}
+
+void BackgroundWorker::Run()
+{
+    for (;;) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_condition.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+            if (m_stopping) {
+                return;
+            }
+            task = std::move(m_tasks.front());
+            m_tasks.pop_front();
+        }
+        try {
+            task();
+        } catch (...) {
+            // 预取失败不影响前台，需要时由前台同步重算
+        }
+    }
+}
+
+} // namespace dicomstitcher
@@ -0,0 +1,38 @@
+﻿#ifndef BACKGROUNDWORKER_H
+#define BACKGROUNDWORKER_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace dicomstitcher {
+
+// 单线程后台任务队列，用于切片预取等可丢弃的低优先级工作。
+// 任务按提交顺序执行；ClearPending 丢弃尚未开始的任务。任务内抛出的异常被吞掉。
+class BackgroundWorker
+{
+public:
+    BackgroundWorker();
+    ~BackgroundWorker();
+
+    BackgroundWorker(const BackgroundWorker &) = delete;
+    BackgroundWorker &operator=(const BackgroundWorker &) = delete;
+
+    void Post(std::function<void()> task);
+    void ClearPending();
+
+private:
+    void Run();
+
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    std::deque<std::function<void()>> m_tasks;
+    bool m_stopping{false};
+    std::thread m_thread;
+};
+
+} // namespace dicomstitcher
+
+#endif // BACKGROUNDWORKER_H
@@ -0,0 +1,164 @@
+﻿#include "batchrunner.h"
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1600)
+# pragma execution_character_set("utf-8")
+#endif
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+namespace {
+
+void PrintUsage()
+{
+    std::cout <<
+        "用法:\n"
+        "  dicomstitcher_batch [选项] --manifest 清单.ini\n"
+        "  dicomstitcher_batch [选项] 输出路径 序列目录1 序列目录2 [序列目录3 ...]\n"
+        "\n"
+        "选项:\n"
+        "  --jobs N            同时运行的任务数（默认 1）\n"
+        "  --threads N         所有任务合计的线程数（默认 ITK 全局默认值）\n"
+        "  --memory MB         所有任务合计的内存预算（按解码后的体数据尺寸估算，默认不限制）\n"
+        "  --report 文件.csv   写出逐任务耗时报告\n"
+        "  --trace 文件.json   写出 Chrome trace（各阶段与工作线程的时间线，chrome://tracing 打开）\n"
+        "  --coarse center|centroid|bone|skin      默认 bone\n"
+        "  --registration none|rigid|affine        默认 rigid\n"
+        "  --spacing MM        各向同性重采样间距，0 表示保持原始间距（默认 1.0）\n"
+        "  --verbose           输出各阶段进度\n"
+        "\n"
+        "输出格式按扩展名推断：.nrrd / .nii / .nii.gz，其余视为 DICOM 序列目录。\n";
+}
+
+bool ParseUnsigned(const char *text, unsigned long long &value)
+{
+    char *end = nullptr;
+    value = std::strtoull(text, &end, 10);
+    return end != text && *end == '\0';
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+#ifdef _WIN32
+    SetConsoleOutputCP(65001);
+#endif
+    using namespace dicomstitcher;
+
+    BatchJob defaults;
+    BatchOptions options;
+    std::string manifest;
+    std::string reportPath;
+    std::string tracePath;
+    std::vector<std::string> positional;
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        auto value = [&]() -> const char * {
+            if (i + 1 >= argc) {
+                std::cerr << arg << " 缺少参数" << std::endl;
+                std::exit(2);
+            }
+            return argv[++i];
+        };
+        unsigned long long number = 0;
+        if (arg == "--help" || arg == "-h") {
+            PrintUsage();
+            return 0;
+        } else if (arg == "--manifest") {
+            manifest = value();
+        } else if (arg == "--jobs" && ParseUnsigned(value(), number) && number > 0) {
+            options.concurrentJobs = static_cast<unsigned int>(number);
+        } else if (arg == "--threads" && ParseUnsigned(value(), number)) {
+            options.threadBudget = static_cast<unsigned int>(number);
+        } else if (arg == "--memory" && ParseUnsigned(value(), number)) {
+            options.memoryBudgetBytes = static_cast<std::size_t>(number) << 20;
+        } else if (arg == "--report") {
+            reportPath = value();
+        } else if (arg == "--trace") {
+            tracePath = value();
+        } else if (arg == "--verbose") {
+            options.verbose = true;
+        } else if (arg == "--coarse" || arg == "--registration" || arg == "--spacing") {
+            const std::string text = value();
+            if (arg == "--coarse") {
+                const std::string modes[] = {"center", "centroid", "bone", "skin"};
+                bool found = false;
+                for (int m = 0; m < 4; ++m) {
+                    if (text == modes[m]) {
+                        defaults.coarseMode = static_cast<CoarseAlignmentMode>(m);
+                        found = true;
+                    }
+                }
+                if (!found) {
+                    std::cerr << "未知粗对齐方式: " << text << std::endl;
+                    return 2;
+                }
+            } else if (arg == "--registration") {
+                if (text == "none") {
+                    defaults.registration = false;
+                } else if (text == "rigid" || text == "affine") {
+                    defaults.registration = true;
+                    defaults.registrationMode = text == "rigid" ? RegistrationMode::Rigid : RegistrationMode::Affine;
+                } else {
+                    std::cerr << "未知配准方式: " << text << std::endl;
+                    return 2;
+                }
+            } else {
+                const double spacing = std::atof(text.c_str());
+                defaults.spacing.mode = spacing > 0.0 ? SpacingMode::Isotropic : SpacingMode::Native;
+                if (spacing > 0.0) {
+                    defaults.spacing.spacing = spacing;
+                }
+            }
+        } else if (!arg.empty() && arg[0] == '-') {
+            std::cerr << "无效参数: " << arg << std::endl;
+            PrintUsage();
+            return 2;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    std::vector<BatchJob> jobs;
+    if (!manifest.empty()) {
+        std::string error;
+        if (!ParseBatchManifest(manifest, defaults, jobs, error)) {
+            std::cerr << error << std::endl;
+            return 2;
+        }
+    } else if (positional.size() >= 3) {
+        BatchJob job = defaults;
+        job.name = "job";
+        job.output = positional.front();
+        job.series.assign(positional.begin() + 1, positional.end());
+        job.format = ExportFormatFromPath(job.output);
+        jobs.push_back(job);
+    } else {
+        PrintUsage();
+        return 2;
+    }
+
+    Profiler::Instance().BeginRun();
+    const std::vector<BatchJobReport> reports = RunBatch(jobs, options);
+    if (!tracePath.empty() && !Profiler::Instance().WriteChromeTrace(tracePath)) {
+        std::cerr << "无法写出跟踪: " << tracePath << std::endl;
+    }
+    if (!reportPath.empty() && !WriteBatchReport(reportPath, reports)) {
+        std::cerr << "无法写出报告: " << reportPath << std::endl;
+    }
+
+    int failed = 0;
+    for (const BatchJobReport &report : reports) {
+        failed += report.ok ? 0 : 1;
+    }
+    std::cout << jobs.size() - failed << "/" << jobs.size() << " 个任务完成" << std::endl;
+    return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,520 @@
+﻿#include "batchrunner.h"
+#include "dicomindex.h"
+#include "imagepyramid.h"
+#include "seriesloader.h"
+#include "stitchingengine.h"
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1600)
+# pragma execution_character_set("utf-8")
+#endif
+
+#include <itkMultiThreaderBase.h>
+#include <itksys/SystemTools.hxx>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace dicomstitcher {
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double SecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+std::mutex &ConsoleMutex()
+{
+    static std::mutex mutex;
+    return mutex;
+}
+
+void PrintLine(const std::string &line)
+{
+    std::lock_guard<std::mutex> lock(ConsoleMutex());
+    std::cout << line << std::endl;
+}
+
+std::string Trim(const std::string &text)
+{
+    const auto first = text.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos) {
+        return std::string();
+    }
+    const auto last = text.find_last_not_of(" \t\r\n");
+    return text.substr(first, last - first + 1);
+}
+
+std::string Lower(std::string text)
+{
+    std::transform(text.begin(), text.end(), text.begin(),
+                   [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return text;
+}
+
+bool EndsWith(const std::string &text, const std::string &suffix)
+{
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// 合计内存预算：超出时排队；没有其他任务在运行时总是放行，避免单个大任务永远等待
+class MemoryGate
+{
+public:
+    explicit MemoryGate(std::size_t budget)
+        : m_budget(budget)
+    {
+    }
+
+    void Acquire(std::size_t bytes)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_changed.wait(lock, [this, bytes]() {
+            return m_budget == 0 || m_used == 0 || m_used + bytes <= m_budget;
+        });
+        m_used += bytes;
+    }
+
+    void Release(std::size_t bytes)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_used -= std::min(bytes, m_used);
+        }
+        m_changed.notify_all();
+    }
+
+private:
+    std::size_t m_budget;
+    std::size_t m_used{0};
+    std::mutex m_mutex;
+    std::condition_variable m_changed;
+};
+
+// 按解码后的几何估算峰值内存（不看文件大小：JPEG / JPEG 2000 / JPEG-LS 压缩序列解码后可大出数倍）：
+// 同一时间只解码一段，各段重采样体与金字塔在拼接前都保留，拼接结果的网格不超过各段重采样网格之和。
+// 几何取自 DICOM 目录索引（只读头信息并写入索引缓存，随后的加载直接复用）；无法扫描的目录计为 0，加载时再报错
+std::size_t EstimateJobBytes(const BatchJob &job, unsigned int threads)
+{
+    const std::vector<unsigned int> pyramidFactors{2, 4, 8};
+    DicomIndexSettings settings;
+    settings.numberOfThreads = threads;
+    double largestDecoded = 0.0;
+    double resampled = 0.0;
+    double pyramid = 0.0;
+    for (const std::string &dir : job.series) {
+        const DicomIndexResult index = ScanDicomDirectory(dir, settings, CancelToken());
+        if (index.status != DicomIndexResult::Status::Ok || index.series.empty()) {
+            continue;
+        }
+        // 与 LoadSeries 相同，取层数最多的序列
+        const DicomSeriesInfo &series = index.series.front();
+        ImageGrid grid;
+        grid.origin.Fill(0.0);
+        grid.direction.SetIdentity();
+        grid.size[0] = series.columns;
+        grid.size[1] = series.rows;
+        grid.size[2] = series.files.size();
+        for (unsigned int i = 0; i < 3; ++i) {
+            grid.spacing[i] = series.spacing[i] > 0.0 ? series.spacing[i] : 1.0;
+        }
+        double voxels = 1.0;
+        for (unsigned int i = 0; i < 3; ++i) {
+            voxels *= static_cast<double>(grid.size[i]);
+        }
+        largestDecoded = std::max(largestDecoded, voxels);
+
+        const ImageGrid target = WithSpacing(grid, ComputeTargetSpacing(grid, job.spacing));
+        double targetVoxels = 1.0;
+        for (unsigned int i = 0; i < 3; ++i) {
+            targetVoxels *= static_cast<double>(target.size[i]);
+        }
+        resampled += targetVoxels;
+        for (unsigned int factor : pyramidFactors) {
+            double levelVoxels = 1.0;
+            for (unsigned int i = 0; i < 3; ++i) {
+                levelVoxels *= std::ceil(static_cast<double>(target.size[i]) / factor);
+            }
+            pyramid += levelVoxels;
+        }
+    }
+    // 解码体 + 各段重采样体 + 金字塔 + 拼接结果
+    return static_cast<std::size_t>((largestDecoded + resampled + pyramid + resampled) * sizeof(PixelType));
+}
+
+const char *LoadStatusText(SeriesLoadResult::Status status)
+{
+    switch (status) {
+    case SeriesLoadResult::Status::NoSeries:
+        return "未找到 DICOM 序列";
+    case SeriesLoadResult::Status::Cancelled:
+        return "加载已取消";
+    default:
+        return "读取失败";
+    }
+}
+
+void RunJobStages(const BatchJob &job, unsigned int threads, bool verbose, BatchJobReport &report)
+{
+    const CancelToken cancel;
+
+    // 进度只在文字变化时输出，避免逐次迭代刷屏
+    auto lastText = std::make_shared<std::string>();
+    ProgressCallback progress;
+    if (verbose) {
+        const std::string name = job.name;
+        progress = [name, lastText](const std::string &text, int) {
+            std::lock_guard<std::mutex> lock(ConsoleMutex());
+            if (*lastText != text) {
+                *lastText = text;
+                std::cout << "[" << name << "] " << text << std::endl;
+            }
+        };
+    }
+
+    SeriesLoadRequest load;
+    load.spacing = job.spacing;
+    load.readerThreads = threads;
+    load.index.numberOfThreads = threads;
+    load.generateVtkImage = false;
+    auto loadSeries = [&](std::size_t i, SeriesLoadResult &result) {
+        const Clock::time_point t = Clock::now();
+        load.directory = job.series[i];
+        load.label = job.name + " #" + std::to_string(i + 1);
+        result = LoadSeries(load, cancel, progress);
+        report.loadSeconds += SecondsSince(t);
+        if (result.status != SeriesLoadResult::Status::Ok) {
+            report.message = std::string(LoadStatusText(result.status)) + ": " + job.series[i]
+                           + (result.errorMessage.empty() ? std::string() : " (" + result.errorMessage + ")");
+            return false;
+        }
+        return true;
+    };
+
+    try {
+        SeriesLoadResult fixed;
+        if (!loadSeries(0, fixed)) {
+            return;
+        }
+        ImageType::Pointer current = fixed.image;
+        ImagePyramid::Pointer currentPyramid = fixed.pyramid;
+        const itk::MetaDataDictionary dictionary = fixed.dictionary;
+        fixed = SeriesLoadResult();
+
+        for (std::size_t i = 1; i < job.series.size(); ++i) {
+            SeriesLoadResult moving;
+            if (!loadSeries(i, moving)) {
+                return;
+            }
+
+            Clock::time_point t = Clock::now();
+            CoarseAlignmentSettings coarseSettings;
+            coarseSettings.mode = job.coarseMode;
+            coarseSettings.numberOfThreads = threads;
+            CoarseAlignmentResult coarse = ComputeCoarseAlignment(*currentPyramid, *moving.pyramid, coarseSettings, cancel);
+            if (!coarse.ok) {
+                coarseSettings.mode = CoarseAlignmentMode::GeometricCenter;
+                coarse = ComputeCoarseAlignment(*currentPyramid, *moving.pyramid, coarseSettings, cancel);
+            }
+            itk::Transform<double, 3>::Pointer transform = coarse.transform;
+            report.coarseSeconds += SecondsSince(t);
+
+            if (job.registration) {
+                t = Clock::now();
+                RegistrationSettings settings;
+                settings.mode = job.registrationMode;
+                settings.numberOfThreads = threads;
+                RegistrationResult registered =
+                    RegisterImages(*currentPyramid, *moving.pyramid, transform.GetPointer(), settings, cancel, progress);
+                report.registrationSeconds += SecondsSince(t);
+                if (registered.status != RegistrationResult::Status::Ok) {
+                    report.message = registered.status == RegistrationResult::Status::NoOverlap
+                                         ? "粗对齐后没有重叠区域: " + job.series[i]
+                                         : "配准失败: " + registered.errorMessage;
+                    return;
+                }
+                transform = registered.transform;
+            }
+
+            t = Clock::now();
+            StitchingSettings stitching;
+            stitching.numberOfThreads = threads;
+            if (i + 1 == job.series.size()) {
+                // 最后一段：拼接与写出流式进行
+                ExportRequest request;
+                request.format = job.format;
+                request.path = job.output;
+                request.referenceDictionary = dictionary;
+                request.stitching = stitching;
+                request.numberOfThreads = threads;
+                request.compress = job.format != ExportFormat::Nifti || EndsWith(Lower(job.output), ".gz");
+                const ExportResult exported = ExportStitchedVolume(current.GetPointer(), moving.image.GetPointer(),
+                                                                   transform.GetPointer(), request, cancel, progress);
+                report.exportSeconds += SecondsSince(t);
+                if (exported.status != ExportResult::Status::Ok) {
+                    report.message = exported.status == ExportResult::Status::NoInverse
+                                         ? "变换不可逆"
+                                         : "导出失败: " + exported.errorMessage;
+                    return;
+                }
+                report.slices = exported.slices;
+            } else {
+                // 中间段：拼接结果作为下一段的 Fixed
+                StitchingResult stitched = StitchToImage(current.GetPointer(), moving.image.GetPointer(),
+                                                         transform.GetPointer(), stitching, cancel, progress);
+                if (stitched.status != StitchingResult::Status::Ok) {
+                    report.exportSeconds += SecondsSince(t);
+                    report.message = "拼接失败: " + stitched.errorMessage;
+                    return;
+                }
+                moving = SeriesLoadResult();
+                current = stitched.image;
+                currentPyramid = ImagePyramid::Build(current.GetPointer(), {2, 4, 8}, threads, cancel);
+                report.exportSeconds += SecondsSince(t);
+            }
+        }
+        report.ok = true;
+    } catch (const itk::ExceptionObject &ex) {
+        report.message = ex.what();
+    } catch (const std::exception &ex) {
+        report.message = ex.what();
+    }
+}
+
+void RunJob(const BatchJob &job, unsigned int threads, bool verbose, BatchJobReport &report)
+{
+    const Clock::time_point start = Clock::now();
+    ScopedStage stage("batch.job");
+    RunJobStages(job, threads, verbose, report);
+    report.totalSeconds = SecondsSince(start);
+}
+
+std::string CsvField(const std::string &text)
+{
+    if (text.find_first_of(",\"\n") == std::string::npos) {
+        return text;
+    }
+    std::string quoted = "\"";
+    for (char c : text) {
+        if (c == '"') {
+            quoted += '"';
+        }
+        quoted += c;
+    }
+    return quoted + "\"";
+}
+
+} // namespace
+
+ExportFormat ExportFormatFromPath(const std::string &path)
+{
+    const std::string lower = Lower(path);
+    if (EndsWith(lower, ".nrrd")) {
+        return ExportFormat::Nrrd;
+    }
+    if (EndsWith(lower, ".nii") || EndsWith(lower, ".nii.gz")) {
+        return ExportFormat::Nifti;
+    }
+    return ExportFormat::DicomSeries;
+}
+
+bool ParseBatchManifest(const std::string &path,
+                        const BatchJob &defaults,
+                        std::vector<BatchJob> &jobs,
+                        std::string &error)
+{
+    std::ifstream file(path);
+    if (!file) {
+        error = "无法打开清单: " + path;
+        return false;
+    }
+    // 相对路径以清单所在目录为基准
+    const std::string baseDir = itksys::SystemTools::GetFilenamePath(itksys::SystemTools::CollapseFullPath(path));
+    auto resolve = [&baseDir](const std::string &value) {
+        return itksys::SystemTools::CollapseFullPath(value, baseDir);
+    };
+
+    std::vector<bool> formatGiven;
+    std::string line;
+    int lineNumber = 0;
+    auto fail = [&](const std::string &message) {
+        error = path + ":" + std::to_string(lineNumber) + ": " + message;
+        return false;
+    };
+
+    while (std::getline(file, line)) {
+        ++lineNumber;
+        if (lineNumber == 1 && line.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+            line.erase(0, 3);
+        }
+        line = Trim(line);
+        if (line.empty() || line[0] == '#' || line[0] == ';') {
+            continue;
+        }
+        if (line.front() == '[') {
+            if (line.back() != ']') {
+                return fail("任务名缺少 ]");
+            }
+            jobs.push_back(defaults);
+            jobs.back().name = Trim(line.substr(1, line.size() - 2));
+            formatGiven.push_back(false);
+            continue;
+        }
+        const auto equals = line.find('=');
+        if (equals == std::string::npos) {
+            return fail("应为 key = value");
+        }
+        if (jobs.empty()) {
+            return fail("key 出现在任务名之前");
+        }
+        BatchJob &job = jobs.back();
+        const std::string key = Lower(Trim(line.substr(0, equals)));
+        const std::string value = Trim(line.substr(equals + 1));
+        const std::string lowerValue = Lower(value);
+
+        if (key == "series") {
+            job.series.push_back(resolve(value));
+        } else if (key == "output") {
+            job.output = resolve(value);
+        } else if (key == "format") {
+            if (lowerValue == "dicom") {
+                job.format = ExportFormat::DicomSeries;
+            } else if (lowerValue == "nrrd") {
+                job.format = ExportFormat::Nrrd;
+            } else if (lowerValue == "nifti") {
+                job.format = ExportFormat::Nifti;
+            } else {
+                return fail("未知格式: " + value);
+            }
+            formatGiven.back() = true;
+        } else if (key == "coarse") {
+            if (lowerValue == "center") {
+                job.coarseMode = CoarseAlignmentMode::GeometricCenter;
+            } else if (lowerValue == "centroid") {
+                job.coarseMode = CoarseAlignmentMode::Centroid;
+            } else if (lowerValue == "bone") {
+                job.coarseMode = CoarseAlignmentMode::Bone;
+            } else if (lowerValue == "skin") {
+                job.coarseMode = CoarseAlignmentMode::Skin;
+            } else {
+                return fail("未知粗对齐方式: " + value);
+            }
+        } else if (key == "registration") {
+            job.registration = lowerValue != "none";
+            if (lowerValue == "rigid") {
+                job.registrationMode = RegistrationMode::Rigid;
+            } else if (lowerValue == "affine") {
+                job.registrationMode = RegistrationMode::Affine;
+            } else if (lowerValue != "none") {
+                return fail("未知配准方式: " + value);
+            }
+        } else if (key == "spacing") {
+            char *end = nullptr;
+            const double spacing = std::strtod(value.c_str(), &end);
+            if (end == value.c_str() || spacing < 0.0) {
+                return fail("间距无效: " + value);
+            }
+            job.spacing.mode = spacing > 0.0 ? SpacingMode::Isotropic : SpacingMode::Native;
+            job.spacing.spacing = spacing > 0.0 ? spacing : job.spacing.spacing;
+        } else {
+            return fail("未知 key: " + key);
+        }
+    }
+
+    for (std::size_t i = 0; i < jobs.size(); ++i) {
+        BatchJob &job = jobs[i];
+        if (job.series.size() < 2 || job.output.empty()) {
+            error = path + ": 任务 [" + job.name + "] 需要至少两个 series 与一个 output";
+            return false;
+        }
+        if (!formatGiven[i]) {
+            job.format = ExportFormatFromPath(job.output);
+        }
+    }
+    return true;
+}
+
+std::vector<BatchJobReport> RunBatch(const std::vector<BatchJob> &jobs, const BatchOptions &options)
+{
+    std::vector<BatchJobReport> reports(jobs.size());
+    if (jobs.empty()) {
+        return reports;
+    }
+
+    // 全局线程池按总预算设置（须在任何 ITK 计算之前），每个任务再按份额限制自己的工作单元数
+    if (options.threadBudget > 0) {
+        itk::MultiThreaderBase::SetGlobalDefaultNumberOfThreads(options.threadBudget);
+    }
+    const unsigned int budget = itk::MultiThreaderBase::GetGlobalDefaultNumberOfThreads();
+    const unsigned int concurrent = static_cast<unsigned int>(
+        std::max<std::size_t>(1, std::min<std::size_t>(options.concurrentJobs, jobs.size())));
+    const unsigned int threadsPerJob = std::max(1u, budget / concurrent);
+
+    MemoryGate gate(options.memoryBudgetBytes);
+    std::atomic<std::size_t> next{0};
+    auto worker = [&]() {
+        for (std::size_t i = next.fetch_add(1); i < jobs.size(); i = next.fetch_add(1)) {
+            const BatchJob &job = jobs[i];
+            BatchJobReport &report = reports[i];
+            report.name = job.name;
+            report.estimatedBytes = EstimateJobBytes(job, threadsPerJob);
+
+            const Clock::time_point waitStart = Clock::now();
+            gate.Acquire(report.estimatedBytes);
+            report.waitSeconds = SecondsSince(waitStart);
+
+            PrintLine("[" + job.name + "] 开始（" + std::to_string(job.series.size()) + " 段，"
+                      + std::to_string(threadsPerJob) + " 线程）");
+            RunJob(job, threadsPerJob, options.verbose, report);
+            gate.Release(report.estimatedBytes);
+
+            char seconds[32];
+            std::snprintf(seconds, sizeof(seconds), "%.1f s", report.totalSeconds);
+            PrintLine("[" + job.name + "] " + (report.ok ? "完成 " + std::string(seconds) : "失败: " + report.message));
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 1; i < concurrent; ++i) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+    return reports;
+}
+
+bool WriteBatchReport(const std::string &path, const std::vector<BatchJobReport> &reports)
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    file << "job,status,slices,estimated_mb,wait_s,load_s,coarse_s,registration_s,export_s,total_s,message\n";
+    for (const BatchJobReport &report : reports) {
+        char numbers[256];
+        std::snprintf(numbers, sizeof(numbers), "%zu,%.1f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f", report.slices,
+                      report.estimatedBytes / (1024.0 * 1024.0), report.waitSeconds, report.loadSeconds,
+                      report.coarseSeconds, report.registrationSeconds, report.exportSeconds, report.totalSeconds);
+        file << CsvField(report.name) << ',' << (report.ok ? "ok" : "failed") << ',' << numbers << ','
+             << CsvField(report.message) << '\n';
+    }
+    return static_cast<bool>(file);
+}
+
+} // namespace dicomstitcher
@@ -0,0 +1,80 @@
+﻿#ifndef BATCHRUNNER_H
+#define BATCHRUNNER_H
+
+#include "pipelinecommon.h"
+#include "imagepreprocessing.h"
+#include "coarsealignment.h"
+#include "registration.h"
+#include "resultexporter.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace dicomstitcher {
+
+// 一个拼接任务：series 按拼接顺序排列，第一个为 Fixed，其余依次配准并拼接到已有结果上
+struct BatchJob
+{
+    std::string name;
+    std::vector<std::string> series;
+    std::string output;
+    ExportFormat format{ExportFormat::Nifti};
+    SpacingPolicy spacing;
+    CoarseAlignmentMode coarseMode{CoarseAlignmentMode::Bone};
+    bool registration{true};
+    RegistrationMode registrationMode{RegistrationMode::Rigid};
+};
+
+struct BatchOptions
+{
+    unsigned int concurrentJobs{1};
+    unsigned int threadBudget{0};        // 所有任务合计的线程数，0 表示 ITK 默认
+    std::size_t memoryBudgetBytes{0};    // 所有任务合计的内存预算（估算值），0 表示不限制
+    bool verbose{false};                 // 输出各阶段的进度文字
+};
+
+// 单个任务的耗时报告（秒）
+struct BatchJobReport
+{
+    std::string name;
+    bool ok{false};
+    std::string message;
+    std::size_t slices{0};
+    std::size_t estimatedBytes{0};
+    double waitSeconds{0.0};       // 等待内存预算
+    double loadSeconds{0.0};
+    double coarseSeconds{0.0};
+    double registrationSeconds{0.0};
+    double exportSeconds{0.0};     // 含拼接
+    double totalSeconds{0.0};
+};
+
+// 由输出文件名推断格式：.nrrd → NRRD，.nii / .nii.gz → NIfTI，其余视为 DICOM 目录
+ExportFormat ExportFormatFromPath(const std::string &path);
+
+// 清单为 INI 风格的文本（UTF-8）：
+//   [任务名]
+//   series = 目录        （可重复，按拼接顺序）
+//   output = 输出路径
+//   format = dicom | nrrd | nifti          （可选，默认按输出文件名推断）
+//   coarse = center | centroid | bone | skin
+//   registration = none | rigid | affine
+//   spacing = 1.0                          （各向同性间距 mm，0 表示保持原始间距）
+// defaults 为未指定项的初值；出错时返回 false 并在 error 中给出行号
+bool ParseBatchManifest(const std::string &path,
+                        const BatchJob &defaults,
+                        std::vector<BatchJob> &jobs,
+                        std::string &error);
+
+// 并发执行：最多 concurrentJobs 个任务同时运行，各自分得 threadBudget / concurrentJobs 个线程；
+// 开始前按 DICOM 头信息中的解码后尺寸估算内存（解码体、重采样体、金字塔与拼接结果），合计超出 memoryBudgetBytes 时排队等待（单个任务超出预算时独占运行）。
+// 返回的报告顺序与 jobs 一致。
+std::vector<BatchJobReport> RunBatch(const std::vector<BatchJob> &jobs, const BatchOptions &options);
+
+// 报告写为 CSV（UTF-8）
+bool WriteBatchReport(const std::string &path, const std::vector<BatchJobReport> &reports);
+
+} // namespace dicomstitcher
+
+#endif // BATCHRUNNER_H
@@ -0,0 +1,352 @@
+﻿// 全流程基准：用确定性合成 CT 体模（两段 z 方向部分重叠）依次测量每个处理阶段，
+// 每个阶段、尺寸、线程数输出一行 JSON（耗时中位数、吞吐量、该阶段超出基线的峰值内存），便于不同构建之间比较。用法：
+//   bench_pipeline [--sizes 256x256x200,512x512x300] [--spacing 0.9x0.9x2.0]
+//                  [--threads 1,2,4,8] [--repeat 3] [--stages dicom_read,stitch,...]
+//                  [--data bench_data] [--out results.jsonl]
+// 合成的 DICOM 序列缓存在 --data 目录下，再次运行时复用。
+#include "benchcommon.h"
+#include "coarsealignment.h"
+#include "fastmutualinformation.h"
+#include "fusionsliceprovider.h"
+#include "imagepreprocessing.h"
+#include "imagepyramid.h"
+#include "itkvtkbridge.h"
+#include "manualalignment.h"
+#include "parallelseriesreader.h"
+#include "registration.h"
+#include "resultexporter.h"
+#include "seriesloader.h"
+#include "stitchingengine.h"
+
+#include <itkMultiThreaderBase.h>
+#include <itkTranslationTransform.h>
+#include <itksys/SystemTools.hxx>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace dicomstitcher;
+using namespace dicomstitcher::bench;
+
+namespace {
+
+std::vector<std::string> Split(const std::string &text, char separator)
+{
+    std::vector<std::string> parts;
+    std::stringstream stream(text);
+    std::string part;
+    while (std::getline(stream, part, separator)) {
+        if (!part.empty()) {
+            parts.push_back(part);
+        }
+    }
+    return parts;
+}
+
+bool ParseTriple(const std::string &text, double value[3])
+{
+    const auto parts = Split(text, 'x');
+    if (parts.size() != 3) {
+        return false;
+    }
+    for (int i = 0; i < 3; ++i) {
+        value[i] = std::atof(parts[i].c_str());
+        if (value[i] <= 0.0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string VolumeName(const PhantomSpec &spec)
+{
+    char name[96];
+    std::snprintf(name, sizeof(name), "%lux%lux%lu@%.2fx%.2fx%.2f", spec.size[0], spec.size[1],
+                  spec.size[2], spec.spacing[0], spec.spacing[1], spec.spacing[2]);
+    return name;
+}
+
+double Voxels(const ImageType *image)
+{
+    return static_cast<double>(image->GetLargestPossibleRegion().GetNumberOfPixels());
+}
+
+void Usage()
+{
+    std::fprintf(stderr,
+                 "usage: bench_pipeline [--sizes NXxNYxNZ,...] [--spacing SXxSYxSZ] [--threads 1,2,4]\n"
+                 "                      [--repeat N] [--stages a,b,...] [--data DIR] [--out FILE]\n"
+                 "stages: dicom_read load_preview orient_to_ras resample_isotropic orient_and_resample itk_to_vtk\n"
+                 "        resample_to_reference fusion_slice manual_nudge mi_metric pyramid_build coarse_alignment\n"
+                 "        registration stitch export_nrrd\n");
+}
+
+} // namespace
+
+int main(int argc, char *argv[])
+{
+    std::vector<PhantomSpec> specs;
+    double spacing[3] = {0.9, 0.9, 2.0};
+    std::vector<unsigned int> threadCounts{1, 2, 4, 8};
+    int repeat = 3;
+    std::set<std::string> stages;
+    std::string dataDirectory = "bench_data";
+    std::string outPath;
+    std::vector<std::string> sizeTexts{"256x256x200"};
+
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const bool hasValue = i + 1 < argc;
+        if (arg == "--sizes" && hasValue) {
+            sizeTexts = Split(argv[++i], ',');
+        } else if (arg == "--spacing" && hasValue) {
+            if (!ParseTriple(argv[++i], spacing)) {
+                Usage();
+                return 2;
+            }
+        } else if (arg == "--threads" && hasValue) {
+            threadCounts.clear();
+            for (const auto &t : Split(argv[++i], ',')) {
+                threadCounts.push_back(static_cast<unsigned int>(std::max(1, std::atoi(t.c_str()))));
+            }
+        } else if (arg == "--repeat" && hasValue) {
+            repeat = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--stages" && hasValue) {
+            for (const auto &s : Split(argv[++i], ',')) {
+                stages.insert(s);
+            }
+        } else if (arg == "--data" && hasValue) {
+            dataDirectory = argv[++i];
+        } else if (arg == "--out" && hasValue) {
+            outPath = argv[++i];
+        } else {
+            Usage();
+            return 2;
+        }
+    }
+    for (const auto &text : sizeTexts) {
+        double size[3];
+        if (!ParseTriple(text, size)) {
+            Usage();
+            return 2;
+        }
+        PhantomSpec spec;
+        for (int i = 0; i < 3; ++i) {
+            spec.size[i] = static_cast<unsigned long>(size[i]);
+            spec.spacing[i] = spacing[i];
+        }
+        specs.push_back(spec);
+    }
+
+    std::FILE *out = stdout;
+    if (!outPath.empty()) {
+        out = std::fopen(outPath.c_str(), "w");
+        if (!out) {
+            std::fprintf(stderr, "cannot open %s\n", outPath.c_str());
+            return 1;
+        }
+    }
+    auto enabled = [&](const char *stage) { return stages.empty() || stages.count(stage) > 0; };
+
+    for (const PhantomSpec &spec : specs) {
+        const std::string volumeName = VolumeName(spec);
+        std::fprintf(stderr, "preparing %s ...\n", volumeName.c_str());
+
+        // 两段体模沿 z 错开 60% 长度，重叠 40%，模拟分段扫描
+        PhantomSpec movingSpec = spec;
+        movingSpec.zStart = 0.6 * spec.size[2] * spec.spacing[2];
+        ImageType::Pointer fixedRaw = MakePhantom(spec);
+        ImageType::Pointer movingRaw = MakePhantom(movingSpec);
+
+        std::vector<std::string> files;
+        if (enabled("dicom_read") || enabled("load_preview")) {
+            files = WriteDicomPhantom(fixedRaw.GetPointer(), dataDirectory + "/" + volumeName);
+        }
+
+        SpacingPolicy policy;
+        policy.mode = SpacingMode::Isotropic;
+        policy.spacing = std::max(spec.spacing[0], spec.spacing[1]);
+        ImageType::Pointer fixed = OrientAndResample(fixedRaw.GetPointer(), policy);
+        ImageType::Pointer moving = OrientAndResample(movingRaw.GetPointer(), policy);
+        const double rawVoxels = Voxels(fixedRaw.GetPointer());
+        const double rawBytes = rawVoxels * sizeof(PixelType);
+        const double voxels = Voxels(fixed.GetPointer());
+
+        // 名义上的对齐变换：两段体模按物理坐标生成，恒等即为正确对齐
+        auto identity = itk::TranslationTransform<double, 3>::New();
+        identity->SetIdentity();
+
+        for (unsigned int threads : threadCounts) {
+            itk::MultiThreaderBase::SetGlobalDefaultNumberOfThreads(threads);
+            Measurement m;
+            m.volume = volumeName;
+            m.threads = threads;
+            auto record = [&](const char *stage, double stageVoxels, double stageBytes,
+                              const std::function<void()> &fn) {
+                if (!enabled(stage)) {
+                    return;
+                }
+                m.stage = stage;
+                m.voxels = stageVoxels;
+                m.bytes = stageBytes;
+                StageMemoryMeter memory;
+                memory.Start();
+                m.seconds = TimeSeconds(fn, repeat);
+                m.stagePeakMB = memory.Stop() / (1024.0 * 1024.0);
+                m.baselineRssMB = memory.BaselineBytes() / (1024.0 * 1024.0);
+                WriteMeasurement(out, m);
+            };
+
+            record("dicom_read", rawVoxels, rawBytes, [&]() {
+                ParallelSeriesReader reader;
+                reader.SetFileNames(files);
+                reader.SetNumberOfThreads(threads);
+                reader.Read();
+            });
+
+            // 渐进加载的首个预览：抽层解码并插值到最终网格为止，收到预览后取消其余的解码
+            record("load_preview", voxels, voxels * sizeof(PixelType), [&]() {
+                SeriesLoadRequest request;
+                request.fileNames = files;
+                request.spacing = policy;
+                request.readerThreads = threads;
+                request.volumeCache.enabled = false;
+                const CancelToken cancel;
+                request.preview = [&cancel](const SeriesPreview &) { cancel.Cancel(); };
+                LoadSeries(request, cancel, ProgressCallback());
+            });
+
+            record("orient_to_ras", rawVoxels, rawBytes, [&]() {
+                OrientToRAS(fixedRaw.GetPointer());
+            });
+
+            ImageType::Pointer oriented = OrientToRAS(fixedRaw.GetPointer());
+            record("resample_isotropic", voxels, voxels * sizeof(PixelType), [&]() {
+                ResampleToIsotropic(oriented.GetPointer(), policy.spacing);
+            });
+
+            record("orient_and_resample", voxels, voxels * sizeof(PixelType), [&]() {
+                OrientAndResample(fixedRaw.GetPointer(), policy);
+            });
+
+            record("itk_to_vtk", voxels, voxels * sizeof(PixelType), [&]() {
+                ItkToVtkImage(fixed.GetPointer());
+            });
+
+            record("resample_to_reference", voxels, voxels * sizeof(PixelType), [&]() {
+                ResampleToReference(moving.GetPointer(), fixed.GetPointer(), identity.GetPointer());
+            });
+
+            // 融合显示：翻页时逐张切片重采样并混合；每次测量一整圈轴位切片，缓存容量小于层数，测的是冷路径
+            const auto fixedSize = fixed->GetLargestPossibleRegion().GetSize();
+            const int axialSlices = static_cast<int>(fixedSize[2]);
+            record("fusion_slice", voxels, voxels * sizeof(PixelType) * 2, [&]() {
+                FusionSliceProvider provider;
+                provider.SetImages(fixed, moving);
+                provider.SetTransform(identity.GetPointer());
+                provider.SetCacheCapacity(4);
+                for (int k = 0; k < axialSlices; ++k) {
+                    provider.GetSlice(SliceOrientation::Axial, k);
+                }
+            });
+
+            // 手动对齐：每次微调后只重采样当前轴位切片（变换改变，缓存全部失效）；
+            // 每次测量 100 次微调，单次延迟为结果的 1/100
+            const auto planePixels = static_cast<double>(fixedSize[0] * fixedSize[1]);
+            record("manual_nudge", planePixels * 100, planePixels * 100 * sizeof(PixelType) * 2, [&]() {
+                FusionSliceProvider provider;
+                provider.SetImages(fixed, moving);
+                ManualAlignment alignment;
+                alignment.Reset(identity.GetPointer());
+                ManualAlignment::VectorType axis;
+                axis[0] = 0.0;
+                axis[1] = 0.0;
+                axis[2] = 1.0;
+                const ImageType::PointType center = ComputeCenter(fixed.GetPointer());
+                for (int i = 0; i < 100; ++i) {
+                    alignment.Rotate(axis, 0.002, center);
+                    provider.SetTransform(alignment.Transform().GetPointer());
+                    provider.GetSlice(SliceOrientation::Axial, axialSlices / 2);
+                }
+            });
+
+            const std::size_t samples = 100000;
+            record("mi_metric", static_cast<double>(samples), 0.0, [&]() {
+                FastMutualInformationMetric metric;
+                metric.SetFixedImage(fixed.GetPointer());
+                metric.SetMovingImage(moving.GetPointer());
+                metric.SetNumberOfSamples(samples);
+                metric.SetNumberOfThreads(threads);
+                metric.Initialize();
+                FastMutualInformationMetric::DerivativeType derivative;
+                for (int i = 0; i < 10; ++i) {
+                    metric.GetValueAndDerivative(identity.GetPointer(), derivative);
+                }
+            });
+
+            ImagePyramid::Pointer fixedPyramid;
+            ImagePyramid::Pointer movingPyramid;
+            record("pyramid_build", voxels, voxels * sizeof(PixelType), [&]() {
+                fixedPyramid = ImagePyramid::Build(fixed.GetPointer(), {2, 4, 8}, threads, CancelToken());
+            });
+            if (!fixedPyramid) {
+                fixedPyramid = ImagePyramid::Build(fixed.GetPointer(), {2, 4, 8}, threads, CancelToken());
+            }
+            movingPyramid = ImagePyramid::Build(moving.GetPointer(), {2, 4, 8}, threads, CancelToken());
+
+            CoarseAlignmentSettings coarseSettings;
+            coarseSettings.numberOfThreads = threads;
+            itk::Transform<double, 3>::Pointer coarse;
+            record("coarse_alignment", voxels * 2, 0.0, [&]() {
+                coarse = ComputeCoarseAlignment(*fixedPyramid, *movingPyramid, coarseSettings).transform;
+            });
+
+            // 配准只跑少量迭代：关心单次迭代与金字塔层级的开销，不关心收敛
+            RegistrationSettings registrationSettings;
+            registrationSettings.rigidIterations = 20;
+            registrationSettings.numberOfThreads = threads;
+            record("registration", voxels, 0.0, [&]() {
+                RegisterImages(*fixedPyramid, *movingPyramid, identity.GetPointer(), registrationSettings,
+                               CancelToken(), ProgressCallback());
+            });
+
+            StitchingSettings stitching;
+            stitching.numberOfThreads = threads;
+            ImageGrid stitchGrid;
+            ComputeStitchingGrid(fixed.GetPointer(), moving.GetPointer(), identity.GetPointer(), stitching,
+                                 stitchGrid);
+            const double stitchVoxels =
+                static_cast<double>(stitchGrid.size[0]) * stitchGrid.size[1] * stitchGrid.size[2];
+            record("stitch", stitchVoxels, stitchVoxels * sizeof(PixelType), [&]() {
+                StitchImages(fixed.GetPointer(), moving.GetPointer(), identity.GetPointer(), stitching,
+                             SlabCallback(), CancelToken(), ProgressCallback());
+            });
+
+            ExportRequest exportRequest;
+            exportRequest.format = ExportFormat::Nrrd;
+            exportRequest.path = dataDirectory + "/" + volumeName + "_stitched.nrrd";
+            exportRequest.stitching = stitching;
+            exportRequest.numberOfThreads = threads;
+            record("export_nrrd", stitchVoxels, stitchVoxels * sizeof(PixelType), [&]() {
+                const ExportResult result = ExportStitchedVolume(fixed.GetPointer(), moving.GetPointer(),
+                                                                 identity.GetPointer(), exportRequest,
+                                                                 CancelToken(), ProgressCallback());
+                if (result.status != ExportResult::Status::Ok) {
+                    std::fprintf(stderr, "export failed: %s\n", result.errorMessage.c_str());
+                }
+            });
+            itksys::SystemTools::RemoveFile(exportRequest.path);
+        }
+    }
+
+    if (out != stdout) {
+        std::fclose(out);
+    }
+    return 0;
+}
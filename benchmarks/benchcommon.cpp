@@ -0,0 +1,271 @@
+﻿#include "benchcommon.h"
+
+#include <itkGDCMImageIO.h>
+#include <itkImageFileWriter.h>
+#include <itkMetaDataObject.h>
+#include <itksys/Directory.hxx>
+#include <itksys/SystemTools.hxx>
+
+#include <gdcmUIDGenerator.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+namespace dicomstitcher {
+namespace bench {
+
+namespace {
+
+// 整数坐标哈希 → [-1, 1)，作为可复现的噪声
+inline double HashNoise(std::int64_t x, std::int64_t y, std::int64_t z)
+{
+    std::uint64_t h = static_cast<std::uint64_t>(x) * 0x9E3779B97F4A7C15ull
+                    ^ static_cast<std::uint64_t>(y) * 0xC2B2AE3D27D4EB4Full
+                    ^ static_cast<std::uint64_t>(z) * 0x165667B19E3779F9ull;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDull;
+    h ^= h >> 33;
+    return static_cast<double>(h >> 11) / static_cast<double>(1ull << 52) - 1.0;
+}
+
+// 物理坐标（mm，躯干中心为原点）处的 HU
+double PhantomValue(double x, double y, double z)
+{
+    // 躯干半径随 z 缓慢变化，给粗对齐的 z 剖面提供特征
+    const double scale = 1.0 + 0.08 * std::sin(z / 90.0) + 0.04 * std::sin(z / 23.0);
+    const double tx = x / (160.0 * scale);
+    const double ty = y / (110.0 * scale);
+    const double torso = tx * tx + ty * ty;
+    if (torso >= 1.0) {
+        return -1000.0;
+    }
+    double v = 40.0;
+    if (torso > 0.92) {
+        v = -80.0; // 皮下脂肪
+    }
+    // 双肺只出现在一段 z 范围内
+    if (z > 150.0 && z < 450.0) {
+        for (double side : {-1.0, 1.0}) {
+            const double lx = (x - side * 70.0) / 50.0;
+            const double ly = (y + 10.0) / 70.0;
+            if (lx * lx + ly * ly < 1.0) {
+                v = -800.0;
+            }
+        }
+    }
+    // 脊柱与每 30 mm 一根肋骨环
+    const double sx = x / 16.0;
+    const double sy = (y - 70.0) / 16.0;
+    if (sx * sx + sy * sy < 1.0) {
+        v = 700.0;
+    }
+    const double ribPhase = std::fmod(std::fabs(z), 30.0);
+    if (ribPhase < 6.0 && torso > 0.75 && torso < 0.85) {
+        v = 500.0;
+    }
+    return v;
+}
+
+} // namespace
+
+ImageType::Pointer MakePhantom(const PhantomSpec &spec)
+{
+    auto image = ImageType::New();
+    ImageType::RegionType region;
+    ImageType::SizeType size;
+    ImageType::SpacingType spacing;
+    for (unsigned int i = 0; i < 3; ++i) {
+        size[i] = spec.size[i];
+        spacing[i] = spec.spacing[i];
+    }
+    region.SetSize(size);
+    image->SetRegions(region);
+    image->SetSpacing(spacing);
+    ImageType::DirectionType direction;
+    direction.SetIdentity();
+    ImageType::PointType origin;
+    origin[0] = -0.5 * (size[0] - 1) * spacing[0];
+    origin[1] = -0.5 * (size[1] - 1) * spacing[1];
+    origin[2] = spec.zStart;
+    if (spec.flipZ) {
+        direction[2][2] = -1.0;
+        origin[2] = spec.zStart + (size[2] - 1) * spacing[2];
+    }
+    image->SetDirection(direction);
+    image->SetOrigin(origin);
+    image->Allocate();
+
+    PixelType *buffer = image->GetBufferPointer();
+    const std::size_t slice = size[0] * size[1];
+    ParallelFor(size[2], 0, [&](std::size_t k) {
+        const double z = origin[2] + direction[2][2] * spacing[2] * static_cast<double>(k);
+        const auto zKey = static_cast<std::int64_t>(std::lround(z * 10.0));
+        PixelType *out = buffer + k * slice;
+        for (std::size_t j = 0; j < size[1]; ++j) {
+            const double y = origin[1] + spacing[1] * static_cast<double>(j);
+            const auto yKey = static_cast<std::int64_t>(std::lround(y * 10.0));
+            for (std::size_t i = 0; i < size[0]; ++i) {
+                const double x = origin[0] + spacing[0] * static_cast<double>(i);
+                const double noise = 20.0 * HashNoise(std::lround(x * 10.0), yKey, zKey);
+                *out++ = static_cast<PixelType>(std::lround(PhantomValue(x, y, z) + noise));
+            }
+        }
+    });
+    return image;
+}
+
+std::vector<std::string> WriteDicomPhantom(const ImageType *image, const std::string &directory)
+{
+    const auto size = image->GetLargestPossibleRegion().GetSize();
+    std::vector<std::string> files;
+    for (unsigned long k = 0; k < size[2]; ++k) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "/IMG%05lu.dcm", k + 1);
+        files.push_back(directory + name);
+    }
+
+    // 已生成过同样层数的序列时直接复用
+    itksys::Directory existing;
+    if (existing.Load(directory) && existing.GetNumberOfFiles() == size[2] + 2
+        && itksys::SystemTools::FileExists(files.back())) {
+        return files;
+    }
+    itksys::SystemTools::MakeDirectory(directory);
+
+    gdcm::UIDGenerator uid;
+    const std::string study = uid.Generate();
+    const std::string series = uid.Generate();
+    const std::string frame = uid.Generate();
+    const std::size_t slicePixels = size[0] * size[1];
+
+    ParallelFor(size[2], 0, [&](std::size_t k) {
+        auto slice = ImageType::New();
+        ImageType::RegionType region;
+        ImageType::SizeType sliceSize = size;
+        sliceSize[2] = 1;
+        region.SetSize(sliceSize);
+        slice->SetRegions(region);
+        slice->SetSpacing(image->GetSpacing());
+        slice->SetDirection(image->GetDirection());
+        ImageType::PointType origin;
+        ImageType::IndexType index{{0, 0, static_cast<itk::IndexValueType>(k)}};
+        image->TransformIndexToPhysicalPoint(index, origin);
+        slice->SetOrigin(origin);
+        slice->GetPixelContainer()->SetImportPointer(
+            const_cast<PixelType *>(image->GetBufferPointer()) + k * slicePixels, slicePixels, false);
+
+        itk::MetaDataDictionary dictionary;
+        gdcm::UIDGenerator sliceUid;
+        itk::EncapsulateMetaData<std::string>(dictionary, "0008|0016", "1.2.840.10008.5.1.4.1.1.2");
+        itk::EncapsulateMetaData<std::string>(dictionary, "0008|0018", sliceUid.Generate());
+        itk::EncapsulateMetaData<std::string>(dictionary, "0008|0060", "CT");
+        itk::EncapsulateMetaData<std::string>(dictionary, "0010|0010", "PHANTOM");
+        itk::EncapsulateMetaData<std::string>(dictionary, "0010|0020", "BENCH");
+        itk::EncapsulateMetaData<std::string>(dictionary, "0020|000d", study);
+        itk::EncapsulateMetaData<std::string>(dictionary, "0020|000e", series);
+        itk::EncapsulateMetaData<std::string>(dictionary, "0020|0052", frame);
+        itk::EncapsulateMetaData<std::string>(dictionary, "0020|0013", std::to_string(k + 1));
+        itk::EncapsulateMetaData<std::string>(dictionary, "0028|1052", "0");
+        itk::EncapsulateMetaData<std::string>(dictionary, "0028|1053", "1");
+        slice->SetMetaDataDictionary(dictionary);
+
+        auto io = itk::GDCMImageIO::New();
+        io->KeepOriginalUIDOn();
+        auto writer = itk::ImageFileWriter<ImageType>::New();
+        writer->SetImageIO(io);
+        writer->SetInput(slice);
+        writer->SetFileName(files[k]);
+        writer->Update();
+    });
+    return files;
+}
+
+double TimeSeconds(const std::function<void()> &fn, int repeat)
+{
+    std::vector<double> samples;
+    for (int i = 0; i < std::max(1, repeat); ++i) {
+        const auto t0 = std::chrono::steady_clock::now();
+        fn();
+        samples.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+namespace {
+
+// 重置进程的峰值常驻内存（VmHWM / ru_maxrss），只有 Linux 支持
+bool ResetPeakRss()
+{
+#if defined(__linux__)
+    std::FILE *clearRefs = std::fopen("/proc/self/clear_refs", "w");
+    if (!clearRefs) {
+        return false;
+    }
+    const bool written = std::fputs("5", clearRefs) >= 0;
+    return std::fclose(clearRefs) == 0 && written;
+#else
+    return false;
+#endif
+}
+
+} // namespace
+
+StageMemoryMeter::~StageMemoryMeter()
+{
+    if (m_sampler.joinable()) {
+        Stop();
+    }
+}
+
+void StageMemoryMeter::Start()
+{
+    if (m_sampler.joinable()) {
+        Stop();
+    }
+    m_peakReset = ResetPeakRss();
+    m_baseline = CurrentRssBytes();
+    m_sampledPeak = m_baseline;
+    if (!m_peakReset) {
+        m_running = true;
+        m_sampler = std::thread([this]() {
+            while (m_running) {
+                const std::size_t current = CurrentRssBytes();
+                if (current > m_sampledPeak) {
+                    m_sampledPeak = current;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        });
+    }
+}
+
+std::size_t StageMemoryMeter::Stop()
+{
+    std::size_t peak = std::max<std::size_t>(m_sampledPeak, CurrentRssBytes());
+    if (m_sampler.joinable()) {
+        m_running = false;
+        m_sampler.join();
+        peak = std::max<std::size_t>(peak, m_sampledPeak);
+    }
+    if (m_peakReset) {
+        peak = std::max(peak, PeakRssBytes());
+    }
+    return peak > m_baseline ? peak - m_baseline : 0;
+}
+
+void WriteMeasurement(std::FILE *out, const Measurement &m)
+{
+    const double seconds = std::max(m.seconds, 1e-9);
+    std::fprintf(out,
+                 "{\"stage\":\"%s\",\"volume\":\"%s\",\"threads\":%u,\"seconds\":%.6f,"
+                 "\"voxels_per_s\":%.1f,\"mb_per_s\":%.2f,\"baseline_rss_mb\":%.1f,\"stage_peak_mb\":%.1f}\n",
+                 m.stage.c_str(), m.volume.c_str(), m.threads, m.seconds, m.voxels / seconds,
+                 m.bytes / seconds / (1024.0 * 1024.0), m.baselineRssMB, m.stagePeakMB);
+    std::fflush(out);
+}
+
+} // namespace bench
+} // namespace dicomstitcher
@@ -0,0 +1,78 @@
+﻿// 基准程序共用：确定性合成 CT 体模、DICOM 序列写出、计时与各阶段峰值内存、JSON Lines 输出
+#ifndef BENCHCOMMON_H
+#define BENCHCOMMON_H
+
+#include "pipelinecommon.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace dicomstitcher {
+namespace bench {
+
+struct PhantomSpec
+{
+    unsigned long size[3]{256, 256, 200};
+    double spacing[3]{0.9, 0.9, 2.0};
+    double zStart{0.0};    // 第一层的物理 z（mm），不同段体模在重叠区内容一致
+    bool flipZ{true};      // 典型 DICOM 轴位序列：z 递减，需要翻转才能到 RAS
+};
+
+// 内容只由物理坐标决定（椭圆躯干、脊柱、肋骨环、双肺 + 坐标哈希噪声），与线程数、生成顺序无关
+ImageType::Pointer MakePhantom(const PhantomSpec &spec);
+
+// 写为单层 DICOM 文件序列（IMG00001.dcm …），目录已存在且文件数一致时直接复用。返回文件列表（按 z 排序）
+std::vector<std::string> WriteDicomPhantom(const ImageType *image, const std::string &directory);
+
+// 重复 repeat 次，返回中位数耗时（秒）
+double TimeSeconds(const std::function<void()> &fn, int repeat);
+
+// 一个阶段自身的峰值常驻内存：Start 时记下基线，Stop 返回期间峰值与基线之差（字节）。
+// Linux 上 Start 写 /proc/self/clear_refs 重置进程峰值，Stop 读取精确的峰值；
+// 其他平台（或无法重置时）由后台线程每毫秒采样 CurrentRssBytes，极短的尖峰可能漏掉
+class StageMemoryMeter
+{
+public:
+    StageMemoryMeter() = default;
+    ~StageMemoryMeter();
+
+    StageMemoryMeter(const StageMemoryMeter &) = delete;
+    StageMemoryMeter &operator=(const StageMemoryMeter &) = delete;
+
+    void Start();
+    std::size_t Stop();
+
+    std::size_t BaselineBytes() const { return m_baseline; }
+
+private:
+    std::size_t m_baseline{0};
+    bool m_peakReset{false};
+    std::atomic<bool> m_running{false};
+    std::atomic<std::size_t> m_sampledPeak{0};
+    std::thread m_sampler;
+};
+
+// 一条测量结果，一行一个 JSON 对象，便于不同构建之间逐行比较
+struct Measurement
+{
+    std::string stage;
+    std::string volume;   // 如 "256x256x200@0.9x0.9x2.0"
+    unsigned int threads{0};
+    double voxels{0.0};   // 每次处理的体素（或样本）数
+    double bytes{0.0};    // 每次处理的字节数
+    double seconds{0.0};
+    double baselineRssMB{0.0}; // 阶段开始时的常驻内存
+    double stagePeakMB{0.0};   // 阶段期间（含全部重复）常驻内存峰值超出基线的部分
+};
+
+void WriteMeasurement(std::FILE *out, const Measurement &m);
+
+} // namespace bench
+} // namespace dicomstitcher
+
+#endif // BENCHCOMMON_H
@@ -0,0 +1,498 @@
+﻿#include "brickedvolume.h"
+#include "dicomindex.h"
+
+#include <itksys/SystemTools.hxx>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <itksys/Encoding.hxx>
+#else
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace dicomstitcher {
+
+namespace {
+
+constexpr std::size_t BrickVoxels =
+    std::size_t(BrickedVolume::BrickEdge) * BrickedVolume::BrickEdge * BrickedVolume::BrickEdge;
+// 512 KiB：是页大小与 Windows 映射粒度（64 KiB）的整数倍，每个分块可单独映射
+constexpr std::size_t BrickBytes = BrickVoxels * sizeof(PixelType);
+
+inline std::size_t BrickOffset(std::size_t x, std::size_t y, std::size_t z)
+{
+    return (z * BrickedVolume::BrickEdge + y) * BrickedVolume::BrickEdge + x;
+}
+
+} // namespace
+
+// 分块的后备存储：创建后立即删除（POSIX）或关闭时删除（Windows）的临时文件，大小按全部分块预留，
+// 未写入的分块不占磁盘（稀疏文件）
+class BrickScratchFile
+{
+public:
+    BrickScratchFile(const std::string &directory, std::uint64_t bytes)
+    {
+#if defined(_WIN32)
+        std::wstring folder;
+        if (directory.empty()) {
+            wchar_t buffer[MAX_PATH + 1];
+            const DWORD length = GetTempPathW(MAX_PATH + 1, buffer);
+            folder.assign(buffer, length);
+        } else {
+            folder = itksys::Encoding::ToWide(directory);
+        }
+        wchar_t path[MAX_PATH + 1];
+        if (GetTempFileNameW(folder.c_str(), L"dsb", 0, path) == 0) {
+            throw itk::ExceptionObject(__FILE__, __LINE__, "Failed to create brick scratch file");
+        }
+        m_file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                             FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+        if (m_file == INVALID_HANDLE_VALUE) {
+            DeleteFileW(path);
+            throw itk::ExceptionObject(__FILE__, __LINE__, "Failed to open brick scratch file");
+        }
+        DWORD returned = 0;
+        DeviceIoControl(m_file, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned, nullptr);
+        LARGE_INTEGER size;
+        size.QuadPart = static_cast<LONGLONG>(bytes);
+        m_mapping = CreateFileMappingW(m_file, nullptr, PAGE_READWRITE, size.HighPart, size.LowPart, nullptr);
+        if (!m_mapping) {
+            CloseHandle(m_file);
+            throw itk::ExceptionObject(__FILE__, __LINE__, "Failed to reserve brick scratch file");
+        }
+#else
+        std::string path = directory;
+        if (path.empty()) {
+            const char *temp = itksys::SystemTools::GetEnv("TMPDIR");
+            path = temp && *temp ? temp : "/tmp";
+        }
+        path += "/dicomstitcher-bricks-XXXXXX";
+        m_fd = ::mkstemp(&path[0]);
+        if (m_fd < 0) {
+            throw itk::ExceptionObject(__FILE__, __LINE__, "Failed to create brick scratch file");
+        }
+        ::unlink(path.c_str());
+        if (::ftruncate(m_fd, static_cast<off_t>(bytes)) != 0) {
+            ::close(m_fd);
+            throw itk::ExceptionObject(__FILE__, __LINE__, "Failed to reserve brick scratch file");
+        }
+#endif
+    }
+
+    ~BrickScratchFile()
+    {
+#if defined(_WIN32)
+        CloseHandle(m_mapping);
+        CloseHandle(m_file);
+#else
+        ::close(m_fd);
+#endif
+    }
+
+    BrickScratchFile(const BrickScratchFile &) = delete;
+    BrickScratchFile &operator=(const BrickScratchFile &) = delete;
+
+    PixelType *Map(std::uint64_t offset) const
+    {
+#if defined(_WIN32)
+        void *data = MapViewOfFile(m_mapping, FILE_MAP_WRITE, static_cast<DWORD>(offset >> 32),
+                                   static_cast<DWORD>(offset & 0xffffffffu), BrickBytes);
+        return static_cast<PixelType *>(data);
+#else
+        void *data = ::mmap(nullptr, BrickBytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, static_cast<off_t>(offset));
+        return data == MAP_FAILED ? nullptr : static_cast<PixelType *>(data);
+#endif
+    }
+
+    static void Unmap(PixelType *data)
+    {
+#if defined(_WIN32)
+        UnmapViewOfFile(data);
+#else
+        ::munmap(data, BrickBytes);
+#endif
+    }
+
+private:
+#if defined(_WIN32)
+    HANDLE m_file{INVALID_HANDLE_VALUE};
+    HANDLE m_mapping{nullptr};
+#else
+    int m_fd{-1};
+#endif
+};
+
+// 一个已映射的分块；最后一个引用释放时解除映射，脏页留给系统写回
+struct BrickPool::MappedBrick
+{
+    Key key;
+    std::shared_ptr<BrickScratchFile> file;
+    PixelType *data;
+
+    ~MappedBrick() { BrickScratchFile::Unmap(data); }
+};
+
+std::string DefaultBrickScratchDirectory()
+{
+    return ApplicationCacheDirectory() + "/bricks";
+}
+
+std::shared_ptr<BrickPool> BrickPool::Create(std::size_t residentBytes, const std::string &scratchDirectory)
+{
+    return std::shared_ptr<BrickPool>(new BrickPool(residentBytes, scratchDirectory));
+}
+
+BrickPool::BrickPool(std::size_t residentBytes, const std::string &scratchDirectory)
+    : m_budget(residentBytes)
+    , m_scratchDirectory(scratchDirectory.empty() ? DefaultBrickScratchDirectory() : scratchDirectory)
+{
+}
+
+void BrickPool::SetResidentBudget(std::size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_budget = bytes;
+    EvictLocked();
+}
+
+std::size_t BrickPool::ResidentBudget() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_budget;
+}
+
+std::size_t BrickPool::ResidentBytes() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_resident;
+}
+
+std::shared_ptr<BrickPool::MappedBrick> BrickPool::Acquire(const BrickedVolume &volume, std::size_t brick)
+{
+    const Key key = (static_cast<Key>(volume.m_id) << 32) | static_cast<Key>(brick);
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto found = m_index.find(key);
+    if (found != m_index.end()) {
+        m_lru.splice(m_lru.begin(), m_lru, found->second);
+        return m_lru.front();
+    }
+
+    // 只建立映射，不触发读盘；缺页在调用方访问像素时（锁外）发生
+    PixelType *data = volume.m_file->Map(static_cast<std::uint64_t>(brick) * BrickBytes);
+    if (!data) {
+        throw itk::ExceptionObject(__FILE__, __LINE__, "Failed to map volume brick");
+    }
+    auto mapped = std::make_shared<MappedBrick>();
+    mapped->key = key;
+    mapped->file = volume.m_file;
+    mapped->data = data;
+    m_lru.push_front(mapped);
+    m_index[key] = m_lru.begin();
+    m_resident += BrickBytes;
+    EvictLocked();
+    return mapped;
+}
+
+void BrickPool::Release(std::uint32_t volumeId)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto it = m_lru.begin(); it != m_lru.end();) {
+        if (static_cast<std::uint32_t>((*it)->key >> 32) == volumeId) {
+            m_index.erase((*it)->key);
+            m_resident -= BrickBytes;
+            it = m_lru.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void BrickPool::EvictLocked()
+{
+    // 只有池本身持有引用（use_count 为 1）的分块可以淘汰；新引用只在持锁的 Acquire 中产生
+    for (auto it = m_lru.end(); m_resident > m_budget && it != m_lru.begin();) {
+        --it;
+        if (it->use_count() == 1) {
+            m_index.erase((*it)->key);
+            m_resident -= BrickBytes;
+            it = m_lru.erase(it);
+        }
+    }
+}
+
+BrickedVolume::BrickedVolume(const ImageGrid &grid, std::shared_ptr<BrickPool> pool, const std::string &directory)
+    : m_grid(grid)
+    , m_pool(std::move(pool))
+{
+    static std::atomic<std::uint32_t> nextId{0};
+    m_id = nextId.fetch_add(1);
+    std::uint64_t bricks = 1;
+    for (unsigned int i = 0; i < 3; ++i) {
+        m_bricks[i] = (grid.size[i] + BrickEdge - 1) / BrickEdge;
+        bricks *= m_bricks[i];
+    }
+    if (bricks > std::numeric_limits<std::uint32_t>::max()) {
+        throw itk::ExceptionObject(__FILE__, __LINE__, "Volume too large for bricked storage");
+    }
+    std::string folder = directory.empty() ? m_pool->ScratchDirectory() : directory;
+    if (!itksys::SystemTools::MakeDirectory(folder)) {
+        folder.clear(); // 退回系统临时目录
+    }
+    m_file = std::make_shared<BrickScratchFile>(folder, std::max<std::uint64_t>(1, bricks) * BrickBytes);
+}
+
+BrickedVolume::~BrickedVolume()
+{
+    m_pool->Release(m_id);
+}
+
+std::shared_ptr<BrickedVolume> BrickedVolume::Create(const ImageGrid &grid,
+                                                     std::shared_ptr<BrickPool> pool,
+                                                     const std::string &directory)
+{
+    if (!pool) {
+        throw itk::ExceptionObject(__FILE__, __LINE__, "BrickedVolume requires a BrickPool");
+    }
+    return std::shared_ptr<BrickedVolume>(new BrickedVolume(grid, std::move(pool), directory));
+}
+
+std::shared_ptr<BrickedVolume> BrickedVolume::FromImage(const ImageType *image,
+                                                        std::shared_ptr<BrickPool> pool,
+                                                        const CancelToken &cancel,
+                                                        unsigned int numberOfThreads,
+                                                        const std::string &directory)
+{
+    auto volume = Create(GridOf(image), std::move(pool), directory);
+    const auto size = image->GetBufferedRegion().GetSize();
+    const std::size_t sx = size[0];
+    const std::size_t sxy = size[0] * size[1];
+    const PixelType *source = image->GetBufferPointer();
+    const std::size_t *bricks = volume->m_bricks;
+
+    // 每个分块只由一个工作单元写入；写完即可被淘汰，拷贝过程中常驻量不超过预算加线程数个分块
+    ParallelFor(bricks[0] * bricks[1] * bricks[2], numberOfThreads, [&](std::size_t brick) {
+        cancel.ThrowIfCancelled();
+        const std::size_t b[3] = {brick % bricks[0], (brick / bricks[0]) % bricks[1], brick / (bricks[0] * bricks[1])};
+        std::size_t begin[3];
+        std::size_t end[3];
+        for (unsigned int i = 0; i < 3; ++i) {
+            begin[i] = b[i] * BrickEdge;
+            end[i] = std::min<std::size_t>(begin[i] + BrickEdge, size[i]);
+        }
+        const auto mapped = volume->m_pool->Acquire(*volume, brick);
+        for (std::size_t z = begin[2]; z < end[2]; ++z) {
+            for (std::size_t y = begin[1]; y < end[1]; ++y) {
+                std::memcpy(mapped->data + BrickOffset(0, y - begin[1], z - begin[2]),
+                            source + z * sxy + y * sx + begin[0], (end[0] - begin[0]) * sizeof(PixelType));
+            }
+        }
+    });
+    return volume;
+}
+
+BrickedVolume::RegionType BrickedVolume::LargestRegion() const
+{
+    RegionType region;
+    region.SetSize(m_grid.size);
+    return region;
+}
+
+template <typename Body>
+void BrickedVolume::ForEachBrick(const RegionType &region, Body &&body) const
+{
+    std::size_t first[3];
+    std::size_t last[3];
+    for (unsigned int i = 0; i < 3; ++i) {
+        if (region.GetSize(i) == 0) {
+            return;
+        }
+        first[i] = static_cast<std::size_t>(region.GetIndex(i)) / BrickEdge;
+        last[i] = (static_cast<std::size_t>(region.GetIndex(i)) + region.GetSize(i) - 1) / BrickEdge;
+    }
+    for (std::size_t bz = first[2]; bz <= last[2]; ++bz) {
+        for (std::size_t by = first[1]; by <= last[1]; ++by) {
+            for (std::size_t bx = first[0]; bx <= last[0]; ++bx) {
+                const std::size_t b[3] = {bx, by, bz};
+                RegionType part;
+                RegionType::IndexType brickStart;
+                for (unsigned int i = 0; i < 3; ++i) {
+                    brickStart[i] = static_cast<itk::IndexValueType>(b[i] * BrickEdge);
+                    const auto begin = std::max<itk::IndexValueType>(brickStart[i], region.GetIndex(i));
+                    const auto end = std::min<itk::IndexValueType>(brickStart[i] + BrickEdge,
+                                                                    region.GetIndex(i)
+                                                                        + static_cast<itk::IndexValueType>(region.GetSize(i)));
+                    part.SetIndex(i, begin);
+                    part.SetSize(i, static_cast<itk::SizeValueType>(end - begin));
+                }
+                const auto mapped = m_pool->Acquire(*this, (bz * m_bricks[1] + by) * m_bricks[0] + bx);
+                body(mapped->data, brickStart, part);
+            }
+        }
+    }
+}
+
+void BrickedVolume::ReadRegion(const RegionType &region, PixelType *out) const
+{
+    const auto start = region.GetIndex();
+    const std::size_t sx = region.GetSize(0);
+    const std::size_t sxy = sx * region.GetSize(1);
+    ForEachBrick(region, [&](const PixelType *brick, const RegionType::IndexType &brickStart, const RegionType &part) {
+        const auto p = part.GetIndex();
+        for (itk::SizeValueType z = 0; z < part.GetSize(2); ++z) {
+            for (itk::SizeValueType y = 0; y < part.GetSize(1); ++y) {
+                const PixelType *src = brick + BrickOffset(p[0] - brickStart[0], p[1] + y - brickStart[1],
+                                                           p[2] + z - brickStart[2]);
+                PixelType *dst = out + (p[2] + z - start[2]) * sxy + (p[1] + y - start[1]) * sx + (p[0] - start[0]);
+                std::memcpy(dst, src, part.GetSize(0) * sizeof(PixelType));
+            }
+        }
+    });
+}
+
+void BrickedVolume::WriteRegion(const RegionType &region, const PixelType *in)
+{
+    const auto start = region.GetIndex();
+    const std::size_t sx = region.GetSize(0);
+    const std::size_t sxy = sx * region.GetSize(1);
+    ForEachBrick(region, [&](PixelType *brick, const RegionType::IndexType &brickStart, const RegionType &part) {
+        const auto p = part.GetIndex();
+        for (itk::SizeValueType z = 0; z < part.GetSize(2); ++z) {
+            for (itk::SizeValueType y = 0; y < part.GetSize(1); ++y) {
+                PixelType *dst = brick + BrickOffset(p[0] - brickStart[0], p[1] + y - brickStart[1],
+                                                     p[2] + z - brickStart[2]);
+                const PixelType *src =
+                    in + (p[2] + z - start[2]) * sxy + (p[1] + y - start[1]) * sx + (p[0] - start[0]);
+                std::memcpy(dst, src, part.GetSize(0) * sizeof(PixelType));
+            }
+        }
+    });
+}
+
+ImageType::Pointer BrickedVolume::ReadRegionImage(const RegionType &region) const
+{
+    ImageType::PointType origin = m_grid.origin;
+    for (unsigned int i = 0; i < 3; ++i) {
+        for (unsigned int j = 0; j < 3; ++j) {
+            origin[i] += m_grid.direction[i][j] * m_grid.spacing[j] * static_cast<double>(region.GetIndex(j));
+        }
+    }
+    auto image = ImageType::New();
+    ImageType::RegionType local;
+    local.SetSize(region.GetSize());
+    image->SetRegions(local);
+    image->SetOrigin(origin);
+    image->SetSpacing(m_grid.spacing);
+    image->SetDirection(m_grid.direction);
+    image->Allocate();
+    ReadRegion(region, image->GetBufferPointer());
+    return image;
+}
+
+void BrickedVolume::ExtractSlice(SliceOrientation orientation, int index, PixelType *out) const
+{
+    // 法向只有一层，区域的 x 最快顺序正好是切片的 u 行 v 列（u 轴编号总小于 v 轴）
+    const SliceLayout layout = GetSliceLayout(m_grid, orientation);
+    RegionType region = LargestRegion();
+    region.SetIndex(layout.normalAxis, index);
+    region.SetSize(layout.normalAxis, 1);
+    ReadRegion(region, out);
+}
+
+bool MappedRegion(const ImageGrid &source,
+                  const IndexAffine &affine,
+                  const double first[3],
+                  const double last[3],
+                  ImageType::RegionType &region)
+{
+    double lower[3] = {std::numeric_limits<double>::max(), std::numeric_limits<double>::max(),
+                       std::numeric_limits<double>::max()};
+    double upper[3] = {std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest(),
+                       std::numeric_limits<double>::lowest()};
+    for (unsigned int corner = 0; corner < 8; ++corner) {
+        double k[3];
+        for (unsigned int i = 0; i < 3; ++i) {
+            k[i] = ((corner >> i) & 1u) ? last[i] : first[i];
+        }
+        for (unsigned int j = 0; j < 3; ++j) {
+            const double c = affine.a[j][0] * k[0] + affine.a[j][1] * k[1] + affine.a[j][2] * k[2] + affine.b[j];
+            lower[j] = std::min(lower[j], c);
+            upper[j] = std::max(upper[j], c);
+        }
+    }
+    for (unsigned int j = 0; j < 3; ++j) {
+        const double n = static_cast<double>(source.size[j]);
+        const double begin = std::max(0.0, std::floor(lower[j]) - 1.0);
+        const double end = std::min(n, std::floor(upper[j]) + 2.0);
+        if (!(begin < end)) {
+            return false;
+        }
+        region.SetIndex(j, static_cast<itk::IndexValueType>(begin));
+        region.SetSize(j, static_cast<itk::SizeValueType>(end - begin));
+    }
+    return true;
+}
+
+void ResliceSlice(const BrickedVolume &volume,
+                  const itk::Transform<double, 3> *transform,
+                  const ImageGrid &grid,
+                  SliceOrientation orientation,
+                  int index,
+                  PixelType *out,
+                  unsigned char *inside,
+                  unsigned int numberOfThreads)
+{
+    const SliceLayout layout = GetSliceLayout(grid, orientation);
+
+    // 只需几何即可求索引映射，不分配像素
+    const ImageType::Pointer geometry = NewGeometryImage(volume.Grid());
+    IndexAffine affine;
+    if (!ComputeIndexAffine(geometry.GetPointer(), grid, transform, affine)) {
+        ImageType::Pointer image = volume.ReadRegionImage(volume.LargestRegion());
+        ResliceSlice(image.GetPointer(), transform, grid, orientation, index, out, inside, numberOfThreads);
+        return;
+    }
+
+    // 只读取切片映射到 volume 的包围盒，索引平移后浮点舍入与在完整体数据上采样略有不同
+    double first[3];
+    double last[3];
+    first[layout.uAxis] = 0.0;
+    last[layout.uAxis] = static_cast<double>(layout.width) - 1.0;
+    first[layout.vAxis] = 0.0;
+    last[layout.vAxis] = static_cast<double>(layout.height) - 1.0;
+    first[layout.normalAxis] = last[layout.normalAxis] = index;
+    ImageType::RegionType box;
+    if (!MappedRegion(volume.Grid(), affine, first, last, box)) {
+        const std::size_t count = layout.width * layout.height;
+        std::fill(out, out + count, PixelType(0));
+        if (inside) {
+            std::fill(inside, inside + count, static_cast<unsigned char>(0));
+        }
+        return;
+    }
+    for (unsigned int j = 0; j < 3; ++j) {
+        affine.b[j] -= static_cast<double>(box.GetIndex(j));
+    }
+    ImageType::Pointer part = volume.ReadRegionImage(box);
+    ResliceSlice(part.GetPointer(), affine, grid, orientation, index, out, inside, numberOfThreads);
+}
+
+vtkSmartPointer<vtkImageData> ExtractSliceImage(const BrickedVolume &volume, SliceOrientation orientation, int index)
+{
+    vtkSmartPointer<vtkImageData> slice = NewSliceImage(volume.Grid(), orientation, index);
+    volume.ExtractSlice(orientation, index, static_cast<PixelType *>(slice->GetScalarPointer()));
+    return slice;
+}
+
+} // namespace dicomstitcher
@@ -0,0 +1,145 @@
+﻿#ifndef BRICKEDVOLUME_H
+#define BRICKEDVOLUME_H
+
+#include "pipelinecommon.h"
+#include "imagepreprocessing.h"
+#include "slicereslicer.h"
+
+#include <itkTransform.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace dicomstitcher {
+
+class BrickedVolume;
+class BrickScratchFile;
+
+// ApplicationCacheDirectory() 下的 bricks。分块临时文件默认放在磁盘上的缓存目录：
+// 系统临时目录（如 /tmp）常是内存文件系统，换出的分块仍会占用内存
+std::string DefaultBrickScratchDirectory();
+
+// 多个分块体数据共用的常驻内存预算：已映射的分块按最近使用排序，超出预算时解除最久未用的映射
+// （脏页由系统写回临时文件）。正在被读写的分块不会被淘汰，因此常驻量可能暂时超出预算。线程安全。
+class BrickPool
+{
+public:
+    // scratchDirectory 为分块临时文件所在目录，为空时使用 DefaultBrickScratchDirectory()
+    static std::shared_ptr<BrickPool> Create(std::size_t residentBytes,
+                                             const std::string &scratchDirectory = std::string());
+
+    void SetResidentBudget(std::size_t bytes);
+    std::size_t ResidentBudget() const;
+    std::size_t ResidentBytes() const;
+    const std::string &ScratchDirectory() const { return m_scratchDirectory; }
+
+    BrickPool(const BrickPool &) = delete;
+    BrickPool &operator=(const BrickPool &) = delete;
+
+private:
+    friend class BrickedVolume;
+    struct MappedBrick;
+    using Key = std::uint64_t; // 体数据编号 << 32 | 分块编号
+
+    BrickPool(std::size_t residentBytes, const std::string &scratchDirectory);
+
+    std::shared_ptr<MappedBrick> Acquire(const BrickedVolume &volume, std::size_t brick);
+    void Release(std::uint32_t volumeId);
+    void EvictLocked();
+
+    mutable std::mutex m_mutex;
+    std::size_t m_budget;
+    const std::string m_scratchDirectory;
+    std::size_t m_resident{0};
+    std::list<std::shared_ptr<MappedBrick>> m_lru; // 头部为最近使用
+    std::unordered_map<Key, std::list<std::shared_ptr<MappedBrick>>::iterator> m_index;
+};
+
+// 按 64³ 体素分块存放的 short 体数据，像素保存在内存映射的临时文件中（关闭后自动删除），
+// 常驻内存由 BrickPool 的预算控制，体数据大小只受磁盘空间限制。
+// 分块内按 x 最快连续存放，任意方向的切片只触及与之相交的一层分块，当前切片附近的访问保持在内存中。
+// 读写接口可在多个线程中并发调用；并发写同一区域的结果未定义。
+class BrickedVolume
+{
+public:
+    static constexpr unsigned int BrickEdge = 64;
+
+    using RegionType = ImageType::RegionType;
+
+    // 空体数据（像素为 0）。directory 为空时使用 pool 的临时目录，该目录无法创建时退回系统临时目录；
+    // 无法创建临时文件时抛出 itk::ExceptionObject
+    static std::shared_ptr<BrickedVolume> Create(const ImageGrid &grid,
+                                                 std::shared_ptr<BrickPool> pool,
+                                                 const std::string &directory = std::string());
+
+    // 拷贝 image 的全部像素（按分块并行）
+    static std::shared_ptr<BrickedVolume> FromImage(const ImageType *image,
+                                                    std::shared_ptr<BrickPool> pool,
+                                                    const CancelToken &cancel = CancelToken(),
+                                                    unsigned int numberOfThreads = 0,
+                                                    const std::string &directory = std::string());
+
+    ~BrickedVolume();
+
+    BrickedVolume(const BrickedVolume &) = delete;
+    BrickedVolume &operator=(const BrickedVolume &) = delete;
+
+    const ImageGrid &Grid() const { return m_grid; }
+    RegionType LargestRegion() const;
+
+    // region 需在 LargestRegion() 内；out / in 按 region 的 x 最快顺序连续存放
+    void ReadRegion(const RegionType &region, PixelType *out) const;
+    void WriteRegion(const RegionType &region, const PixelType *in);
+
+    // region 的像素拷贝为独立的 ITK 图像：索引从 0 开始，原点移到 region 起点，间距与方向不变
+    ImageType::Pointer ReadRegionImage(const RegionType &region) const;
+
+    // 与 ExtractSlice(const ImageType *, ...) 相同的输出布局
+    void ExtractSlice(SliceOrientation orientation, int index, PixelType *out) const;
+
+private:
+    friend class BrickPool;
+
+    BrickedVolume(const ImageGrid &grid, std::shared_ptr<BrickPool> pool, const std::string &directory);
+
+    // 对 region 与每个相交分块的交集调用 body(分块像素, 分块起点, 交集)
+    template <typename Body>
+    void ForEachBrick(const RegionType &region, Body &&body) const;
+
+    ImageGrid m_grid;
+    std::size_t m_bricks[3];
+    std::uint32_t m_id;
+    std::shared_ptr<BrickPool> m_pool;
+    std::shared_ptr<BrickScratchFile> m_file;
+};
+
+// grid 的索引盒 [first, last]（各轴闭区间）经 affine 映射到 source 后的索引包围盒，外扩一个体素并与 source 求交：
+// 只读取这个区域时，插值的邻点与界内判断都与在完整体数据上采样相同。不相交时返回 false
+bool MappedRegion(const ImageGrid &source,
+                  const IndexAffine &affine,
+                  const double first[3],
+                  const double last[3],
+                  ImageType::RegionType &region);
+
+// 与 ResliceSlice(const ImageType *, ...) 相同的采样规则（截断取整前的浮点舍入可能相差 1）。
+// 线性变换时只读取这张切片的 MappedRegion，非线性变换时读取整个体数据
+void ResliceSlice(const BrickedVolume &volume,
+                  const itk::Transform<double, 3> *transform,
+                  const ImageGrid &grid,
+                  SliceOrientation orientation,
+                  int index,
+                  PixelType *out,
+                  unsigned char *inside = nullptr,
+                  unsigned int numberOfThreads = 0);
+
+// 一张切片的 VTK_SHORT 图像（几何见 NewSliceImage），供 viewer 只显示这一层
+vtkSmartPointer<vtkImageData> ExtractSliceImage(const BrickedVolume &volume, SliceOrientation orientation, int index);
+
+} // namespace dicomstitcher
+
+#endif // BRICKEDVOLUME_H
@@ -0,0 +1,368 @@
+﻿#include "coarsealignment.h"
+#include "imagepreprocessing.h"
+
+#include <itkEuler3DTransform.h>
+#include <itkTranslationTransform.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+namespace dicomstitcher {
+
+namespace {
+
+constexpr double kPi = 3.14159265358979323846;
+
+// 一个块层（z 方向一组块）上的加权矩，x / y 为物理坐标（mm），权重为掩膜面积（mm²）
+struct SlabMoments
+{
+    double w{0.0};
+    double sx{0.0};
+    double sy{0.0};
+    double sxx{0.0};
+    double syy{0.0};
+    double sxy{0.0};
+
+    SlabMoments &operator+=(const SlabMoments &o)
+    {
+        w += o.w;
+        sx += o.sx;
+        sy += o.sy;
+        sxx += o.sxx;
+        syy += o.syy;
+        sxy += o.sxy;
+        return *this;
+    }
+};
+
+// 沿 z 的块层剖面，z 按升序排列
+struct MaskProfile
+{
+    std::vector<double> z;
+    std::vector<SlabMoments> slabs;
+};
+
+MaskProfile ComputeProfile(const ImageType *image,
+                           double threshold,
+                           const CoarseAlignmentSettings &settings,
+                           const CancelToken &cancel)
+{
+    const ImageType::RegionType region = image->GetBufferedRegion();
+    const auto size = region.GetSize();
+    const auto spacing = image->GetSpacing();
+    MaskProfile profile;
+    if (region.GetNumberOfPixels() == 0) {
+        return profile;
+    }
+    std::size_t factor[3];
+    std::size_t blocks[3];
+    for (unsigned int i = 0; i < 3; ++i) {
+        factor[i] = std::max<std::size_t>(1, static_cast<std::size_t>(std::lround(settings.gridSpacing / spacing[i])));
+        factor[i] = std::min<std::size_t>(factor[i], size[i]);
+        blocks[i] = std::max<std::size_t>(1, size[i] / factor[i]);
+    }
+
+    // 阈值转成 short 比较；块中心的物理坐标由 index → physical 的仿射给出
+    const PixelType cut = static_cast<PixelType>(std::clamp(std::ceil(threshold), -32768.0, 32767.0));
+    const double blockVoxels = static_cast<double>(factor[0] * factor[1] * factor[2]);
+    const double blockArea = factor[0] * spacing[0] * factor[1] * spacing[1];
+    const auto matrix = image->GetIndexToPhysicalPoint();
+    ImageType::PointType origin;
+    image->TransformIndexToPhysicalPoint(region.GetIndex(), origin);
+
+    profile.z.resize(blocks[2]);
+    profile.slabs.resize(blocks[2]);
+    const PixelType *buffer = image->GetBufferPointer();
+    const std::size_t sliceStride = size[0] * size[1];
+
+    ParallelFor(blocks[2], settings.numberOfThreads, [&](std::size_t bz) {
+        cancel.ThrowIfCancelled();
+        std::vector<std::uint32_t> counts(blocks[0] * blocks[1], 0);
+        for (std::size_t z = bz * factor[2]; z < (bz + 1) * factor[2]; ++z) {
+            for (std::size_t y = 0; y < blocks[1] * factor[1]; ++y) {
+                const PixelType *row = buffer + z * sliceStride + y * size[0];
+                std::uint32_t *blockRow = counts.data() + (y / factor[1]) * blocks[0];
+                for (std::size_t x = 0; x < blocks[0] * factor[0]; ++x) {
+                    blockRow[x / factor[0]] += row[x] >= cut ? 1u : 0u;
+                }
+            }
+        }
+
+        SlabMoments moments;
+        double center[3];
+        center[2] = bz * factor[2] + 0.5 * (factor[2] - 1);
+        for (std::size_t by = 0; by < blocks[1]; ++by) {
+            center[1] = by * factor[1] + 0.5 * (factor[1] - 1);
+            for (std::size_t bx = 0; bx < blocks[0]; ++bx) {
+                const double fraction = counts[by * blocks[0] + bx] / blockVoxels;
+                if (fraction < settings.minimumBlockFraction) {
+                    continue;
+                }
+                center[0] = bx * factor[0] + 0.5 * (factor[0] - 1);
+                const double px = origin[0] + matrix[0][0] * center[0] + matrix[0][1] * center[1] + matrix[0][2] * center[2];
+                const double py = origin[1] + matrix[1][0] * center[0] + matrix[1][1] * center[1] + matrix[1][2] * center[2];
+                const double w = fraction * blockArea;
+                moments.w += w;
+                moments.sx += w * px;
+                moments.sy += w * py;
+                moments.sxx += w * px * px;
+                moments.syy += w * py * py;
+                moments.sxy += w * px * py;
+            }
+        }
+        profile.slabs[bz] = moments;
+        // 层的 z 取层面中心处的物理坐标（已转到 RAS，方向矩阵接近对角）
+        const double midX = 0.5 * (blocks[0] * factor[0] - 1);
+        const double midY = 0.5 * (blocks[1] * factor[1] - 1);
+        profile.z[bz] = origin[2] + matrix[2][0] * midX + matrix[2][1] * midY + matrix[2][2] * center[2];
+    });
+
+    // 第 3 轴可能指向 -z（方向矩阵为负），统一为升序
+    if (profile.z.size() > 1 && profile.z.front() > profile.z.back()) {
+        std::reverse(profile.z.begin(), profile.z.end());
+        std::reverse(profile.slabs.begin(), profile.slabs.end());
+    }
+    return profile;
+}
+
+// 在 [zLow, zHigh] 内的块层矩之和
+SlabMoments SumRange(const MaskProfile &profile, double zLow, double zHigh)
+{
+    SlabMoments sum;
+    for (std::size_t i = 0; i < profile.z.size(); ++i) {
+        if (profile.z[i] >= zLow && profile.z[i] <= zHigh) {
+            sum += profile.slabs[i];
+        }
+    }
+    return sum;
+}
+
+// 截面积剖面在 z 处的线性插值，范围外返回 false
+bool AreaAt(const MaskProfile &profile, double z, double &area)
+{
+    const auto &zs = profile.z;
+    if (zs.empty() || z < zs.front() || z > zs.back()) {
+        return false;
+    }
+    if (zs.size() == 1) {
+        area = profile.slabs.front().w;
+        return true;
+    }
+    const auto upper = std::upper_bound(zs.begin(), zs.end(), z);
+    const std::size_t i1 = std::min<std::size_t>(static_cast<std::size_t>(upper - zs.begin()), zs.size() - 1);
+    const std::size_t i0 = i1 - 1;
+    const double t = (z - zs[i0]) / (zs[i1] - zs[i0]);
+    area = profile.slabs[i0].w + (profile.slabs[i1].w - profile.slabs[i0].w) * t;
+    return true;
+}
+
+// Fixed 的 z 对应 Moving 的 z + shift；返回重叠段上截面积剖面的归一化互相关
+double ProfileCorrelation(const MaskProfile &fixed, const MaskProfile &moving, double shift)
+{
+    double sa = 0.0;
+    double sb = 0.0;
+    double saa = 0.0;
+    double sbb = 0.0;
+    double sab = 0.0;
+    double n = 0.0;
+    for (std::size_t i = 0; i < fixed.z.size(); ++i) {
+        double b = 0.0;
+        if (!AreaAt(moving, fixed.z[i] + shift, b)) {
+            continue;
+        }
+        const double a = fixed.slabs[i].w;
+        sa += a;
+        sb += b;
+        saa += a * a;
+        sbb += b * b;
+        sab += a * b;
+        n += 1.0;
+    }
+    if (n < 3.0) {
+        return -1.0;
+    }
+    const double va = saa - sa * sa / n;
+    const double vb = sbb - sb * sb / n;
+    if (va <= 1e-12 || vb <= 1e-12) {
+        return -1.0;
+    }
+    return (sab - sa * sb / n) / std::sqrt(va * vb);
+}
+
+// 层内主轴方向（弧度），各向同性程度太高时返回 false
+bool PrincipalAngle(const SlabMoments &m, double &angle)
+{
+    if (m.w <= 0.0) {
+        return false;
+    }
+    const double mx = m.sx / m.w;
+    const double my = m.sy / m.w;
+    const double cxx = m.sxx / m.w - mx * mx;
+    const double cyy = m.syy / m.w - my * my;
+    const double cxy = m.sxy / m.w - mx * my;
+    const double anisotropy = std::sqrt((cxx - cyy) * (cxx - cyy) + 4.0 * cxy * cxy) / std::max(cxx + cyy, 1e-12);
+    if (anisotropy < 0.1) {
+        return false;
+    }
+    angle = 0.5 * std::atan2(2.0 * cxy, cxx - cyy);
+    return true;
+}
+
+itk::Transform<double, 3>::Pointer MakeTranslation(const ImageType::PointType &from, const ImageType::PointType &to)
+{
+    using TranslationType = itk::TranslationTransform<double, 3>;
+    auto transform = TranslationType::New();
+    transform->Translate(to - from);
+    return transform.GetPointer();
+}
+
+} // namespace
+
+CoarseAlignmentResult ComputeCoarseAlignment(const ImageType *fixed,
+                                             const ImageType *moving,
+                                             const CoarseAlignmentSettings &settings,
+                                             const CancelToken &cancel)
+{
+    CoarseAlignmentResult result;
+    if (!fixed || !moving) {
+        return result;
+    }
+    ScopedStage stage("coarse_alignment");
+
+    const ImageType::PointType centerF = ComputeCenter(fixed);
+    const ImageType::PointType centerM = ComputeCenter(moving);
+    if (settings.mode == CoarseAlignmentMode::GeometricCenter) {
+        result.transform = MakeTranslation(centerF, centerM);
+        result.zShift = centerM[2] - centerF[2];
+        result.ok = true;
+        return result;
+    }
+
+    const double threshold = settings.mode == CoarseAlignmentMode::Bone ? settings.boneThreshold
+                                                                          : settings.skinThreshold;
+    const MaskProfile profileF = ComputeProfile(fixed, threshold, settings, cancel);
+    const MaskProfile profileM = ComputeProfile(moving, threshold, settings, cancel);
+    cancel.ThrowIfCancelled();
+    if (profileF.z.empty() || profileM.z.empty()) {
+        return result;
+    }
+
+    const double infinity = std::numeric_limits<double>::infinity();
+    const SlabMoments totalF = SumRange(profileF, -infinity, infinity);
+    const SlabMoments totalM = SumRange(profileM, -infinity, infinity);
+    if (totalF.w <= 0.0 || totalM.w <= 0.0) {
+        return result;
+    }
+
+    if (settings.mode == CoarseAlignmentMode::Centroid) {
+        // 整体掩膜重心；z 取截面积加权的平均
+        ImageType::PointType cF;
+        ImageType::PointType cM;
+        double zF = 0.0;
+        double zM = 0.0;
+        for (std::size_t i = 0; i < profileF.z.size(); ++i) {
+            zF += profileF.z[i] * profileF.slabs[i].w;
+        }
+        for (std::size_t i = 0; i < profileM.z.size(); ++i) {
+            zM += profileM.z[i] * profileM.slabs[i].w;
+        }
+        cF[0] = totalF.sx / totalF.w;
+        cF[1] = totalF.sy / totalF.w;
+        cF[2] = zF / totalF.w;
+        cM[0] = totalM.sx / totalM.w;
+        cM[1] = totalM.sy / totalM.w;
+        cM[2] = zM / totalM.w;
+        result.transform = MakeTranslation(cF, cM);
+        result.zShift = cM[2] - cF[2];
+        result.ok = true;
+        return result;
+    }
+
+    // z 偏移：截面积剖面的互相关，步长为块层间距的 1/4，最大值处抛物线细化
+    const double stepF = profileF.z.size() > 1 ? (profileF.z.back() - profileF.z.front()) / (profileF.z.size() - 1)
+                                               : settings.gridSpacing;
+    const double step = std::max(0.25 * stepF, 0.5);
+    const double shiftLow = profileM.z.front() - profileF.z.back() + settings.minimumOverlap;
+    const double shiftHigh = profileM.z.back() - profileF.z.front() - settings.minimumOverlap;
+    double shift = centerM[2] - centerF[2];
+    double correlation = -1.0;
+    if (shiftLow <= shiftHigh) {
+        const int count = static_cast<int>(std::floor((shiftHigh - shiftLow) / step)) + 1;
+        std::vector<double> scores(static_cast<std::size_t>(count));
+        ParallelFor(scores.size(), settings.numberOfThreads, [&](std::size_t i) {
+            scores[i] = ProfileCorrelation(profileF, profileM, shiftLow + step * static_cast<double>(i));
+        });
+        const auto best = std::max_element(scores.begin(), scores.end());
+        const std::size_t i = static_cast<std::size_t>(best - scores.begin());
+        correlation = *best;
+        shift = shiftLow + step * static_cast<double>(i);
+        if (i > 0 && i + 1 < scores.size()) {
+            const double denominator = scores[i - 1] - 2.0 * scores[i] + scores[i + 1];
+            if (denominator < 0.0) {
+                shift += step * 0.5 * (scores[i - 1] - scores[i + 1]) / denominator;
+            }
+        }
+    }
+
+    // 重叠段（Fixed 坐标）内的重心与层内主轴
+    const double zLow = std::max(profileF.z.front(), profileM.z.front() - shift);
+    const double zHigh = std::min(profileF.z.back(), profileM.z.back() - shift);
+    SlabMoments overlapF = SumRange(profileF, zLow, zHigh);
+    SlabMoments overlapM = SumRange(profileM, zLow + shift, zHigh + shift);
+    if (overlapF.w <= 0.0 || overlapM.w <= 0.0) {
+        overlapF = totalF;
+        overlapM = totalM;
+    }
+
+    double rotation = 0.0;
+    double angleF = 0.0;
+    double angleM = 0.0;
+    if (PrincipalAngle(overlapF, angleF) && PrincipalAngle(overlapM, angleM)) {
+        // 主轴无方向，差值折到 (-π/2, π/2]
+        rotation = angleM - angleF;
+        while (rotation > 0.5 * kPi) {
+            rotation -= kPi;
+        }
+        while (rotation <= -0.5 * kPi) {
+            rotation += kPi;
+        }
+        rotation = std::clamp(rotation, -settings.maximumRotation, settings.maximumRotation);
+    }
+
+    using EulerType = itk::Euler3DTransform<double>;
+    auto transform = EulerType::New();
+    EulerType::InputPointType center;
+    center[0] = overlapF.sx / overlapF.w;
+    center[1] = overlapF.sy / overlapF.w;
+    center[2] = zHigh >= zLow ? 0.5 * (zLow + zHigh) : centerF[2];
+    EulerType::OutputVectorType translation;
+    translation[0] = overlapM.sx / overlapM.w - center[0];
+    translation[1] = overlapM.sy / overlapM.w - center[1];
+    translation[2] = shift;
+    transform->SetCenter(center);
+    transform->SetRotation(0.0, 0.0, rotation);
+    transform->SetTranslation(translation);
+
+    result.transform = transform.GetPointer();
+    result.zShift = shift;
+    result.rotation = rotation;
+    result.correlation = correlation;
+    result.ok = true;
+    return result;
+}
+
+CoarseAlignmentResult ComputeCoarseAlignment(const ImagePyramid &fixed,
+                                             const ImagePyramid &moving,
+                                             const CoarseAlignmentSettings &settings,
+                                             const CancelToken &cancel)
+{
+    const double maximumSpacing = 0.5 * settings.gridSpacing;
+    const ImageType::ConstPointer fixedLevel = fixed.GetCoarsestLevel(maximumSpacing);
+    const ImageType::ConstPointer movingLevel = moving.GetCoarsestLevel(maximumSpacing);
+    return ComputeCoarseAlignment(fixedLevel.GetPointer(), movingLevel.GetPointer(), settings, cancel);
+}
+
+} // namespace dicomstitcher
@@ -0,0 +1,57 @@
+﻿#ifndef COARSEALIGNMENT_H
+#define COARSEALIGNMENT_H
+
+#include "pipelinecommon.h"
+#include "imagepyramid.h"
+
+#include <itkTransform.h>
+
+namespace dicomstitcher {
+
+// 与 combo_coarse_mode 的选项顺序一致
+enum class CoarseAlignmentMode
+{
+    GeometricCenter, // 体数据几何中心平移
+    Centroid,        // 身体掩膜重心平移
+    Bone,            // 骨骼阈值：z 剖面互相关 + 重叠段重心 + 层内主轴
+    Skin             // 体表阈值（身体截面），方法同 Bone
+};
+
+struct CoarseAlignmentSettings
+{
+    CoarseAlignmentMode mode{CoarseAlignmentMode::Bone};
+    double gridSpacing{6.0};     // 降采样块的目标边长（mm），4–8 mm
+    double boneThreshold{200.0}; // HU
+    double skinThreshold{-400.0};
+    double minimumBlockFraction{0.25}; // 块内超过阈值的体素比例达到该值才计入掩膜
+    double minimumOverlap{40.0};  // z 剖面互相关要求的最小重叠长度（mm）
+    double maximumRotation{0.26}; // 层内旋转上限（弧度，约 15°）
+    unsigned int numberOfThreads{0};
+};
+
+struct CoarseAlignmentResult
+{
+    bool ok{false};
+    itk::Transform<double, 3>::Pointer transform; // Fixed 物理坐标 → Moving 物理坐标
+    double zShift{0.0};     // Moving 相对 Fixed 的 z 偏移（mm）
+    double rotation{0.0};   // 绕 z 的层内旋转（弧度）
+    double correlation{0.0}; // z 剖面归一化互相关，GeometricCenter / Centroid 模式为 0
+};
+
+// 在 gridSpacing 的块网格上计算初始刚体变换。输入应为 OrientAndResample 的输出（轴对齐，第 3 轴为 z）。
+// 每个体数据只读一遍：按 z 块并行统计块内阈值比例，再累加为逐块层的加权矩（重心、层内协方差、截面积）。
+CoarseAlignmentResult ComputeCoarseAlignment(const ImageType *fixed,
+                                             const ImageType *moving,
+                                             const CoarseAlignmentSettings &settings,
+                                             const CancelToken &cancel = CancelToken());
+
+// 同上，输入取自共享金字塔：使用间距不超过 gridSpacing / 2 的最粗层级（每块每轴至少 2 个体素），
+// 既减少读取量，又避免平滑过度使薄层骨皮质跌出阈值
+CoarseAlignmentResult ComputeCoarseAlignment(const ImagePyramid &fixed,
+                                             const ImagePyramid &moving,
+                                             const CoarseAlignmentSettings &settings,
+                                             const CancelToken &cancel = CancelToken());
+
+} // namespace dicomstitcher
+
+#endif // COARSEALIGNMENT_H
@@ -0,0 +1,416 @@
+﻿#include "dicomindex.h"
+
+#include <itksys/Directory.hxx>
+#include <itksys/SystemTools.hxx>
+
+#include <gdcmAttribute.h>
+#include <gdcmReader.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <unordered_map>
+
+namespace dicomstitcher {
+
+namespace {
+
+constexpr const char *CacheMagic = "dicomstitcher-index 1";
+
+// 一个文件的头信息；valid 为 false 表示不是可用的图像文件（也会缓存，避免每次重新解析）
+struct FileEntry
+{
+    std::string name; // 目录内的文件名
+    std::uint64_t size{0};
+    std::int64_t mtime{0};
+    bool valid{false};
+    std::string seriesUID;
+    std::string seriesDate;
+    std::string description;
+    std::string modality;
+    unsigned int rows{0};
+    unsigned int columns{0};
+    double pixelSpacing[2]{0.0, 0.0}; // 行间距、列间距（0028|0030 的顺序）
+    double position[3]{0.0, 0.0, 0.0};
+    double orientation[6]{1.0, 0.0, 0.0, 0.0, 1.0, 0.0};
+};
+
+std::uint64_t HashPath(const std::string &text)
+{
+    std::uint64_t hash = 1469598103934665603ull; // FNV-1a
+    for (const char c : text) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+std::string CacheFileFor(const std::string &cacheDirectory, const std::string &directory)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.idx", static_cast<unsigned long long>(HashPath(directory)));
+    return cacheDirectory + "/" + name;
+}
+
+// 缓存按制表符分列，字符串中的制表符与换行替换为空格
+std::string Sanitize(std::string text)
+{
+    std::replace_if(text.begin(), text.end(), [](char c) { return c == '\t' || c == '\n' || c == '\r'; }, ' ');
+    return text;
+}
+
+std::string TrimValue(const char *data, std::size_t length)
+{
+    std::string value(data, length);
+    while (!value.empty() && (value.back() == ' ' || value.back() == '\0')) {
+        value.pop_back();
+    }
+    const std::size_t first = value.find_first_not_of(' ');
+    return first == std::string::npos ? std::string() : value.substr(first);
+}
+
+std::string GetString(const gdcm::DataSet &dataSet, const gdcm::Tag &tag)
+{
+    if (!dataSet.FindDataElement(tag)) {
+        return std::string();
+    }
+    const gdcm::ByteValue *value = dataSet.GetDataElement(tag).GetByteValue();
+    if (!value) {
+        return std::string();
+    }
+    return TrimValue(value->GetPointer(), value->GetLength());
+}
+
+// 多值十进制串（DS），如 "0.7\0.7"
+std::size_t GetDecimals(const gdcm::DataSet &dataSet, const gdcm::Tag &tag, double *values, std::size_t count)
+{
+    std::stringstream stream(GetString(dataSet, tag));
+    std::string item;
+    std::size_t parsed = 0;
+    while (parsed < count && std::getline(stream, item, '\\')) {
+        char *end = nullptr;
+        const double v = std::strtod(item.c_str(), &end);
+        if (end == item.c_str()) {
+            break;
+        }
+        values[parsed++] = v;
+    }
+    return parsed;
+}
+
+bool ParseHeader(const std::string &path, FileEntry &entry)
+{
+    static const gdcm::Tag SeriesDate(0x0008, 0x0021);
+    static const gdcm::Tag Modality(0x0008, 0x0060);
+    static const gdcm::Tag SeriesDescription(0x0008, 0x103e);
+    static const gdcm::Tag SeriesUID(0x0020, 0x000e);
+    static const gdcm::Tag Position(0x0020, 0x0032);
+    static const gdcm::Tag Orientation(0x0020, 0x0037);
+    static const gdcm::Tag Rows(0x0028, 0x0010);
+    static const gdcm::Tag Columns(0x0028, 0x0011);
+    static const gdcm::Tag PixelSpacing(0x0028, 0x0030);
+
+    gdcm::Reader reader;
+    reader.SetFileName(path.c_str());
+    // 只读到最大的所需标签为止，不读像素数据
+    const std::set<gdcm::Tag> tags{SeriesDate, Modality, SeriesDescription, SeriesUID, Position,
+                                   Orientation, Rows, Columns, PixelSpacing};
+    if (!reader.ReadSelectedTags(tags)) {
+        return false;
+    }
+    const gdcm::DataSet &dataSet = reader.GetFile().GetDataSet();
+
+    entry.seriesUID = GetString(dataSet, SeriesUID);
+    if (entry.seriesUID.empty() || !dataSet.FindDataElement(Rows) || !dataSet.FindDataElement(Columns)) {
+        return false;
+    }
+    entry.seriesDate = GetString(dataSet, SeriesDate);
+    entry.description = Sanitize(GetString(dataSet, SeriesDescription));
+    entry.modality = GetString(dataSet, Modality);
+
+    gdcm::Attribute<0x0028, 0x0010> rows;
+    rows.SetFromDataElement(dataSet.GetDataElement(Rows));
+    gdcm::Attribute<0x0028, 0x0011> columns;
+    columns.SetFromDataElement(dataSet.GetDataElement(Columns));
+    entry.rows = rows.GetValue();
+    entry.columns = columns.GetValue();
+
+    if (GetDecimals(dataSet, PixelSpacing, entry.pixelSpacing, 2) != 2) {
+        entry.pixelSpacing[0] = entry.pixelSpacing[1] = 1.0;
+    }
+    GetDecimals(dataSet, Position, entry.position, 3);
+    GetDecimals(dataSet, Orientation, entry.orientation, 6);
+    return entry.rows > 0 && entry.columns > 0;
+}
+
+std::unordered_map<std::string, FileEntry> LoadCache(const std::string &path, const std::string &directory)
+{
+    std::unordered_map<std::string, FileEntry> entries;
+    std::FILE *file = itksys::SystemTools::Fopen(path, "rb");
+    if (!file) {
+        return entries;
+    }
+    std::string content;
+    char buffer[1 << 16];
+    std::size_t read = 0;
+    while ((read = std::fread(buffer, 1, sizeof(buffer), file)) > 0) {
+        content.append(buffer, read);
+    }
+    std::fclose(file);
+
+    std::stringstream stream(content);
+    std::string line;
+    if (!std::getline(stream, line) || line != CacheMagic || !std::getline(stream, line) || line != directory) {
+        return entries; // 版本不符或哈希碰撞：当作没有缓存
+    }
+    while (std::getline(stream, line)) {
+        std::vector<std::string> fields;
+        std::size_t start = 0;
+        for (std::size_t tab = line.find('\t'); ; tab = line.find('\t', start)) {
+            fields.push_back(line.substr(start, tab == std::string::npos ? std::string::npos : tab - start));
+            if (tab == std::string::npos) {
+                break;
+            }
+            start = tab + 1;
+        }
+        if (fields.size() != 21) {
+            continue;
+        }
+        FileEntry entry;
+        entry.name = fields[0];
+        entry.size = std::strtoull(fields[1].c_str(), nullptr, 10);
+        entry.mtime = std::strtoll(fields[2].c_str(), nullptr, 10);
+        entry.valid = fields[3] == "1";
+        entry.seriesUID = fields[4];
+        entry.seriesDate = fields[5];
+        entry.description = fields[6];
+        entry.modality = fields[7];
+        entry.rows = static_cast<unsigned int>(std::strtoul(fields[8].c_str(), nullptr, 10));
+        entry.columns = static_cast<unsigned int>(std::strtoul(fields[9].c_str(), nullptr, 10));
+        for (int i = 0; i < 2; ++i) {
+            entry.pixelSpacing[i] = std::strtod(fields[10 + i].c_str(), nullptr);
+        }
+        for (int i = 0; i < 3; ++i) {
+            entry.position[i] = std::strtod(fields[12 + i].c_str(), nullptr);
+        }
+        for (int i = 0; i < 6; ++i) {
+            entry.orientation[i] = std::strtod(fields[15 + i].c_str(), nullptr);
+        }
+        const std::string key = entry.name;
+        entries.emplace(key, std::move(entry));
+    }
+    return entries;
+}
+
+// 先写临时文件再替换，写到一半被中断不会留下损坏的索引；临时文件名带随机后缀，
+// 多个进程（如并发的批处理任务）同时扫描同一目录时不会写进同一个临时文件
+void SaveCache(const std::string &path, const std::string &directory, const std::vector<FileEntry> &entries)
+{
+    itksys::SystemTools::MakeDirectory(itksys::SystemTools::GetFilenamePath(path));
+    std::random_device random;
+    const std::string temporary = path + "." + std::to_string(random()) + ".tmp";
+    std::FILE *file = itksys::SystemTools::Fopen(temporary, "wb");
+    if (!file) {
+        return;
+    }
+    std::fprintf(file, "%s\n%s\n", CacheMagic, directory.c_str());
+    for (const FileEntry &e : entries) {
+        std::fprintf(file, "%s\t%llu\t%lld\t%d\t%s\t%s\t%s\t%s\t%u\t%u\t%.17g\t%.17g\t%.17g\t%.17g\t%.17g"
+                           "\t%.17g\t%.17g\t%.17g\t%.17g\t%.17g\t%.17g\n",
+                     e.name.c_str(), static_cast<unsigned long long>(e.size), static_cast<long long>(e.mtime),
+                     e.valid ? 1 : 0, e.seriesUID.c_str(), e.seriesDate.c_str(), e.description.c_str(),
+                     e.modality.c_str(), e.rows, e.columns, e.pixelSpacing[0], e.pixelSpacing[1],
+                     e.position[0], e.position[1], e.position[2], e.orientation[0], e.orientation[1],
+                     e.orientation[2], e.orientation[3], e.orientation[4], e.orientation[5]);
+    }
+    if (std::fclose(file) == 0) {
+        itksys::SystemTools::RemoveFile(path);
+        itksys::SystemTools::RenameFile(temporary, path);
+    } else {
+        itksys::SystemTools::RemoveFile(temporary);
+    }
+}
+
+std::vector<DicomSeriesInfo> GroupSeries(const std::string &directory, const std::vector<FileEntry> &entries)
+{
+    // 方向余弦取 3 位小数参与分组，容忍浮点书写差异
+    auto seriesKey = [](const FileEntry &e) {
+        char key[160];
+        std::snprintf(key, sizeof(key), "|%s|%u|%u|%.3f|%.3f|%.3f|%.3f|%.3f|%.3f", e.seriesDate.c_str(), e.rows,
+                      e.columns, e.orientation[0], e.orientation[1], e.orientation[2], e.orientation[3],
+                      e.orientation[4], e.orientation[5]);
+        return e.seriesUID + key;
+    };
+    std::map<std::string, std::vector<const FileEntry *>> groups;
+    for (const FileEntry &e : entries) {
+        if (e.valid) {
+            groups[seriesKey(e)].push_back(&e);
+        }
+    }
+
+    std::vector<DicomSeriesInfo> series;
+    for (auto &group : groups) {
+        std::vector<const FileEntry *> &files = group.second;
+        const FileEntry &first = *files.front();
+        const double *r = first.orientation;
+        const double *c = first.orientation + 3;
+        const double normal[3] = {r[1] * c[2] - r[2] * c[1], r[2] * c[0] - r[0] * c[2], r[0] * c[1] - r[1] * c[0]};
+        auto along = [&normal](const FileEntry *e) {
+            return e->position[0] * normal[0] + e->position[1] * normal[1] + e->position[2] * normal[2];
+        };
+        std::stable_sort(files.begin(), files.end(), [&](const FileEntry *a, const FileEntry *b) {
+            const double da = along(a);
+            const double db = along(b);
+            return da != db ? da < db : a->name < b->name;
+        });
+
+        DicomSeriesInfo info;
+        info.seriesUID = first.seriesUID;
+        info.seriesDate = first.seriesDate;
+        info.description = first.description;
+        info.modality = first.modality;
+        info.rows = first.rows;
+        info.columns = first.columns;
+        info.spacing[0] = first.pixelSpacing[1];
+        info.spacing[1] = first.pixelSpacing[0];
+        std::vector<double> steps;
+        for (std::size_t i = 0; i < files.size(); ++i) {
+            info.files.push_back(directory + "/" + files[i]->name);
+            if (i > 0) {
+                steps.push_back(along(files[i]) - along(files[i - 1]));
+            }
+        }
+        if (!steps.empty()) {
+            std::nth_element(steps.begin(), steps.begin() + steps.size() / 2, steps.end());
+            info.spacing[2] = steps[steps.size() / 2];
+        }
+        info.extent[0] = info.spacing[0] * info.columns;
+        info.extent[1] = info.spacing[1] * info.rows;
+        info.extent[2] = files.size() > 1 ? along(files.back()) - along(files.front()) + info.spacing[2] : 0.0;
+        series.push_back(std::move(info));
+    }
+    std::stable_sort(series.begin(), series.end(), [](const DicomSeriesInfo &a, const DicomSeriesInfo &b) {
+        return a.files.size() > b.files.size();
+    });
+    return series;
+}
+
+} // namespace
+
+std::string ApplicationCacheDirectory()
+{
+    std::string base;
+#if defined(_WIN32)
+    itksys::SystemTools::GetEnv("LOCALAPPDATA", base);
+#else
+    if (!itksys::SystemTools::GetEnv("XDG_CACHE_HOME", base) || base.empty()) {
+        std::string home;
+        if (itksys::SystemTools::GetEnv("HOME", home) && !home.empty()) {
+            base = home + "/.cache";
+        }
+    }
+#endif
+    if (base.empty()) {
+        base = itksys::SystemTools::GetCurrentWorkingDirectory();
+    }
+    itksys::SystemTools::ConvertToUnixSlashes(base);
+    return base + "/DicomStitcher";
+}
+
+std::string DefaultIndexCacheDirectory()
+{
+    return ApplicationCacheDirectory() + "/index";
+}
+
+DicomIndexResult ScanDicomDirectory(const std::string &directory,
+                                    const DicomIndexSettings &settings,
+                                    const CancelToken &cancel,
+                                    const FractionCallback &progress)
+{
+    DicomIndexResult result;
+    try {
+        std::string root = itksys::SystemTools::CollapseFullPath(directory);
+        itksys::SystemTools::ConvertToUnixSlashes(root);
+
+        itksys::Directory listing;
+        if (!listing.Load(root)) {
+            result.errorMessage = "cannot open directory: " + directory;
+            return result;
+        }
+        std::vector<FileEntry> entries;
+        for (unsigned long i = 0; i < listing.GetNumberOfFiles(); ++i) {
+            const std::string name = listing.GetFile(i);
+            if (name == "." || name == ".." || listing.FileIsDirectory(i)) {
+                continue;
+            }
+            FileEntry entry;
+            entry.name = name;
+            entries.push_back(std::move(entry));
+        }
+        cancel.ThrowIfCancelled();
+
+        const std::string cachePath = CacheFileFor(
+            settings.cacheDirectory.empty() ? DefaultIndexCacheDirectory() : settings.cacheDirectory, root);
+        const std::unordered_map<std::string, FileEntry> cached =
+            settings.useCache ? LoadCache(cachePath, root) : std::unordered_map<std::string, FileEntry>();
+
+        // 逐文件 stat，未变化的取缓存，其余解析头信息；网络共享上 stat 本身也值得并行
+        std::atomic<std::size_t> done{0};
+        std::atomic<std::size_t> parsed{0};
+        ParallelFor(entries.size(), settings.numberOfThreads, [&](std::size_t i) {
+            cancel.ThrowIfCancelled();
+            FileEntry &entry = entries[i];
+            const std::string path = root + "/" + entry.name;
+            entry.size = itksys::SystemTools::FileLength(path);
+            entry.mtime = itksys::SystemTools::ModifiedTime(path);
+            const auto hit = cached.find(entry.name);
+            if (hit != cached.end() && hit->second.size == entry.size && hit->second.mtime == entry.mtime) {
+                entry = hit->second;
+            } else {
+                const std::uint64_t size = entry.size;
+                const std::int64_t mtime = entry.mtime;
+                FileEntry fresh;
+                fresh.name = entry.name;
+                fresh.valid = ParseHeader(path, fresh);
+                fresh.size = size;
+                fresh.mtime = mtime;
+                entry = std::move(fresh);
+                parsed.fetch_add(1);
+            }
+            if (progress) {
+                progress(static_cast<double>(done.fetch_add(1) + 1) / static_cast<double>(entries.size()));
+            }
+        });
+        cancel.ThrowIfCancelled();
+
+        result.filesParsed = parsed.load();
+        result.filesCached = entries.size() - result.filesParsed;
+        // 有新解析的文件或有文件被删除时更新索引
+        if (settings.useCache && (result.filesParsed > 0 || cached.size() != entries.size())) {
+            SaveCache(cachePath, root, entries);
+        }
+
+        result.series = GroupSeries(root, entries);
+        result.status = DicomIndexResult::Status::Ok;
+    } catch (const itk::ProcessAborted &) {
+        result = DicomIndexResult();
+        result.status = DicomIndexResult::Status::Cancelled;
+    } catch (const itk::ExceptionObject &ex) {
+        result = DicomIndexResult();
+        result.status = cancel.IsCancelled() ? DicomIndexResult::Status::Cancelled
+                                             : DicomIndexResult::Status::Failed;
+        result.errorMessage = ex.what();
+    } catch (const std::exception &ex) {
+        result = DicomIndexResult();
+        result.status = DicomIndexResult::Status::Failed;
+        result.errorMessage = ex.what();
+    }
+    return result;
+}
+
+} // namespace dicomstitcher
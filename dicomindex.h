@@ -0,0 +1,64 @@
+﻿#ifndef DICOMINDEX_H
+#define DICOMINDEX_H
+
+#include "pipelinecommon.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace dicomstitcher {
+
+// 一个序列的概要：文件按层位置（IPP 在层法向上的投影）升序排列，可直接交给 ParallelSeriesReader
+struct DicomSeriesInfo
+{
+    std::string seriesUID;
+    std::string seriesDate;        // 0008|0021
+    std::string description;       // 0008|103e
+    std::string modality;          // 0008|0060
+    std::vector<std::string> files;
+    unsigned int rows{0};
+    unsigned int columns{0};
+    double spacing[3]{0.0, 0.0, 0.0}; // 列 / 行 / 层间距（mm），层间距取相邻层位置差的中位数，单层为 0
+    double extent[3]{0.0, 0.0, 0.0};  // 物理范围（mm）
+};
+
+struct DicomIndexSettings
+{
+    std::string cacheDirectory;       // 索引缓存目录，为空时使用 DefaultIndexCacheDirectory()
+    bool useCache{true};
+    unsigned int numberOfThreads{0};  // 头信息解析线程数，0 表示 ITK 默认
+};
+
+struct DicomIndexResult
+{
+    enum class Status { Ok, Failed, Cancelled };
+
+    Status status{Status::Failed};
+    std::string errorMessage;            // ITK/标准异常原文（本地编码），可能为空
+    std::vector<DicomSeriesInfo> series; // 按层数降序
+    std::size_t filesParsed{0};          // 本次重新解析头信息的文件数
+    std::size_t filesCached{0};          // 直接取自缓存的文件数
+};
+
+// 用户缓存目录下的 DicomStitcher（Windows 为 %LOCALAPPDATA%，其他平台为 $XDG_CACHE_HOME 或 ~/.cache）
+std::string ApplicationCacheDirectory();
+
+// ApplicationCacheDirectory() 下的 index
+std::string DefaultIndexCacheDirectory();
+
+// 扫描目录（不递归）中的 DICOM 文件并按序列分组。头信息缓存按目录路径存放一个索引文件，
+// 以文件名、大小、修改时间判断是否变化：未变化的文件直接取缓存，新增或改动的文件并行解析
+// （只读取分组与几何所需的标签，不读像素），删除的文件从索引中移除。
+// 分组依据与 GDCMSeriesFileNames 的 SetUseSeriesDetails + 0008|0021 限制相当：
+// 序列 UID、序列日期、层方向与矩阵尺寸都相同的文件为同一序列。
+// 设计为在工作线程中运行；不抛异常，错误与取消都通过 Status 返回。
+DicomIndexResult ScanDicomDirectory(const std::string &directory,
+                                    const DicomIndexSettings &settings,
+                                    const CancelToken &cancel,
+                                    const FractionCallback &progress = FractionCallback());
+
+} // namespace dicomstitcher
+
+#endif // DICOMINDEX_H
@@ -0,0 +1,361 @@
+﻿#include "fastmutualinformation.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <random>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define DICOMSTITCHER_MI_SSE2 1
+#endif
+
+namespace dicomstitcher {
+
+namespace {
+
+constexpr int kPaddingBins = 2;  // 与 Mattes v4 相同
+constexpr std::size_t kChunkSize = 2048; // 每个样本块的样本数，决定直方图合并的粒度
+
+// 三次 B 样条及其导数
+inline double CubicBSpline(double u)
+{
+    u = std::fabs(u);
+    if (u < 1.0) {
+        return (4.0 - 6.0 * u * u + 3.0 * u * u * u) / 6.0;
+    }
+    if (u < 2.0) {
+        const double t = 2.0 - u;
+        return t * t * t / 6.0;
+    }
+    return 0.0;
+}
+
+inline double CubicBSplineDerivative(double u)
+{
+    const double a = std::fabs(u);
+    const double sign = u < 0.0 ? -1.0 : 1.0;
+    if (a < 1.0) {
+        return sign * (-2.0 * a + 1.5 * a * a);
+    }
+    if (a < 2.0) {
+        const double t = 2.0 - a;
+        return sign * (-0.5 * t * t);
+    }
+    return 0.0;
+}
+
+// row[0..3] += w[0..3]
+inline void AddFourBins(float *row, const float w[4])
+{
+#if defined(DICOMSTITCHER_MI_SSE2)
+    _mm_storeu_ps(row, _mm_add_ps(_mm_loadu_ps(row), _mm_loadu_ps(w)));
+#else
+    row[0] += w[0];
+    row[1] += w[1];
+    row[2] += w[2];
+    row[3] += w[3];
+#endif
+}
+
+// Moving 箱位置 ζ 所在的起始箱 k（贡献 k-1 .. k+2），与 Mattes v4 一样夹到 [2, bins-3]
+inline int ParzenStart(double zeta, int bins)
+{
+    return std::clamp(static_cast<int>(std::floor(zeta)), kPaddingBins, bins - kPaddingBins - 1);
+}
+
+} // namespace
+
+void FastMutualInformationMetric::Initialize()
+{
+    if (!m_fixed || !m_moving) {
+        itkGenericExceptionMacro(<< "FastMutualInformationMetric: fixed and moving images are required");
+    }
+    m_bins = std::max(m_bins, 2u * kPaddingBins + 2u);
+    const int bins = static_cast<int>(m_bins);
+
+    // 灰度范围取整幅图像，与 Mattes v4 相同
+    const ImageType::RegionType fixedRegion = m_fixed->GetBufferedRegion();
+    const PixelType *fixedBuffer = m_fixed->GetBufferPointer();
+    const std::size_t fixedCount = fixedRegion.GetNumberOfPixels();
+    const auto fixedRange = std::minmax_element(fixedBuffer, fixedBuffer + fixedCount);
+    const double fixedMin = *fixedRange.first;
+    const double fixedMax = *fixedRange.second;
+    const double fixedBinSize = fixedMax > fixedMin ? (fixedMax - fixedMin) / (bins - 2 * kPaddingBins) : 1.0;
+
+    m_fixedLut.resize(1 << 16);
+    for (std::size_t i = 0; i < m_fixedLut.size(); ++i) {
+        const double v = static_cast<PixelType>(static_cast<std::uint16_t>(i));
+        const int bin = static_cast<int>(std::floor((v - fixedMin) / fixedBinSize + kPaddingBins));
+        m_fixedLut[i] = static_cast<std::uint16_t>(std::clamp(bin, kPaddingBins, bins - kPaddingBins - 1));
+    }
+
+    const PixelType *movingBuffer = m_moving->GetBufferPointer();
+    const ImageType::RegionType movingRegion = m_moving->GetBufferedRegion();
+    const auto movingRange = std::minmax_element(movingBuffer, movingBuffer + movingRegion.GetNumberOfPixels());
+    m_movingMin = *movingRange.first;
+    m_movingMax = *movingRange.second;
+    m_movingBinSize = m_movingMax > m_movingMin ? (m_movingMax - m_movingMin) / (bins - 2 * kPaddingBins) : 1.0;
+
+    const auto physicalToIndex = m_moving->GetPhysicalPointToIndexMatrix();
+    for (unsigned int r = 0; r < 3; ++r) {
+        for (unsigned int c = 0; c < 3; ++c) {
+            m_physicalToIndex[r][c] = physicalToIndex[r][c];
+        }
+        m_origin[r] = m_moving->GetOrigin()[r];
+        m_movingSize[r] = static_cast<std::int64_t>(movingRegion.GetSize(r));
+    }
+    // 连续索引相对缓冲区起点：把起点折算进原点
+    {
+        ImageType::PointType start;
+        m_moving->TransformIndexToPhysicalPoint(movingRegion.GetIndex(), start);
+        for (unsigned int r = 0; r < 3; ++r) {
+            m_origin[r] = start[r];
+        }
+    }
+
+    // 分层随机采样：Fixed 划分为边长 cell 的体素块，每块随机取一个体素。
+    // 只用 mt19937 的原始输出取模，不依赖标准库分布的实现，跨平台结果一致
+    m_points.clear();
+    m_fixedBin.clear();
+    const auto start = fixedRegion.GetIndex();
+    const auto size = fixedRegion.GetSize();
+    const double cell = std::max(1.0, std::cbrt(static_cast<double>(fixedCount) / std::max<std::size_t>(1, m_numberOfSamples)));
+    std::size_t cells[3];
+    for (unsigned int i = 0; i < 3; ++i) {
+        cells[i] = static_cast<std::size_t>(std::ceil(size[i] / cell));
+    }
+    m_points.reserve(cells[0] * cells[1] * cells[2]);
+    m_fixedBin.reserve(cells[0] * cells[1] * cells[2]);
+    std::mt19937 rng(m_seed);
+    for (std::size_t cz = 0; cz < cells[2]; ++cz) {
+        for (std::size_t cy = 0; cy < cells[1]; ++cy) {
+            for (std::size_t cx = 0; cx < cells[0]; ++cx) {
+                const std::size_t c[3] = {cx, cy, cz};
+                ImageType::IndexType index;
+                std::size_t offset = 0;
+                std::size_t stride = 1;
+                for (unsigned int i = 0; i < 3; ++i) {
+                    const auto lo = static_cast<std::size_t>(std::floor(c[i] * cell));
+                    const auto hi = std::min<std::size_t>(size[i], static_cast<std::size_t>(std::floor((c[i] + 1) * cell)));
+                    const std::size_t extent = std::max<std::size_t>(1, hi - lo);
+                    const std::size_t local = lo + rng() % extent;
+                    index[i] = start[i] + static_cast<itk::IndexValueType>(local);
+                    offset += local * stride;
+                    stride *= size[i];
+                }
+                PointType p;
+                m_fixed->TransformIndexToPhysicalPoint(index, p);
+                m_points.push_back(p);
+                m_fixedBin.push_back(m_fixedLut[static_cast<std::uint16_t>(fixedBuffer[offset])]);
+            }
+        }
+    }
+}
+
+double FastMutualInformationMetric::GetValue(const TransformType *transform)
+{
+    return Evaluate(transform, nullptr);
+}
+
+double FastMutualInformationMetric::GetValueAndDerivative(const TransformType *transform, DerivativeType &derivative)
+{
+    return Evaluate(transform, &derivative);
+}
+
+double FastMutualInformationMetric::Evaluate(const TransformType *transform, DerivativeType *derivative)
+{
+    if (m_points.empty()) {
+        itkGenericExceptionMacro(<< "FastMutualInformationMetric: Initialize() has not been called");
+    }
+    const int bins = static_cast<int>(m_bins);
+    const std::size_t binCount = static_cast<std::size_t>(bins) * bins;
+    const std::size_t sampleCount = m_points.size();
+    const std::size_t chunkCount = (sampleCount + kChunkSize - 1) / kChunkSize;
+    const unsigned int parameterCount = transform->GetNumberOfParameters();
+
+    m_chunkHistograms.assign(chunkCount * binCount, 0.0f);
+    m_chunkValid.assign(chunkCount, 0);
+    m_zeta.resize(sampleCount);
+    m_valid.resize(sampleCount);
+    if (derivative) {
+        m_zetaDerivative.resize(sampleCount * parameterCount);
+    }
+
+    const PixelType *movingBuffer = m_moving->GetBufferPointer();
+    const std::int64_t sx = 1;
+    const std::int64_t sy = m_movingSize[0];
+    const std::int64_t sz = m_movingSize[0] * m_movingSize[1];
+
+    // 第一遍：变换采样点、三线性插值（含梯度）、累积联合直方图
+    ParallelFor(chunkCount, m_threads, [&](std::size_t chunk) {
+        float *histogram = m_chunkHistograms.data() + chunk * binCount;
+        TransformType::JacobianType jacobian;
+        std::size_t valid = 0;
+        const std::size_t first = chunk * kChunkSize;
+        const std::size_t last = std::min(sampleCount, first + kChunkSize);
+        for (std::size_t s = first; s < last; ++s) {
+            m_valid[s] = 0;
+            const PointType q = transform->TransformPoint(m_points[s]);
+            double c[3];
+            for (unsigned int r = 0; r < 3; ++r) {
+                c[r] = m_physicalToIndex[r][0] * (q[0] - m_origin[0])
+                     + m_physicalToIndex[r][1] * (q[1] - m_origin[1])
+                     + m_physicalToIndex[r][2] * (q[2] - m_origin[2]);
+            }
+            // 只取 8 个邻点都在缓冲区内的位置，梯度处处有定义
+            std::int64_t i0[3];
+            double f[3];
+            bool inside = true;
+            for (unsigned int r = 0; r < 3 && inside; ++r) {
+                inside = m_movingSize[r] >= 2 && c[r] >= 0.0 && c[r] <= static_cast<double>(m_movingSize[r] - 1);
+                if (inside) {
+                    i0[r] = std::min<std::int64_t>(static_cast<std::int64_t>(c[r]), m_movingSize[r] - 2);
+                    f[r] = c[r] - static_cast<double>(i0[r]);
+                }
+            }
+            if (!inside) {
+                continue;
+            }
+
+            const PixelType *p = movingBuffer + i0[0] * sx + i0[1] * sy + i0[2] * sz;
+            const double v000 = p[0];
+            const double v100 = p[sx];
+            const double v010 = p[sy];
+            const double v110 = p[sx + sy];
+            const double v001 = p[sz];
+            const double v101 = p[sx + sz];
+            const double v011 = p[sy + sz];
+            const double v111 = p[sx + sy + sz];
+            const double x00 = v000 + (v100 - v000) * f[0];
+            const double x10 = v010 + (v110 - v010) * f[0];
+            const double x01 = v001 + (v101 - v001) * f[0];
+            const double x11 = v011 + (v111 - v011) * f[0];
+            const double y0 = x00 + (x10 - x00) * f[1];
+            const double y1 = x01 + (x11 - x01) * f[1];
+            const double value = std::clamp(y0 + (y1 - y0) * f[2], m_movingMin, m_movingMax);
+
+            const double zeta = (value - m_movingMin) / m_movingBinSize + kPaddingBins;
+            const int k = ParzenStart(zeta, bins);
+            float weights[4];
+            for (int j = 0; j < 4; ++j) {
+                weights[j] = static_cast<float>(CubicBSpline(static_cast<double>(k - 1 + j) - zeta));
+            }
+            AddFourBins(histogram + m_fixedBin[s] * bins + (k - 1), weights);
+            m_zeta[s] = static_cast<float>(zeta);
+            m_valid[s] = 1;
+            ++valid;
+
+            if (derivative) {
+                // 索引空间梯度 → 物理空间梯度：∇p = Mᵀ ∇c
+                double gc[3];
+                {
+                    const double dx0 = (v100 - v000) + ((v110 - v010) - (v100 - v000)) * f[1];
+                    const double dx1 = (v101 - v001) + ((v111 - v011) - (v101 - v001)) * f[1];
+                    gc[0] = dx0 + (dx1 - dx0) * f[2];
+                    gc[1] = (x10 - x00) + ((x11 - x01) - (x10 - x00)) * f[2];
+                    gc[2] = y1 - y0;
+                }
+                double gp[3];
+                for (unsigned int col = 0; col < 3; ++col) {
+                    gp[col] = m_physicalToIndex[0][col] * gc[0]
+                            + m_physicalToIndex[1][col] * gc[1]
+                            + m_physicalToIndex[2][col] * gc[2];
+                }
+                transform->ComputeJacobianWithRespectToParameters(m_points[s], jacobian);
+                double *dz = m_zetaDerivative.data() + s * parameterCount;
+                for (unsigned int i = 0; i < parameterCount; ++i) {
+                    dz[i] = (gp[0] * jacobian(0, i) + gp[1] * jacobian(1, i) + gp[2] * jacobian(2, i))
+                          / m_movingBinSize;
+                }
+            }
+        }
+        m_chunkValid[chunk] = valid;
+    });
+
+    // 按块号顺序合并，结果与线程调度无关
+    std::vector<double> joint(binCount, 0.0);
+    m_validSamples = 0;
+    for (std::size_t chunk = 0; chunk < chunkCount; ++chunk) {
+        const float *histogram = m_chunkHistograms.data() + chunk * binCount;
+        for (std::size_t i = 0; i < binCount; ++i) {
+            joint[i] += histogram[i];
+        }
+        m_validSamples += m_chunkValid[chunk];
+    }
+    if (m_validSamples == 0) {
+        itkGenericExceptionMacro(<< "FastMutualInformationMetric: all samples map outside the moving image");
+    }
+
+    const double normalizer = 1.0 / static_cast<double>(m_validSamples);
+    std::vector<double> fixedMarginal(static_cast<std::size_t>(bins), 0.0);
+    std::vector<double> movingMarginal(static_cast<std::size_t>(bins), 0.0);
+    for (int a = 0; a < bins; ++a) {
+        for (int b = 0; b < bins; ++b) {
+            double &p = joint[static_cast<std::size_t>(a) * bins + b];
+            p *= normalizer;
+            fixedMarginal[a] += p;
+            movingMarginal[b] += p;
+        }
+    }
+
+    double mutualInformation = 0.0;
+    for (int a = 0; a < bins; ++a) {
+        for (int b = 0; b < bins; ++b) {
+            const double p = joint[static_cast<std::size_t>(a) * bins + b];
+            if (p > 1e-16 && fixedMarginal[a] > 1e-16 && movingMarginal[b] > 1e-16) {
+                mutualInformation += p * std::log(p / (fixedMarginal[a] * movingMarginal[b]));
+            }
+        }
+    }
+
+    if (derivative) {
+        // ∂(-MI)/∂μ = 1/N Σ_x [Σ_κ β3'(κ - ζ) log(p(ι, κ) / p_m(κ))] ∂ζ/∂μ
+        std::vector<double> logRatio(binCount, 0.0);
+        for (int a = 0; a < bins; ++a) {
+            for (int b = 0; b < bins; ++b) {
+                const std::size_t i = static_cast<std::size_t>(a) * bins + b;
+                if (joint[i] > 1e-16 && movingMarginal[b] > 1e-16) {
+                    logRatio[i] = std::log(joint[i] / movingMarginal[b]);
+                }
+            }
+        }
+
+        m_chunkDerivatives.assign(chunkCount * parameterCount, 0.0);
+        ParallelFor(chunkCount, m_threads, [&](std::size_t chunk) {
+            double *accumulator = m_chunkDerivatives.data() + chunk * parameterCount;
+            const std::size_t first = chunk * kChunkSize;
+            const std::size_t last = std::min(sampleCount, first + kChunkSize);
+            for (std::size_t s = first; s < last; ++s) {
+                if (!m_valid[s]) {
+                    continue;
+                }
+                const double zeta = m_zeta[s];
+                const int k = ParzenStart(zeta, bins);
+                const double *row = logRatio.data() + static_cast<std::size_t>(m_fixedBin[s]) * bins;
+                double coefficient = 0.0;
+                for (int j = k - 1; j <= k + 2; ++j) {
+                    coefficient += CubicBSplineDerivative(static_cast<double>(j) - zeta) * row[j];
+                }
+                const double *dz = m_zetaDerivative.data() + s * parameterCount;
+                for (unsigned int i = 0; i < parameterCount; ++i) {
+                    accumulator[i] += coefficient * dz[i];
+                }
+            }
+        });
+
+        derivative->SetSize(parameterCount);
+        derivative->Fill(0.0);
+        for (std::size_t chunk = 0; chunk < chunkCount; ++chunk) {
+            const double *accumulator = m_chunkDerivatives.data() + chunk * parameterCount;
+            for (unsigned int i = 0; i < parameterCount; ++i) {
+                (*derivative)[i] += accumulator[i];
+            }
+        }
+        *derivative *= normalizer;
+    }
+
+    return -mutualInformation;
+}
+
+} // namespace dicomstitcher
@@ -0,0 +1,81 @@
+﻿#ifndef FASTMUTUALINFORMATION_H
+#define FASTMUTUALINFORMATION_H
+
+#include "pipelinecommon.h"
+
+#include <itkArray.h>
+#include <itkTransform.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace dicomstitcher {
+
+// 面向 short CT 的采样互信息度量，与 ITK Mattes v4 定义一致（值为 -MI，越小越好）：
+// - 分箱方式相同：Fixed 零阶箱（经查找表），Moving 三次 B 样条 Parzen 窗，两端各留 2 个填充箱；
+// - 分层随机采样：Fixed 划分为体素块，每块取一点，mt19937 固定种子，结果可复现；
+// - 按样本块累积联合直方图（一次向量加法写入 4 个相邻箱）后按固定顺序合并，结果与线程数无关；
+// - 解析梯度：∂value/∂μ 由 Moving 三线性插值的梯度与变换的参数雅可比按链式法则得到。
+class FastMutualInformationMetric
+{
+public:
+    using PointType = ImageType::PointType;
+    using TransformType = itk::Transform<double, 3>;
+    using DerivativeType = itk::Array<double>;
+
+    void SetFixedImage(const ImageType *image) { m_fixed = image; }
+    void SetMovingImage(const ImageType *image) { m_moving = image; }
+    void SetNumberOfHistogramBins(unsigned int bins) { m_bins = bins; }
+    void SetNumberOfSamples(std::size_t samples) { m_numberOfSamples = samples; }
+    void SetRandomSeed(unsigned int seed) { m_seed = seed; }
+    void SetNumberOfThreads(unsigned int threads) { m_threads = threads; }
+
+    // 采样、分箱查找表与灰度范围；图像或设置改变后需重新调用
+    void Initialize();
+
+    // 采样点（Fixed 物理坐标），可交给 Mattes v4 的 SetFixedSampledPointSet 做对照
+    const std::vector<PointType> &GetSamplePoints() const { return m_points; }
+    // 最近一次评估中落在 Moving 内的样本数
+    std::size_t GetNumberOfValidSamples() const { return m_validSamples; }
+
+    double GetValue(const TransformType *transform);
+    // derivative 为 ∂value/∂μ；注意 ITK v4 度量返回的是其相反数（优化器按加法更新）
+    double GetValueAndDerivative(const TransformType *transform, DerivativeType &derivative);
+
+private:
+    double Evaluate(const TransformType *transform, DerivativeType *derivative);
+
+    ImageType::ConstPointer m_fixed;
+    ImageType::ConstPointer m_moving;
+    unsigned int m_bins{50};
+    std::size_t m_numberOfSamples{100000};
+    unsigned int m_seed{121212};
+    unsigned int m_threads{0};
+
+    // 采样点及其 Fixed 箱号
+    std::vector<PointType> m_points;
+    std::vector<std::uint16_t> m_fixedBin;
+    std::vector<std::uint16_t> m_fixedLut; // short（按 uint16 索引）→ Fixed 箱号
+
+    // Moving 分箱与物理坐标 → 缓冲区连续索引的映射
+    double m_movingMin{0.0};
+    double m_movingMax{0.0};
+    double m_movingBinSize{1.0};
+    double m_physicalToIndex[3][3]{};
+    double m_origin[3]{};
+    std::int64_t m_movingSize[3]{};
+
+    // 评估时的临时数据：按样本块存放直方图 / 梯度累加，每个样本存放 Moving 箱位置与 ∂ζ/∂μ
+    std::vector<float> m_chunkHistograms;
+    std::vector<double> m_chunkDerivatives;
+    std::vector<std::size_t> m_chunkValid;
+    std::vector<float> m_zeta;
+    std::vector<unsigned char> m_valid;
+    std::vector<double> m_zetaDerivative;
+    std::size_t m_validSamples{0};
+};
+
+} // namespace dicomstitcher
+
+#endif // FASTMUTUALINFORMATION_H
@@ -0,0 +1,403 @@
+﻿#include "fusionsliceprovider.h"
+#include "simdkernels.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace dicomstitcher {
+
+FusionSliceProvider::FusionSliceProvider()
+    : m_state(std::make_shared<State>())
+{
+    RebuildLookupTables();
+}
+
+FusionSliceProvider::~FusionSliceProvider() = default;
+
+void FusionSliceProvider::SetImages(ImageType::Pointer fixed, ImageType::Pointer moving)
+{
+    auto state = std::make_shared<State>(*Snapshot());
+    state->fixed = fixed;
+    state->moving = fixed ? moving : nullptr;
+    state->fixedBricks = nullptr;
+    state->movingBricks = nullptr;
+    if (fixed) {
+        state->grid = GridOf(fixed.GetPointer());
+    }
+    ReplaceState(state);
+}
+
+void FusionSliceProvider::SetBrickedImages(std::shared_ptr<const BrickedVolume> fixed,
+                                           std::shared_ptr<const BrickedVolume> moving)
+{
+    auto state = std::make_shared<State>(*Snapshot());
+    state->fixed = nullptr;
+    state->moving = nullptr;
+    state->fixedBricks = fixed;
+    state->movingBricks = fixed ? std::move(moving) : nullptr;
+    if (fixed) {
+        state->grid = fixed->Grid();
+    }
+    ReplaceState(state);
+}
+
+void FusionSliceProvider::SetTransform(const itk::Transform<double, 3> *transform)
+{
+    auto state = std::make_shared<State>(*Snapshot());
+    state->transform = nullptr;
+    if (transform) {
+        // 拷贝一份，调用方之后修改参数不会影响后台正在使用的快照
+        state->transform = transform->Clone().GetPointer();
+    }
+    ReplaceState(state);
+}
+
+void FusionSliceProvider::SetCacheCapacity(std::size_t slices)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_capacity = std::max<std::size_t>(1, slices);
+    while (m_cache.size() > m_capacity) {
+        m_cache.pop_back();
+    }
+}
+
+void FusionSliceProvider::SetOpacity(double opacity)
+{
+    m_opacity = std::clamp(opacity, 0.0, 1.0);
+}
+
+void FusionSliceProvider::SetMode(FusionMode mode)
+{
+    m_mode = mode;
+}
+
+void FusionSliceProvider::SetOverlayColor(double r, double g, double b)
+{
+    const std::array<double, 3> color{{std::clamp(r, 0.0, 1.0), std::clamp(g, 0.0, 1.0), std::clamp(b, 0.0, 1.0)}};
+    if (color == m_overlayColor) {
+        return;
+    }
+    m_overlayColor = color;
+    RebuildLookupTables();
+}
+
+void FusionSliceProvider::SetWindowLevel(double window, double level)
+{
+    window = std::max(window, 1.0);
+    if (window == m_window && level == m_level) {
+        return;
+    }
+    m_window = window;
+    m_level = level;
+    RebuildLookupTables();
+}
+
+void FusionSliceProvider::SetDifferenceBoneOnly(bool boneOnly, double threshold)
+{
+    m_differenceBoneOnly = boneOnly;
+    m_boneThreshold = threshold;
+}
+
+bool FusionSliceProvider::HasFixed() const
+{
+    return Snapshot()->HasFixed();
+}
+
+vtkSmartPointer<vtkImageData> FusionSliceProvider::GetSlice(SliceOrientation orientation, int index)
+{
+    const auto state = Snapshot();
+    if (!state->HasFixed()) {
+        return nullptr;
+    }
+    if (index < 0 || index >= SliceCount(state->grid, orientation)) {
+        return nullptr;
+    }
+
+    const std::uint64_t key = MakeKey(orientation, index);
+    const auto pixels = Pixels(*state, orientation, index);
+
+    if (!m_output || m_outputKey != key || m_outputGeneration != state->generation) {
+        m_output = NewSliceImage(state->grid, orientation, index, VTK_UNSIGNED_CHAR, 3);
+        m_outputKey = key;
+        m_outputGeneration = state->generation;
+    }
+    Compose(*pixels, static_cast<unsigned char *>(m_output->GetScalarPointer()));
+    m_output->Modified();
+    return m_output;
+}
+
+void FusionSliceProvider::Prefetch(SliceOrientation orientation, int index, int radius, int direction)
+{
+    const auto state = Snapshot();
+    m_worker.ClearPending();
+    if (!state->HasFixed() || !state->HasMoving()) {
+        return;
+    }
+    const int count = SliceCount(state->grid, orientation);
+    // 由近及远：无方向时先 ±1 再 ±2；有方向时前方 1 张、身后 1 张（回翻一张很常见），再沿翻页方向继续向前
+    std::vector<int> order;
+    if (direction == 0) {
+        for (int d = 1; d <= radius; ++d) {
+            order.push_back(index + d);
+            order.push_back(index - d);
+        }
+    } else {
+        direction = direction > 0 ? 1 : -1;
+        order.push_back(index + direction);
+        order.push_back(index - direction);
+        for (int d = 2; d <= 2 * radius; ++d) {
+            order.push_back(index + direction * d);
+        }
+    }
+    for (int neighbour : order) {
+        if (neighbour < 0 || neighbour >= count) {
+            continue;
+        }
+        const std::uint64_t key = MakeKey(orientation, neighbour);
+        m_worker.Post([this, state, orientation, neighbour, key]() {
+            if (Snapshot()->generation != state->generation || Lookup(key, state->generation)) {
+                return;
+            }
+            // 单线程计算，不与前台同步请求争抢线程池
+            Insert(key, state->generation, ComputeSlice(*state, orientation, neighbour, 1));
+        });
+    }
+}
+
+vtkSmartPointer<vtkImageData> FusionSliceProvider::GetDifferenceSlice(SliceOrientation orientation,
+                                                                      int index,
+                                                                      DifferenceStatistics *statistics)
+{
+    const auto state = Snapshot();
+    if (!state->HasFixed() || !state->HasMoving()) {
+        return nullptr;
+    }
+    if (index < 0 || index >= SliceCount(state->grid, orientation)) {
+        return nullptr;
+    }
+
+    const std::uint64_t key = MakeKey(orientation, index);
+    const auto pixels = Pixels(*state, orientation, index);
+    const std::size_t count = pixels->fixed.size();
+
+    // Moving 界外的像素已替换为 Fixed 的值（差值为 0），统计时由 inside 排除
+    const unsigned char *mask = pixels->inside.data();
+    if (m_differenceBoneOnly) {
+        const auto threshold = static_cast<PixelType>(std::clamp(std::ceil(m_boneThreshold), -32768.0, 32767.0));
+        m_maskScratch.resize(count);
+        for (std::size_t i = 0; i < count; ++i) {
+            m_maskScratch[i] = static_cast<unsigned char>(
+                pixels->inside[i] && (pixels->fixed[i] >= threshold || pixels->moving[i] >= threshold));
+        }
+        mask = m_maskScratch.data();
+    }
+
+    m_differenceScratch.resize(count);
+    simd::DiffSums sums;
+    simd::AbsDiffAccumulate(pixels->fixed.data(), pixels->moving.data(), mask, m_differenceScratch.data(), count, sums);
+
+    if (!m_differenceOutput || m_differenceKey != key || m_differenceGeneration != state->generation) {
+        m_differenceOutput = NewSliceImage(state->grid, orientation, index, VTK_UNSIGNED_CHAR, 1);
+        m_differenceKey = key;
+        m_differenceGeneration = state->generation;
+    }
+    auto *gray = static_cast<unsigned char *>(m_differenceOutput->GetScalarPointer());
+    const unsigned char *lut = m_differenceLut.data();
+    for (std::size_t i = 0; i < count; ++i) {
+        gray[i] = mask[i] ? lut[m_differenceScratch[i]] : 0;
+    }
+    m_differenceOutput->Modified();
+
+    if (statistics) {
+        *statistics = DifferenceStatistics();
+        statistics->pixels = static_cast<std::size_t>(sums.count);
+        if (sums.count > 0) {
+            const double n = static_cast<double>(sums.count);
+            const double meanA = static_cast<double>(sums.a) / n;
+            const double meanB = static_cast<double>(sums.b) / n;
+            const double varA = static_cast<double>(sums.aa) / n - meanA * meanA;
+            const double varB = static_cast<double>(sums.bb) / n - meanB * meanB;
+            const double cov = static_cast<double>(sums.ab) / n - meanA * meanB;
+            statistics->meanAbsoluteDifference = static_cast<double>(sums.absDiff) / n;
+            if (varA > 0.0 && varB > 0.0) {
+                statistics->normalizedCrossCorrelation = std::clamp(cov / std::sqrt(varA * varB), -1.0, 1.0);
+            }
+        }
+    }
+    return m_differenceOutput;
+}
+
+std::uint64_t FusionSliceProvider::MakeKey(SliceOrientation orientation, int index)
+{
+    return (static_cast<std::uint64_t>(orientation) << 32) | static_cast<std::uint32_t>(index);
+}
+
+std::shared_ptr<const FusionSliceProvider::SlicePixels>
+FusionSliceProvider::ComputeSlice(const State &state,
+                                  SliceOrientation orientation,
+                                  int index,
+                                  unsigned int numberOfThreads)
+{
+    const SliceLayout layout = GetSliceLayout(state.grid, orientation);
+    const std::size_t count = layout.width * layout.height;
+
+    auto pixels = std::make_shared<SlicePixels>();
+    pixels->fixed.resize(count);
+    if (state.fixedBricks) {
+        state.fixedBricks->ExtractSlice(orientation, index, pixels->fixed.data());
+    } else {
+        ExtractSlice(state.fixed.GetPointer(), orientation, index, pixels->fixed.data());
+    }
+    if (!state.HasMoving()) {
+        return pixels;
+    }
+
+    pixels->moving.resize(count);
+    pixels->inside.resize(count);
+    if (state.movingBricks) {
+        ResliceSlice(*state.movingBricks, state.transform.GetPointer(), state.grid,
+                     orientation, index, pixels->moving.data(), pixels->inside.data(), numberOfThreads);
+    } else {
+        ResliceSlice(state.moving.GetPointer(), state.transform.GetPointer(), state.grid,
+                     orientation, index, pixels->moving.data(), pixels->inside.data(), numberOfThreads);
+    }
+    // Moving 覆盖不到的位置按 Fixed 显示，混合时不会被压暗
+    for (std::size_t i = 0; i < count; ++i) {
+        if (!pixels->inside[i]) {
+            pixels->moving[i] = pixels->fixed[i];
+        }
+    }
+    return pixels;
+}
+
+std::shared_ptr<const FusionSliceProvider::SlicePixels>
+FusionSliceProvider::Pixels(const State &state, SliceOrientation orientation, int index)
+{
+    const std::uint64_t key = MakeKey(orientation, index);
+    auto pixels = Lookup(key, state.generation);
+    if (!pixels) {
+        pixels = ComputeSlice(state, orientation, index, 0);
+        Insert(key, state.generation, pixels);
+    }
+    return pixels;
+}
+
+std::shared_ptr<const FusionSliceProvider::State> FusionSliceProvider::Snapshot() const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_state;
+}
+
+void FusionSliceProvider::ReplaceState(std::shared_ptr<State> state)
+{
+    m_worker.ClearPending();
+    std::lock_guard<std::mutex> lock(m_mutex);
+    state->generation = m_state->generation + 1;
+    m_state = std::move(state);
+    m_cache.clear();
+}
+
+std::shared_ptr<const FusionSliceProvider::SlicePixels>
+FusionSliceProvider::Lookup(std::uint64_t key, std::uint64_t generation)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (auto it = m_cache.begin(); it != m_cache.end(); ++it) {
+        if (it->key == key && it->generation == generation) {
+            m_cache.splice(m_cache.begin(), m_cache, it);
+            return m_cache.front().pixels;
+        }
+    }
+    return nullptr;
+}
+
+void FusionSliceProvider::Insert(std::uint64_t key,
+                                 std::uint64_t generation,
+                                 std::shared_ptr<const SlicePixels> pixels)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    // 计算期间快照已被替换：结果作废
+    if (generation != m_state->generation) {
+        return;
+    }
+    for (const CacheEntry &entry : m_cache) {
+        if (entry.key == key) {
+            return;
+        }
+    }
+    m_cache.push_front(CacheEntry{key, generation, std::move(pixels)});
+    while (m_cache.size() > m_capacity) {
+        m_cache.pop_back();
+    }
+}
+
+void FusionSliceProvider::RebuildLookupTables()
+{
+    // 与 vtkImageMapToWindowLevelColors 相同的线性映射：[level - window/2, level + window/2] → [0, 255]
+    constexpr std::size_t kEntries = 1 << 16;
+    m_grayLut.resize(kEntries);
+    m_differenceLut.resize(kEntries);
+    for (auto &lut : m_colorLut) {
+        lut.resize(kEntries);
+    }
+    const double lower = m_level - 0.5 * m_window;
+    const double scale = 255.0 / m_window;
+    for (std::size_t i = 0; i < kEntries; ++i) {
+        const auto value = static_cast<PixelType>(static_cast<std::uint16_t>(i));
+        const double gray = std::clamp((static_cast<double>(value) - lower) * scale, 0.0, 255.0);
+        m_grayLut[i] = static_cast<unsigned char>(gray + 0.5);
+        for (unsigned int c = 0; c < 3; ++c) {
+            m_colorLut[c][i] = static_cast<unsigned char>(gray * m_overlayColor[c] + 0.5);
+        }
+        // 差值按无符号索引：[0, window] → [0, 255]
+        m_differenceLut[i] = static_cast<unsigned char>(std::min(static_cast<double>(i) * scale, 255.0) + 0.5);
+    }
+}
+
+void FusionSliceProvider::Compose(const SlicePixels &pixels, unsigned char *rgb)
+{
+    const std::size_t count = pixels.fixed.size();
+    const unsigned char *gray = m_grayLut.data();
+
+    if (pixels.moving.empty()) {
+        for (std::size_t i = 0; i < count; ++i) {
+            const unsigned char g = gray[static_cast<std::uint16_t>(pixels.fixed[i])];
+            rgb[3 * i] = rgb[3 * i + 1] = rgb[3 * i + 2] = g;
+        }
+        return;
+    }
+
+    if (m_mode == FusionMode::Blend) {
+        // 先在原始灰度上混合再查表，与 vtkImageBlend 后接窗宽窗位的结果一致
+        const int w1 = static_cast<int>(std::lround(m_opacity * simd::kWeightOne));
+        m_blendScratch.resize(count);
+        simd::LerpRowsQ14(pixels.fixed.data(), pixels.moving.data(), m_blendScratch.data(), count,
+                          simd::kWeightOne - w1, w1);
+        for (std::size_t i = 0; i < count; ++i) {
+            const unsigned char g = gray[static_cast<std::uint16_t>(m_blendScratch[i])];
+            rgb[3 * i] = rgb[3 * i + 1] = rgb[3 * i + 2] = g;
+        }
+        return;
+    }
+
+    // Overlay：Fixed 灰度与 Moving 伪彩分别查表，再在 8 位 RGB 上混合；Moving 界外保持 Fixed 灰度
+    m_rgbScratch.resize(3 * count);
+    unsigned char *movingRgb = m_rgbScratch.data();
+    const unsigned char *red = m_colorLut[0].data();
+    const unsigned char *green = m_colorLut[1].data();
+    const unsigned char *blue = m_colorLut[2].data();
+    for (std::size_t i = 0; i < count; ++i) {
+        const unsigned char g = gray[static_cast<std::uint16_t>(pixels.fixed[i])];
+        rgb[3 * i] = rgb[3 * i + 1] = rgb[3 * i + 2] = g;
+        if (pixels.inside[i]) {
+            const auto m = static_cast<std::uint16_t>(pixels.moving[i]);
+            movingRgb[3 * i] = red[m];
+            movingRgb[3 * i + 1] = green[m];
+            movingRgb[3 * i + 2] = blue[m];
+        } else {
+            movingRgb[3 * i] = movingRgb[3 * i + 1] = movingRgb[3 * i + 2] = g;
+        }
+    }
+    simd::BlendRowsU8(rgb, movingRgb, rgb, 3 * count, static_cast<int>(std::lround(m_opacity * 256.0)));
+}
+
+} // namespace dicomstitcher
@@ -0,0 +1,168 @@
+﻿#ifndef FUSIONSLICEPROVIDER_H
+#define FUSIONSLICEPROVIDER_H
+
+#include "pipelinecommon.h"
+#include "imagepreprocessing.h"
+#include "slicereslicer.h"
+#include "backgroundworker.h"
+#include "brickedvolume.h"
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+
+#include <itkTransform.h>
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace dicomstitcher {
+
+// 融合显示方式
+enum class FusionMode
+{
+    Blend,   // 灰度混合：fixed * (1 - opacity) + moving * opacity，再做窗宽窗位
+    Overlay  // Fixed 灰度 + Moving 伪彩叠加（在显示空间混合）
+};
+
+// 差值切片的统计量，只计入 Moving 覆盖的像素（骨骼模式下再要求任一侧达到骨骼阈值）
+struct DifferenceStatistics
+{
+    std::size_t pixels{0};
+    double meanAbsoluteDifference{0.0};     // HU
+    double normalizedCrossCorrelation{0.0}; // [-1, 1]；任一侧方差为 0 时为 0
+};
+
+// 按需生成融合切片：只对当前显示的切片把 Moving 重采样到 Fixed 网格，
+// 重采样结果放入 LRU 缓存，并在后台线程预取相邻切片。
+// 图像或变换改变时缓存失效；不透明度、显示方式和窗宽窗位只影响最后的混合，
+// 每次 GetSlice 从缓存重新混合即可。所有公有接口应在同一线程（GUI）调用。
+class FusionSliceProvider
+{
+public:
+    FusionSliceProvider();
+    ~FusionSliceProvider();
+
+    FusionSliceProvider(const FusionSliceProvider &) = delete;
+    FusionSliceProvider &operator=(const FusionSliceProvider &) = delete;
+
+    // moving 为空时只输出 Fixed 切片；清除之前设置的分块体数据
+    void SetImages(ImageType::Pointer fixed, ImageType::Pointer moving);
+    // 同上，切片从分块体数据读取，只有当前切片附近的分块常驻内存；清除之前设置的图像
+    void SetBrickedImages(std::shared_ptr<const BrickedVolume> fixed, std::shared_ptr<const BrickedVolume> moving);
+    // Fixed 物理坐标 → Moving 物理坐标；内部保存一份拷贝，nullptr 表示恒等
+    void SetTransform(const itk::Transform<double, 3> *transform);
+    void SetCacheCapacity(std::size_t slices);
+
+    // Moving 的不透明度 [0, 1]
+    void SetOpacity(double opacity);
+    void SetMode(FusionMode mode);
+    // Overlay 模式下 Moving 的颜色（各分量 [0, 1]）
+    void SetOverlayColor(double r, double g, double b);
+    // 两幅图共用的窗宽窗位，通过 16 位查找表映射到 8 位灰度
+    void SetWindowLevel(double window, double level);
+
+    // 差值切片只显示 / 统计骨骼：Fixed 或 Moving 不低于 threshold（HU）的像素
+    void SetDifferenceBoneOnly(bool boneOnly, double threshold = 200.0);
+
+    bool HasFixed() const;
+
+    // 同步返回 Fixed 网格上的一张融合切片（VTK_UNSIGNED_CHAR RGB，几何见 NewSliceImage）；
+    // 无 Fixed 时返回空。连续请求同一张切片时复用同一个 vtkImageData，只刷新像素
+    vtkSmartPointer<vtkImageData> GetSlice(SliceOrientation orientation, int index);
+    // 在后台预取 index 两侧各 radius 张切片，丢弃之前尚未开始的预取。
+    // direction 为 ±1（最近的翻页方向）时改为沿该方向预取 2 * radius 张，反方向只取 1 张
+    void Prefetch(SliceOrientation orientation, int index, int radius = 2, int direction = 0);
+    // 同一张切片的 |Fixed − Moving|（VTK_UNSIGNED_CHAR 单分量，[0, 窗宽] 线性映射到 [0, 255]），
+    // 与 GetSlice 共用重采样缓存，只多一遍向量化的差值与统计。无 Moving 时返回空
+    vtkSmartPointer<vtkImageData> GetDifferenceSlice(SliceOrientation orientation,
+                                                     int index,
+                                                     DifferenceStatistics *statistics = nullptr);
+
+private:
+    // 不可变快照：后台任务持有快照计算，前台替换快照不影响进行中的计算
+    // Fixed / Moving 各自为图像或分块体数据之一
+    struct State
+    {
+        ImageType::Pointer fixed;
+        ImageType::Pointer moving;
+        std::shared_ptr<const BrickedVolume> fixedBricks;
+        std::shared_ptr<const BrickedVolume> movingBricks;
+        itk::Transform<double, 3>::ConstPointer transform;
+        ImageGrid grid;
+        std::uint64_t generation{0};
+
+        bool HasFixed() const { return fixed || fixedBricks; }
+        bool HasMoving() const { return moving || movingBricks; }
+    };
+
+    // 一张切片上的 Fixed 与重采样后的 Moving；Moving 界外像素已替换为 Fixed 的值
+    struct SlicePixels
+    {
+        std::vector<PixelType> fixed;
+        std::vector<PixelType> moving;
+        std::vector<unsigned char> inside;
+    };
+
+    struct CacheEntry
+    {
+        std::uint64_t key;
+        std::uint64_t generation;
+        std::shared_ptr<const SlicePixels> pixels;
+    };
+
+    static std::uint64_t MakeKey(SliceOrientation orientation, int index);
+    static std::shared_ptr<const SlicePixels> ComputeSlice(const State &state,
+                                                           SliceOrientation orientation,
+                                                           int index,
+                                                           unsigned int numberOfThreads);
+
+    // 命中缓存或同步计算
+    std::shared_ptr<const SlicePixels> Pixels(const State &state, SliceOrientation orientation, int index);
+    std::shared_ptr<const State> Snapshot() const;
+    void ReplaceState(std::shared_ptr<State> state);
+    std::shared_ptr<const SlicePixels> Lookup(std::uint64_t key, std::uint64_t generation);
+    void Insert(std::uint64_t key, std::uint64_t generation, std::shared_ptr<const SlicePixels> pixels);
+
+    void RebuildLookupTables();
+    void Compose(const SlicePixels &pixels, unsigned char *rgb);
+
+    mutable std::mutex m_mutex;
+    std::shared_ptr<const State> m_state;
+    std::list<CacheEntry> m_cache; // 头部为最近使用
+    std::size_t m_capacity{24};
+
+    // 显示参数，仅在 GUI 线程访问
+    FusionMode m_mode{FusionMode::Blend};
+    double m_opacity{0.5};
+    double m_window{2000.0};
+    double m_level{40.0};
+    std::array<double, 3> m_overlayColor{{1.0, 0.6, 0.0}};
+    std::vector<unsigned char> m_grayLut;                 // short（按 uint16 索引）→ 灰度
+    std::array<std::vector<unsigned char>, 3> m_colorLut; // short → Overlay 颜色分量
+    std::vector<PixelType> m_blendScratch;
+    std::vector<unsigned char> m_rgbScratch;
+    std::vector<unsigned char> m_differenceLut; // |差值|（uint16）→ 灰度
+    std::vector<unsigned short> m_differenceScratch;
+    std::vector<unsigned char> m_maskScratch;
+    bool m_differenceBoneOnly{false};
+    double m_boneThreshold{200.0};
+
+    // 最近一次输出，翻到同一张切片时复用
+    vtkSmartPointer<vtkImageData> m_output;
+    std::uint64_t m_outputKey{0};
+    std::uint64_t m_outputGeneration{0};
+    vtkSmartPointer<vtkImageData> m_differenceOutput;
+    std::uint64_t m_differenceKey{0};
+    std::uint64_t m_differenceGeneration{0};
+
+    BackgroundWorker m_worker; // 最后声明：析构时最先停止，保证任务不会访问已销毁的成员
+};
+
+} // namespace dicomstitcher
+
+#endif // FUSIONSLICEPROVIDER_H
@@ -0,0 +1,309 @@
+﻿#include "imagepreprocessing.h"
+
+#include "separableresampler.h"
+
+#include <itkOrientImageFilter.h>
+#include <itkResampleImageFilter.h>
+#include <itkLinearInterpolateImageFunction.h>
+#include <itkMatrixOffsetTransformBase.h>
+#include <itkSpatialOrientationAdapter.h>
+#include <itkTranslationTransform.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace dicomstitcher {
+
+ImageGrid GridOf(const ImageType *image)
+{
+    ImageGrid grid;
+    grid.origin = image->GetOrigin();
+    grid.spacing = image->GetSpacing();
+    grid.direction = image->GetDirection();
+    grid.size = image->GetLargestPossibleRegion().GetSize();
+    return grid;
+}
+
+ImageType::Pointer NewGeometryImage(const ImageGrid &grid)
+{
+    auto image = ImageType::New();
+    ImageType::RegionType region;
+    region.SetSize(grid.size);
+    image->SetRegions(region);
+    image->SetOrigin(grid.origin);
+    image->SetSpacing(grid.spacing);
+    image->SetDirection(grid.direction);
+    return image;
+}
+
+bool ComputeIndexAffine(const ImageType *image,
+                        const ImageGrid &grid,
+                        const itk::Transform<double, 3> *transform,
+                        IndexAffine &affine)
+{
+    // 变换 T(p) = M p + t
+    double m[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+    double t[3] = {0.0, 0.0, 0.0};
+    if (transform) {
+        using TranslationType = itk::TranslationTransform<double, 3>;
+        using MatrixOffsetType = itk::MatrixOffsetTransformBase<double, 3, 3>;
+        if (const auto *translation = dynamic_cast<const TranslationType *>(transform)) {
+            for (unsigned int r = 0; r < 3; ++r) {
+                t[r] = translation->GetOffset()[r];
+            }
+        } else if (const auto *matrixOffset = dynamic_cast<const MatrixOffsetType *>(transform)) {
+            for (unsigned int r = 0; r < 3; ++r) {
+                for (unsigned int c = 0; c < 3; ++c) {
+                    m[r][c] = matrixOffset->GetMatrix()[r][c];
+                }
+                t[r] = matrixOffset->GetOffset()[r];
+            }
+        } else {
+            return false;
+        }
+    }
+
+    const auto inDir = image->GetDirection();
+    const auto inSpacing = image->GetSpacing();
+    const auto inOrigin = image->GetOrigin();
+    const auto inStart = image->GetBufferedRegion().GetIndex();
+
+    // c = S_in^-1 D_in^T (M (O_out + D_out S_out k) + t - O_in) - start
+    double shifted[3];
+    for (unsigned int r = 0; r < 3; ++r) {
+        double v = t[r] - inOrigin[r];
+        for (unsigned int c = 0; c < 3; ++c) {
+            v += m[r][c] * grid.origin[c];
+        }
+        shifted[r] = v;
+    }
+    for (unsigned int j = 0; j < 3; ++j) {
+        double b = 0.0;
+        for (unsigned int r = 0; r < 3; ++r) {
+            b += inDir[r][j] * shifted[r];
+        }
+        affine.b[j] = b / inSpacing[j] - static_cast<double>(inStart[j]);
+        for (unsigned int i = 0; i < 3; ++i) {
+            double v = 0.0;
+            for (unsigned int r = 0; r < 3; ++r) {
+                double md = 0.0;
+                for (unsigned int c = 0; c < 3; ++c) {
+                    md += m[r][c] * grid.direction[c][i];
+                }
+                v += inDir[r][j] * md;
+            }
+            affine.a[j][i] = v * grid.spacing[i] / inSpacing[j];
+        }
+    }
+    return true;
+}
+
+ImageGrid ComputeRASGrid(const ImageType *image)
+{
+    const ImageGrid input = GridOf(image);
+    const ImageType::DirectionType target = itk::SpatialOrientationAdapter().ToDirectionCosines(
+        itk::SpatialOrientation::ITK_COORDINATE_ORIENTATION_RAS);
+
+    // 每个输出轴选取与目标方向最接近的输入轴，点积符号决定是否翻转
+    unsigned int axisOf[3] = {0, 1, 2};
+    bool flip[3] = {false, false, false};
+    bool used[3] = {false, false, false};
+    for (unsigned int i = 0; i < 3; ++i) {
+        double best = -1.0;
+        for (unsigned int j = 0; j < 3; ++j) {
+            if (used[j]) {
+                continue;
+            }
+            double dot = 0.0;
+            for (unsigned int r = 0; r < 3; ++r) {
+                dot += input.direction[r][j] * target[r][i];
+            }
+            if (std::abs(dot) > best) {
+                best = std::abs(dot);
+                axisOf[i] = j;
+                flip[i] = dot < 0.0;
+            }
+        }
+        used[axisOf[i]] = true;
+    }
+
+    ImageGrid grid;
+    ImageType::IndexType corner;
+    corner.Fill(0);
+    for (unsigned int i = 0; i < 3; ++i) {
+        const unsigned int j = axisOf[i];
+        const double sign = flip[i] ? -1.0 : 1.0;
+        for (unsigned int r = 0; r < 3; ++r) {
+            grid.direction[r][i] = sign * input.direction[r][j];
+        }
+        grid.spacing[i] = input.spacing[j];
+        grid.size[i] = input.size[j];
+        if (flip[i]) {
+            corner[j] = static_cast<ImageType::IndexValueType>(input.size[j]) - 1;
+        }
+    }
+    image->TransformIndexToPhysicalPoint(corner, grid.origin);
+    return grid;
+}
+
+ImageGrid WithSpacing(const ImageGrid &grid, const ImageType::SpacingType &spacing)
+{
+    ImageGrid result = grid;
+    result.spacing = spacing;
+    for (unsigned int i = 0; i < 3; ++i) {
+        const double physicalLength = grid.spacing[i] * static_cast<double>(grid.size[i] - 1);
+        result.size[i] = static_cast<ImageType::SizeType::SizeValueType>(
+            std::floor(physicalLength / spacing[i] + 0.5)) + 1;
+    }
+    return result;
+}
+
+ImageType::Pointer OrientToRAS(ImageType *image, const CancelToken &cancel)
+{
+    using OrientFilter = itk::OrientImageFilter<ImageType, ImageType>;
+    auto orient = OrientFilter::New();
+    orient->UseImageDirectionOn();
+    orient->SetDesiredCoordinateOrientation(itk::SpatialOrientation::ITK_COORDINATE_ORIENTATION_RAS);
+    orient->SetInput(image);
+    cancel.Watch(orient);
+    orient->Update();
+    return orient->GetOutput();
+}
+
+ImageType::Pointer ResampleToIsotropic(ImageType *image, double spacing, const CancelToken &cancel)
+{
+    ImageType::SpacingType newSpacing;
+    newSpacing.Fill(spacing);
+    return ResampleToGrid(image, WithSpacing(GridOf(image), newSpacing), nullptr, cancel);
+}
+
+ImageType::Pointer ResampleToReference(ImageType *image,
+                                       ImageType *reference,
+                                       itk::Transform<double, 3> *transform,
+                                       const CancelToken &cancel)
+{
+    return ResampleToGrid(image, GridOf(reference), transform, cancel);
+}
+
+ImageType::Pointer ResampleToGrid(ImageType *image,
+                                  const ImageGrid &grid,
+                                  itk::Transform<double, 3> *transform,
+                                  const CancelToken &cancel,
+                                  const FractionCallback &progress)
+{
+    AxisMapping mapping;
+    if (ComputeAxisAlignedMapping(image, grid, transform, mapping)) {
+        return ResampleSeparable(image, grid, mapping, 0, cancel, progress);
+    }
+    return ResampleToGridGeneric(image, grid, transform, cancel, progress);
+}
+
+ImageType::Pointer ResampleToGridGeneric(ImageType *image,
+                                         const ImageGrid &grid,
+                                         itk::Transform<double, 3> *transform,
+                                         const CancelToken &cancel,
+                                         const FractionCallback &progress)
+{
+    using ResampleFilter = itk::ResampleImageFilter<ImageType, ImageType>;
+    using Interpolator = itk::LinearInterpolateImageFunction<ImageType, double>;
+    auto resample = ResampleFilter::New();
+    auto interp = Interpolator::New();
+    resample->SetInput(image);
+    resample->SetInterpolator(interp);
+    resample->SetDefaultPixelValue(0);
+    if (transform) {
+        resample->SetTransform(transform);
+    }
+
+    resample->SetOutputSpacing(grid.spacing);
+    resample->SetOutputOrigin(grid.origin);
+    resample->SetOutputDirection(grid.direction);
+    resample->SetSize(grid.size);
+    cancel.Watch(resample);
+    ForwardProgress(resample, progress);
+    resample->UpdateLargestPossibleRegion();
+    return resample->GetOutput();
+}
+
+ImageType::SpacingType ComputeTargetSpacing(const ImageGrid &rasGrid, const SpacingPolicy &policy)
+{
+    ImageType::SpacingType spacing = rasGrid.spacing;
+    switch (policy.mode) {
+    case SpacingMode::Native:
+        break;
+    case SpacingMode::ThroughPlane: {
+        unsigned int sliceAxis = 2;
+        for (unsigned int i = 0; i < 3; ++i) {
+            if (rasGrid.spacing[i] > rasGrid.spacing[sliceAxis]) {
+                sliceAxis = i;
+            }
+        }
+        spacing[sliceAxis] = policy.spacing;
+        break;
+    }
+    case SpacingMode::Isotropic:
+        spacing.Fill(policy.spacing);
+        break;
+    case SpacingMode::MemoryBudget: {
+        // 几何平均间距：各向同性网格的体素数与原始数据相同，不会凭空增加体素
+        double volume = 1.0;
+        double product = 1.0;
+        for (unsigned int i = 0; i < 3; ++i) {
+            volume *= rasGrid.spacing[i] * static_cast<double>(rasGrid.size[i]);
+            product *= rasGrid.spacing[i];
+        }
+        double iso = std::cbrt(product);
+        if (policy.memoryBudgetBytes > 0) {
+            const double budgetVoxels = static_cast<double>(policy.memoryBudgetBytes) / sizeof(PixelType);
+            iso = std::max(iso, std::cbrt(volume / budgetVoxels));
+        }
+        spacing.Fill(iso);
+        break;
+    }
+    }
+    for (unsigned int i = 0; i < 3; ++i) {
+        if (!(spacing[i] > 0.0)) {
+            spacing[i] = rasGrid.spacing[i];
+        }
+    }
+    return spacing;
+}
+
+ImageGrid ComputeOrientedGrid(const ImageType *image, const SpacingPolicy &policy)
+{
+    const ImageGrid rasGrid = ComputeRASGrid(image);
+    return WithSpacing(rasGrid, ComputeTargetSpacing(rasGrid, policy));
+}
+
+ImageType::Pointer OrientAndResample(ImageType *image, const SpacingPolicy &policy,
+                                     const CancelToken &cancel,
+                                     const FractionCallback &progress)
+{
+    return ResampleToGrid(image, ComputeOrientedGrid(image, policy), nullptr, cancel, progress);
+}
+
+itk::Point<double, 3> ComputeCenter(const ImageType *image)
+{
+    if (!image) {
+        itk::Point<double, 3> center;
+        center.Fill(0.0);
+        return center;
+    }
+    return ComputeCenter(GridOf(image));
+}
+
+itk::Point<double, 3> ComputeCenter(const ImageGrid &grid)
+{
+    itk::Vector<double, 3> halfExtent;
+    for (unsigned int i = 0; i < 3; ++i) {
+        halfExtent[i] = grid.spacing[i] * static_cast<double>(grid.size[i] - 1) * 0.5;
+    }
+    itk::Vector<double, 3> dirHalf = grid.direction * halfExtent;
+    itk::Point<double, 3> center;
+    for (unsigned int i = 0; i < 3; ++i) {
+        center[i] = grid.origin[i] + dirHalf[i];
+    }
+    return center;
+}
+
+} // namespace dicomstitcher
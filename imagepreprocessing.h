@@ -0,0 +1,103 @@
+﻿#ifndef IMAGEPREPROCESSING_H
+#define IMAGEPREPROCESSING_H
+
+#include "pipelinecommon.h"
+
+#include <itkPoint.h>
+#include <itkTransform.h>
+
+#include <cstddef>
+
+namespace dicomstitcher {
+
+// 体素网格几何（不含像素）
+struct ImageGrid
+{
+    ImageType::PointType origin;
+    ImageType::SpacingType spacing;
+    ImageType::DirectionType direction;
+    ImageType::SizeType size;
+};
+
+ImageGrid GridOf(const ImageType *image);
+
+// 只有 grid 几何、不分配像素的图像，供只做索引与物理坐标换算的接口使用（如 ComputeIndexAffine）
+ImageType::Pointer NewGeometryImage(const ImageGrid &grid);
+
+// 线性变换下 grid 索引 k 到 image 连续索引（相对缓冲区起点）的仿射映射：c = a k + b
+struct IndexAffine
+{
+    double a[3][3];
+    double b[3];
+};
+
+// transform 为空、TranslationTransform 或 MatrixOffsetTransformBase 派生类时返回 true；
+// transform 把 grid 所在空间的点映射到 image 所在空间（与 ResampleImageFilter 约定相同）
+bool ComputeIndexAffine(const ImageType *image,
+                        const ImageGrid &grid,
+                        const itk::Transform<double, 3> *transform,
+                        IndexAffine &affine);
+
+// 预处理输出间距策略
+enum class SpacingMode
+{
+    Native,        // 保持原始体素间距，只做方向标准化
+    ThroughPlane,  // 层内保持原始间距，仅层间方向重采样到 spacing
+    Isotropic,     // 各向同性 spacing
+    MemoryBudget   // 自动：体素数不超过原始数据的各向同性间距，且体数据不超过内存预算
+};
+
+struct SpacingPolicy
+{
+    SpacingMode mode{SpacingMode::Isotropic};
+    double spacing{1.0};                          // ThroughPlane / Isotropic 的目标间距 (mm)
+    std::size_t memoryBudgetBytes{std::size_t(1) << 30}; // MemoryBudget 模式下单个体数据上限
+};
+
+// 按策略计算 RAS 网格的目标间距；层间方向取间距最大的轴
+ImageType::SpacingType ComputeTargetSpacing(const ImageGrid &rasGrid, const SpacingPolicy &policy);
+
+// 输入图像按 OrientToRAS 重排后的网格（轴置换/翻转后的方向、原点与原始间距），不复制像素
+ImageGrid ComputeRASGrid(const ImageType *image);
+
+// 保持物理范围不变，按新间距重新计算尺寸（与 ResampleToIsotropic 相同的取整规则）
+ImageGrid WithSpacing(const ImageGrid &grid, const ImageType::SpacingType &spacing);
+
+// OrientAndResample 的输出网格：RAS 网格 + 按策略计算的目标间距。只读取几何，像素可尚未填充
+ImageGrid ComputeOrientedGrid(const ImageType *image, const SpacingPolicy &policy);
+
+// 预处理与重采样：不依赖 Qt，可在工作线程中调用
+ImageType::Pointer OrientToRAS(ImageType *image, const CancelToken &cancel = CancelToken());
+ImageType::Pointer ResampleToIsotropic(ImageType *image, double spacing = 1.0,
+                                       const CancelToken &cancel = CancelToken());
+ImageType::Pointer ResampleToReference(ImageType *image,
+                                       ImageType *reference,
+                                       itk::Transform<double, 3> *transform,
+                                       const CancelToken &cancel = CancelToken());
+// 在 grid 上线性插值采样 image；transform 为空时视为恒等变换。
+// 映射为轴对齐（无旋转）时走可分离 SIMD 路径，否则回退到 ResampleToGridGeneric。
+ImageType::Pointer ResampleToGrid(ImageType *image,
+                                  const ImageGrid &grid,
+                                  itk::Transform<double, 3> *transform = nullptr,
+                                  const CancelToken &cancel = CancelToken(),
+                                  const FractionCallback &progress = FractionCallback());
+
+// 通用路径：itk::ResampleImageFilter + LinearInterpolateImageFunction
+ImageType::Pointer ResampleToGridGeneric(ImageType *image,
+                                         const ImageGrid &grid,
+                                         itk::Transform<double, 3> *transform = nullptr,
+                                         const CancelToken &cancel = CancelToken(),
+                                         const FractionCallback &progress = FractionCallback());
+
+// 方向标准化与重采样合并为一次采样：RAS 轴置换直接体现在输出网格中，
+// 不生成中间的重排体数据。各向同性策略下结果与 OrientToRAS + ResampleToIsotropic 相同。
+ImageType::Pointer OrientAndResample(ImageType *image, const SpacingPolicy &policy,
+                                     const CancelToken &cancel = CancelToken(),
+                                     const FractionCallback &progress = FractionCallback());
+
+itk::Point<double, 3> ComputeCenter(const ImageType *image);
+itk::Point<double, 3> ComputeCenter(const ImageGrid &grid);
+
+} // namespace dicomstitcher
+
+#endif // IMAGEPREPROCESSING_H
@@ -0,0 +1,214 @@
+﻿#include "imagepyramid.h"
+#include "brickedvolume.h"
+#include "imagepreprocessing.h"
+
+#include <itkRegionOfInterestImageFilter.h>
+#include <itkShrinkImageFilter.h>
+#include <itkSmoothingRecursiveGaussianImageFilter.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace dicomstitcher {
+
+ImageType::Pointer ReduceImage(const ImageType *image,
+                               unsigned int factor,
+                               const CancelToken &cancel,
+                               unsigned int numberOfThreads,
+                               const FractionCallback &progress)
+{
+    using SmoothType = itk::SmoothingRecursiveGaussianImageFilter<ImageType, ImageType>;
+    using ShrinkType = itk::ShrinkImageFilter<ImageType, ImageType>;
+
+    auto smooth = SmoothType::New();
+    smooth->SetInput(image);
+    SmoothType::SigmaArrayType sigma;
+    for (unsigned int i = 0; i < 3; ++i) {
+        sigma[i] = 0.5 * factor * image->GetSpacing()[i];
+    }
+    smooth->SetSigmaArray(sigma);
+    if (numberOfThreads > 0) {
+        smooth->SetNumberOfWorkUnits(numberOfThreads);
+    }
+    cancel.Watch(smooth);
+    if (progress) {
+        ForwardProgress(smooth, [progress](double fraction) { progress(0.8 * fraction); });
+    }
+
+    auto shrink = ShrinkType::New();
+    shrink->SetInput(smooth->GetOutput());
+    shrink->SetShrinkFactors(std::max(1u, factor));
+    if (numberOfThreads > 0) {
+        shrink->SetNumberOfWorkUnits(numberOfThreads);
+    }
+    cancel.Watch(shrink);
+    if (progress) {
+        ForwardProgress(shrink, [progress](double fraction) { progress(0.8 + 0.2 * fraction); });
+    }
+    shrink->Update();
+
+    ImageType::Pointer level = shrink->GetOutput();
+    level->DisconnectPipeline();
+    return level;
+}
+
+ImagePyramid::Pointer ImagePyramid::Build(ImageType::ConstPointer base,
+                                          const std::vector<unsigned int> &factors,
+                                          unsigned int numberOfThreads,
+                                          const CancelToken &cancel,
+                                          const FractionCallback &progress)
+{
+    auto pyramid = std::make_shared<ImagePyramid>();
+    pyramid->m_base = base;
+    if (!base) {
+        return pyramid;
+    }
+
+    std::vector<unsigned int> sorted(factors);
+    std::sort(sorted.begin(), sorted.end());
+    sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+    const auto size = base->GetLargestPossibleRegion().GetSize();
+    const itk::SizeValueType shortest = std::min({size[0], size[1], size[2]});
+
+    // 逐级构建：每层由已有的最接近层级再降采样，平滑只作用在更小的数据上。
+    // 进度按各层输入体素数分配：以 previousFactor 为倍数的层输入约为原图的 1 / previousFactor³
+    std::vector<unsigned int> planned;
+    double totalWork = 0.0;
+    for (unsigned int factor : sorted) {
+        const unsigned int previousFactor = planned.empty() ? 1 : planned.back();
+        if (factor <= 1 || factor % previousFactor != 0 || factor > shortest) {
+            continue;
+        }
+        totalWork += 1.0 / std::pow(static_cast<double>(previousFactor), 3);
+        planned.push_back(factor);
+    }
+
+    ImageType::ConstPointer previous = base;
+    unsigned int previousFactor = 1;
+    double workDone = 0.0;
+    for (unsigned int factor : planned) {
+        cancel.ThrowIfCancelled();
+        const unsigned int step = factor / previousFactor;
+        const double work = 1.0 / std::pow(static_cast<double>(previousFactor), 3);
+        FractionCallback levelProgress;
+        if (progress) {
+            levelProgress = [progress, workDone, work, totalWork](double fraction) {
+                progress((workDone + work * fraction) / totalWork);
+            };
+        }
+        ImageType::Pointer level = ReduceImage(previous.GetPointer(), step, cancel, numberOfThreads, levelProgress);
+        workDone += work;
+        pyramid->m_levels.push_back(Level{factor, level});
+        previous = level;
+        previousFactor = factor;
+    }
+    return pyramid;
+}
+
+ImagePyramid::Pointer ImagePyramid::FromImage(ImageType::ConstPointer base)
+{
+    auto pyramid = std::make_shared<ImagePyramid>();
+    pyramid->m_base = base;
+    return pyramid;
+}
+
+ImagePyramid::Pointer ImagePyramid::FromLevels(ImageType::ConstPointer base,
+                                               const std::vector<std::pair<unsigned int, ImageType::Pointer>> &levels)
+{
+    auto pyramid = std::make_shared<ImagePyramid>();
+    pyramid->m_base = base;
+    for (const auto &level : levels) {
+        if (level.first > 1 && level.second) {
+            pyramid->m_levels.push_back(Level{level.first, level.second});
+        }
+    }
+    std::sort(pyramid->m_levels.begin(), pyramid->m_levels.end(),
+              [](const Level &a, const Level &b) { return a.factor < b.factor; });
+    return pyramid;
+}
+
+ImagePyramid::Pointer ImagePyramid::WithBrickedBase(std::shared_ptr<const BrickedVolume> base,
+                                                    const ImagePyramid *levels)
+{
+    auto pyramid = std::make_shared<ImagePyramid>();
+    pyramid->m_bricks = std::move(base);
+    if (levels) {
+        pyramid->m_levels = levels->m_levels;
+    }
+    return pyramid;
+}
+
+ImageType::ConstPointer ImagePyramid::GetBaseGeometry() const
+{
+    if (m_bricks) {
+        return NewGeometryImage(m_bricks->Grid()).GetPointer();
+    }
+    return m_base;
+}
+
+ImageType::Pointer ImagePyramid::ReadBaseRegion(const ImageType::RegionType &region, const CancelToken &cancel) const
+{
+    cancel.ThrowIfCancelled();
+    if (m_bricks) {
+        return m_bricks->ReadRegionImage(region);
+    }
+    if (!m_base) {
+        return nullptr;
+    }
+    using ExtractType = itk::RegionOfInterestImageFilter<ImageType, ImageType>;
+    auto extract = ExtractType::New();
+    extract->SetInput(m_base);
+    extract->SetRegionOfInterest(region);
+    cancel.Watch(extract);
+    extract->Update();
+    ImageType::Pointer image = extract->GetOutput();
+    image->DisconnectPipeline();
+    return image;
+}
+
+ImageType::ConstPointer ImagePyramid::GetLevel(unsigned int factor) const
+{
+    if (factor <= 1) {
+        if (m_bricks) {
+            return m_bricks->ReadRegionImage(m_bricks->LargestRegion()).GetPointer();
+        }
+        return m_base;
+    }
+    for (const Level &level : m_levels) {
+        if (level.factor == factor) {
+            return level.image.GetPointer();
+        }
+    }
+    return nullptr;
+}
+
+ImageType::ConstPointer ImagePyramid::GetCoarsestLevel(double maximumSpacing, unsigned int *factor) const
+{
+    const Level *best = nullptr;
+    for (const Level &level : m_levels) {
+        const auto spacing = level.image->GetSpacing();
+        if (std::max({spacing[0], spacing[1], spacing[2]}) <= maximumSpacing) {
+            best = &level;
+        }
+    }
+    if (!best && !m_levels.empty()) {
+        // 原始间距已超过 maximumSpacing（如 5 mm 层厚）：取最粗的层级，不退回原图
+        best = &m_levels.back();
+    }
+    if (factor) {
+        *factor = best ? best->factor : 1;
+    }
+    return best ? ImageType::ConstPointer(best->image.GetPointer()) : GetLevel(1);
+}
+
+std::vector<unsigned int> ImagePyramid::GetFactors() const
+{
+    std::vector<unsigned int> factors{1};
+    for (const Level &level : m_levels) {
+        factors.push_back(level.factor);
+    }
+    return factors;
+}
+
+} // namespace dicomstitcher
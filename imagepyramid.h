@@ -0,0 +1,82 @@
+﻿#ifndef IMAGEPYRAMID_H
+#define IMAGEPYRAMID_H
+
+#include "pipelinecommon.h"
+
+#include <memory>
+#include <utility>
+#include <vector>
+
+namespace dicomstitcher {
+
+class BrickedVolume;
+
+// 一次降采样：sigma = 0.5 * factor 个体素的高斯平滑后按 factor 抽取（ShrinkImageFilter，物理中心不变）。
+// numberOfThreads 为 0 时使用 ITK 默认线程数。progress 来自两个过滤器的 ProgressEvent（平滑占前 80%）。
+ImageType::Pointer ReduceImage(const ImageType *image,
+                               unsigned int factor,
+                               const CancelToken &cancel,
+                               unsigned int numberOfThreads = 0,
+                               const FractionCallback &progress = FractionCallback());
+
+// 加载时为每个体数据构建一次的多分辨率金字塔（默认 2x/4x/8x），供配准、粗对齐与预览共享，
+// 避免各自重复平滑降采样。每层由上一层级继续降采样得到，平滑与抽取都是多线程过滤器。
+// 原图可以是连续的图像，也可以是分块体数据（此时只有降采样层级常驻内存，原图按区域读取）。
+// 构建完成后只读，通过 Pointer 在 GUI 线程与工作线程之间共享；重新加载序列时整体替换。
+class ImagePyramid
+{
+public:
+    using Pointer = std::shared_ptr<const ImagePyramid>;
+
+    // factors 按升序构建，每个需为前一层的整数倍（如 2/4/8）；超过体数据最短边的层级被跳过。
+    // progress 按各层输入体素数加权（第一层占绝大部分）
+    static Pointer Build(ImageType::ConstPointer base,
+                         const std::vector<unsigned int> &factors,
+                         unsigned int numberOfThreads,
+                         const CancelToken &cancel,
+                         const FractionCallback &progress = FractionCallback());
+
+    // 只包含原始分辨率，用于没有预先构建金字塔的调用方
+    static Pointer FromImage(ImageType::ConstPointer base);
+
+    // 由已有的层级组装（如从预处理缓存映射得到），levels 为 (factor, image)
+    static Pointer FromLevels(ImageType::ConstPointer base,
+                              const std::vector<std::pair<unsigned int, ImageType::Pointer>> &levels);
+
+    // 沿用 levels 的降采样层级，原图换成分块体数据（几何需与 levels 的原图一致）；levels 可为空
+    static Pointer WithBrickedBase(std::shared_ptr<const BrickedVolume> base, const ImagePyramid *levels);
+
+    // 原图为分块体数据时为空
+    const ImageType *GetBase() const { return m_base.GetPointer(); }
+    const std::shared_ptr<const BrickedVolume> &GetBrickedBase() const { return m_bricks; }
+    bool HasBase() const { return m_base || m_bricks; }
+
+    // 原图的几何（分块原图时不含像素），用于索引与物理坐标的换算
+    ImageType::ConstPointer GetBaseGeometry() const;
+    // 原图 region 内的像素拷贝为独立图像：索引从 0 开始，原点移到 region 起点
+    ImageType::Pointer ReadBaseRegion(const ImageType::RegionType &region, const CancelToken &cancel) const;
+
+    // factor 为 1 时返回原图（分块原图时读出整个体数据）；没有该层级时返回空
+    ImageType::ConstPointer GetLevel(unsigned int factor) const;
+
+    // 各轴间距都不超过 maximumSpacing 的最粗层级；没有层级满足时返回最粗的层级，
+    // 没有降采样层级时返回原图（分块原图时读出整个体数据）。factor 输出其降采样倍数
+    ImageType::ConstPointer GetCoarsestLevel(double maximumSpacing, unsigned int *factor = nullptr) const;
+
+    std::vector<unsigned int> GetFactors() const;
+
+private:
+    struct Level
+    {
+        unsigned int factor;
+        ImageType::Pointer image;
+    };
+
+    ImageType::ConstPointer m_base;
+    std::shared_ptr<const BrickedVolume> m_bricks;
+    std::vector<Level> m_levels; // 按 factor 升序
+};
+
+} // namespace dicomstitcher
+
+#endif // IMAGEPYRAMID_H
@@ -0,0 +1,249 @@
+﻿#include "instrumentation.h"
+
+#include <itksys/SystemTools.hxx>
+
+#include <algorithm>
+#include <cstdio>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+namespace dicomstitcher {
+
+namespace {
+
+thread_local const char *t_currentStage = nullptr;
+
+std::string EscapeJson(const std::string &text)
+{
+    std::string out;
+    out.reserve(text.size());
+    for (const char c : text) {
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char buffer[8];
+                std::snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                out += buffer;
+            } else {
+                out += c;
+            }
+        }
+    }
+    return out;
+}
+
+} // namespace
+
+std::size_t CurrentRssBytes()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.WorkingSetSize;
+    }
+    return 0;
+#elif defined(__linux__)
+    std::FILE *statm = std::fopen("/proc/self/statm", "r");
+    if (!statm) {
+        return 0;
+    }
+    unsigned long size = 0;
+    unsigned long resident = 0;
+    const int fields = std::fscanf(statm, "%lu %lu", &size, &resident);
+    std::fclose(statm);
+    return fields == 2 ? static_cast<std::size_t>(resident) * static_cast<std::size_t>(sysconf(_SC_PAGESIZE)) : 0;
+#else
+    return 0;
+#endif
+}
+
+std::size_t PeakRssBytes()
+{
+#if defined(_WIN32)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return counters.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#if defined(__APPLE__)
+    return static_cast<std::size_t>(usage.ru_maxrss); // 字节
+#else
+    return static_cast<std::size_t>(usage.ru_maxrss) * 1024; // KB
+#endif
+#endif
+}
+
+Profiler &Profiler::Instance()
+{
+    static Profiler instance;
+    return instance;
+}
+
+Profiler::Profiler()
+    : m_origin(Clock::now())
+{
+    // DICOMSTITCHER_TRACE=0 关闭事件记录（平均耗时仍会更新）
+    const char *env = itksys::SystemTools::GetEnv("DICOMSTITCHER_TRACE");
+    if (env && std::string(env) == "0") {
+        m_enabled = false;
+    }
+}
+
+void Profiler::SetEnabled(bool enabled)
+{
+    m_enabled.store(enabled);
+}
+
+void Profiler::BeginRun()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_events.clear();
+    m_origin = Clock::now();
+}
+
+unsigned int Profiler::ThreadIndex()
+{
+    const auto id = std::this_thread::get_id();
+    const auto it = m_threads.find(id);
+    if (it != m_threads.end()) {
+        return it->second;
+    }
+    const auto index = static_cast<unsigned int>(m_threads.size());
+    m_threads.emplace(id, index);
+    return index;
+}
+
+void Profiler::AddEvent(const char *category, const std::string &name, Clock::time_point begin,
+                        Clock::time_point end, const std::string &args)
+{
+    if (!m_enabled.load()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_events.size() >= MaximumEvents) {
+        return;
+    }
+    // 跨越 BeginRun 的事件截取到本次运行开始之后的部分
+    begin = std::max(begin, m_origin);
+    end = std::max(end, begin);
+    Event event;
+    event.category = category;
+    event.name = name;
+    event.beginUs = std::chrono::duration_cast<std::chrono::microseconds>(begin - m_origin).count();
+    event.durationUs = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+    event.tid = ThreadIndex();
+    event.args = args;
+    m_events.push_back(std::move(event));
+}
+
+bool Profiler::WriteChromeTrace(const std::string &path) const
+{
+    std::vector<Event> events;
+    std::vector<unsigned int> threads;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        events = m_events;
+        for (const auto &entry : m_threads) {
+            threads.push_back(entry.second);
+        }
+    }
+    std::sort(threads.begin(), threads.end());
+    std::sort(events.begin(), events.end(),
+              [](const Event &a, const Event &b) { return a.beginUs < b.beginUs; });
+
+    std::FILE *file = itksys::SystemTools::Fopen(path, "wb");
+    if (!file) {
+        return false;
+    }
+    std::fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    bool first = true;
+    for (const unsigned int tid : threads) {
+        std::fprintf(file, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"thread %u\"}}",
+                     first ? "" : ",\n", tid, tid);
+        first = false;
+    }
+    for (const Event &event : events) {
+        std::fprintf(file, "%s{\"ph\":\"X\",\"cat\":\"%s\",\"name\":\"%s\",\"pid\":1,\"tid\":%u,"
+                           "\"ts\":%lld,\"dur\":%lld,\"args\":{%s}}",
+                     first ? "" : ",\n", event.category, EscapeJson(event.name).c_str(), event.tid,
+                     static_cast<long long>(event.beginUs), static_cast<long long>(event.durationUs),
+                     event.args.c_str());
+        first = false;
+    }
+    std::fprintf(file, "\n]}\n");
+    return std::fclose(file) == 0;
+}
+
+double Profiler::AverageSeconds(const std::string &name, double fallback) const
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto it = m_averages.find(name);
+    return it != m_averages.end() ? it->second : fallback;
+}
+
+void Profiler::UpdateAverage(const std::string &name, double seconds)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const auto it = m_averages.find(name);
+    if (it == m_averages.end()) {
+        m_averages.emplace(name, seconds);
+    } else {
+        // 指数滑动平均：数据规模变化时几次运行内跟上
+        it->second = 0.6 * it->second + 0.4 * seconds;
+    }
+}
+
+ScopedStage::ScopedStage(const char *name, std::vector<StageTiming> *timings)
+    : m_name(name)
+    , m_parent(t_currentStage)
+    , m_timings(timings)
+    , m_begin(Profiler::Clock::now())
+    , m_rssBegin(CurrentRssBytes())
+{
+    t_currentStage = name;
+}
+
+ScopedStage::~ScopedStage()
+{
+    t_currentStage = m_parent;
+    const auto end = Profiler::Clock::now();
+    const std::size_t rssEnd = CurrentRssBytes();
+    const std::size_t peak = PeakRssBytes();
+    const double seconds = std::chrono::duration<double>(end - m_begin).count();
+    const std::int64_t delta = static_cast<std::int64_t>(rssEnd) - static_cast<std::int64_t>(m_rssBegin);
+
+    Profiler &profiler = Profiler::Instance();
+    char args[160];
+    std::snprintf(args, sizeof(args), "\"rss_mb\":%.1f,\"rss_delta_mb\":%.1f,\"peak_rss_mb\":%.1f",
+                  rssEnd / (1024.0 * 1024.0), delta / (1024.0 * 1024.0), peak / (1024.0 * 1024.0));
+    profiler.AddEvent("stage", m_name, m_begin, end, args);
+    profiler.UpdateAverage(m_name, seconds);
+
+    if (m_timings) {
+        m_timings->push_back(StageTiming{m_name, seconds, delta, peak});
+    }
+}
+
+const char *ScopedStage::Current()
+{
+    return t_currentStage;
+}
+
+} // namespace dicomstitcher
@@ -0,0 +1,105 @@
+﻿#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace dicomstitcher {
+
+// 进程当前 / 峰值常驻内存（字节），平台不支持时返回 0
+std::size_t CurrentRssBytes();
+std::size_t PeakRssBytes();
+
+// 一个阶段的耗时与内存，供状态栏和批处理报告汇总
+struct StageTiming
+{
+    std::string name;
+    double seconds{0.0};
+    std::int64_t rssDeltaBytes{0}; // 阶段结束与开始时常驻内存之差
+    std::size_t peakRssBytes{0};   // 阶段结束时的进程峰值
+};
+
+// 进程内的轻量跟踪记录：各阶段（ScopedStage）与 ParallelFor 工作单元各记一条 Chrome trace "X" 事件，
+// 可写出为 chrome://tracing / Perfetto 可打开的 JSON。线程安全；事件数有上限，超出后丢弃新事件。
+// 同时按阶段名维护耗时的滑动平均，用于按实际耗时分配进度条区间。
+class Profiler
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static Profiler &Instance();
+
+    void SetEnabled(bool enabled);
+    bool IsEnabled() const { return m_enabled; }
+
+    // 开始新的一次运行：清空事件，保留耗时统计
+    void BeginRun();
+
+    void AddEvent(const char *category, const std::string &name, Clock::time_point begin, Clock::time_point end,
+                  const std::string &args = std::string());
+
+    // 写出最近一次运行的 Chrome trace JSON，失败返回 false
+    bool WriteChromeTrace(const std::string &path) const;
+
+    // 阶段 name 最近几次运行的平均耗时（秒），没有记录时返回 fallback
+    double AverageSeconds(const std::string &name, double fallback) const;
+    void UpdateAverage(const std::string &name, double seconds);
+
+private:
+    Profiler();
+
+    struct Event
+    {
+        const char *category;
+        std::string name;
+        std::int64_t beginUs;
+        std::int64_t durationUs;
+        unsigned int tid;
+        std::string args; // 已格式化的 JSON 对象成员，可为空
+    };
+
+    unsigned int ThreadIndex(); // 调用方持有 m_mutex
+
+    static constexpr std::size_t MaximumEvents = 200000;
+
+    mutable std::mutex m_mutex;
+    std::atomic<bool> m_enabled{true};
+    Clock::time_point m_origin;
+    std::vector<Event> m_events;
+    std::unordered_map<std::thread::id, unsigned int> m_threads;
+    std::map<std::string, double> m_averages;
+};
+
+// 作用域计时：构造时记下时间与常驻内存，析构时写入一条 "stage" 事件、更新平均耗时，
+// 并可追加到 timings。同一线程内嵌套时，ParallelFor 的工作单元事件以最内层阶段命名。
+class ScopedStage
+{
+public:
+    explicit ScopedStage(const char *name, std::vector<StageTiming> *timings = nullptr);
+    ~ScopedStage();
+
+    ScopedStage(const ScopedStage &) = delete;
+    ScopedStage &operator=(const ScopedStage &) = delete;
+
+    // 当前线程最内层的阶段名，没有时为 nullptr
+    static const char *Current();
+
+private:
+    const char *m_name;
+    const char *m_parent;
+    std::vector<StageTiming> *m_timings;
+    Profiler::Clock::time_point m_begin;
+    std::size_t m_rssBegin;
+};
+
+} // namespace dicomstitcher
+
+#endif // INSTRUMENTATION_H
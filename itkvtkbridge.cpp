@@ -0,0 +1,59 @@
+﻿#include "itkvtkbridge.h"
+
+#include <vtkCommand.h>
+#include <vtkPointData.h>
+#include <vtkShortArray.h>
+
+namespace dicomstitcher {
+
+namespace {
+
+// 挂在 VTK 标量数组上的空观察者：数组析构时观察者随之释放，
+// 借此让 VTK 一侧持有 ITK 图像（及其像素缓冲）的引用。
+class ItkImageOwner : public vtkCommand
+{
+public:
+    static ItkImageOwner *New() { return new ItkImageOwner; }
+    vtkTypeMacro(ItkImageOwner, vtkCommand);
+
+    void Execute(vtkObject *, unsigned long, void *) override {}
+
+    ImageType::Pointer image;
+};
+
+} // namespace
+
+vtkSmartPointer<vtkImageData> ItkToVtkImage(ImageType *image)
+{
+    if (!image || !image->GetBufferPointer()) {
+        return nullptr;
+    }
+
+    const auto region = image->GetLargestPossibleRegion();
+    const auto size = region.GetSize();
+    const auto spacing = image->GetSpacing();
+    const auto origin = image->GetOrigin();
+
+    // 标量数组直接包装 ITK 像素缓冲（save=1：VTK 不负责释放）
+    auto scalars = vtkSmartPointer<vtkShortArray>::New();
+    scalars->SetNumberOfComponents(1);
+    scalars->SetArray(image->GetBufferPointer(),
+                      static_cast<vtkIdType>(region.GetNumberOfPixels()),
+                      1);
+
+    auto owner = vtkSmartPointer<ItkImageOwner>::New();
+    owner->image = image;
+    scalars->AddObserver(vtkCommand::DeleteEvent, owner);
+
+    auto vtkImage = vtkSmartPointer<vtkImageData>::New();
+    vtkImage->SetDimensions(static_cast<int>(size[0]),
+                            static_cast<int>(size[1]),
+                            static_cast<int>(size[2]));
+    vtkImage->SetSpacing(spacing[0], spacing[1], spacing[2]);
+    vtkImage->SetOrigin(origin[0], origin[1], origin[2]);
+    vtkImage->GetPointData()->SetScalars(scalars);
+
+    return vtkImage;
+}
+
+} // namespace dicomstitcher
@@ -0,0 +1,18 @@
+﻿#ifndef ITKVTKBRIDGE_H
+#define ITKVTKBRIDGE_H
+
+#include "pipelinecommon.h"
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+
+namespace dicomstitcher {
+
+// 零拷贝转换：返回的 vtkImageData 标量数组直接引用 ITK 像素缓冲，
+// 并持有 ITK 图像的引用，两侧任一先释放都不会使缓冲失效。
+// 共享期间不要对 ITK 图像重新 Allocate；原地修改像素后需调用 vtkImageData::Modified()。
+vtkSmartPointer<vtkImageData> ItkToVtkImage(ImageType *image);
+
+} // namespace dicomstitcher
+
+#endif // ITKVTKBRIDGE_H
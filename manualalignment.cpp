@@ -0,0 +1,119 @@
+﻿#include "manualalignment.h"
+
+#include <itkAffineTransform.h>
+#include <itkTranslationTransform.h>
+
+#include <algorithm>
+#include <cmath>
+
+namespace dicomstitcher {
+
+namespace {
+
+constexpr double kPi = 3.14159265358979323846;
+
+// 绕单位轴 axis 旋转 radians 的矩阵（Rodrigues 公式）
+itk::Matrix<double, 3, 3> AxisAngleMatrix(const itk::Vector<double, 3> &axis, double radians)
+{
+    const double c = std::cos(radians);
+    const double s = std::sin(radians);
+    const double t = 1.0 - c;
+    const double x = axis[0];
+    const double y = axis[1];
+    const double z = axis[2];
+    itk::Matrix<double, 3, 3> m;
+    m[0][0] = t * x * x + c;
+    m[0][1] = t * x * y - s * z;
+    m[0][2] = t * x * z + s * y;
+    m[1][0] = t * x * y + s * z;
+    m[1][1] = t * y * y + c;
+    m[1][2] = t * y * z - s * x;
+    m[2][0] = t * x * z - s * y;
+    m[2][1] = t * y * z + s * x;
+    m[2][2] = t * z * z + c;
+    return m;
+}
+
+} // namespace
+
+bool ManualAlignment::Reset(const itk::Transform<double, 3> *base)
+{
+    m_baseMatrix.SetIdentity();
+    m_baseOffset.Fill(0.0);
+    m_rotation.SetIdentity();
+    m_translation.Fill(0.0);
+    m_modified = false;
+    m_valid = true;
+    if (!base) {
+        return true;
+    }
+    using TranslationType = itk::TranslationTransform<double, 3>;
+    using MatrixOffsetType = itk::MatrixOffsetTransformBase<double, 3, 3>;
+    if (const auto *translation = dynamic_cast<const TranslationType *>(base)) {
+        m_baseOffset = translation->GetOffset();
+    } else if (const auto *matrixOffset = dynamic_cast<const MatrixOffsetType *>(base)) {
+        m_baseMatrix = matrixOffset->GetMatrix();
+        m_baseOffset = matrixOffset->GetOffset();
+    } else {
+        m_valid = false;
+    }
+    return m_valid;
+}
+
+void ManualAlignment::Translate(const VectorType &delta)
+{
+    m_translation += delta;
+    m_modified = true;
+}
+
+void ManualAlignment::Rotate(const VectorType &axis, double radians, const PointType &center)
+{
+    const double length = axis.GetNorm();
+    if (length <= 0.0 || radians == 0.0) {
+        return;
+    }
+    // 新的 G'(y) = Q (G(y) - c) + c = Q R y + Q (t - c) + c
+    const itk::Matrix<double, 3, 3> q = AxisAngleMatrix(axis / length, radians);
+    VectorType shifted;
+    for (unsigned int i = 0; i < 3; ++i) {
+        shifted[i] = m_translation[i] - center[i];
+    }
+    VectorType translation = q * shifted;
+    for (unsigned int i = 0; i < 3; ++i) {
+        translation[i] += center[i];
+    }
+    m_rotation = q * m_rotation;
+    m_translation = translation;
+    m_modified = true;
+}
+
+itk::Transform<double, 3>::Pointer ManualAlignment::Transform() const
+{
+    if (!m_valid) {
+        return nullptr;
+    }
+    // T(x) = M G⁻¹(x) + o = M Rᵀ x + (o - M Rᵀ t)
+    const itk::Matrix<double, 3, 3> inverseRotation(m_rotation.GetTranspose());
+    const itk::Matrix<double, 3, 3> matrix = m_baseMatrix * inverseRotation;
+    const VectorType offset = m_baseOffset - matrix * m_translation;
+
+    using AffineType = itk::AffineTransform<double, 3>;
+    auto transform = AffineType::New();
+    transform->SetMatrix(matrix);
+    transform->SetOffset(offset);
+    return transform.GetPointer();
+}
+
+ManualAlignment::VectorType ManualAlignment::Translation(const PointType &center) const
+{
+    const VectorType moved = m_rotation * center.GetVectorFromOrigin() + m_translation;
+    return moved - center.GetVectorFromOrigin();
+}
+
+double ManualAlignment::RotationDegrees() const
+{
+    const double trace = m_rotation[0][0] + m_rotation[1][1] + m_rotation[2][2];
+    return std::acos(std::clamp(0.5 * (trace - 1.0), -1.0, 1.0)) * 180.0 / kPi;
+}
+
+} // namespace dicomstitcher
@@ -0,0 +1,49 @@
+﻿#ifndef MANUALALIGNMENT_H
+#define MANUALALIGNMENT_H
+
+#include "pipelinecommon.h"
+
+#include <itkTransform.h>
+
+namespace dicomstitcher {
+
+// 手动对齐：在 Fixed 物理空间中对 Moving 的显示位置做刚体微调。
+// 微调累积为刚体运动 G(y) = R y + t（把 Moving 的内容从 y 移到 G(y)），
+// 当前变换为 base ∘ G⁻¹（Fixed → Moving），仍是矩阵 + 偏移形式：
+// 切片重采样走仿射快速路径，也可直接作为配准初值。只在一个线程中使用。
+class ManualAlignment
+{
+public:
+    using PointType = ImageType::PointType;
+    using VectorType = itk::Vector<double, 3>;
+
+    // 以 base（nullptr 为恒等）为起点并清除微调；base 只支持平移或矩阵+偏移类变换，否则返回 false 且不可微调
+    bool Reset(const itk::Transform<double, 3> *base);
+    bool IsValid() const { return m_valid; }
+    // 自上次 Reset 以来是否有微调
+    bool IsModified() const { return m_modified; }
+
+    // Moving 沿 delta（mm，物理坐标）平移
+    void Translate(const VectorType &delta);
+    // Moving 绕过 center、方向为 axis 的轴旋转 radians（右手定则）
+    void Rotate(const VectorType &axis, double radians, const PointType &center);
+
+    // 当前的 Fixed → Moving 变换（itk::AffineTransform）；不可微调时返回空
+    itk::Transform<double, 3>::Pointer Transform() const;
+
+    // 微调量：平移为 G 把 center 移动的距离（mm），旋转为 R 的转角（度）
+    VectorType Translation(const PointType &center) const;
+    double RotationDegrees() const;
+
+private:
+    itk::Matrix<double, 3, 3> m_baseMatrix;
+    VectorType m_baseOffset;
+    itk::Matrix<double, 3, 3> m_rotation;
+    VectorType m_translation;
+    bool m_valid{false};
+    bool m_modified{false};
+};
+
+} // namespace dicomstitcher
+
+#endif // MANUALALIGNMENT_H
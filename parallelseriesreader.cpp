@@ -0,0 +1,210 @@
+﻿#include "parallelseriesreader.h"
+
+#include <itkGDCMImageIO.h>
+#include <itkImageSeriesReader.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+namespace dicomstitcher {
+
+namespace {
+
+template <typename TIn>
+void ConvertToPixel(const void *source, PixelType *target, std::size_t count)
+{
+    const auto *in = static_cast<const TIn *>(source);
+    constexpr double lo = static_cast<double>(std::numeric_limits<PixelType>::min());
+    constexpr double hi = static_cast<double>(std::numeric_limits<PixelType>::max());
+    for (std::size_t i = 0; i < count; ++i) {
+        // 与 ITK ConvertPixelBuffer 一致采用截断，但先夹取到 short 范围避免溢出
+        const double v = std::min(hi, std::max(lo, static_cast<double>(in[i])));
+        target[i] = static_cast<PixelType>(v);
+    }
+}
+
+void ConvertSlice(itk::IOComponentEnum component, const void *source, PixelType *target, std::size_t count)
+{
+    switch (component) {
+    case itk::IOComponentEnum::UCHAR:  ConvertToPixel<unsigned char>(source, target, count); break;
+    case itk::IOComponentEnum::CHAR:   ConvertToPixel<signed char>(source, target, count); break;
+    case itk::IOComponentEnum::USHORT: ConvertToPixel<unsigned short>(source, target, count); break;
+    case itk::IOComponentEnum::UINT:   ConvertToPixel<unsigned int>(source, target, count); break;
+    case itk::IOComponentEnum::INT:    ConvertToPixel<int>(source, target, count); break;
+    case itk::IOComponentEnum::FLOAT:  ConvertToPixel<float>(source, target, count); break;
+    case itk::IOComponentEnum::DOUBLE: ConvertToPixel<double>(source, target, count); break;
+    default:
+        throw itk::ExceptionObject(__FILE__, __LINE__, "Unsupported DICOM pixel component type");
+    }
+}
+
+} // namespace
+
+ImageType::Pointer ParallelSeriesReader::ReadWithSeriesReader()
+{
+    using ReaderType = itk::ImageSeriesReader<ImageType>;
+    auto reader = ReaderType::New();
+    reader->SetImageIO(itk::GDCMImageIO::New());
+    reader->SetFileNames(m_fileNames);
+    m_cancel.Watch(reader);
+    reader->Update();
+    return reader->GetOutput();
+}
+
+ImageType::Pointer ParallelSeriesReader::Read()
+{
+    if (m_fileNames.empty()) {
+        throw itk::ExceptionObject(__FILE__, __LINE__, "No DICOM files to read");
+    }
+
+    // 首尾切片头信息决定体数据几何
+    auto firstIO = itk::GDCMImageIO::New();
+    firstIO->SetFileName(m_fileNames.front());
+    firstIO->ReadImageInformation();
+
+    // 多帧单文件、多分量或几何信息不完整的数据交给 ITK 原生读取
+    const bool fullGeometry = firstIO->GetNumberOfDimensions() >= 3;
+    const bool multiFrame = fullGeometry && firstIO->GetDimensions(2) > 1;
+    if (m_fileNames.size() == 1 || !fullGeometry || multiFrame
+        || firstIO->GetNumberOfComponents() != 1) {
+        return ReadWithSeriesReader();
+    }
+
+    const std::size_t nx = firstIO->GetDimensions(0);
+    const std::size_t ny = firstIO->GetDimensions(1);
+    const std::size_t nz = m_fileNames.size();
+
+    ImageType::PointType origin;
+    ImageType::SpacingType spacing;
+    ImageType::DirectionType direction;
+    direction.SetIdentity();
+    for (unsigned int i = 0; i < 3; ++i) {
+        origin[i] = firstIO->GetOrigin(i);
+    }
+    spacing[0] = firstIO->GetSpacing(0);
+    spacing[1] = firstIO->GetSpacing(1);
+
+    const std::vector<double> rowDir = firstIO->GetDirection(0);
+    const std::vector<double> colDir = firstIO->GetDirection(1);
+    for (unsigned int i = 0; i < 3; ++i) {
+        direction[i][0] = rowDir[i];
+        direction[i][1] = colDir[i];
+    }
+
+    // 与 ImageSeriesReader 相同：z 间距与方向取首尾切片原点连线
+    auto lastIO = itk::GDCMImageIO::New();
+    lastIO->SetFileName(m_fileNames.back());
+    lastIO->ReadImageInformation();
+    double delta[3];
+    double length = 0.0;
+    for (unsigned int i = 0; i < 3; ++i) {
+        delta[i] = lastIO->GetOrigin(i) - origin[i];
+        length += delta[i] * delta[i];
+    }
+    length = std::sqrt(length);
+    if (length > 0.0) {
+        spacing[2] = length / static_cast<double>(nz - 1);
+        for (unsigned int i = 0; i < 3; ++i) {
+            direction[i][2] = delta[i] / length;
+        }
+    } else {
+        spacing[2] = firstIO->GetSpacing(2) > 0.0 ? firstIO->GetSpacing(2) : 1.0;
+        direction[0][2] = rowDir[1] * colDir[2] - rowDir[2] * colDir[1];
+        direction[1][2] = rowDir[2] * colDir[0] - rowDir[0] * colDir[2];
+        direction[2][2] = rowDir[0] * colDir[1] - rowDir[1] * colDir[0];
+    }
+
+    auto image = ImageType::New();
+    ImageType::RegionType region;
+    ImageType::SizeType size;
+    size[0] = nx;
+    size[1] = ny;
+    size[2] = nz;
+    region.SetSize(size);
+    image->SetRegions(region);
+    image->SetOrigin(origin);
+    image->SetSpacing(spacing);
+    image->SetDirection(direction);
+    image->Allocate();
+    image->SetMetaDataDictionary(firstIO->GetMetaDataDictionary());
+
+    PixelType *buffer = image->GetBufferPointer();
+    const std::size_t slicePixels = nx * ny;
+    std::atomic<std::size_t> decoded{0};
+    const std::size_t reportStep = std::max<std::size_t>(1, nz / 50);
+
+    // 解码顺序：渐进读取时抽样切片排在前面，两段之间回调预览。
+    // stride 为 1 时抽样就是整个序列，预览与最终结果相同，不回调
+    std::size_t stride = 1;
+    if (m_preview && m_previewSpacing > spacing[2]) {
+        stride = static_cast<std::size_t>(std::lround(m_previewSpacing / spacing[2]));
+        stride = std::max<std::size_t>(1, std::min(stride, nz - 1));
+    }
+    const bool progressive = m_preview && stride > 1;
+    std::vector<std::size_t> order;
+    order.reserve(nz);
+    for (std::size_t z = 0; z < nz; z += stride) {
+        order.push_back(z);
+    }
+    // 最后一层总在抽样内，预览才能覆盖到序列末端
+    const bool lastExtra = (nz - 1) % stride != 0;
+    if (lastExtra) {
+        order.push_back(nz - 1);
+    }
+    const std::size_t previewCount = order.size();
+    for (std::size_t z = 0; z < nz; ++z) {
+        if (z % stride != 0 && !(lastExtra && z == nz - 1)) {
+            order.push_back(z);
+        }
+    }
+
+    auto decodeSlice = [&](std::size_t i) {
+        m_cancel.ThrowIfCancelled();
+
+        const std::size_t z = order[i];
+        auto io = itk::GDCMImageIO::New();
+        io->SetFileName(m_fileNames[z]);
+        io->ReadImageInformation();
+        if (io->GetDimensions(0) != nx || io->GetDimensions(1) != ny
+            || io->GetNumberOfComponents() != 1) {
+            throw itk::ExceptionObject(__FILE__, __LINE__,
+                                       "Slice size mismatch in series: " + m_fileNames[z]);
+        }
+
+        PixelType *target = buffer + z * slicePixels;
+        const auto component = io->GetComponentType();
+        if (component == itk::IOComponentEnum::SHORT) {
+            io->Read(target);
+        } else {
+            // 每个线程一份暂存缓冲，解码后转换到 short
+            thread_local std::vector<char> scratch;
+            scratch.resize(static_cast<std::size_t>(io->GetImageSizeInBytes()));
+            io->Read(scratch.data());
+            ConvertSlice(component, scratch.data(), target, slicePixels);
+        }
+
+        const std::size_t done = decoded.fetch_add(1) + 1;
+        if (m_progress && (done % reportStep == 0 || done == nz)) {
+            m_progress(static_cast<double>(done) / static_cast<double>(nz));
+        }
+    };
+
+    if (progressive) {
+        ParallelFor(previewCount, m_numberOfThreads, decodeSlice);
+        m_cancel.ThrowIfCancelled();
+        m_preview(image.GetPointer(), static_cast<unsigned int>(stride));
+        ParallelFor(nz - previewCount, m_numberOfThreads,
+                    [&](std::size_t i) { decodeSlice(previewCount + i); });
+    } else {
+        ParallelFor(nz, m_numberOfThreads, decodeSlice);
+    }
+    m_cancel.ThrowIfCancelled();
+
+    return image;
+}
+
+} // namespace dicomstitcher
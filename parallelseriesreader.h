@@ -0,0 +1,58 @@
+﻿#ifndef PARALLELSERIESREADER_H
+#define PARALLELSERIESREADER_H
+
+#include "pipelinecommon.h"
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace dicomstitcher {
+
+// 多线程 DICOM 序列读取：每个线程持有独立的 GDCMImageIO，
+// 切片并行解码后直接写入预分配体数据中对应的 z 位置。
+// 文件名须已按切片位置排序（GDCMSeriesFileNames 的输出即满足）。
+class ParallelSeriesReader
+{
+public:
+    // fraction ∈ [0, 1]，在工作线程中调用
+    using SliceProgressCallback = std::function<void(double fraction)>;
+
+    void SetFileNames(const std::vector<std::string> &fileNames) { m_fileNames = fileNames; }
+    const std::vector<std::string> &GetFileNames() const { return m_fileNames; }
+
+    // 0 表示使用 ITK 全局默认线程数
+    void SetNumberOfThreads(unsigned int threads) { m_numberOfThreads = threads; }
+    unsigned int GetNumberOfThreads() const { return m_numberOfThreads; }
+
+    void SetCancelToken(const CancelToken &cancel) { m_cancel = cancel; }
+    void SetProgressCallback(const SliceProgressCallback &progress) { m_progress = progress; }
+
+    // 渐进读取：先解码层距约为 sliceSpacing (mm) 的抽样切片（z = 0, stride, 2·stride, ... 以及最后一层），
+    // 在调用 Read() 的线程中以 (已分配的完整体数据, stride) 回调，返回后再解码其余切片。
+    // 回调时其余切片的像素尚未写入。原层距已不小于约 sliceSpacing（stride 为 1）或走原生 ITK 读取路径
+    // （多帧、多分量等）时不回调。
+    using PreviewCallback = std::function<void(const ImageType *image, unsigned int stride)>;
+    void SetPreview(double sliceSpacing, const PreviewCallback &callback)
+    {
+        m_previewSpacing = sliceSpacing;
+        m_preview = callback;
+    }
+
+    // 失败抛出 itk::ExceptionObject，取消抛出 itk::ProcessAborted
+    ImageType::Pointer Read();
+
+private:
+    ImageType::Pointer ReadWithSeriesReader();
+
+    std::vector<std::string> m_fileNames;
+    unsigned int m_numberOfThreads{0};
+    CancelToken m_cancel;
+    SliceProgressCallback m_progress;
+    double m_previewSpacing{0.0};
+    PreviewCallback m_preview;
+};
+
+} // namespace dicomstitcher
+
+#endif // PARALLELSERIESREADER_H
@@ -0,0 +1,250 @@
+﻿#ifndef PIPELINECOMMON_H
+#define PIPELINECOMMON_H
+
+#include "instrumentation.h"
+
+#include <itkImage.h>
+#include <itkMacro.h>
+#include <itkProcessObject.h>
+#include <itkEventObject.h>
+#include <itkMultiThreaderBase.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace dicomstitcher {
+
+using PixelType = short;
+constexpr unsigned int Dimension = 3;
+using ImageType = itk::Image<PixelType, Dimension>;
+
+// 进度回调：text 为 UTF-8 描述，progress 为 0-100（-1 表示不更新进度条）。
+// 可能在工作线程中被调用，调用方负责转发到 GUI 线程。
+using ProgressCallback = std::function<void(const std::string &text, int progress)>;
+
+// 取消标记：拷贝共享同一个标志位，GUI 线程置位，工作线程在阶段边界检查
+class CancelToken
+{
+public:
+    CancelToken()
+        : m_flag(std::make_shared<std::atomic<bool>>(false))
+    {
+    }
+
+    void Cancel() const { m_flag->store(true); }
+    bool IsCancelled() const { return m_flag->load(); }
+
+    // 已取消时抛出 itk::ProcessAborted，与 ITK 过滤器被中断时的行为一致
+    void ThrowIfCancelled() const
+    {
+        if (IsCancelled()) {
+            throw itk::ProcessAborted(__FILE__, __LINE__);
+        }
+    }
+
+    // 让 ITK 过滤器在 ProgressEvent 中响应取消（下一次 UpdateProgress 时抛出 ProcessAborted）
+    void Watch(itk::ProcessObject *filter) const
+    {
+        if (!filter) {
+            return;
+        }
+        auto flag = m_flag;
+        filter->AddObserver(itk::ProgressEvent(), [filter, flag](const itk::EventObject &) {
+            if (flag->load()) {
+                filter->AbortGenerateDataOn();
+            }
+        });
+    }
+
+private:
+    std::shared_ptr<std::atomic<bool>> m_flag;
+};
+
+inline void ReportProgress(const ProgressCallback &progress, const std::string &text, int value)
+{
+    if (progress) {
+        progress(text, value);
+    }
+}
+
+// 子阶段进度：fraction ∈ [0, 1]，可能在多个工作线程中并发调用
+using FractionCallback = std::function<void(double fraction)>;
+
+// 把 ITK 过滤器的 ProgressEvent（过滤器自身的 GetProgress()）转发为 fraction
+inline void ForwardProgress(itk::ProcessObject *filter, const FractionCallback &progress)
+{
+    if (!filter || !progress) {
+        return;
+    }
+    filter->AddObserver(itk::ProgressEvent(), [filter, progress](const itk::EventObject &) {
+        progress(filter->GetProgress());
+    });
+}
+
+// 父进度条上的一段 [begin, end]：子阶段的 fraction 线性映射到这一段，
+// 只在整数百分比增大时回调，避免多线程下大量重复或倒退的刷新排队到 GUI 线程
+class ProgressRange
+{
+public:
+    ProgressRange(const ProgressCallback &progress, std::string text, int begin, int end)
+        : m_progress(progress)
+        , m_text(std::move(text))
+        , m_begin(begin)
+        , m_end(end)
+        , m_last(std::make_shared<std::atomic<int>>(-1))
+    {
+    }
+
+    void Update(double fraction) const
+    {
+        if (!m_progress) {
+            return;
+        }
+        fraction = std::min(1.0, std::max(0.0, fraction));
+        const int value = m_begin + static_cast<int>(fraction * (m_end - m_begin));
+        int last = m_last->load();
+        while (value > last) {
+            if (m_last->compare_exchange_weak(last, value)) {
+                m_progress(m_text, value);
+                return;
+            }
+        }
+    }
+
+    // 拷贝共享同一个"已报告"计数，可交给工作线程
+    FractionCallback AsCallback() const
+    {
+        const ProgressRange range = *this;
+        return [range](double fraction) { range.Update(fraction); };
+    }
+
+    int Begin() const { return m_begin; }
+    int End() const { return m_end; }
+
+private:
+    ProgressCallback m_progress;
+    std::string m_text;
+    int m_begin;
+    int m_end;
+    std::shared_ptr<std::atomic<int>> m_last;
+};
+
+// 多阶段流水线的进度分配：每段宽度按 Profiler 中该阶段最近的平均耗时计算（无记录时用 defaultSeconds），
+// 进度条反映时间实际花在哪个阶段，而不是写死的百分比
+class ProgressPlan
+{
+public:
+    struct Stage
+    {
+        const char *name;
+        double defaultSeconds;
+    };
+
+    explicit ProgressPlan(const std::vector<Stage> &stages, int begin = 0, int end = 100)
+    {
+        std::vector<double> seconds;
+        double total = 0.0;
+        for (const Stage &stage : stages) {
+            seconds.push_back(std::max(1e-3, Profiler::Instance().AverageSeconds(stage.name, stage.defaultSeconds)));
+            total += seconds.back();
+        }
+        double accumulated = 0.0;
+        for (std::size_t i = 0; i < stages.size(); ++i) {
+            const int from = begin + static_cast<int>((end - begin) * accumulated / total);
+            accumulated += seconds[i];
+            const int to = begin + static_cast<int>((end - begin) * accumulated / total);
+            m_ranges.push_back(Entry{stages[i].name, from, to});
+        }
+    }
+
+    ProgressRange Range(const char *name, const ProgressCallback &progress, std::string text) const
+    {
+        for (const Entry &entry : m_ranges) {
+            if (std::string(entry.name) == name) {
+                return ProgressRange(progress, std::move(text), entry.begin, entry.end);
+            }
+        }
+        return ProgressRange(progress, std::move(text), -1, -1);
+    }
+
+private:
+    struct Entry
+    {
+        const char *name;
+        int begin;
+        int end;
+    };
+    std::vector<Entry> m_ranges;
+};
+
+// 在 ITK 线程池上并行执行 body(i)，i ∈ [0, count)。
+// numberOfThreads 为 0 时使用 ITK 全局默认线程数；任务按原子计数动态领取，
+// 适合单项耗时不均（如压缩切片解码）的场景。body 抛出的第一个异常会在返回前重新抛出。
+// 跟踪开启时每个工作单元记一条 "worker" 事件，以调用线程当前的 ScopedStage 命名。
+template <typename Body>
+void ParallelFor(std::size_t count, unsigned int numberOfThreads, Body &&body)
+{
+    if (count == 0) {
+        return;
+    }
+    auto threader = itk::MultiThreaderBase::New();
+    std::size_t workUnits = numberOfThreads > 0 ? numberOfThreads : threader->GetNumberOfWorkUnits();
+    workUnits = std::max<std::size_t>(1, std::min(workUnits, count));
+    if (workUnits == 1) {
+        for (std::size_t i = 0; i < count; ++i) {
+            body(i);
+        }
+        return;
+    }
+
+    std::atomic<std::size_t> next{0};
+    std::atomic<bool> failed{false};
+    std::exception_ptr firstError;
+    std::mutex errorMutex;
+
+    Profiler &profiler = Profiler::Instance();
+    const char *stage = ScopedStage::Current();
+    const bool traced = profiler.IsEnabled() && stage;
+
+    threader->SetNumberOfWorkUnits(static_cast<itk::ThreadIdType>(workUnits));
+    threader->ParallelizeArray(
+        0, static_cast<itk::SizeValueType>(workUnits),
+        [&](itk::SizeValueType) {
+            const auto begin = Profiler::Clock::now();
+            std::size_t items = 0;
+            try {
+                for (std::size_t i = next.fetch_add(1); i < count && !failed.load();
+                     i = next.fetch_add(1)) {
+                    body(i);
+                    ++items;
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(errorMutex);
+                if (!firstError) {
+                    firstError = std::current_exception();
+                }
+                failed.store(true);
+            }
+            if (traced) {
+                profiler.AddEvent("worker", stage, begin, Profiler::Clock::now(),
+                                  "\"items\":" + std::to_string(items));
+            }
+        },
+        nullptr);
+
+    if (firstError) {
+        std::rethrow_exception(firstError);
+    }
+}
+
+} // namespace dicomstitcher
+
+#endif // PIPELINECOMMON_H
@@ -0,0 +1,471 @@
+﻿#include "registration.h"
+#include "imagepreprocessing.h"
+#include "fastmutualinformation.h"
+#include "imagepyramid.h"
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1600)
+# pragma execution_character_set("utf-8")
+#endif
+
+#include <itkAffineTransform.h>
+#include <itkEuler3DTransform.h>
+#include <itkImageRegistrationMethodv4.h>
+#include <itkMattesMutualInformationImageToImageMetricv4.h>
+#include <itkMatrixOffsetTransformBase.h>
+#include <itkRegionOfInterestImageFilter.h>
+#include <itkRegistrationParameterScalesFromPhysicalShift.h>
+#include <itkRegularStepGradientDescentOptimizerv4.h>
+#include <itkTranslationTransform.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdio>
+#include <exception>
+#include <limits>
+
+namespace dicomstitcher {
+
+namespace {
+
+using PointType = ImageType::PointType;
+using TransformBaseType = itk::Transform<double, 3>;
+using EulerTransformType = itk::Euler3DTransform<double>;
+using AffineTransformType = itk::AffineTransform<double, 3>;
+
+// 一层金字塔上的一对图像
+struct LevelImages
+{
+    unsigned int factor;
+    ImageType::ConstPointer fixed;
+    ImageType::ConstPointer moving;
+};
+
+std::array<PointType, 8> RegionCorners(const ImageType *image, const ImageType::RegionType &region)
+{
+    std::array<PointType, 8> corners;
+    const auto start = region.GetIndex();
+    const auto size = region.GetSize();
+    for (unsigned int c = 0; c < 8; ++c) {
+        ImageType::IndexType index;
+        for (unsigned int i = 0; i < 3; ++i) {
+            index[i] = start[i] + (((c >> i) & 1u) ? static_cast<itk::IndexValueType>(size[i]) - 1 : 0);
+        }
+        image->TransformIndexToPhysicalPoint(index, corners[c]);
+    }
+    return corners;
+}
+
+// points 的包围盒外扩 margin 后在 image 中覆盖的索引区域（与最大区域求交）；为空时返回 false
+bool RegionCovering(const ImageType *image,
+                    const std::array<PointType, 8> &points,
+                    double margin,
+                    ImageType::RegionType &region)
+{
+    PointType lower;
+    PointType upper;
+    lower.Fill(std::numeric_limits<double>::max());
+    upper.Fill(std::numeric_limits<double>::lowest());
+    for (const PointType &p : points) {
+        for (unsigned int i = 0; i < 3; ++i) {
+            lower[i] = std::min(lower[i], p[i] - margin);
+            upper[i] = std::max(upper[i], p[i] + margin);
+        }
+    }
+
+    // 包围盒 8 个角点换算成连续索引后再取索引包围盒，适用于任意方向矩阵
+    const ImageType::RegionType largest = image->GetLargestPossibleRegion();
+    double lo[3] = {std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), std::numeric_limits<double>::max()};
+    double hi[3] = {std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest()};
+    for (unsigned int c = 0; c < 8; ++c) {
+        PointType p;
+        for (unsigned int i = 0; i < 3; ++i) {
+            p[i] = ((c >> i) & 1u) ? upper[i] : lower[i];
+        }
+        itk::ContinuousIndex<double, 3> ci;
+        image->TransformPhysicalPointToContinuousIndex(p, ci);
+        for (unsigned int i = 0; i < 3; ++i) {
+            lo[i] = std::min(lo[i], ci[i]);
+            hi[i] = std::max(hi[i], ci[i]);
+        }
+    }
+
+    ImageType::IndexType start;
+    ImageType::SizeType size;
+    for (unsigned int i = 0; i < 3; ++i) {
+        const auto first = std::max<itk::IndexValueType>(
+            largest.GetIndex(i), static_cast<itk::IndexValueType>(std::floor(lo[i])));
+        const auto last = std::min<itk::IndexValueType>(
+            largest.GetIndex(i) + static_cast<itk::IndexValueType>(largest.GetSize(i)) - 1,
+            static_cast<itk::IndexValueType>(std::ceil(hi[i])));
+        if (last < first) {
+            return false;
+        }
+        start[i] = first;
+        size[i] = static_cast<itk::SizeValueType>(last - first + 1);
+    }
+    region.SetIndex(start);
+    region.SetSize(size);
+    return true;
+}
+
+ImageType::Pointer ExtractRegion(const ImageType *image, const ImageType::RegionType &region, const CancelToken &cancel)
+{
+    using ExtractType = itk::RegionOfInterestImageFilter<ImageType, ImageType>;
+    auto extract = ExtractType::New();
+    extract->SetInput(image);
+    extract->SetRegionOfInterest(region);
+    cancel.Watch(extract);
+    extract->Update();
+    return extract->GetOutput();
+}
+
+// 一层金字塔：优先从共享金字塔截取覆盖 roi 的区域；金字塔没有该层级时对 roi 现场平滑降采样
+ImageType::ConstPointer MakeLevel(const ImagePyramid &pyramid,
+                                  const ImageType *roi,
+                                  bool cropped,
+                                  unsigned int factor,
+                                  const CancelToken &cancel)
+{
+    if (factor <= 1) {
+        return roi;
+    }
+    if (ImageType::ConstPointer level = pyramid.GetLevel(factor)) {
+        if (!cropped) {
+            return level;
+        }
+        ImageType::RegionType region;
+        if (RegionCovering(level.GetPointer(), RegionCorners(roi, roi->GetLargestPossibleRegion()), 0.0, region)) {
+            return ExtractRegion(level.GetPointer(), region, cancel).GetPointer();
+        }
+    }
+    return ReduceImage(roi, factor, cancel).GetPointer();
+}
+
+// 用初始变换设置刚体：旋转中心取 Fixed 重叠区中心，矩阵非正交时只保留中心处的位移
+void InitializeRigid(EulerTransformType *euler, const TransformBaseType *initial, const PointType &center)
+{
+    euler->SetIdentity();
+    euler->SetCenter(center);
+    if (!initial) {
+        return;
+    }
+    using TranslationType = itk::TranslationTransform<double, 3>;
+    using MatrixOffsetType = itk::MatrixOffsetTransformBase<double, 3, 3>;
+    if (const auto *translation = dynamic_cast<const TranslationType *>(initial)) {
+        euler->SetTranslation(translation->GetOffset());
+    } else if (const auto *matrixOffset = dynamic_cast<const MatrixOffsetType *>(initial)) {
+        try {
+            euler->SetMatrix(matrixOffset->GetMatrix(), 1e-4);
+        } catch (const itk::ExceptionObject &) {
+            euler->SetIdentity();
+            euler->SetCenter(center);
+        }
+        // 绕 center 旋转时 T(center) = center + translation
+        euler->SetTranslation(matrixOffset->TransformPoint(center) - center);
+    }
+}
+
+// 单阶段的逐层优化：transform 原位更新，上一层结果作为下一层初值
+template <typename TTransform>
+void RunStage(const char *stageName,
+              const std::vector<LevelImages> &levels,
+              TTransform *transform,
+              unsigned int iterationsPerLevel,
+              const RegistrationSettings &settings,
+              const CancelToken &cancel,
+              const ProgressCallback &progress,
+              int progressBegin,
+              int progressEnd,
+              RegistrationResult &result)
+{
+    using MetricType = itk::MattesMutualInformationImageToImageMetricv4<ImageType, ImageType>;
+    using OptimizerType = itk::RegularStepGradientDescentOptimizerv4<double>;
+    using RegistrationType = itk::ImageRegistrationMethodv4<ImageType, ImageType, TTransform>;
+    using ScalesType = itk::RegistrationParameterScalesFromPhysicalShift<MetricType>;
+
+    const int levelCount = static_cast<int>(levels.size());
+    for (int l = 0; l < levelCount; ++l) {
+        const LevelImages &level = levels[static_cast<std::size_t>(l)];
+        ScopedStage levelStage("registration.level");
+
+        auto metric = MetricType::New();
+        metric->SetNumberOfHistogramBins(settings.histogramBins);
+        metric->SetUseMovingImageGradientFilter(false);
+        metric->SetUseFixedImageGradientFilter(false);
+        if (settings.numberOfThreads > 0) {
+            metric->SetMaximumNumberOfWorkUnits(settings.numberOfThreads);
+        }
+
+        auto scales = ScalesType::New();
+        scales->SetMetric(metric);
+
+        auto optimizer = OptimizerType::New();
+        optimizer->SetLearningRate(settings.maximumStepLength * level.factor);
+        optimizer->SetMinimumStepLength(settings.minimumStepLength * level.factor);
+        optimizer->SetRelaxationFactor(0.5);
+        optimizer->SetGradientMagnitudeTolerance(1e-6);
+        optimizer->SetNumberOfIterations(iterationsPerLevel);
+        optimizer->SetReturnBestParametersAndValue(true);
+        optimizer->SetScalesEstimator(scales);
+        optimizer->SetDoEstimateLearningRateOnce(false);
+        optimizer->SetDoEstimateLearningRateAtEachIteration(false);
+
+        OptimizerType *observed = optimizer.GetPointer();
+        const int begin = progressBegin + (progressEnd - progressBegin) * l / levelCount;
+        const int end = progressBegin + (progressEnd - progressBegin) * (l + 1) / levelCount;
+        optimizer->AddObserver(itk::IterationEvent(), [&, observed, begin, end](const itk::EventObject &) {
+            if (cancel.IsCancelled()) {
+                observed->StopOptimization();
+                return;
+            }
+            const unsigned int iteration = observed->GetCurrentIteration() + 1;
+            char text[160];
+            std::snprintf(text, sizeof(text), "%s 第 %d/%d 层（%ux） 迭代 %u  MI %.4f",
+                          stageName, l + 1, levelCount, level.factor, iteration, observed->GetCurrentMetricValue());
+            ReportProgress(progress, text,
+                           begin + static_cast<int>((end - begin) * std::min(1.0, double(iteration) / iterationsPerLevel)));
+        });
+
+        auto registration = RegistrationType::New();
+        registration->SetFixedImage(level.fixed);
+        registration->SetMovingImage(level.moving);
+        registration->SetMetric(metric);
+        registration->SetOptimizer(optimizer);
+        registration->SetInitialTransform(transform);
+        registration->InPlaceOn();
+        if (settings.numberOfThreads > 0) {
+            registration->SetNumberOfWorkUnits(settings.numberOfThreads);
+        }
+
+        // 金字塔在外部构建，这里每次只跑一层
+        registration->SetNumberOfLevels(1);
+        typename RegistrationType::ShrinkFactorsArrayType shrink(1);
+        shrink[0] = 1;
+        registration->SetShrinkFactorsPerLevel(shrink);
+        typename RegistrationType::SmoothingSigmasArrayType sigmas(1);
+        sigmas[0] = 0.0;
+        registration->SetSmoothingSigmasPerLevel(sigmas);
+
+        const double voxels = static_cast<double>(level.fixed->GetLargestPossibleRegion().GetNumberOfPixels());
+        registration->SetMetricSamplingStrategy(RegistrationType::MetricSamplingStrategyEnum::RANDOM);
+        registration->SetMetricSamplingPercentage(std::min(1.0, static_cast<double>(settings.samplesPerLevel) / voxels));
+        registration->MetricSamplingReinitializeSeed(settings.randomSeed);
+
+        registration->Update();
+        cancel.ThrowIfCancelled();
+
+        result.iterations += optimizer->GetCurrentIteration();
+        result.metricValue = optimizer->GetValue();
+    }
+}
+
+// 刚体阶段的快速路径：FastMutualInformationMetric + 规则步长梯度下降。
+// 参数按"单位参数对应的物理位移"归一化：旋转乘以重叠区半径，平移为 1，步长单位统一为 mm
+void RunRigidStageFast(const std::vector<LevelImages> &levels,
+                       EulerTransformType *euler,
+                       const RegistrationSettings &settings,
+                       const CancelToken &cancel,
+                       const ProgressCallback &progress,
+                       int progressBegin,
+                       int progressEnd,
+                       RegistrationResult &result)
+{
+    const int levelCount = static_cast<int>(levels.size());
+    for (int l = 0; l < levelCount; ++l) {
+        const LevelImages &level = levels[static_cast<std::size_t>(l)];
+        ScopedStage levelStage("registration.level");
+
+        FastMutualInformationMetric metric;
+        metric.SetFixedImage(level.fixed);
+        metric.SetMovingImage(level.moving);
+        metric.SetNumberOfHistogramBins(settings.histogramBins);
+        metric.SetNumberOfSamples(settings.samplesPerLevel);
+        metric.SetRandomSeed(static_cast<unsigned int>(settings.randomSeed));
+        metric.SetNumberOfThreads(settings.numberOfThreads);
+        metric.Initialize();
+
+        const auto corners = RegionCorners(level.fixed, level.fixed->GetLargestPossibleRegion());
+        const double radius = std::max(1.0, 0.5 * corners[0].EuclideanDistanceTo(corners[7]));
+        const double weights[6] = {radius, radius, radius, 1.0, 1.0, 1.0};
+
+        double step = settings.maximumStepLength * level.factor;
+        const double minimumStep = settings.minimumStepLength * level.factor;
+        EulerTransformType::ParametersType parameters = euler->GetParameters();
+        EulerTransformType::ParametersType best = parameters;
+        double bestValue = std::numeric_limits<double>::max();
+        double previous[6] = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+        FastMutualInformationMetric::DerivativeType derivative;
+
+        const int begin = progressBegin + (progressEnd - progressBegin) * l / levelCount;
+        const int end = progressBegin + (progressEnd - progressBegin) * (l + 1) / levelCount;
+        unsigned int iteration = 0;
+        while (iteration < settings.rigidIterations && step >= minimumStep) {
+            cancel.ThrowIfCancelled();
+            euler->SetParameters(parameters);
+            const double value = metric.GetValueAndDerivative(euler, derivative);
+            ++iteration;
+            if (value < bestValue) {
+                bestValue = value;
+                best = parameters;
+            }
+
+            double scaled[6];
+            double norm = 0.0;
+            double dot = 0.0;
+            for (unsigned int i = 0; i < 6; ++i) {
+                scaled[i] = derivative[i] / weights[i];
+                norm += scaled[i] * scaled[i];
+                dot += scaled[i] * previous[i];
+            }
+            norm = std::sqrt(norm);
+            if (norm < 1e-12) {
+                break;
+            }
+            // 梯度方向反转说明越过了极小值，步长减半
+            if (dot < 0.0) {
+                step *= 0.5;
+            }
+            for (unsigned int i = 0; i < 6; ++i) {
+                parameters[i] -= step * scaled[i] / norm / weights[i];
+                previous[i] = scaled[i];
+            }
+
+            char text[160];
+            std::snprintf(text, sizeof(text), "刚体配准 第 %d/%d 层（%ux） 迭代 %u  MI %.4f",
+                          l + 1, levelCount, level.factor, iteration, value);
+            ReportProgress(progress, text,
+                           begin + static_cast<int>((end - begin) * std::min(1.0, double(iteration) / settings.rigidIterations)));
+        }
+
+        euler->SetParameters(best);
+        result.iterations += iteration;
+        result.metricValue = bestValue;
+    }
+}
+
+} // namespace
+
+RegistrationResult RegisterImages(const ImageType *fixed,
+                                  const ImageType *moving,
+                                  const itk::Transform<double, 3> *initial,
+                                  const RegistrationSettings &settings,
+                                  const CancelToken &cancel,
+                                  const ProgressCallback &progress)
+{
+    if (!fixed || !moving) {
+        return RegistrationResult();
+    }
+    return RegisterImages(*ImagePyramid::FromImage(fixed), *ImagePyramid::FromImage(moving),
+                          initial, settings, cancel, progress);
+}
+
+RegistrationResult RegisterImages(const ImagePyramid &fixedPyramid,
+                                  const ImagePyramid &movingPyramid,
+                                  const itk::Transform<double, 3> *initial,
+                                  const RegistrationSettings &settings,
+                                  const CancelToken &cancel,
+                                  const ProgressCallback &progress)
+{
+    RegistrationResult result;
+    if (!fixedPyramid.HasBase() || !movingPyramid.HasBase()) {
+        return result;
+    }
+    // 原图可能是分块体数据：重叠区用几何估计，只读出裁剪后的区域
+    const ImageType::ConstPointer fixedGeometry = fixedPyramid.GetBaseGeometry();
+    const ImageType::ConstPointer movingGeometry = movingPyramid.GetBaseGeometry();
+    const ImageType *fixed = fixedGeometry.GetPointer();
+    const ImageType *moving = movingGeometry.GetPointer();
+
+    ScopedStage stage("registration");
+    try {
+        // 只在初始变换估计出的重叠区（外扩 margin）内配准：两段扫描通常只有一小段重叠
+        ReportProgress(progress, "估计重叠区域...", 2);
+        ImageType::ConstPointer fixedRoi;
+        ImageType::ConstPointer movingRoi;
+        bool cropped = false;
+        TransformBaseType::ConstPointer inverse = initial ? initial->GetInverseTransform().GetPointer() : nullptr;
+        if (!initial || inverse) {
+            std::array<PointType, 8> movingInFixed = RegionCorners(moving, moving->GetLargestPossibleRegion());
+            if (inverse) {
+                for (PointType &p : movingInFixed) {
+                    p = inverse->TransformPoint(p);
+                }
+            }
+            ImageType::RegionType fixedRegion;
+            if (!RegionCovering(fixed, movingInFixed, settings.overlapMargin, fixedRegion)) {
+                result.status = RegistrationResult::Status::NoOverlap;
+                return result;
+            }
+            std::array<PointType, 8> fixedInMoving = RegionCorners(fixed, fixedRegion);
+            if (initial) {
+                for (PointType &p : fixedInMoving) {
+                    p = initial->TransformPoint(p);
+                }
+            }
+            ImageType::RegionType movingRegion;
+            if (!RegionCovering(moving, fixedInMoving, settings.overlapMargin, movingRegion)) {
+                result.status = RegistrationResult::Status::NoOverlap;
+                return result;
+            }
+            fixedRoi = fixedPyramid.ReadBaseRegion(fixedRegion, cancel);
+            movingRoi = movingPyramid.ReadBaseRegion(movingRegion, cancel);
+            cropped = true;
+        } else {
+            fixedRoi = fixedPyramid.GetLevel(1);
+            movingRoi = movingPyramid.GetLevel(1);
+        }
+        cancel.ThrowIfCancelled();
+
+        ReportProgress(progress, "准备图像金字塔...", 5);
+        std::vector<LevelImages> levels;
+        for (unsigned int factor : settings.shrinkFactors) {
+            levels.push_back(LevelImages{std::max(1u, factor),
+                                        MakeLevel(fixedPyramid, fixedRoi.GetPointer(), cropped, factor, cancel),
+                                        MakeLevel(movingPyramid, movingRoi.GetPointer(), cropped, factor, cancel)});
+            cancel.ThrowIfCancelled();
+        }
+        if (levels.empty()) {
+            levels.push_back(LevelImages{1, fixedRoi, movingRoi});
+        }
+
+        // 刚体阶段：旋转中心为重叠区中心
+        const bool affine = settings.mode == RegistrationMode::Affine;
+        const PointType center = ComputeCenter(fixedRoi.GetPointer());
+        auto euler = EulerTransformType::New();
+        InitializeRigid(euler, initial, center);
+        if (settings.fastRigidMetric) {
+            RunRigidStageFast(levels, euler.GetPointer(), settings, cancel, progress, 10, affine ? 55 : 100, result);
+        } else {
+            RunStage("刚体配准", levels, euler.GetPointer(), settings.rigidIterations,
+                     settings, cancel, progress, 10, affine ? 55 : 100, result);
+        }
+        result.transform = euler.GetPointer();
+
+        if (affine) {
+            auto affineTransform = AffineTransformType::New();
+            affineTransform->SetCenter(euler->GetCenter());
+            affineTransform->SetMatrix(euler->GetMatrix());
+            affineTransform->SetTranslation(euler->GetTranslation());
+            RunStage("仿射配准", levels, affineTransform.GetPointer(), settings.affineIterations,
+                     settings, cancel, progress, 55, 100, result);
+            result.transform = affineTransform.GetPointer();
+        }
+        result.status = RegistrationResult::Status::Ok;
+    } catch (const itk::ProcessAborted &) {
+        result = RegistrationResult();
+        result.status = RegistrationResult::Status::Cancelled;
+    } catch (const itk::ExceptionObject &ex) {
+        result = RegistrationResult();
+        result.status = cancel.IsCancelled() ? RegistrationResult::Status::Cancelled
+                                             : RegistrationResult::Status::Failed;
+        result.errorMessage = ex.what();
+    } catch (const std::exception &ex) {
+        result = RegistrationResult();
+        result.status = RegistrationResult::Status::Failed;
+        result.errorMessage = ex.what();
+    }
+    return result;
+}
+
+} // namespace dicomstitcher
@@ -0,0 +1,69 @@
+﻿#ifndef REGISTRATION_H
+#define REGISTRATION_H
+
+#include "pipelinecommon.h"
+#include "imagepyramid.h"
+
+#include <itkTransform.h>
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace dicomstitcher {
+
+enum class RegistrationMode
+{
+    Rigid,  // 6 自由度（Euler3D）
+    Affine  // 先刚体再 12 自由度仿射
+};
+
+struct RegistrationSettings
+{
+    RegistrationMode mode{RegistrationMode::Rigid};
+    std::vector<unsigned int> shrinkFactors{4, 2, 1}; // 由粗到细，每层先高斯平滑再降采样
+    unsigned int histogramBins{50};
+    std::size_t samplesPerLevel{100000};  // 每层 Mattes MI 随机采样点数上限
+    unsigned int rigidIterations{200};    // 每层
+    unsigned int affineIterations{100};   // 每层
+    double maximumStepLength{1.0};        // 最细层的初始步长（mm），粗层按降采样倍数放大
+    double minimumStepLength{0.01};
+    double overlapMargin{30.0};           // 按初始变换估计的重叠区外扩（mm），只在该区域内配准
+    unsigned int numberOfThreads{0};      // 0 表示 ITK 默认
+    int randomSeed{121212};               // 采样种子固定，结果可复现
+    bool fastRigidMetric{true};           // 刚体阶段使用 FastMutualInformationMetric，否则用 ITK Mattes v4
+};
+
+struct RegistrationResult
+{
+    enum class Status { Ok, NoOverlap, Failed, Cancelled };
+
+    Status status{Status::Failed};
+    std::string errorMessage;                     // ITK/标准异常原文（本地编码），可能为空
+    itk::Transform<double, 3>::Pointer transform; // Fixed 物理坐标 → Moving 物理坐标，可直接交给 ResampleToReference
+    double metricValue{0.0};                      // 最细层最终的 Mattes MI（越小越好）
+    unsigned int iterations{0};                   // 所有阶段与层级的迭代总数
+};
+
+// 多分辨率 Mattes MI 配准：刚体（可选再仿射），每层使用 ITK v4 配准框架，度量多线程计算。
+// initial 为 Fixed → Moving 的初始变换（如几何中心平移），可为空；只支持平移或矩阵+偏移类变换。
+// 设计为在工作线程中运行；不抛异常，错误与取消都通过 Status 返回。
+RegistrationResult RegisterImages(const ImageType *fixed,
+                                  const ImageType *moving,
+                                  const itk::Transform<double, 3> *initial,
+                                  const RegistrationSettings &settings,
+                                  const CancelToken &cancel,
+                                  const ProgressCallback &progress);
+
+// 同上，各层级优先取自加载时构建的共享金字塔（截取重叠区），金字塔缺少的层级才现场计算。
+// 原图为分块体数据时只读出重叠区（初始变换不可逆、无法估计重叠区时读出整个体数据）
+RegistrationResult RegisterImages(const ImagePyramid &fixed,
+                                  const ImagePyramid &moving,
+                                  const itk::Transform<double, 3> *initial,
+                                  const RegistrationSettings &settings,
+                                  const CancelToken &cancel,
+                                  const ProgressCallback &progress);
+
+} // namespace dicomstitcher
+
+#endif // REGISTRATION_H
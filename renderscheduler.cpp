@@ -0,0 +1,174 @@
+﻿#include "renderscheduler.h"
+
+#include "instrumentation.h"
+
+#include <QGuiApplication>
+#include <QScreen>
+#include <QStringList>
+
+#include <vtkCallbackCommand.h>
+#include <vtkCommand.h>
+#include <vtkRenderWindow.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+struct RenderScheduler::View
+{
+    vtkSmartPointer<vtkRenderWindow> window;
+    std::function<void()> render;
+    vtkSmartPointer<vtkCallbackCommand> callback;
+    unsigned long startTag{0};
+    unsigned long endTag{0};
+    bool dirty{false};
+    dicomstitcher::Profiler::Clock::time_point begin;
+    ViewStats stats;
+};
+
+RenderScheduler::RenderScheduler(QObject *parent)
+    : QObject(parent)
+{
+    if (const QScreen *screen = QGuiApplication::primaryScreen()) {
+        const double rate = screen->refreshRate();
+        if (rate >= 20.0) {
+            m_frameIntervalMs = std::max(1, static_cast<int>(std::floor(1000.0 / rate)));
+        }
+    }
+    m_timer.setSingleShot(true);
+    m_timer.setTimerType(Qt::PreciseTimer);
+    connect(&m_timer, &QTimer::timeout, this, &RenderScheduler::flush);
+    m_sinceFlush.start();
+}
+
+RenderScheduler::~RenderScheduler()
+{
+    for (const auto &view : m_views) {
+        view->window->RemoveObserver(view->startTag);
+        view->window->RemoveObserver(view->endTag);
+    }
+}
+
+int RenderScheduler::addView(const QString &name, vtkRenderWindow *window, std::function<void()> render)
+{
+    auto view = std::make_unique<View>();
+    view->window = window;
+    view->render = render ? std::move(render) : [window]() { window->Render(); };
+    view->stats.name = name;
+    view->callback = vtkSmartPointer<vtkCallbackCommand>::New();
+    view->callback->SetCallback(RenderScheduler::OnRenderEvent);
+    view->callback->SetClientData(view.get());
+    view->startTag = window->AddObserver(vtkCommand::StartEvent, view->callback);
+    view->endTag = window->AddObserver(vtkCommand::EndEvent, view->callback);
+    m_views.push_back(std::move(view));
+    return static_cast<int>(m_views.size()) - 1;
+}
+
+void RenderScheduler::requestRender(int view)
+{
+    if (view < 0 || view >= static_cast<int>(m_views.size())) {
+        return;
+    }
+    View &entry = *m_views[static_cast<std::size_t>(view)];
+    ++entry.stats.requests;
+    if (entry.dirty) {
+        ++entry.stats.coalesced;
+        return;
+    }
+    entry.dirty = true;
+    schedule();
+}
+
+void RenderScheduler::requestAll()
+{
+    for (int i = 0; i < static_cast<int>(m_views.size()); ++i) {
+        requestRender(i);
+    }
+}
+
+void RenderScheduler::schedule()
+{
+    if (m_timer.isActive() || m_flushing) {
+        return;
+    }
+    const qint64 elapsed = m_sinceFlush.elapsed();
+    m_timer.start(elapsed >= m_frameIntervalMs ? 0 : static_cast<int>(m_frameIntervalMs - elapsed));
+}
+
+void RenderScheduler::flush()
+{
+    if (m_flushing) {
+        return;
+    }
+    m_timer.stop();
+    m_flushing = true;
+    for (const auto &view : m_views) {
+        // 渲染期间新产生的请求留到下一帧
+        if (view->dirty) {
+            view->dirty = false;
+            view->render();
+        }
+    }
+    m_flushing = false;
+    m_sinceFlush.restart();
+    for (const auto &view : m_views) {
+        if (view->dirty) {
+            schedule();
+            break;
+        }
+    }
+}
+
+void RenderScheduler::OnRenderEvent(vtkObject *, unsigned long eventId, void *clientData, void *)
+{
+    auto *view = static_cast<View *>(clientData);
+    if (!view) {
+        return;
+    }
+    if (eventId == vtkCommand::StartEvent) {
+        // 此前的修改都会画进这一帧：无论渲染由谁发起，都满足已有的请求
+        view->dirty = false;
+        view->begin = dicomstitcher::Profiler::Clock::now();
+        return;
+    }
+    const auto end = dicomstitcher::Profiler::Clock::now();
+    const double ms = std::chrono::duration<double, std::milli>(end - view->begin).count();
+    ViewStats &stats = view->stats;
+    stats.lastMs = ms;
+    stats.averageMs = stats.frames == 0 ? ms : 0.8 * stats.averageMs + 0.2 * ms;
+    stats.maxMs = std::max(stats.maxMs, ms);
+    ++stats.frames;
+    dicomstitcher::Profiler &profiler = dicomstitcher::Profiler::Instance();
+    if (profiler.IsEnabled()) {
+        profiler.AddEvent("render", stats.name.toStdString(), view->begin, end);
+    }
+}
+
+std::vector<RenderScheduler::ViewStats> RenderScheduler::stats() const
+{
+    std::vector<ViewStats> result;
+    for (const auto &view : m_views) {
+        result.push_back(view->stats);
+    }
+    return result;
+}
+
+void RenderScheduler::resetStats()
+{
+    for (const auto &view : m_views) {
+        const QString name = view->stats.name;
+        view->stats = ViewStats();
+        view->stats.name = name;
+    }
+}
+
+QString RenderScheduler::summary() const
+{
+    QStringList parts;
+    for (const auto &view : m_views) {
+        if (view->stats.frames > 0) {
+            parts << QString("%1 %2 ms").arg(view->stats.name).arg(view->stats.averageMs, 0, 'f', 1);
+        }
+    }
+    return parts.join("  ");
+}
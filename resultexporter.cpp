@@ -0,0 +1,608 @@
+﻿#include "resultexporter.h"
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1600)
+# pragma execution_character_set("utf-8")
+#endif
+
+#include "itk_zlib.h"
+
+#include <itkGDCMImageIO.h>
+#include <itkImageFileWriter.h>
+#include <itkMetaDataObject.h>
+#include <itksys/SystemTools.hxx>
+
+#include <gdcmUIDGenerator.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+namespace dicomstitcher {
+
+namespace {
+
+ImageType::Pointer CopySlab(const ImageType *slab)
+{
+    auto copy = ImageType::New();
+    copy->CopyInformation(slab);
+    copy->SetRegions(slab->GetBufferedRegion());
+    copy->Allocate();
+    std::memcpy(copy->GetBufferPointer(), slab->GetBufferPointer(),
+                slab->GetBufferedRegion().GetNumberOfPixels() * sizeof(PixelType));
+    return copy;
+}
+
+bool IsLittleEndian()
+{
+    const std::uint16_t probe = 1;
+    unsigned char first = 0;
+    std::memcpy(&first, &probe, 1);
+    return first == 1;
+}
+
+// 单个 gzip 成员（deflate + gzip 头尾）；多个成员顺序拼接后仍是合法的 gzip 流
+std::vector<unsigned char> GzipMember(const unsigned char *data, std::size_t size, int level)
+{
+    z_stream stream;
+    std::memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw itk::ExceptionObject(__FILE__, __LINE__, "deflateInit2 failed");
+    }
+    std::vector<unsigned char> out(deflateBound(&stream, static_cast<uLong>(size)));
+    stream.next_in = const_cast<Bytef *>(data);
+    stream.avail_in = static_cast<uInt>(size);
+    stream.next_out = out.data();
+    stream.avail_out = static_cast<uInt>(out.size());
+    const int status = deflate(&stream, Z_FINISH);
+    const std::size_t written = stream.total_out;
+    deflateEnd(&stream);
+    if (status != Z_STREAM_END) {
+        throw itk::ExceptionObject(__FILE__, __LINE__, "gzip compression failed");
+    }
+    out.resize(written);
+    return out;
+}
+
+// 大缓冲区的顺序写文件；路径为 UTF-8
+class BufferedFile
+{
+public:
+    explicit BufferedFile(const std::string &path)
+        : m_path(path)
+    {
+        m_file = itksys::SystemTools::Fopen(path, "wb");
+        if (!m_file) {
+            throw itk::ExceptionObject(__FILE__, __LINE__, "Cannot open " + path + " for writing");
+        }
+        m_buffer.resize(std::size_t(4) << 20);
+        std::setvbuf(m_file, m_buffer.data(), _IOFBF, m_buffer.size());
+    }
+
+    ~BufferedFile()
+    {
+        if (m_file) {
+            std::fclose(m_file);
+        }
+    }
+
+    BufferedFile(const BufferedFile &) = delete;
+    BufferedFile &operator=(const BufferedFile &) = delete;
+
+    void Write(const void *data, std::size_t size)
+    {
+        if (size > 0 && std::fwrite(data, 1, size, m_file) != size) {
+            throw itk::ExceptionObject(__FILE__, __LINE__, "Write failed: " + m_path);
+        }
+    }
+
+    void Close()
+    {
+        std::FILE *file = m_file;
+        m_file = nullptr;
+        if (file && std::fclose(file) != 0) {
+            throw itk::ExceptionObject(__FILE__, __LINE__, "Write failed: " + m_path);
+        }
+    }
+
+private:
+    std::string m_path;
+    std::FILE *m_file{nullptr};
+    std::vector<char> m_buffer; // 须比 m_file 活得久（setvbuf）
+};
+
+// 按分块顺序写出：Begin 在拼接线程中、第一个分块之前调用；WriteSlab 在后台线程中按 z 顺序逐个调用
+class SlabWriter
+{
+public:
+    virtual ~SlabWriter() = default;
+    virtual void Begin(const ImageGrid &grid) = 0;
+    virtual void WriteSlab(const ImageType *slab, std::size_t zBegin) = 0;
+    virtual void Finish() = 0;
+    // 失败或取消时清理未写完的输出
+    virtual void Discard() = 0;
+};
+
+// 单文件体数据（NRRD / NIfTI）：头部 + 原始 short 数据，可选 gzip
+class VolumeFileWriter : public SlabWriter
+{
+public:
+    VolumeFileWriter(const ExportRequest &request, const CancelToken &cancel)
+        : m_request(request)
+        , m_cancel(cancel)
+    {
+    }
+
+    void Begin(const ImageGrid &grid) override
+    {
+        m_file = std::make_unique<BufferedFile>(m_request.path);
+        const std::string header = MakeHeader(grid);
+        if (m_request.compress && m_compressHeader) {
+            const auto member = GzipMember(reinterpret_cast<const unsigned char *>(header.data()),
+                                           header.size(), m_request.compressionLevel);
+            m_file->Write(member.data(), member.size());
+        } else {
+            m_file->Write(header.data(), header.size());
+        }
+    }
+
+    void WriteSlab(const ImageType *slab, std::size_t) override
+    {
+        m_cancel.ThrowIfCancelled();
+        const auto *bytes = reinterpret_cast<const unsigned char *>(slab->GetBufferPointer());
+        const std::size_t size = slab->GetBufferedRegion().GetNumberOfPixels() * sizeof(PixelType);
+        if (!m_request.compress) {
+            m_file->Write(bytes, size);
+            return;
+        }
+
+        // 分块并行压缩，再按顺序写出；内存中只保留当前分块的压缩结果
+        const std::size_t chunk = std::max<std::size_t>(std::size_t(64) << 10, m_request.chunkBytes);
+        const std::size_t count = (size + chunk - 1) / chunk;
+        std::vector<std::vector<unsigned char>> members(count);
+        ParallelFor(count, m_request.numberOfThreads, [&](std::size_t i) {
+            m_cancel.ThrowIfCancelled();
+            const std::size_t begin = i * chunk;
+            members[i] = GzipMember(bytes + begin, std::min(chunk, size - begin), m_request.compressionLevel);
+        });
+        for (const auto &member : members) {
+            m_file->Write(member.data(), member.size());
+        }
+    }
+
+    void Finish() override
+    {
+        if (m_file) {
+            m_file->Close();
+            m_file.reset();
+        }
+    }
+
+    void Discard() override
+    {
+        m_file.reset();
+        itksys::SystemTools::RemoveFile(m_request.path);
+    }
+
+protected:
+    virtual std::string MakeHeader(const ImageGrid &grid) = 0;
+
+    ExportRequest m_request;
+    CancelToken m_cancel;
+    bool m_compressHeader{false}; // NIfTI 的 .gz 是整个文件压缩，NRRD 只压缩数据
+    std::unique_ptr<BufferedFile> m_file;
+};
+
+// NRRD（数据内嵌），物理空间为 LPS，与 ITK 一致
+class NrrdWriter : public VolumeFileWriter
+{
+public:
+    using VolumeFileWriter::VolumeFileWriter;
+
+protected:
+    std::string MakeHeader(const ImageGrid &grid) override
+    {
+        std::ostringstream header;
+        header.precision(17);
+        header << "NRRD0004\n"
+               << "# Complete NRRD file format specification at:\n"
+               << "# http://teem.sourceforge.net/nrrd/format.html\n"
+               << "type: short\n"
+               << "dimension: 3\n"
+               << "space: left-posterior-superior\n"
+               << "sizes: " << grid.size[0] << ' ' << grid.size[1] << ' ' << grid.size[2] << '\n'
+               << "space directions:";
+        for (unsigned int i = 0; i < 3; ++i) {
+            header << " (" << grid.direction[0][i] * grid.spacing[i] << ',' << grid.direction[1][i] * grid.spacing[i]
+                   << ',' << grid.direction[2][i] * grid.spacing[i] << ')';
+        }
+        header << "\nkinds: domain domain domain\n"
+               << "endian: " << (IsLittleEndian() ? "little" : "big") << '\n'
+               << "encoding: " << (m_request.compress ? "gzip" : "raw") << '\n'
+               << "space origin: (" << grid.origin[0] << ',' << grid.origin[1] << ',' << grid.origin[2] << ")\n\n";
+        return header.str();
+    }
+};
+
+// NIfTI-1 单文件头（348 字节，字段自然对齐，无填充）
+#pragma pack(push, 1)
+struct Nifti1Header
+{
+    std::int32_t sizeof_hdr;
+    char data_type[10];
+    char db_name[18];
+    std::int32_t extents;
+    std::int16_t session_error;
+    char regular;
+    char dim_info;
+    std::int16_t dim[8];
+    float intent_p1;
+    float intent_p2;
+    float intent_p3;
+    std::int16_t intent_code;
+    std::int16_t datatype;
+    std::int16_t bitpix;
+    std::int16_t slice_start;
+    float pixdim[8];
+    float vox_offset;
+    float scl_slope;
+    float scl_inter;
+    std::int16_t slice_end;
+    char slice_code;
+    char xyzt_units;
+    float cal_max;
+    float cal_min;
+    float slice_duration;
+    float toffset;
+    std::int32_t glmax;
+    std::int32_t glmin;
+    char descrip[80];
+    char aux_file[24];
+    std::int16_t qform_code;
+    std::int16_t sform_code;
+    float quatern_b;
+    float quatern_c;
+    float quatern_d;
+    float qoffset_x;
+    float qoffset_y;
+    float qoffset_z;
+    float srow_x[4];
+    float srow_y[4];
+    float srow_z[4];
+    char intent_name[16];
+    char magic[4];
+};
+#pragma pack(pop)
+static_assert(sizeof(Nifti1Header) == 348, "NIfTI-1 header must be 348 bytes");
+
+// dim[] 为 int16：任一轴超过该尺寸时 NIfTI-1 无法表示，导出前检查
+constexpr std::size_t NiftiMaximumDimension = 32767;
+
+// NIfTI-1（.nii / .nii.gz）：只写 sform（RAS），qform_code 为 0
+class NiftiWriter : public VolumeFileWriter
+{
+public:
+    NiftiWriter(const ExportRequest &request, const CancelToken &cancel)
+        : VolumeFileWriter(request, cancel)
+    {
+        m_compressHeader = true;
+    }
+
+protected:
+    std::string MakeHeader(const ImageGrid &grid) override
+    {
+        Nifti1Header hdr;
+        std::memset(&hdr, 0, sizeof(hdr));
+        hdr.sizeof_hdr = 348;
+        hdr.regular = 'r';
+        hdr.dim[0] = 3;
+        for (unsigned int i = 0; i < 3; ++i) {
+            hdr.dim[i + 1] = static_cast<std::int16_t>(grid.size[i]);
+            hdr.pixdim[i + 1] = static_cast<float>(grid.spacing[i]);
+        }
+        hdr.dim[4] = hdr.dim[5] = hdr.dim[6] = hdr.dim[7] = 1;
+        hdr.pixdim[0] = 1.0f;
+        hdr.datatype = 4; // DT_INT16
+        hdr.bitpix = 16;
+        hdr.vox_offset = 352.0f;
+        hdr.scl_slope = 1.0f;
+        hdr.xyzt_units = 2; // NIFTI_UNITS_MM
+        std::strncpy(hdr.descrip, "DicomStitcher", sizeof(hdr.descrip) - 1);
+        hdr.sform_code = 1; // NIFTI_XFORM_SCANNER_ANAT
+
+        // LPS → RAS：前两行取反
+        float *rows[3] = {hdr.srow_x, hdr.srow_y, hdr.srow_z};
+        for (unsigned int r = 0; r < 3; ++r) {
+            const double sign = r < 2 ? -1.0 : 1.0;
+            for (unsigned int i = 0; i < 3; ++i) {
+                rows[r][i] = static_cast<float>(sign * grid.direction[r][i] * grid.spacing[i]);
+            }
+            rows[r][3] = static_cast<float>(sign * grid.origin[r]);
+        }
+        std::memcpy(hdr.magic, "n+1\0", 4);
+
+        std::string header(reinterpret_cast<const char *>(&hdr), sizeof(hdr));
+        header.append(4, '\0'); // 扩展标记：无扩展
+        return header;
+    }
+};
+
+std::string FormatTriplet(double a, double b, double c)
+{
+    char text[128];
+    std::snprintf(text, sizeof(text), "%.6f\\%.6f\\%.6f", a, b, c);
+    return text;
+}
+
+std::string FormatNumber(double v)
+{
+    char text[64];
+    std::snprintf(text, sizeof(text), "%.6f", v);
+    return text;
+}
+
+// DICOM 序列：每层一个文件，各层在线程池中并行编码写出
+class DicomSeriesWriter : public SlabWriter
+{
+public:
+    DicomSeriesWriter(const ExportRequest &request, const CancelToken &cancel)
+        : m_request(request)
+        , m_cancel(cancel)
+    {
+    }
+
+    void Begin(const ImageGrid &grid) override
+    {
+        if (!itksys::SystemTools::MakeDirectory(m_request.path)) {
+            throw itk::ExceptionObject(__FILE__, __LINE__, "Cannot create directory " + m_request.path);
+        }
+        m_grid = grid;
+
+        // 沿用患者 / 检查 / 参考坐标系，去掉文件元信息与由图像决定的像素模块标签
+        m_template = m_request.referenceDictionary;
+        std::vector<std::string> erase;
+        for (const std::string &key : m_template.GetKeys()) {
+            if (key.compare(0, 5, "0002|") == 0) {
+                erase.push_back(key);
+            }
+        }
+        for (const char *key : {"0028|0002", "0028|0004", "0028|0008", "0028|0010", "0028|0011", "0028|0100",
+                                "0028|0101", "0028|0102", "0028|0103", "0008|0018", "0020|0013", "0020|1041"}) {
+            erase.push_back(key);
+        }
+        for (const std::string &key : erase) {
+            m_template.Erase(key);
+        }
+
+        gdcm::UIDGenerator uid;
+        itk::EncapsulateMetaData<std::string>(m_template, "0020|000e", uid.Generate());
+        itk::EncapsulateMetaData<std::string>(m_template, "0008|0008", "DERIVED\\SECONDARY");
+        itk::EncapsulateMetaData<std::string>(m_template, "0008|103e", "Stitched");
+        itk::EncapsulateMetaData<std::string>(m_template, "0020|0011", "1000");
+        // 拼接结果已是 HU，写出时不再做 rescale
+        itk::EncapsulateMetaData<std::string>(m_template, "0028|1052", "0");
+        itk::EncapsulateMetaData<std::string>(m_template, "0028|1053", "1");
+        itk::EncapsulateMetaData<std::string>(m_template, "0028|1054", "HU");
+        itk::EncapsulateMetaData<std::string>(
+            m_template, "0020|0037",
+            FormatTriplet(grid.direction[0][0], grid.direction[1][0], grid.direction[2][0]) + "\\"
+                + FormatTriplet(grid.direction[0][1], grid.direction[1][1], grid.direction[2][1]));
+        itk::EncapsulateMetaData<std::string>(m_template, "0028|0030",
+                                              FormatNumber(grid.spacing[1]) + "\\" + FormatNumber(grid.spacing[0]));
+        itk::EncapsulateMetaData<std::string>(m_template, "0018|0050", FormatNumber(grid.spacing[2]));
+        itk::EncapsulateMetaData<std::string>(m_template, "0018|0088", FormatNumber(grid.spacing[2]));
+    }
+
+    void WriteSlab(const ImageType *slab, std::size_t zBegin) override
+    {
+        m_cancel.ThrowIfCancelled();
+        const auto size = slab->GetBufferedRegion().GetSize();
+        const std::size_t slicePixels = size[0] * size[1];
+
+        ParallelFor(size[2], m_request.numberOfThreads, [&](std::size_t z) {
+            m_cancel.ThrowIfCancelled();
+            const std::size_t index = zBegin + z;
+
+            // 单层图像直接引用分块缓冲区，不复制像素
+            auto slice = ImageType::New();
+            ImageType::RegionType region;
+            ImageType::SizeType sliceSize = size;
+            sliceSize[2] = 1;
+            region.SetSize(sliceSize);
+            slice->SetRegions(region);
+            slice->SetSpacing(m_grid.spacing);
+            slice->SetDirection(m_grid.direction);
+            ImageType::PointType origin;
+            ImageType::IndexType sliceIndex{{0, 0, static_cast<itk::IndexValueType>(z)}};
+            slab->TransformIndexToPhysicalPoint(sliceIndex, origin);
+            slice->SetOrigin(origin);
+            slice->GetPixelContainer()->SetImportPointer(
+                const_cast<PixelType *>(slab->GetBufferPointer()) + z * slicePixels, slicePixels, false);
+
+            itk::MetaDataDictionary dictionary = m_template;
+            gdcm::UIDGenerator uid;
+            itk::EncapsulateMetaData<std::string>(dictionary, "0008|0018", uid.Generate());
+            itk::EncapsulateMetaData<std::string>(dictionary, "0020|0013", std::to_string(index + 1));
+            itk::EncapsulateMetaData<std::string>(dictionary, "0020|0032", FormatTriplet(origin[0], origin[1], origin[2]));
+            itk::EncapsulateMetaData<std::string>(dictionary, "0020|1041", FormatNumber(origin[2]));
+            slice->SetMetaDataDictionary(dictionary);
+
+            auto io = itk::GDCMImageIO::New();
+            io->KeepOriginalUIDOn();
+            auto writer = itk::ImageFileWriter<ImageType>::New();
+            writer->SetImageIO(io);
+            writer->SetInput(slice);
+            char name[32];
+            std::snprintf(name, sizeof(name), "/IMG%05zu.dcm", index + 1);
+            writer->SetFileName(m_request.path + name);
+            writer->Update();
+        });
+    }
+
+    void Finish() override {}
+
+    // 已写出的层是完整的 DICOM 文件，保留在目录中
+    void Discard() override {}
+
+private:
+    ExportRequest m_request;
+    CancelToken m_cancel;
+    ImageGrid m_grid;
+    itk::MetaDataDictionary m_template;
+};
+
+std::unique_ptr<SlabWriter> MakeWriter(const ExportRequest &request, const CancelToken &cancel)
+{
+    switch (request.format) {
+    case ExportFormat::DicomSeries:
+        return std::make_unique<DicomSeriesWriter>(request, cancel);
+    case ExportFormat::Nrrd:
+        return std::make_unique<NrrdWriter>(request, cancel);
+    case ExportFormat::Nifti:
+        return std::make_unique<NiftiWriter>(request, cancel);
+    }
+    return nullptr;
+}
+
+// NIfTI 导出前按拼接网格检查尺寸，超出 NiftiMaximumDimension 时在 errorMessage 中说明并返回 false
+bool CheckNiftiGrid(const ImageType *fixed,
+                    const ImageType *moving,
+                    const itk::Transform<double, 3> *transform,
+                    const ExportRequest &request,
+                    ExportResult &result)
+{
+    if (request.format != ExportFormat::Nifti) {
+        return true;
+    }
+    ImageGrid grid;
+    if (ComputeStitchingGrid(fixed, moving, transform, request.stitching, grid)
+        && std::max({grid.size[0], grid.size[1], grid.size[2]}) > NiftiMaximumDimension) {
+        std::ostringstream message;
+        message << "NIfTI-1 cannot store more than " << NiftiMaximumDimension
+                << " voxels along an axis (stitched grid " << grid.size[0] << " x " << grid.size[1] << " x "
+                << grid.size[2] << "); export as NRRD or DICOM instead";
+        result.errorMessage = message.str();
+        return false;
+    }
+    return true;
+}
+
+// 拼接由 stitch 执行（连续或分块输入），这里把产出的分块交给后台写出
+ExportResult ExportSlabs(const std::function<StitchingResult(const SlabCallback &)> &stitch,
+                         const ExportRequest &request,
+                         const CancelToken &cancel,
+                         const ProgressCallback &progress)
+{
+    ExportResult result;
+    ScopedStage stage("export");
+    std::unique_ptr<SlabWriter> writer = MakeWriter(request, cancel);
+    bool begun = false;
+    std::future<void> pending;
+
+    // 拼接线程产出分块：等待上一块写完（保证顺序、限制内存）后复制本块并交给后台线程编码
+    auto sink = [&](const ImageType *slab, std::size_t zBegin, const ImageGrid &grid) {
+        if (!begun) {
+            writer->Begin(grid);
+            begun = true;
+        }
+        if (pending.valid()) {
+            pending.get();
+        }
+        ImageType::Pointer copy = CopySlab(slab);
+        SlabWriter *target = writer.get();
+        pending = std::async(std::launch::async, [target, copy, zBegin]() {
+            ScopedStage writeStage("export.write");
+            target->WriteSlab(copy.GetPointer(), zBegin);
+        });
+    };
+
+    StitchingResult stitched = stitch(sink);
+
+    try {
+        if (pending.valid()) {
+            pending.get();
+        }
+        if (stitched.status == StitchingResult::Status::Ok) {
+            ReportProgress(progress, "写出结果...", 100);
+            writer->Finish();
+        }
+    } catch (const itk::ProcessAborted &) {
+        stitched.status = StitchingResult::Status::Cancelled;
+    } catch (const itk::ExceptionObject &ex) {
+        stitched.status = cancel.IsCancelled() ? StitchingResult::Status::Cancelled
+                                               : StitchingResult::Status::Failed;
+        stitched.errorMessage = ex.what();
+    } catch (const std::exception &ex) {
+        stitched.status = StitchingResult::Status::Failed;
+        stitched.errorMessage = ex.what();
+    }
+
+    switch (stitched.status) {
+    case StitchingResult::Status::Ok:
+        result.status = ExportResult::Status::Ok;
+        result.slices = stitched.grid.size[2];
+        return result;
+    case StitchingResult::Status::NoInverse:
+        result.status = ExportResult::Status::NoInverse;
+        break;
+    case StitchingResult::Status::Cancelled:
+        result.status = ExportResult::Status::Cancelled;
+        break;
+    case StitchingResult::Status::Failed:
+        result.status = ExportResult::Status::Failed;
+        result.errorMessage = stitched.errorMessage;
+        break;
+    }
+    if (begun) {
+        writer->Discard();
+    }
+    return result;
+}
+
+} // namespace
+
+ExportResult ExportStitchedVolume(const ImageType *fixed,
+                                  const ImageType *moving,
+                                  const itk::Transform<double, 3> *transform,
+                                  const ExportRequest &request,
+                                  const CancelToken &cancel,
+                                  const ProgressCallback &progress)
+{
+    ExportResult result;
+    if (!fixed || !moving || request.path.empty() || !CheckNiftiGrid(fixed, moving, transform, request, result)) {
+        return result;
+    }
+    return ExportSlabs(
+        [&](const SlabCallback &sink) {
+            return StitchImages(fixed, moving, transform, request.stitching, sink, cancel, progress);
+        },
+        request, cancel, progress);
+}
+
+ExportResult ExportStitchedVolume(const BrickedVolume &fixed,
+                                  const BrickedVolume &moving,
+                                  const itk::Transform<double, 3> *transform,
+                                  const ExportRequest &request,
+                                  const CancelToken &cancel,
+                                  const ProgressCallback &progress)
+{
+    ExportResult result;
+    if (request.path.empty()
+        || !CheckNiftiGrid(NewGeometryImage(fixed.Grid()).GetPointer(), NewGeometryImage(moving.Grid()).GetPointer(),
+                           transform, request, result)) {
+        return result;
+    }
+    return ExportSlabs(
+        [&](const SlabCallback &sink) {
+            return StitchImages(fixed, moving, transform, request.stitching, sink, cancel, progress);
+        },
+        request, cancel, progress);
+}
+
+} // namespace dicomstitcher
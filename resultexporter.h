@@ -0,0 +1,66 @@
+﻿#ifndef RESULTEXPORTER_H
+#define RESULTEXPORTER_H
+
+#include "pipelinecommon.h"
+#include "stitchingengine.h"
+
+#include <itkMetaDataDictionary.h>
+#include <itkTransform.h>
+
+#include <cstddef>
+#include <string>
+
+namespace dicomstitcher {
+
+enum class ExportFormat
+{
+    DicomSeries, // 每层一个文件，path 为输出目录
+    Nrrd,        // 单文件 .nrrd（数据内嵌）
+    Nifti        // 单文件 .nii / .nii.gz
+};
+
+struct ExportRequest
+{
+    ExportFormat format{ExportFormat::DicomSeries};
+    std::string path;                          // UTF-8
+    itk::MetaDataDictionary referenceDictionary; // Fixed 首张切片的标签：患者 / 检查 / 参考坐标系沿用，序列与实例 UID 新生成
+    StitchingSettings stitching;
+    bool compress{true};                       // NRRD / NIfTI 使用 gzip（NIfTI 需以 .gz 结尾）
+    int compressionLevel{1};                   // zlib 压缩级别，1 最快
+    std::size_t chunkBytes{std::size_t(4) << 20}; // 并行压缩的分块大小
+    unsigned int numberOfThreads{0};           // 编码线程数，0 表示 ITK 默认
+};
+
+struct ExportResult
+{
+    enum class Status { Ok, NoInverse, Failed, Cancelled };
+
+    Status status{Status::Failed};
+    std::string errorMessage; // ITK/标准异常原文（本地编码）或尺寸超限说明，可能为空
+    std::size_t slices{0};    // 写出的层数
+};
+
+// 拼接并写出：StitchingEngine 逐块产出的同时，上一块在后台线程中并行编码 / 压缩并顺序写入，
+// 内存中最多保留两个分块的副本，不在内存中组装完整体数据或完整的编码结果。
+// - DICOM：各层并行编码为独立文件（GDCMImageIO），几何标签由输出网格给出；
+// - NRRD / NIfTI：各分块并行压缩为独立的 gzip 成员后按顺序追加（多成员 gzip 流与单个流等价）；
+//   NIfTI-1 每轴最多 32767 体素，输出网格超出时不开始拼接，直接返回 Failed。
+// 设计为在工作线程中运行；不抛异常，错误与取消都通过 Status 返回。
+ExportResult ExportStitchedVolume(const ImageType *fixed,
+                                  const ImageType *moving,
+                                  const itk::Transform<double, 3> *transform,
+                                  const ExportRequest &request,
+                                  const CancelToken &cancel,
+                                  const ProgressCallback &progress);
+
+// 同上，输入为分块体数据（见 StitchImages 的分块版本）
+ExportResult ExportStitchedVolume(const BrickedVolume &fixed,
+                                  const BrickedVolume &moving,
+                                  const itk::Transform<double, 3> *transform,
+                                  const ExportRequest &request,
+                                  const CancelToken &cancel,
+                                  const ProgressCallback &progress);
+
+} // namespace dicomstitcher
+
+#endif // RESULTEXPORTER_H
@@ -0,0 +1,223 @@
+﻿#include "separableresampler.h"
+
+#include "simdkernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace dicomstitcher {
+
+namespace {
+
+// 一维采样表：每个输出坐标对应的两个输入邻点与 Q14 权重
+struct AxisSamples
+{
+    std::vector<std::int64_t> i0;
+    std::vector<std::int64_t> i1;
+    std::vector<int> w0;
+    std::vector<int> w1;
+    std::vector<unsigned char> valid;
+};
+
+AxisSamples BuildAxisSamples(double offset, double scale, std::size_t outCount, std::size_t inCount)
+{
+    AxisSamples s;
+    s.i0.resize(outCount);
+    s.i1.resize(outCount);
+    s.w0.resize(outCount);
+    s.w1.resize(outCount);
+    s.valid.resize(outCount);
+    const std::int64_t last = static_cast<std::int64_t>(inCount) - 1;
+    for (std::size_t k = 0; k < outCount; ++k) {
+        const double c = offset + scale * static_cast<double>(k);
+        s.valid[k] = (c >= -0.5 && c < static_cast<double>(inCount) - 0.5) ? 1 : 0;
+        const double base = std::floor(c);
+        const double frac = c - base;
+        const auto b = static_cast<std::int64_t>(base);
+        s.i0[k] = std::clamp<std::int64_t>(b, 0, last);
+        s.i1[k] = std::clamp<std::int64_t>(b + 1, 0, last);
+        s.w1[k] = static_cast<int>(std::lround(frac * simd::kWeightOne));
+        s.w0[k] = simd::kWeightOne - s.w1[k];
+    }
+    return s;
+}
+
+inline short LerpQ14(short a, short b, int w0, int w1)
+{
+    const std::int32_t v = static_cast<std::int32_t>(a) * w0 + static_cast<std::int32_t>(b) * w1;
+    return static_cast<short>((v + (1 << (simd::kWeightBits - 1))) >> simd::kWeightBits);
+}
+
+} // namespace
+
+bool ComputeAxisAlignedMapping(const ImageType *image,
+                               const ImageGrid &grid,
+                               const itk::Transform<double, 3> *transform,
+                               AxisMapping &mapping)
+{
+    IndexAffine affine;
+    if (!ComputeIndexAffine(image, grid, transform, affine)) {
+        return false;
+    }
+    const auto &a = affine.a;
+    const auto &b = affine.b;
+
+    // 每一行只能有一个显著非零元，且各行对应不同的输出轴
+    bool used[3] = {false, false, false};
+    for (unsigned int j = 0; j < 3; ++j) {
+        unsigned int best = 0;
+        for (unsigned int i = 1; i < 3; ++i) {
+            if (std::abs(a[j][i]) > std::abs(a[j][best])) {
+                best = i;
+            }
+        }
+        const double dominant = std::abs(a[j][best]);
+        if (dominant == 0.0 || used[best]) {
+            return false;
+        }
+        for (unsigned int i = 0; i < 3; ++i) {
+            // 残差在整个输出范围内累计不足 1e-3 个体素才视为轴对齐
+            const double extent = static_cast<double>(grid.size[i]);
+            if (i != best && std::abs(a[j][i]) * extent > 1e-3) {
+                return false;
+            }
+        }
+        used[best] = true;
+        mapping.outputAxis[j] = best;
+        mapping.scale[j] = a[j][best];
+        mapping.offset[j] = b[j];
+    }
+    return true;
+}
+
+ImageType::Pointer ResampleSeparable(const ImageType *image,
+                                     const ImageGrid &grid,
+                                     const AxisMapping &mapping,
+                                     unsigned int numberOfThreads,
+                                     const CancelToken &cancel,
+                                     const FractionCallback &progress)
+{
+    auto output = ImageType::New();
+    ImageType::RegionType region;
+    region.SetSize(grid.size);
+    output->SetRegions(region);
+    output->SetOrigin(grid.origin);
+    output->SetSpacing(grid.spacing);
+    output->SetDirection(grid.direction);
+    output->Allocate();
+    ResampleSeparableInto(image, mapping, output.GetPointer(), numberOfThreads, cancel, progress);
+    return output;
+}
+
+void ResampleSeparableInto(const ImageType *image,
+                           const AxisMapping &mapping,
+                           ImageType *output,
+                           unsigned int numberOfThreads,
+                           const CancelToken &cancel,
+                           const FractionCallback &progress)
+{
+    const ImageGrid grid = GridOf(output);
+    const auto inSize = image->GetBufferedRegion().GetSize();
+    const std::size_t n0 = inSize[0];
+    const std::size_t n1 = inSize[1];
+    const std::size_t n2 = inSize[2];
+    const PixelType *input = image->GetBufferPointer();
+    PixelType *out = output->GetBufferPointer();
+
+    // m[j]：沿输入轴 j 方向的输出采样数
+    std::size_t m[3];
+    std::size_t dstStride[3];
+    const std::size_t outStride[3] = {1, grid.size[0], grid.size[0] * grid.size[1]};
+    for (unsigned int j = 0; j < 3; ++j) {
+        m[j] = grid.size[mapping.outputAxis[j]];
+        dstStride[j] = outStride[mapping.outputAxis[j]];
+    }
+    const bool identityLayout = mapping.outputAxis[0] == 0 && mapping.outputAxis[1] == 1
+                             && mapping.outputAxis[2] == 2;
+
+    const AxisSamples sx = BuildAxisSamples(mapping.offset[0], mapping.scale[0], m[0], n0);
+    const AxisSamples sy = BuildAxisSamples(mapping.offset[1], mapping.scale[1], m[1], n1);
+    const AxisSamples sz = BuildAxisSamples(mapping.offset[2], mapping.scale[2], m[2], n2);
+
+    const std::size_t planeSize = m[0] * m[1];
+    constexpr std::size_t slabDepth = 8;
+    const std::size_t slabCount = (m[2] + slabDepth - 1) / slabDepth;
+    std::atomic<std::size_t> slabsDone{0};
+
+    ParallelFor(slabCount, numberOfThreads, [&](std::size_t slab) {
+        cancel.ThrowIfCancelled();
+
+        std::vector<PixelType> rows(m[0] * n1);
+        std::vector<PixelType> planes[2] = {std::vector<PixelType>(planeSize),
+                                           std::vector<PixelType>(planeSize)};
+        std::int64_t planeTag[2] = {-1, -1};
+        std::vector<PixelType> blended(identityLayout ? 0 : planeSize);
+
+        // 输入切片 zi 经 x、y 两遍插值得到 m0 × m1 平面
+        auto computePlane = [&](std::int64_t zi, PixelType *dst) {
+            const PixelType *src = input + static_cast<std::size_t>(zi) * n0 * n1;
+            for (std::size_t y = 0; y < n1; ++y) {
+                const PixelType *srcRow = src + y * n0;
+                PixelType *row = rows.data() + y * m[0];
+                for (std::size_t x = 0; x < m[0]; ++x) {
+                    row[x] = sx.valid[x] ? LerpQ14(srcRow[sx.i0[x]], srcRow[sx.i1[x]], sx.w0[x], sx.w1[x])
+                                         : PixelType(0);
+                }
+            }
+            for (std::size_t y = 0; y < m[1]; ++y) {
+                PixelType *dstRow = dst + y * m[0];
+                if (!sy.valid[y]) {
+                    std::memset(dstRow, 0, m[0] * sizeof(PixelType));
+                    continue;
+                }
+                simd::LerpRowsQ14(rows.data() + static_cast<std::size_t>(sy.i0[y]) * m[0],
+                                  rows.data() + static_cast<std::size_t>(sy.i1[y]) * m[0],
+                                  dstRow, m[0], sy.w0[y], sy.w1[y]);
+            }
+        };
+        // 两个平面槽位；z 单调推进时相邻输出平面可复用已插值的输入平面
+        auto ensurePlane = [&](std::int64_t zi, std::int64_t keep) -> const PixelType * {
+            for (int s = 0; s < 2; ++s) {
+                if (planeTag[s] == zi) {
+                    return planes[s].data();
+                }
+            }
+            const int s = planeTag[0] == keep ? 1 : 0;
+            computePlane(zi, planes[s].data());
+            planeTag[s] = zi;
+            return planes[s].data();
+        };
+
+        const std::size_t zBegin = slab * slabDepth;
+        const std::size_t zEnd = std::min(m[2], zBegin + slabDepth);
+        for (std::size_t z = zBegin; z < zEnd; ++z) {
+            PixelType *target = identityLayout ? out + z * planeSize : blended.data();
+            if (!sz.valid[z]) {
+                std::memset(target, 0, planeSize * sizeof(PixelType));
+            } else {
+                const PixelType *p0 = ensurePlane(sz.i0[z], sz.i1[z]);
+                const PixelType *p1 = ensurePlane(sz.i1[z], sz.i0[z]);
+                simd::LerpRowsQ14(p0, p1, target, planeSize, sz.w0[z], sz.w1[z]);
+            }
+            if (!identityLayout) {
+                // 输出轴顺序与输入不同：按步长散射写回
+                for (std::size_t y = 0; y < m[1]; ++y) {
+                    const PixelType *srcRow = blended.data() + y * m[0];
+                    PixelType *dst = out + y * dstStride[1] + z * dstStride[2];
+                    for (std::size_t x = 0; x < m[0]; ++x) {
+                        dst[x * dstStride[0]] = srcRow[x];
+                    }
+                }
+            }
+        }
+        if (progress) {
+            progress(static_cast<double>(slabsDone.fetch_add(1) + 1) / static_cast<double>(slabCount));
+        }
+    });
+    cancel.ThrowIfCancelled();
+}
+
+} // namespace dicomstitcher
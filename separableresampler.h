@@ -0,0 +1,51 @@
+﻿#ifndef SEPARABLERESAMPLER_H
+#define SEPARABLERESAMPLER_H
+
+#include "pipelinecommon.h"
+#include "imagepreprocessing.h"
+
+#include <itkTransform.h>
+
+namespace dicomstitcher {
+
+// 输出网格索引到输入连续索引的轴对齐映射：
+// 输入轴 j 的连续索引 = offset[j] + scale[j] * k[outputAxis[j]]（scale 可为负，即翻转）
+struct AxisMapping
+{
+    unsigned int outputAxis[3]{0, 1, 2};
+    double scale[3]{1.0, 1.0, 1.0};
+    double offset[3]{0.0, 0.0, 0.0};
+};
+
+// 若 grid → image 的映射（含 transform，可为空）只是轴置换 + 缩放 + 平移则返回 true。
+// 支持空变换、TranslationTransform 与 MatrixOffsetTransformBase（矩阵须为置换阵）；
+// 含一般旋转时返回 false，由调用方回退到 itk::ResampleImageFilter。
+bool ComputeAxisAlignedMapping(const ImageType *image,
+                               const ImageGrid &grid,
+                               const itk::Transform<double, 3> *transform,
+                               AxisMapping &mapping);
+
+// 可分离三线性重采样：依次沿输入 x / y / z 做一维线性插值，y、z 两遍为整行向量化混合，
+// 输出按 z 方向分块并行。边界处理与 LinearInterpolateImageFunction 一致
+// （连续索引在 [-0.5, n-0.5) 内有效并夹取邻点，之外填 0）；
+// 每遍结果以 short 保存并四舍五入，与通用滤波器（截断取整）相比相差不超过 2。
+// progress 按已完成的 z 分块报告。
+ImageType::Pointer ResampleSeparable(const ImageType *image,
+                                     const ImageGrid &grid,
+                                     const AxisMapping &mapping,
+                                     unsigned int numberOfThreads = 0,
+                                     const CancelToken &cancel = CancelToken(),
+                                     const FractionCallback &progress = FractionCallback());
+
+// 同上，但写入已分配的 output（网格取 output 的几何），用于原位细化正在显示的体数据：
+// 每个 z 分块写完后才报告进度，报告之前的分块保持 output 原有内容。
+void ResampleSeparableInto(const ImageType *image,
+                           const AxisMapping &mapping,
+                           ImageType *output,
+                           unsigned int numberOfThreads = 0,
+                           const CancelToken &cancel = CancelToken(),
+                           const FractionCallback &progress = FractionCallback());
+
+} // namespace dicomstitcher
+
+#endif // SEPARABLERESAMPLER_H
@@ -0,0 +1,236 @@
+﻿#include "seriesloader.h"
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1600)
+# pragma execution_character_set("utf-8")
+#endif
+
+#include "imagepreprocessing.h"
+#include "itkvtkbridge.h"
+#include "parallelseriesreader.h"
+#include "separableresampler.h"
+
+#include <algorithm>
+#include <cstring>
+#include <exception>
+
+namespace dicomstitcher {
+
+namespace {
+
+// image 中 z = 0, stride, 2·stride, ... 的切片拷贝为独立图像，层距为原来的 stride 倍。
+// 最后一层不在步长上时，多加一层放在下一个步长位置、内容取最后一层（钳位外推），
+// 使子集的 z 范围覆盖整个序列，插值到最终网格时末端几层不会落在子集之外变成 0
+ImageType::Pointer ExtractSliceSubset(const ImageType *image, unsigned int stride)
+{
+    const auto size = image->GetBufferedRegion().GetSize();
+    const std::size_t slicePixels = size[0] * size[1];
+    ImageType::SizeType subsetSize = size;
+    subsetSize[2] = (size[2] - 1 + stride - 1) / stride + 1;
+    ImageType::SpacingType spacing = image->GetSpacing();
+    spacing[2] *= stride;
+
+    auto subset = ImageType::New();
+    ImageType::RegionType region;
+    region.SetSize(subsetSize);
+    subset->SetRegions(region);
+    subset->SetOrigin(image->GetOrigin());
+    subset->SetSpacing(spacing);
+    subset->SetDirection(image->GetDirection());
+    subset->Allocate();
+    const PixelType *source = image->GetBufferPointer();
+    PixelType *target = subset->GetBufferPointer();
+    for (std::size_t z = 0; z < subsetSize[2]; ++z) {
+        const std::size_t sourceZ = std::min<std::size_t>(z * stride, size[2] - 1);
+        std::memcpy(target + z * slicePixels, source + sourceZ * slicePixels, slicePixels * sizeof(PixelType));
+    }
+    return subset;
+}
+
+} // namespace
+
+SeriesLoadResult LoadSeries(const SeriesLoadRequest &request,
+                            const CancelToken &cancel,
+                            const ProgressCallback &progress)
+{
+    SeriesLoadResult result;
+    const std::string &label = request.label;
+
+    // 首次加载使用经验比例，之后按本进程内各阶段最近的实际耗时分配
+    const ProgressPlan plan({{"load.scan", 0.3},
+                             {"load.decode", 2.5},
+                             {"load.resample", 1.0},
+                             {"load.pyramid", 0.6},
+                             {"load.vtk", request.generateVtkImage && !request.brickPool ? 0.05 : 0.0}});
+
+    try {
+        std::vector<std::string> files;
+        std::string seriesUID = request.seriesUID;
+        {
+            ScopedStage stage("load.scan", &result.stages);
+            const ProgressRange range = plan.Range("load.scan", progress, "扫描 " + label + " 序列...");
+            range.Update(0.0);
+            files = request.fileNames;
+            if (files.empty()) {
+                DicomIndexResult index = ScanDicomDirectory(request.directory, request.index, cancel,
+                                                            range.AsCallback());
+                if (index.status == DicomIndexResult::Status::Cancelled) {
+                    throw itk::ProcessAborted(__FILE__, __LINE__);
+                }
+                if (index.status == DicomIndexResult::Status::Failed) {
+                    throw itk::ExceptionObject(__FILE__, __LINE__, index.errorMessage.c_str());
+                }
+                // 序列按层数降序排列：未指定时取最完整的一组，而不是目录中碰巧排在最前的
+                for (const DicomSeriesInfo &series : index.series) {
+                    if (request.seriesUID.empty() || series.seriesUID == request.seriesUID) {
+                        files = series.files;
+                        seriesUID = series.seriesUID;
+                        break;
+                    }
+                }
+            }
+            if (files.empty()) {
+                result.status = SeriesLoadResult::Status::NoSeries;
+                return result;
+            }
+        }
+        cancel.ThrowIfCancelled();
+
+        // 命中预处理缓存时直接映射重采样后的体数据与金字塔，跳过解码、重采样与降采样
+        const std::string cacheKey =
+            MakeVolumeCacheKey(seriesUID, files, request.spacing, request.pyramidFactors);
+        bool cached = false;
+        if (request.volumeCache.enabled && !cacheKey.empty()) {
+            ScopedStage stage("load.cache", &result.stages);
+            CachedVolume volume;
+            cached = LoadCachedVolume(request.volumeCache, cacheKey, volume);
+            if (cached) {
+                result.image = volume.image;
+                result.pyramid = volume.pyramid;
+                result.dictionary = volume.dictionary;
+            }
+        }
+
+        if (!cached) {
+            ImageType::Pointer decoded;
+            SeriesPreview preview;
+            {
+                ScopedStage stage("load.decode", &result.stages);
+                const ProgressRange range = plan.Range("load.decode", progress, "读取 " + label + " 序列...");
+                range.Update(0.0);
+                ParallelSeriesReader reader;
+                reader.SetFileNames(files);
+                reader.SetNumberOfThreads(request.readerThreads);
+                reader.SetCancelToken(cancel);
+                reader.SetProgressCallback(range.AsCallback());
+                if (request.preview && request.generateVtkImage) {
+                    // 抽样切片解码完成：直接插值到最终网格，之后的重采样在这份体数据上原位进行
+                    reader.SetPreview(request.previewSpacing, [&](const ImageType *partial, unsigned int stride) {
+                        ScopedStage previewStage("load.preview", &result.stages);
+                        ImageType::Pointer subset = ExtractSliceSubset(partial, stride);
+                        ImageType::Pointer image = ResampleToGrid(subset.GetPointer(),
+                                                                  ComputeOrientedGrid(partial, request.spacing),
+                                                                  nullptr, cancel);
+                        vtkSmartPointer<vtkImageData> vtkImage = ItkToVtkImage(image.GetPointer());
+                        if (vtkImage) {
+                            preview.image = image;
+                            preview.vtkImage = vtkImage;
+                            request.preview(preview);
+                        }
+                    });
+                }
+                decoded = reader.Read();
+            }
+            cancel.ThrowIfCancelled();
+
+            {
+                ScopedStage stage("load.resample", &result.stages);
+                const ProgressRange range =
+                    plan.Range("load.resample", progress, "方向标准化与重采样 (" + label + ") ...");
+                range.Update(0.0);
+                result.dictionary = decoded->GetMetaDataDictionary();
+                AxisMapping mapping;
+                if (preview.image
+                    && ComputeAxisAlignedMapping(decoded.GetPointer(), GridOf(preview.image.GetPointer()), nullptr,
+                                                 mapping)) {
+                    // 每写完一个 z 分块就通知显示刷新；斜切数据（无轴对齐映射）不原位细化，完成后整体替换
+                    const FractionCallback rangeProgress = range.AsCallback();
+                    ResampleSeparableInto(decoded.GetPointer(), mapping, preview.image.GetPointer(), 0, cancel,
+                                          [&](double fraction) {
+                                              rangeProgress(fraction);
+                                              SeriesPreview refined = preview;
+                                              refined.refined = fraction;
+                                              request.preview(refined);
+                                          });
+                    result.image = preview.image;
+                } else {
+                    result.image = OrientAndResample(decoded.GetPointer(), request.spacing, cancel,
+                                                     range.AsCallback());
+                }
+                decoded = nullptr;
+            }
+            cancel.ThrowIfCancelled();
+
+            {
+                ScopedStage stage("load.pyramid", &result.stages);
+                const ProgressRange range = plan.Range("load.pyramid", progress, "构建图像金字塔 (" + label + ") ...");
+                range.Update(0.0);
+                result.pyramid = ImagePyramid::Build(result.image.GetPointer(), request.pyramidFactors, 0, cancel,
+                                                     range.AsCallback());
+            }
+            cancel.ThrowIfCancelled();
+
+            if (request.volumeCache.enabled && !cacheKey.empty()) {
+                ScopedStage stage("load.cache_store", &result.stages);
+                ReportProgress(progress, "写入预处理缓存 (" + label + ") ...", -1);
+                CachedVolume stored;
+                if (StoreCachedVolume(request.volumeCache, cacheKey, result.image.GetPointer(),
+                                      result.pyramid.get(), result.dictionary)
+                    && LoadCachedVolume(request.volumeCache, cacheKey, stored)) {
+                    // 刚计算的匿名内存换成文件映射：内容相同，但可由系统按需换出
+                    result.image = stored.image;
+                    result.pyramid = stored.pyramid;
+                }
+            }
+        }
+
+        if (request.brickPool) {
+            ScopedStage stage("load.bricks", &result.stages);
+            ReportProgress(progress, "写入分块存储 (" + label + ") ...", -1);
+            result.bricks = BrickedVolume::FromImage(result.image.GetPointer(), request.brickPool, cancel,
+                                                     request.readerThreads);
+            // 之后只通过分块访问：金字塔的原图换成分块，连续的体数据不再返回，随本函数结束释放
+            result.pyramid = ImagePyramid::WithBrickedBase(result.bricks, result.pyramid.get());
+            result.image = nullptr;
+        }
+        cancel.ThrowIfCancelled();
+
+        if (request.generateVtkImage && !result.bricks) {
+            ScopedStage stage("load.vtk", &result.stages);
+            plan.Range("load.vtk", progress, "生成显示数据 (" + label + ") ...").Update(0.0);
+            result.vtkImage = ItkToVtkImage(result.image.GetPointer());
+            if (!result.vtkImage) {
+                // errorMessage 留空，由调用方给出"转换图像失败"提示
+                result.status = SeriesLoadResult::Status::Failed;
+                result.image = nullptr;
+                result.pyramid = nullptr;
+                return result;
+            }
+        }
+        result.status = SeriesLoadResult::Status::Ok;
+    } catch (const itk::ProcessAborted &) {
+        result = SeriesLoadResult();
+        result.status = SeriesLoadResult::Status::Cancelled;
+    } catch (const itk::ExceptionObject &ex) {
+        result = SeriesLoadResult();
+        result.status = cancel.IsCancelled() ? SeriesLoadResult::Status::Cancelled
+                                             : SeriesLoadResult::Status::Failed;
+        result.errorMessage = ex.what();
+    } catch (const std::exception &ex) {
+        result = SeriesLoadResult();
+        result.status = SeriesLoadResult::Status::Failed;
+        result.errorMessage = ex.what();
+    }
+    return result;
+}
+
+} // namespace dicomstitcher
@@ -0,0 +1,79 @@
+﻿#ifndef SERIESLOADER_H
+#define SERIESLOADER_H
+
+#include "pipelinecommon.h"
+#include "imagepreprocessing.h"
+#include "dicomindex.h"
+#include "imagepyramid.h"
+#include "volumecache.h"
+#include "brickedvolume.h"
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+
+#include <itkMetaDataDictionary.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace dicomstitcher {
+
+// 渐进加载的显示数据：位于最终网格上，先由抽层解码的切片插值得到，重采样时按 z 分块原位改写为全分辨率结果
+struct SeriesPreview
+{
+    ImageType::Pointer image;
+    vtkSmartPointer<vtkImageData> vtkImage; // 与 image 共用像素缓冲
+    double refined{0.0};                    // 已写入全分辨率结果的比例：0 为刚生成的预览，1 为细化完成
+};
+
+// 在工作线程中调用，细化阶段可能由多个线程并发调用；回调返回后 image 的像素仍会被改写
+using SeriesPreviewCallback = std::function<void(const SeriesPreview &preview)>;
+
+struct SeriesLoadRequest
+{
+    std::string directory;
+    std::vector<std::string> fileNames; // 已选定序列的文件（按层位置排序，如 DicomSeriesInfo::files），非空时跳过目录扫描
+    std::string seriesUID;        // 扫描目录时选择的序列，为空时取层数最多的序列
+    DicomIndexSettings index;     // 目录扫描的头信息缓存设置
+    std::string label;            // 用于进度文字，如 "Fixed" / "Moving"
+    SpacingPolicy spacing;
+    unsigned int readerThreads{0}; // 切片并行解码线程数，0 表示 ITK 默认
+    std::vector<unsigned int> pyramidFactors{2, 4, 8}; // 为空时不构建金字塔
+    bool generateVtkImage{true};   // 无界面的批处理不需要显示数据；使用 brickPool 时不生成（viewer 按切片读取分块）
+    VolumeCacheSettings volumeCache; // 预处理结果（重采样后的体数据 + 金字塔）的磁盘缓存
+    std::shared_ptr<BrickPool> brickPool; // 非空时结果只以分块体数据返回，显示与处理都通过它读取
+    SeriesPreviewCallback preview; // 非空时渐进加载（需 generateVtkImage；预处理缓存命中或原层距接近 previewSpacing 时不回调）
+    double previewSpacing{4.0};    // 预览抽层解码的层距 (mm)
+};
+
+struct SeriesLoadResult
+{
+    enum class Status { Ok, NoSeries, Failed, Cancelled };
+
+    Status status{Status::Failed};
+    std::string errorMessage;               // ITK/标准异常原文（本地编码），可能为空
+    ImageType::Pointer image;               // RAS 方向 + 重采样后的体数据（有 bricks 时为空）
+    vtkSmartPointer<vtkImageData> vtkImage; // 供 viewer 显示（generateVtkImage 为 false 或有 bricks 时为空）
+    ImagePyramid::Pointer pyramid;          // 多分辨率金字塔，原图为 image 或 bricks
+    std::shared_ptr<BrickedVolume> bricks;  // 分块存放的体数据（request.brickPool 为空时为空）
+    itk::MetaDataDictionary dictionary;     // 首张切片的 DICOM 标签，导出时沿用患者 / 检查信息
+    std::vector<StageTiming> stages;        // 各阶段耗时与内存（scan / cache / decode / preview / resample / pyramid / bricks / vtk）
+};
+
+// 完整的加载流水线：序列扫描（带头信息缓存的目录索引）→ 读取 → 方向标准化 + 重采样（单次采样）→ 金字塔 → 转 VTK。
+// 序列 UID 已知时先查预处理缓存：命中则映射缓存文件，跳过读取、重采样与金字塔；未命中则在金字塔之后写入缓存，
+// 并改用映射的副本，使返回的体数据由文件页承载，内存紧张时可由系统换出。
+// 渐进加载时先解码约 previewSpacing 层距的抽样切片，插值到最终网格后回调预览，解码其余切片后在同一体数据上
+// 按 z 分块原位重采样，使显示从预览逐块细化为全分辨率结果，网格（切片编号与物理位置）始终不变。
+// 给出 brickPool 时把结果写入分块体数据后释放连续的体数据：加载期间仍有解码结果与重采样结果
+// （或缓存映射）各一份完整的连续体数据，加载完成后只有分块（常驻量受预算限制）与金字塔的降采样层级。
+// 各阶段记入 Profiler；进度条区间按各阶段最近的实际耗时分配，阶段内进度来自切片解码与 ITK ProgressEvent。
+// 设计为在工作线程中运行；不抛异常，错误与取消都通过 Status 返回。
+SeriesLoadResult LoadSeries(const SeriesLoadRequest &request,
+                            const CancelToken &cancel,
+                            const ProgressCallback &progress);
+
+} // namespace dicomstitcher
+
+#endif // SERIESLOADER_H
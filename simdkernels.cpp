@@ -0,0 +1,340 @@
+﻿#include "simdkernels.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define DICOMSTITCHER_SIMD_AVX2 1
+# define DICOMSTITCHER_SIMD_SSE2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define DICOMSTITCHER_SIMD_SSE2 1
+#endif
+
+namespace dicomstitcher {
+namespace simd {
+
+namespace {
+
+inline short SaturateToShort(std::int32_t v)
+{
+    return static_cast<short>(std::min<std::int32_t>(32767, std::max<std::int32_t>(-32768, v)));
+}
+
+// AbsDiffAccumulate 中 32 位通道和的清算间隔（像素数）：
+// 每个通道每次迭代最多加 2 个 |a - b|（< 2^17），8192 像素内不会溢出
+constexpr std::size_t kAccumulateBlock = 8192;
+
+#if defined(DICOMSTITCHER_SIMD_SSE2)
+inline std::int64_t SumEpi32(__m128i v)
+{
+    alignas(16) std::int32_t lanes[4];
+    _mm_store_si128(reinterpret_cast<__m128i *>(lanes), v);
+    return std::int64_t(lanes[0]) + lanes[1] + lanes[2] + lanes[3];
+}
+
+inline std::int64_t SumEpi64(__m128i v)
+{
+    alignas(16) std::int64_t lanes[2];
+    _mm_store_si128(reinterpret_cast<__m128i *>(lanes), v);
+    return lanes[0] + lanes[1];
+}
+
+// 有符号 32 位 → 64 位（SSE2 没有 cvtepi32_epi64）
+inline __m128i AddWidenedEpi32(__m128i sum, __m128i v)
+{
+    const __m128i sign = _mm_srai_epi32(v, 31);
+    return _mm_add_epi64(sum, _mm_add_epi64(_mm_unpacklo_epi32(v, sign), _mm_unpackhi_epi32(v, sign)));
+}
+
+// 无符号 32 位 → 64 位
+inline __m128i AddWidenedEpu32(__m128i sum, __m128i v)
+{
+    const __m128i zero = _mm_setzero_si128();
+    return _mm_add_epi64(sum, _mm_add_epi64(_mm_unpacklo_epi32(v, zero), _mm_unpackhi_epi32(v, zero)));
+}
+#endif
+
+#if defined(DICOMSTITCHER_SIMD_AVX2)
+inline std::int64_t SumEpi32(__m256i v)
+{
+    return SumEpi32(_mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+}
+
+inline std::int64_t SumEpi64(__m256i v)
+{
+    return SumEpi64(_mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+}
+
+inline __m256i AddWidenedEpi32(__m256i sum, __m256i v)
+{
+    const __m256i sign = _mm256_srai_epi32(v, 31);
+    return _mm256_add_epi64(sum, _mm256_add_epi64(_mm256_unpacklo_epi32(v, sign), _mm256_unpackhi_epi32(v, sign)));
+}
+
+inline __m256i AddWidenedEpu32(__m256i sum, __m256i v)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    return _mm256_add_epi64(sum, _mm256_add_epi64(_mm256_unpacklo_epi32(v, zero), _mm256_unpackhi_epi32(v, zero)));
+}
+#endif
+
+} // namespace
+
+void LerpRowsQ14(const short *a, const short *b, short *out, std::size_t count, int w0, int w1)
+{
+    std::size_t i = 0;
+    constexpr std::int32_t rounding = 1 << (kWeightBits - 1);
+
+#if defined(DICOMSTITCHER_SIMD_SSE2)
+    // 将 (a, b) 交错成 16 位对，madd 一次得到 a*w0 + b*w1 的 32 位结果
+    const std::int32_t packedWeights =
+        static_cast<std::int32_t>((static_cast<std::uint32_t>(w1) << 16) | (static_cast<std::uint32_t>(w0) & 0xFFFFu));
+#endif
+
+#if defined(DICOMSTITCHER_SIMD_AVX2)
+    {
+        const __m256i weights = _mm256_set1_epi32(packedWeights);
+        const __m256i round = _mm256_set1_epi32(rounding);
+        for (; i + 16 <= count; i += 16) {
+            const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+            const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+            // unpack 与 packs 都按 128 位通道进行，顺序前后一致
+            __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi16(va, vb), weights);
+            __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi16(va, vb), weights);
+            lo = _mm256_srai_epi32(_mm256_add_epi32(lo, round), kWeightBits);
+            hi = _mm256_srai_epi32(_mm256_add_epi32(hi, round), kWeightBits);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_packs_epi32(lo, hi));
+        }
+    }
+#endif
+#if defined(DICOMSTITCHER_SIMD_SSE2)
+    {
+        const __m128i weights = _mm_set1_epi32(packedWeights);
+        const __m128i round = _mm_set1_epi32(rounding);
+        for (; i + 8 <= count; i += 8) {
+            const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+            const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+            __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi16(va, vb), weights);
+            __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi16(va, vb), weights);
+            lo = _mm_srai_epi32(_mm_add_epi32(lo, round), kWeightBits);
+            hi = _mm_srai_epi32(_mm_add_epi32(hi, round), kWeightBits);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packs_epi32(lo, hi));
+        }
+    }
+#endif
+    for (; i < count; ++i) {
+        const std::int32_t v = static_cast<std::int32_t>(a[i]) * w0 + static_cast<std::int32_t>(b[i]) * w1;
+        out[i] = SaturateToShort((v + rounding) >> kWeightBits);
+    }
+}
+
+void BlendRowsU8(const unsigned char *a, const unsigned char *b, unsigned char *out, std::size_t count, int w)
+{
+    w = std::min(256, std::max(0, w));
+    const int w0 = 256 - w;
+    std::size_t i = 0;
+
+    // 零扩展到 16 位后乘加：a * w0 + b * w <= 255 * 256 + 128，不会溢出无符号 16 位
+#if defined(DICOMSTITCHER_SIMD_AVX2)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i vw0 = _mm256_set1_epi16(static_cast<short>(w0));
+        const __m256i vw1 = _mm256_set1_epi16(static_cast<short>(w));
+        const __m256i round = _mm256_set1_epi16(128);
+        for (; i + 32 <= count; i += 32) {
+            const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+            const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+            __m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(va, zero), vw0),
+                                          _mm256_mullo_epi16(_mm256_unpacklo_epi8(vb, zero), vw1));
+            __m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(va, zero), vw0),
+                                          _mm256_mullo_epi16(_mm256_unpackhi_epi8(vb, zero), vw1));
+            lo = _mm256_srli_epi16(_mm256_add_epi16(lo, round), 8);
+            hi = _mm256_srli_epi16(_mm256_add_epi16(hi, round), 8);
+            _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), _mm256_packus_epi16(lo, hi));
+        }
+    }
+#endif
+#if defined(DICOMSTITCHER_SIMD_SSE2)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i vw0 = _mm_set1_epi16(static_cast<short>(w0));
+        const __m128i vw1 = _mm_set1_epi16(static_cast<short>(w));
+        const __m128i round = _mm_set1_epi16(128);
+        for (; i + 16 <= count; i += 16) {
+            const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+            const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+            __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), vw0),
+                                       _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero), vw1));
+            __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), vw0),
+                                       _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero), vw1));
+            lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+            hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), _mm_packus_epi16(lo, hi));
+        }
+    }
+#endif
+    for (; i < count; ++i) {
+        out[i] = static_cast<unsigned char>((a[i] * w0 + b[i] * w + 128) >> 8);
+    }
+}
+
+void AbsDiffAccumulate(const short *a,
+                       const short *b,
+                       const unsigned char *mask,
+                       unsigned short *out,
+                       std::size_t count,
+                       DiffSums &sums)
+{
+    std::size_t i = 0;
+
+    // 掩膜外的像素先清零再累加，计数单独统计；乘积用 (x, 0) 与 (y, 0) 交错后 madd，
+    // 每个 32 位结果只含一个乘积（|x * y| <= 2^30），不会像成对相加那样溢出
+#if defined(DICOMSTITCHER_SIMD_AVX2)
+    {
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i ones = _mm256_set1_epi32(-1);
+        __m256i sumAB = zero;
+        __m256i sumAA = zero;
+        __m256i sumBB = zero;
+        while (i + 16 <= count) {
+            const std::size_t blockEnd = i + std::min<std::size_t>((count - i) / 16 * 16, kAccumulateBlock);
+            __m256i n = zero;
+            __m256i sumD = zero;
+            __m256i sumA = zero;
+            __m256i sumB = zero;
+            for (; i < blockEnd; i += 16) {
+                __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+                __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+                // max - min 按 16 位回绕相减，作为无符号数正好是 |a - b|
+                __m256i d = _mm256_sub_epi16(_mm256_max_epi16(va, vb), _mm256_min_epi16(va, vb));
+                if (out) {
+                    _mm256_storeu_si256(reinterpret_cast<__m256i *>(out + i), d);
+                }
+                if (mask) {
+                    const __m256i m =
+                        _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(mask + i)));
+                    const __m256i keep = _mm256_andnot_si256(_mm256_cmpeq_epi16(m, zero), ones);
+                    va = _mm256_and_si256(va, keep);
+                    vb = _mm256_and_si256(vb, keep);
+                    d = _mm256_and_si256(d, keep);
+                    n = _mm256_sub_epi16(n, keep);
+                } else {
+                    n = _mm256_sub_epi16(n, ones);
+                }
+                sumD = _mm256_add_epi32(sumD, _mm256_add_epi32(_mm256_unpacklo_epi16(d, zero),
+                                                               _mm256_unpackhi_epi16(d, zero)));
+                sumA = _mm256_add_epi32(sumA, _mm256_add_epi32(_mm256_srai_epi32(_mm256_unpacklo_epi16(zero, va), 16),
+                                                               _mm256_srai_epi32(_mm256_unpackhi_epi16(zero, va), 16)));
+                sumB = _mm256_add_epi32(sumB, _mm256_add_epi32(_mm256_srai_epi32(_mm256_unpacklo_epi16(zero, vb), 16),
+                                                               _mm256_srai_epi32(_mm256_unpackhi_epi16(zero, vb), 16)));
+                const __m256i aLo = _mm256_unpacklo_epi16(va, zero);
+                const __m256i aHi = _mm256_unpackhi_epi16(va, zero);
+                const __m256i bLo = _mm256_unpacklo_epi16(vb, zero);
+                const __m256i bHi = _mm256_unpackhi_epi16(vb, zero);
+                sumAB = AddWidenedEpi32(sumAB, _mm256_madd_epi16(aLo, bLo));
+                sumAB = AddWidenedEpi32(sumAB, _mm256_madd_epi16(aHi, bHi));
+                // 平方非负且 <= 2^30，两项之和仍在无符号 32 位内
+                sumAA = AddWidenedEpu32(sumAA, _mm256_add_epi32(_mm256_madd_epi16(aLo, aLo), _mm256_madd_epi16(aHi, aHi)));
+                sumBB = AddWidenedEpu32(sumBB, _mm256_add_epi32(_mm256_madd_epi16(bLo, bLo), _mm256_madd_epi16(bHi, bHi)));
+            }
+            sums.count += static_cast<std::uint64_t>(SumEpi32(_mm256_madd_epi16(n, _mm256_set1_epi16(1))));
+            sums.absDiff += static_cast<std::uint64_t>(SumEpi32(sumD));
+            sums.a += SumEpi32(sumA);
+            sums.b += SumEpi32(sumB);
+        }
+        sums.ab += SumEpi64(sumAB);
+        sums.aa += static_cast<std::uint64_t>(SumEpi64(sumAA));
+        sums.bb += static_cast<std::uint64_t>(SumEpi64(sumBB));
+    }
+#endif
+#if defined(DICOMSTITCHER_SIMD_SSE2)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i ones = _mm_set1_epi32(-1);
+        __m128i sumAB = zero;
+        __m128i sumAA = zero;
+        __m128i sumBB = zero;
+        while (i + 8 <= count) {
+            const std::size_t blockEnd = i + std::min<std::size_t>((count - i) / 8 * 8, kAccumulateBlock);
+            __m128i n = zero;
+            __m128i sumD = zero;
+            __m128i sumA = zero;
+            __m128i sumB = zero;
+            for (; i < blockEnd; i += 8) {
+                __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i *>(a + i));
+                __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i *>(b + i));
+                __m128i d = _mm_sub_epi16(_mm_max_epi16(va, vb), _mm_min_epi16(va, vb));
+                if (out) {
+                    _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), d);
+                }
+                if (mask) {
+                    const __m128i m =
+                        _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(mask + i)), zero);
+                    const __m128i keep = _mm_andnot_si128(_mm_cmpeq_epi16(m, zero), ones);
+                    va = _mm_and_si128(va, keep);
+                    vb = _mm_and_si128(vb, keep);
+                    d = _mm_and_si128(d, keep);
+                    n = _mm_sub_epi16(n, keep);
+                } else {
+                    n = _mm_sub_epi16(n, ones);
+                }
+                sumD = _mm_add_epi32(sumD, _mm_add_epi32(_mm_unpacklo_epi16(d, zero), _mm_unpackhi_epi16(d, zero)));
+                sumA = _mm_add_epi32(sumA, _mm_add_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(zero, va), 16),
+                                                         _mm_srai_epi32(_mm_unpackhi_epi16(zero, va), 16)));
+                sumB = _mm_add_epi32(sumB, _mm_add_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(zero, vb), 16),
+                                                         _mm_srai_epi32(_mm_unpackhi_epi16(zero, vb), 16)));
+                const __m128i aLo = _mm_unpacklo_epi16(va, zero);
+                const __m128i aHi = _mm_unpackhi_epi16(va, zero);
+                const __m128i bLo = _mm_unpacklo_epi16(vb, zero);
+                const __m128i bHi = _mm_unpackhi_epi16(vb, zero);
+                sumAB = AddWidenedEpi32(sumAB, _mm_madd_epi16(aLo, bLo));
+                sumAB = AddWidenedEpi32(sumAB, _mm_madd_epi16(aHi, bHi));
+                sumAA = AddWidenedEpu32(sumAA, _mm_add_epi32(_mm_madd_epi16(aLo, aLo), _mm_madd_epi16(aHi, aHi)));
+                sumBB = AddWidenedEpu32(sumBB, _mm_add_epi32(_mm_madd_epi16(bLo, bLo), _mm_madd_epi16(bHi, bHi)));
+            }
+            sums.count += static_cast<std::uint64_t>(SumEpi32(_mm_madd_epi16(n, _mm_set1_epi16(1))));
+            sums.absDiff += static_cast<std::uint64_t>(SumEpi32(sumD));
+            sums.a += SumEpi32(sumA);
+            sums.b += SumEpi32(sumB);
+        }
+        sums.ab += SumEpi64(sumAB);
+        sums.aa += static_cast<std::uint64_t>(SumEpi64(sumAA));
+        sums.bb += static_cast<std::uint64_t>(SumEpi64(sumBB));
+    }
+#endif
+    for (; i < count; ++i) {
+        const std::int32_t d = std::abs(static_cast<std::int32_t>(a[i]) - static_cast<std::int32_t>(b[i]));
+        if (out) {
+            out[i] = static_cast<unsigned short>(d);
+        }
+        if (mask && !mask[i]) {
+            continue;
+        }
+        const std::int64_t va = a[i];
+        const std::int64_t vb = b[i];
+        ++sums.count;
+        sums.absDiff += static_cast<std::uint64_t>(d);
+        sums.a += va;
+        sums.b += vb;
+        sums.aa += static_cast<std::uint64_t>(va * va);
+        sums.bb += static_cast<std::uint64_t>(vb * vb);
+        sums.ab += va * vb;
+    }
+}
+
+const char *InstructionSetName()
+{
+#if defined(DICOMSTITCHER_SIMD_AVX2)
+    return "AVX2";
+#elif defined(DICOMSTITCHER_SIMD_SSE2)
+    return "SSE2";
+#else
+    return "scalar";
+#endif
+}
+
+} // namespace simd
+} // namespace dicomstitcher
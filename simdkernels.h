@@ -0,0 +1,52 @@
+﻿#ifndef SIMDKERNELS_H
+#define SIMDKERNELS_H
+
+#include <cstddef>
+#include <cstdint>
+
+// 行级向量化内核：x86 上使用 SSE2（编译器开启 AVX2 时使用 256 位版本），
+// 其他平台退化为标量实现。只依赖标准库，便于在各处理阶段复用。
+namespace dicomstitcher {
+namespace simd {
+
+// 定点权重的位数：权重以 Q14 表示，w0 + w1 == 1 << kWeightBits
+constexpr int kWeightBits = 14;
+constexpr int kWeightOne = 1 << kWeightBits;
+
+// 两行 short 线性插值：out[i] = round((a[i] * w0 + b[i] * w1) / 2^14)，结果饱和到 short。
+// out 可与 a 或 b 相同。
+void LerpRowsQ14(const short *a, const short *b, short *out, std::size_t count, int w0, int w1);
+
+// 两行 8 位数据 alpha 混合：out[i] = (a[i] * (256 - w) + b[i] * w + 128) >> 8，w ∈ [0, 256]。
+// 用于显示空间（窗宽窗位映射后的灰度 / RGB）的融合；out 可与 a 或 b 相同。
+void BlendRowsU8(const unsigned char *a, const unsigned char *b, unsigned char *out, std::size_t count, int w);
+
+// 一组像素对 (a, b) 的整数累加量：计数、|a - b| 之和与一阶 / 二阶矩，可由此得到平均绝对差与归一化互相关。
+// 全部为精确的整数运算，结果与指令集无关。
+struct DiffSums
+{
+    std::uint64_t count{0};
+    std::uint64_t absDiff{0};
+    std::int64_t a{0};
+    std::int64_t b{0};
+    std::uint64_t aa{0};
+    std::uint64_t bb{0};
+    std::int64_t ab{0};
+};
+
+// out[i] = |a[i] - b[i]|（无符号 16 位，不会溢出），out 为空时只统计。
+// mask 非空时只有 mask[i] 非 0 的像素计入 sums；结果累加到 sums 已有的值上，可逐行调用。
+void AbsDiffAccumulate(const short *a,
+                       const short *b,
+                       const unsigned char *mask,
+                       unsigned short *out,
+                       std::size_t count,
+                       DiffSums &sums);
+
+// 当前构建使用的指令集名称（基准测试报告用）
+const char *InstructionSetName();
+
+} // namespace simd
+} // namespace dicomstitcher
+
+#endif // SIMDKERNELS_H
@@ -0,0 +1,266 @@
+﻿#include "slicereslicer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+namespace dicomstitcher {
+
+namespace {
+
+// 连续索引 c 处三线性插值；任一轴落在 [-0.5, n-0.5) 之外时 value 置 0 并返回 false
+inline bool SampleLinear(const PixelType *buffer, const std::int64_t size[3], const double c[3], PixelType &value)
+{
+    std::int64_t i0[3];
+    std::int64_t i1[3];
+    double f[3];
+    for (unsigned int j = 0; j < 3; ++j) {
+        if (!(c[j] >= -0.5 && c[j] < static_cast<double>(size[j]) - 0.5)) {
+            value = 0;
+            return false;
+        }
+        const double base = std::floor(c[j]);
+        f[j] = c[j] - base;
+        const auto b = static_cast<std::int64_t>(base);
+        i0[j] = std::max<std::int64_t>(b, 0);
+        i1[j] = std::min<std::int64_t>(b + 1, size[j] - 1);
+    }
+    const std::int64_t sx = 1;
+    const std::int64_t sy = size[0];
+    const std::int64_t sz = size[0] * size[1];
+    const PixelType *p = buffer;
+    const double v000 = p[i0[0] * sx + i0[1] * sy + i0[2] * sz];
+    const double v100 = p[i1[0] * sx + i0[1] * sy + i0[2] * sz];
+    const double v010 = p[i0[0] * sx + i1[1] * sy + i0[2] * sz];
+    const double v110 = p[i1[0] * sx + i1[1] * sy + i0[2] * sz];
+    const double v001 = p[i0[0] * sx + i0[1] * sy + i1[2] * sz];
+    const double v101 = p[i1[0] * sx + i0[1] * sy + i1[2] * sz];
+    const double v011 = p[i0[0] * sx + i1[1] * sy + i1[2] * sz];
+    const double v111 = p[i1[0] * sx + i1[1] * sy + i1[2] * sz];
+    const double x00 = v000 + (v100 - v000) * f[0];
+    const double x10 = v010 + (v110 - v010) * f[0];
+    const double x01 = v001 + (v101 - v001) * f[0];
+    const double x11 = v011 + (v111 - v011) * f[0];
+    const double y0 = x00 + (x10 - x00) * f[1];
+    const double y1 = x01 + (x11 - x01) * f[1];
+    // 与 ResampleImageFilter 相同的截断取整
+    value = static_cast<PixelType>(y0 + (y1 - y0) * f[2]);
+    return true;
+}
+
+void BufferSize(const ImageType *image, std::int64_t size[3])
+{
+    const auto s = image->GetBufferedRegion().GetSize();
+    for (unsigned int j = 0; j < 3; ++j) {
+        size[j] = static_cast<std::int64_t>(s[j]);
+    }
+}
+
+} // namespace
+
+SliceLayout GetSliceLayout(const ImageGrid &grid, SliceOrientation orientation)
+{
+    SliceLayout layout{0, 1, 2, 0, 0};
+    switch (orientation) {
+    case SliceOrientation::Axial:
+        layout = SliceLayout{0, 1, 2, 0, 0};
+        break;
+    case SliceOrientation::Coronal:
+        layout = SliceLayout{0, 2, 1, 0, 0};
+        break;
+    case SliceOrientation::Sagittal:
+        layout = SliceLayout{1, 2, 0, 0, 0};
+        break;
+    }
+    layout.width = grid.size[layout.uAxis];
+    layout.height = grid.size[layout.vAxis];
+    return layout;
+}
+
+int SliceCount(const ImageGrid &grid, SliceOrientation orientation)
+{
+    return static_cast<int>(grid.size[GetSliceLayout(grid, orientation).normalAxis]);
+}
+
+namespace {
+
+// 方向矩阵为正交阵：连续索引 c = D^T (p - o) / spacing
+void WorldToContinuousIndex(const ImageGrid &grid, const ImageType::PointType &point, double c[3])
+{
+    for (unsigned int j = 0; j < 3; ++j) {
+        double projected = 0.0;
+        for (unsigned int r = 0; r < 3; ++r) {
+            projected += grid.direction[r][j] * (point[r] - grid.origin[r]);
+        }
+        c[j] = projected / grid.spacing[j];
+    }
+}
+
+} // namespace
+
+double WorldToSlice(const ImageGrid &grid, SliceOrientation orientation, const ImageType::PointType &point)
+{
+    double c[3];
+    WorldToContinuousIndex(grid, point, c);
+    return c[GetSliceLayout(grid, orientation).normalAxis];
+}
+
+int NearestSlice(const ImageGrid &grid, SliceOrientation orientation, const ImageType::PointType &point)
+{
+    const int count = SliceCount(grid, orientation);
+    const double slice = std::round(WorldToSlice(grid, orientation, point));
+    return static_cast<int>(std::clamp(slice, 0.0, static_cast<double>(std::max(0, count - 1))));
+}
+
+ImageType::PointType SliceToWorld(const ImageGrid &grid,
+                                  SliceOrientation orientation,
+                                  int index,
+                                  const ImageType::PointType &point)
+{
+    double c[3];
+    WorldToContinuousIndex(grid, point, c);
+    c[GetSliceLayout(grid, orientation).normalAxis] = index;
+    ImageType::PointType result;
+    for (unsigned int r = 0; r < 3; ++r) {
+        result[r] = grid.origin[r];
+        for (unsigned int j = 0; j < 3; ++j) {
+            result[r] += grid.direction[r][j] * grid.spacing[j] * c[j];
+        }
+    }
+    return result;
+}
+
+void ExtractSlice(const ImageType *image, SliceOrientation orientation, int index, PixelType *out)
+{
+    const ImageGrid grid = GridOf(image);
+    const SliceLayout layout = GetSliceLayout(grid, orientation);
+    const std::size_t stride[3] = {1, grid.size[0], grid.size[0] * grid.size[1]};
+    const std::size_t su = stride[layout.uAxis];
+    const std::size_t sv = stride[layout.vAxis];
+    const PixelType *base = image->GetBufferPointer()
+                          + static_cast<std::size_t>(index) * stride[layout.normalAxis];
+    for (std::size_t v = 0; v < layout.height; ++v) {
+        const PixelType *src = base + v * sv;
+        PixelType *dst = out + v * layout.width;
+        if (su == 1) {
+            std::copy(src, src + layout.width, dst);
+        } else {
+            for (std::size_t u = 0; u < layout.width; ++u) {
+                dst[u] = src[u * su];
+            }
+        }
+    }
+}
+
+void ResliceSlice(const ImageType *image,
+                  const IndexAffine &affine,
+                  const ImageGrid &grid,
+                  SliceOrientation orientation,
+                  int index,
+                  PixelType *out,
+                  unsigned char *inside,
+                  unsigned int numberOfThreads)
+{
+    const SliceLayout layout = GetSliceLayout(grid, orientation);
+    std::int64_t size[3];
+    BufferSize(image, size);
+    const PixelType *buffer = image->GetBufferPointer();
+
+    ParallelFor(layout.height, numberOfThreads, [&](std::size_t v) {
+        double c[3];
+        double step[3];
+        for (unsigned int j = 0; j < 3; ++j) {
+            c[j] = affine.b[j] + affine.a[j][layout.vAxis] * static_cast<double>(v)
+                 + affine.a[j][layout.normalAxis] * static_cast<double>(index);
+            step[j] = affine.a[j][layout.uAxis];
+        }
+        PixelType *row = out + v * layout.width;
+        unsigned char *mask = inside ? inside + v * layout.width : nullptr;
+        for (std::size_t u = 0; u < layout.width; ++u) {
+            const bool hit = SampleLinear(buffer, size, c, row[u]);
+            if (mask) {
+                mask[u] = hit ? 1 : 0;
+            }
+            c[0] += step[0];
+            c[1] += step[1];
+            c[2] += step[2];
+        }
+    });
+}
+
+void ResliceSlice(const ImageType *image,
+                  const itk::Transform<double, 3> *transform,
+                  const ImageGrid &grid,
+                  SliceOrientation orientation,
+                  int index,
+                  PixelType *out,
+                  unsigned char *inside,
+                  unsigned int numberOfThreads)
+{
+    IndexAffine affine;
+    if (ComputeIndexAffine(image, grid, transform, affine)) {
+        ResliceSlice(image, affine, grid, orientation, index, out, inside, numberOfThreads);
+        return;
+    }
+
+    const SliceLayout layout = GetSliceLayout(grid, orientation);
+    std::int64_t size[3];
+    BufferSize(image, size);
+    const PixelType *buffer = image->GetBufferPointer();
+    const auto start = image->GetBufferedRegion().GetIndex();
+
+    ParallelFor(layout.height, numberOfThreads, [&](std::size_t v) {
+        PixelType *row = out + v * layout.width;
+        unsigned char *mask = inside ? inside + v * layout.width : nullptr;
+        double k[3];
+        k[layout.vAxis] = static_cast<double>(v);
+        k[layout.normalAxis] = static_cast<double>(index);
+        for (std::size_t u = 0; u < layout.width; ++u) {
+            k[layout.uAxis] = static_cast<double>(u);
+            ImageType::PointType p;
+            for (unsigned int r = 0; r < 3; ++r) {
+                p[r] = grid.origin[r];
+                for (unsigned int i = 0; i < 3; ++i) {
+                    p[r] += grid.direction[r][i] * grid.spacing[i] * k[i];
+                }
+            }
+            const ImageType::PointType q = transform->TransformPoint(p);
+            itk::ContinuousIndex<double, 3> ci;
+            image->TransformPhysicalPointToContinuousIndex(q, ci);
+            double c[3];
+            for (unsigned int j = 0; j < 3; ++j) {
+                c[j] = ci[j] - static_cast<double>(start[j]);
+            }
+            const bool hit = SampleLinear(buffer, size, c, row[u]);
+            if (mask) {
+                mask[u] = hit ? 1 : 0;
+            }
+        }
+    });
+}
+
+vtkSmartPointer<vtkImageData> NewSliceImage(const ImageGrid &grid,
+                                            SliceOrientation orientation,
+                                            int index,
+                                            int scalarType,
+                                            int components)
+{
+    // 沿法向只保留第 index 层的范围，原点与间距不变，viewer 可直接 SetSlice(index)
+    const SliceLayout layout = GetSliceLayout(grid, orientation);
+    int extent[6];
+    for (unsigned int i = 0; i < 3; ++i) {
+        extent[2 * i] = 0;
+        extent[2 * i + 1] = static_cast<int>(grid.size[i]) - 1;
+    }
+    extent[2 * layout.normalAxis] = index;
+    extent[2 * layout.normalAxis + 1] = index;
+
+    auto slice = vtkSmartPointer<vtkImageData>::New();
+    slice->SetExtent(extent);
+    slice->SetSpacing(grid.spacing[0], grid.spacing[1], grid.spacing[2]);
+    slice->SetOrigin(grid.origin[0], grid.origin[1], grid.origin[2]);
+    slice->AllocateScalars(scalarType, components);
+    return slice;
+}
+
+} // namespace dicomstitcher
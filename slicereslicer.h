@@ -0,0 +1,78 @@
+﻿#ifndef SLICERESLICER_H
+#define SLICERESLICER_H
+
+#include "pipelinecommon.h"
+#include "imagepreprocessing.h"
+
+#include <vtkSmartPointer.h>
+#include <vtkImageData.h>
+#include <vtkType.h>
+
+#include <itkTransform.h>
+
+#include <cstddef>
+
+namespace dicomstitcher {
+
+// 与 vtkImageViewer2 的 XY / XZ / YZ 切片方向一一对应
+enum class SliceOrientation { Axial, Coronal, Sagittal };
+
+// 切片在体数据中的轴：u 为切片图像的行方向（最快变化），v 为列方向，normal 为切片法向
+struct SliceLayout
+{
+    unsigned int uAxis;
+    unsigned int vAxis;
+    unsigned int normalAxis;
+    std::size_t width;
+    std::size_t height;
+};
+
+SliceLayout GetSliceLayout(const ImageGrid &grid, SliceOrientation orientation);
+int SliceCount(const ImageGrid &grid, SliceOrientation orientation);
+
+// 世界坐标 point 在 grid 上沿切片法向轴的连续层号（未取整、未截断）
+double WorldToSlice(const ImageGrid &grid, SliceOrientation orientation, const ImageType::PointType &point);
+// 同上，四舍五入并截断到 [0, SliceCount - 1]
+int NearestSlice(const ImageGrid &grid, SliceOrientation orientation, const ImageType::PointType &point);
+// 把 point 沿法向轴移到第 index 层的平面上，层内坐标不变
+ImageType::PointType SliceToWorld(const ImageGrid &grid,
+                                  SliceOrientation orientation,
+                                  int index,
+                                  const ImageType::PointType &point);
+
+// 从 image 自身网格取一张切片（无插值），out 需容纳 width * height 个像素
+void ExtractSlice(const ImageType *image, SliceOrientation orientation, int index, PixelType *out);
+
+// 在 grid 的一张切片上对 image 线性插值，grid → image 的索引映射由 affine 给出；
+// 边界规则与 LinearInterpolateImageFunction 一致，界外填 0；inside 非空时逐像素写入是否落在 image 内。
+// 按行并行。
+void ResliceSlice(const ImageType *image,
+                  const IndexAffine &affine,
+                  const ImageGrid &grid,
+                  SliceOrientation orientation,
+                  int index,
+                  PixelType *out,
+                  unsigned char *inside = nullptr,
+                  unsigned int numberOfThreads = 0);
+
+// 非线性变换的回退：逐像素 TransformPoint
+void ResliceSlice(const ImageType *image,
+                  const itk::Transform<double, 3> *transform,
+                  const ImageGrid &grid,
+                  SliceOrientation orientation,
+                  int index,
+                  PixelType *out,
+                  unsigned char *inside = nullptr,
+                  unsigned int numberOfThreads = 0);
+
+// 分配一张切片图像，其 VTK 几何与 grid 体数据（ItkToVtkImage 的约定）中第 index 层重合。
+// 像素按 SliceLayout 的 u 行 v 列连续存放，可直接按 ExtractSlice / ResliceSlice 的输出拷入。
+vtkSmartPointer<vtkImageData> NewSliceImage(const ImageGrid &grid,
+                                            SliceOrientation orientation,
+                                            int index,
+                                            int scalarType = VTK_SHORT,
+                                            int components = 1);
+
+} // namespace dicomstitcher
+
+#endif // SLICERESLICER_H
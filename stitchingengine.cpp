@@ -0,0 +1,422 @@
+﻿#include "stitchingengine.h"
+#include "brickedvolume.h"
+#include "slicereslicer.h"
+
+#if defined(_MSC_VER) && (_MSC_VER >= 1600)
+# pragma execution_character_set("utf-8")
+#endif
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <vector>
+
+namespace dicomstitcher {
+
+namespace {
+
+using PointType = ImageType::PointType;
+
+std::array<PointType, 8> BufferCorners(const ImageType *image)
+{
+    std::array<PointType, 8> corners;
+    const auto region = image->GetLargestPossibleRegion();
+    for (unsigned int c = 0; c < 8; ++c) {
+        ImageType::IndexType index;
+        for (unsigned int i = 0; i < 3; ++i) {
+            index[i] = region.GetIndex(i)
+                     + (((c >> i) & 1u) ? static_cast<itk::IndexValueType>(region.GetSize(i)) - 1 : 0);
+        }
+        image->TransformIndexToPhysicalPoint(index, corners[c]);
+    }
+    return corners;
+}
+
+// 连续索引 c（相对缓冲区起点）到体数据边界 [-0.5, n-0.5) 的最短距离（mm），界外为 0
+inline double BoundaryDistance(const double c[3], const std::int64_t size[3], const double spacing[3])
+{
+    double distance = std::numeric_limits<double>::max();
+    for (unsigned int j = 0; j < 3; ++j) {
+        const double toLower = c[j] + 0.5;
+        const double toUpper = static_cast<double>(size[j]) - 0.5 - c[j];
+        distance = std::min(distance, std::min(toLower, toUpper) * spacing[j]);
+    }
+    return std::max(distance, 0.0);
+}
+
+struct VolumeInfo
+{
+    std::int64_t size[3];
+    double spacing[3];
+};
+
+VolumeInfo InfoOf(const ImageType *image)
+{
+    VolumeInfo info;
+    const auto size = image->GetBufferedRegion().GetSize();
+    for (unsigned int j = 0; j < 3; ++j) {
+        info.size[j] = static_cast<std::int64_t>(size[j]);
+        info.spacing[j] = image->GetSpacing()[j];
+    }
+    return info;
+}
+
+ImageType::Pointer AllocateSlab(const ImageGrid &grid, std::size_t depth)
+{
+    auto slab = ImageType::New();
+    ImageType::RegionType region;
+    ImageType::SizeType size = grid.size;
+    size[2] = depth;
+    region.SetSize(size);
+    slab->SetRegions(region);
+    slab->SetSpacing(grid.spacing);
+    slab->SetDirection(grid.direction);
+    slab->SetOrigin(grid.origin);
+    slab->Allocate();
+    return slab;
+}
+
+// 拼接的一组输入：连续图像，或分块体数据（每个 z 分块只读出它映射到的区域）
+struct StitchSource
+{
+    ImageType::ConstPointer image;    // 连续像素，分块输入时为空
+    const BrickedVolume *bricks{nullptr};
+    ImageType::ConstPointer geometry; // 索引与物理坐标换算；连续输入时即 image
+};
+
+StitchSource SourceOf(const ImageType *image)
+{
+    StitchSource source;
+    source.image = image;
+    source.geometry = image;
+    return source;
+}
+
+StitchSource SourceOf(const BrickedVolume &bricks)
+{
+    StitchSource source;
+    source.bricks = &bricks;
+    source.geometry = NewGeometryImage(bricks.Grid()).GetPointer();
+    return source;
+}
+
+// 一个 z 分块使用的源像素与输出索引 → 源连续索引的映射；image 为空表示分块与该输入不相交
+struct SlabSource
+{
+    ImageType::ConstPointer image;
+    IndexAffine affine;
+};
+
+SlabSource PrepareSlab(const StitchSource &source,
+                       const IndexAffine &affine,
+                       const ImageGrid &grid,
+                       std::size_t zBegin,
+                       std::size_t depth)
+{
+    SlabSource slab;
+    slab.affine = affine;
+    if (!source.bricks) {
+        slab.image = source.image;
+        return slab;
+    }
+    const double first[3] = {0.0, 0.0, static_cast<double>(zBegin)};
+    const double last[3] = {static_cast<double>(grid.size[0]) - 1.0, static_cast<double>(grid.size[1]) - 1.0,
+                            static_cast<double>(zBegin + depth) - 1.0};
+    ImageType::RegionType box;
+    if (MappedRegion(source.bricks->Grid(), affine, first, last, box)) {
+        slab.image = source.bricks->ReadRegionImage(box).GetPointer();
+        for (unsigned int j = 0; j < 3; ++j) {
+            slab.affine.b[j] -= static_cast<double>(box.GetIndex(j));
+        }
+    }
+    return slab;
+}
+
+void ResliceSlab(const SlabSource &slab, const ImageGrid &grid, int k, PixelType *out, unsigned char *inside)
+{
+    if (slab.image) {
+        ResliceSlice(slab.image.GetPointer(), slab.affine, grid, SliceOrientation::Axial, k, out, inside, 1);
+        return;
+    }
+    const std::size_t count = grid.size[0] * grid.size[1];
+    std::fill(out, out + count, PixelType(0));
+    std::fill(inside, inside + count, static_cast<unsigned char>(0));
+}
+
+} // namespace
+
+bool ComputeStitchingGrid(const ImageType *fixed,
+                          const ImageType *moving,
+                          const itk::Transform<double, 3> *transform,
+                          const StitchingSettings &settings,
+                          ImageGrid &grid)
+{
+    if (!fixed || !moving) {
+        return false;
+    }
+    itk::Transform<double, 3>::ConstPointer inverse;
+    if (transform) {
+        inverse = transform->GetInverseTransform().GetPointer();
+        if (!inverse) {
+            return false;
+        }
+    }
+
+    const ImageType::DirectionType direction = fixed->GetDirection();
+    const PointType origin = fixed->GetOrigin();
+    ImageType::SpacingType spacing = fixed->GetSpacing();
+    if (settings.outputSpacing > 0.0) {
+        spacing.Fill(settings.outputSpacing);
+    }
+
+    // 在 Fixed 的轴上求并集包围盒（以 Fixed 原点为零点的轴向坐标）
+    double lo[3] = {std::numeric_limits<double>::max(), std::numeric_limits<double>::max(), std::numeric_limits<double>::max()};
+    double hi[3] = {std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest(), std::numeric_limits<double>::lowest()};
+    auto include = [&](const PointType &p) {
+        for (unsigned int i = 0; i < 3; ++i) {
+            double v = 0.0;
+            for (unsigned int r = 0; r < 3; ++r) {
+                v += direction[r][i] * (p[r] - origin[r]);
+            }
+            lo[i] = std::min(lo[i], v);
+            hi[i] = std::max(hi[i], v);
+        }
+    };
+    for (const PointType &p : BufferCorners(fixed)) {
+        include(p);
+    }
+    for (PointType p : BufferCorners(moving)) {
+        if (inverse) {
+            p = inverse->TransformPoint(p);
+        }
+        include(p);
+    }
+
+    // 边界对齐到以 Fixed 原点为起点的间距整数倍：间距不变时 Fixed 体素落在输出网格点上，无需插值
+    for (unsigned int i = 0; i < 3; ++i) {
+        const double first = std::floor(lo[i] / spacing[i] + 1e-6);
+        const double last = std::ceil(hi[i] / spacing[i] - 1e-6);
+        lo[i] = first * spacing[i];
+        grid.size[i] = static_cast<itk::SizeValueType>(std::max(1.0, last - first + 1.0));
+    }
+    for (unsigned int r = 0; r < 3; ++r) {
+        grid.origin[r] = origin[r];
+        for (unsigned int i = 0; i < 3; ++i) {
+            grid.origin[r] += direction[r][i] * lo[i];
+        }
+    }
+    grid.spacing = spacing;
+    grid.direction = direction;
+    return true;
+}
+
+namespace {
+
+StitchingResult StitchSources(StitchSource fixedSource,
+                              StitchSource movingSource,
+                              const itk::Transform<double, 3> *transform,
+                              const StitchingSettings &settings,
+                              const SlabCallback &sink,
+                              const CancelToken &cancel,
+                              const ProgressCallback &progress)
+{
+    StitchingResult result;
+    const ImageType *fixed = fixedSource.geometry.GetPointer();
+    const ImageType *moving = movingSource.geometry.GetPointer();
+
+    ScopedStage stage("stitch");
+    try {
+        ReportProgress(progress, "计算输出网格...", 0);
+        if (!ComputeStitchingGrid(fixed, moving, transform, settings, result.grid)) {
+            result.status = StitchingResult::Status::NoInverse;
+            return result;
+        }
+        const ImageGrid &grid = result.grid;
+
+        // 输出索引 → 两组数据连续索引的映射；Moving 为非线性变换时逐像素 TransformPoint
+        IndexAffine affineF;
+        ComputeIndexAffine(fixed, grid, nullptr, affineF);
+        IndexAffine affineM;
+        const bool movingLinear = ComputeIndexAffine(moving, grid, transform, affineM);
+        const VolumeInfo infoF = InfoOf(fixed);
+        const VolumeInfo infoM = InfoOf(moving);
+        const auto movingStart = moving->GetBufferedRegion().GetIndex();
+        if (!movingLinear && movingSource.bricks) {
+            // 非线性变换无法预先求出分块映射到的区域，读出整个 Moving
+            movingSource.image = movingSource.bricks->ReadRegionImage(movingSource.bricks->LargestRegion()).GetPointer();
+            movingSource.bricks = nullptr;
+        }
+        const ImageType *movingImage = movingSource.image.GetPointer();
+
+        const std::size_t width = grid.size[0];
+        const std::size_t height = grid.size[1];
+        const std::size_t depth = grid.size[2];
+        const std::size_t sliceSize = width * height;
+        const std::size_t thickness = std::max(1u, settings.slabThickness);
+        const std::size_t slabCount = (depth + thickness - 1) / thickness;
+
+        ImageType::Pointer slab;
+        for (std::size_t s = 0; s < slabCount; ++s) {
+            cancel.ThrowIfCancelled();
+            ScopedStage slabStage("stitch.slab");
+            const std::size_t zBegin = s * thickness;
+            const std::size_t slabDepth = std::min(thickness, depth - zBegin);
+            if (!slab || slab->GetBufferedRegion().GetSize(2) != slabDepth) {
+                slab = AllocateSlab(grid, slabDepth);
+            }
+            PointType slabOrigin = grid.origin;
+            for (unsigned int r = 0; r < 3; ++r) {
+                slabOrigin[r] += grid.direction[r][2] * grid.spacing[2] * static_cast<double>(zBegin);
+            }
+            slab->SetOrigin(slabOrigin);
+            const SlabSource slabF = PrepareSlab(fixedSource, affineF, grid, zBegin, slabDepth);
+            const SlabSource slabM = movingLinear ? PrepareSlab(movingSource, affineM, grid, zBegin, slabDepth)
+                                                  : SlabSource();
+
+            // 层间并行，每层在本线程内串行重采样；临时缓冲按层分配，峰值为线程数 × 一层
+            PixelType *slabBuffer = slab->GetBufferPointer();
+            ParallelFor(slabDepth, settings.numberOfThreads, [&](std::size_t z) {
+                cancel.ThrowIfCancelled();
+                const int k = static_cast<int>(zBegin + z);
+                PixelType *out = slabBuffer + z * sliceSize;
+                std::vector<PixelType> movingSlice(sliceSize);
+                std::vector<unsigned char> insideF(sliceSize);
+                std::vector<unsigned char> insideM(sliceSize);
+                ResliceSlab(slabF, grid, k, out, insideF.data());
+                if (movingLinear) {
+                    ResliceSlab(slabM, grid, k, movingSlice.data(), insideM.data());
+                } else {
+                    ResliceSlice(movingImage, transform, grid, SliceOrientation::Axial, k, movingSlice.data(),
+                                 insideM.data(), 1);
+                }
+
+                for (std::size_t v = 0; v < height; ++v) {
+                    const std::size_t row = v * width;
+                    for (std::size_t u = 0; u < width; ++u) {
+                        const std::size_t i = row + u;
+                        if (!insideM[i]) {
+                            if (!insideF[i]) {
+                                out[i] = settings.outsideValue;
+                            }
+                            continue;
+                        }
+                        if (!insideF[i]) {
+                            out[i] = movingSlice[i];
+                            continue;
+                        }
+
+                        // 重叠区：按到各自边界的距离线性加权
+                        const double k3[3] = {static_cast<double>(u), static_cast<double>(v), static_cast<double>(k)};
+                        double cF[3];
+                        double cM[3];
+                        for (unsigned int j = 0; j < 3; ++j) {
+                            cF[j] = affineF.b[j] + affineF.a[j][0] * k3[0] + affineF.a[j][1] * k3[1] + affineF.a[j][2] * k3[2];
+                        }
+                        if (movingLinear) {
+                            for (unsigned int j = 0; j < 3; ++j) {
+                                cM[j] = affineM.b[j] + affineM.a[j][0] * k3[0] + affineM.a[j][1] * k3[1] + affineM.a[j][2] * k3[2];
+                            }
+                        } else {
+                            PointType p;
+                            for (unsigned int r = 0; r < 3; ++r) {
+                                p[r] = grid.origin[r];
+                                for (unsigned int a = 0; a < 3; ++a) {
+                                    p[r] += grid.direction[r][a] * grid.spacing[a] * k3[a];
+                                }
+                            }
+                            itk::ContinuousIndex<double, 3> ci;
+                            moving->TransformPhysicalPointToContinuousIndex(transform->TransformPoint(p), ci);
+                            for (unsigned int j = 0; j < 3; ++j) {
+                                cM[j] = ci[j] - static_cast<double>(movingStart[j]);
+                            }
+                        }
+                        const double dF = BoundaryDistance(cF, infoF.size, infoF.spacing) + 1e-3;
+                        const double dM = BoundaryDistance(cM, infoM.size, infoM.spacing) + 1e-3;
+                        const double value = (dF * out[i] + dM * movingSlice[i]) / (dF + dM);
+                        out[i] = static_cast<PixelType>(std::lround(value));
+                    }
+                }
+            });
+
+            if (sink) {
+                sink(slab.GetPointer(), zBegin, grid);
+            }
+
+            char text[96];
+            std::snprintf(text, sizeof(text), "拼接 z 分块 %zu/%zu", s + 1, slabCount);
+            ReportProgress(progress, text, static_cast<int>(100 * (s + 1) / slabCount));
+        }
+        result.status = StitchingResult::Status::Ok;
+    } catch (const itk::ProcessAborted &) {
+        result = StitchingResult();
+        result.status = StitchingResult::Status::Cancelled;
+    } catch (const itk::ExceptionObject &ex) {
+        result = StitchingResult();
+        result.status = cancel.IsCancelled() ? StitchingResult::Status::Cancelled
+                                             : StitchingResult::Status::Failed;
+        result.errorMessage = ex.what();
+    } catch (const std::exception &ex) {
+        result = StitchingResult();
+        result.status = StitchingResult::Status::Failed;
+        result.errorMessage = ex.what();
+    }
+    return result;
+}
+
+} // namespace
+
+StitchingResult StitchImages(const ImageType *fixed,
+                             const ImageType *moving,
+                             const itk::Transform<double, 3> *transform,
+                             const StitchingSettings &settings,
+                             const SlabCallback &sink,
+                             const CancelToken &cancel,
+                             const ProgressCallback &progress)
+{
+    if (!fixed || !moving) {
+        return StitchingResult();
+    }
+    return StitchSources(SourceOf(fixed), SourceOf(moving), transform, settings, sink, cancel, progress);
+}
+
+StitchingResult StitchImages(const BrickedVolume &fixed,
+                             const BrickedVolume &moving,
+                             const itk::Transform<double, 3> *transform,
+                             const StitchingSettings &settings,
+                             const SlabCallback &sink,
+                             const CancelToken &cancel,
+                             const ProgressCallback &progress)
+{
+    return StitchSources(SourceOf(fixed), SourceOf(moving), transform, settings, sink, cancel, progress);
+}
+
+StitchingResult StitchToImage(const ImageType *fixed,
+                              const ImageType *moving,
+                              const itk::Transform<double, 3> *transform,
+                              const StitchingSettings &settings,
+                              const CancelToken &cancel,
+                              const ProgressCallback &progress)
+{
+    ImageType::Pointer image;
+    auto collect = [&image](const ImageType *slab, std::size_t zBegin, const ImageGrid &grid) {
+        if (!image) {
+            image = AllocateSlab(grid, grid.size[2]);
+        }
+        const std::size_t sliceSize = grid.size[0] * grid.size[1];
+        const std::size_t count = sliceSize * slab->GetBufferedRegion().GetSize(2);
+        std::memcpy(image->GetBufferPointer() + zBegin * sliceSize, slab->GetBufferPointer(),
+                    count * sizeof(PixelType));
+    };
+    StitchingResult result = StitchImages(fixed, moving, transform, settings, collect, cancel, progress);
+    if (result.status == StitchingResult::Status::Ok) {
+        result.image = image;
+    }
+    return result;
+}
+
+} // namespace dicomstitcher
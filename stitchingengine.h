@@ -0,0 +1,79 @@
+﻿#ifndef STITCHINGENGINE_H
+#define STITCHINGENGINE_H
+
+#include "pipelinecommon.h"
+#include "imagepreprocessing.h"
+
+#include <itkTransform.h>
+
+#include <cstddef>
+#include <functional>
+#include <string>
+
+namespace dicomstitcher {
+
+class BrickedVolume;
+
+struct StitchingSettings
+{
+    double outputSpacing{0.0};        // 输出各向同性间距（mm），0 表示沿用 Fixed 的间距
+    unsigned int slabThickness{32};   // 每个 z 分块的层数，决定峰值内存
+    PixelType outsideValue{-1024};    // 两组数据都未覆盖处的填充值（空气）
+    unsigned int numberOfThreads{0};  // 0 表示 ITK 默认
+};
+
+struct StitchingResult
+{
+    enum class Status { Ok, NoInverse, Failed, Cancelled };
+
+    Status status{Status::Failed};
+    std::string errorMessage;  // ITK/标准异常原文（本地编码），可能为空
+    ImageGrid grid;            // 输出网格
+    ImageType::Pointer image;  // 仅 StitchToImage 填充
+};
+
+// 输出网格：方向与 Fixed 相同，范围为 Fixed 与变换后 Moving 包围盒的并集。
+// transform 为 Fixed → Moving（配准结果），需可求逆；不可逆时返回 false。
+bool ComputeStitchingGrid(const ImageType *fixed,
+                          const ImageType *moving,
+                          const itk::Transform<double, 3> *transform,
+                          const StitchingSettings &settings,
+                          ImageGrid &grid);
+
+// 每生成一个 z 分块回调一次。slab 的原点、间距、方向与输出网格一致，只覆盖 [zBegin, zBegin + 层数)；
+// slab 在回调返回后会被复用，需要保留时由回调方自行拷贝或写出。
+using SlabCallback = std::function<void(const ImageType *slab, std::size_t zBegin, const ImageGrid &grid)>;
+
+// 按 z 分块流式拼接：每块分别从 Fixed / Moving 重采样；只被一方覆盖的体素直接取该方的值，
+// 重叠区按到各自体数据边界的距离线性加权（w_F = d_F / (d_F + d_M)）。
+// 峰值内存约为一个分块加每线程一层的临时缓冲，与输出体数据大小无关。
+// 设计为在工作线程中运行；不抛异常，错误与取消都通过 Status 返回。
+StitchingResult StitchImages(const ImageType *fixed,
+                             const ImageType *moving,
+                             const itk::Transform<double, 3> *transform,
+                             const StitchingSettings &settings,
+                             const SlabCallback &sink,
+                             const CancelToken &cancel,
+                             const ProgressCallback &progress);
+
+// 同上，输入为分块体数据：每个 z 分块只读出它映射到的两块区域，峰值内存另加这两块区域，与输入大小无关
+// （Moving 为非线性变换时无法预先求出区域，读出整个 Moving）。与连续输入的结果可能有 ±1 的舍入差异
+StitchingResult StitchImages(const BrickedVolume &fixed,
+                             const BrickedVolume &moving,
+                             const itk::Transform<double, 3> *transform,
+                             const StitchingSettings &settings,
+                             const SlabCallback &sink,
+                             const CancelToken &cancel,
+                             const ProgressCallback &progress);
+
+// 便捷版本：把所有分块拼到一个完整体数据中（内存为整个输出体积）
+StitchingResult StitchToImage(const ImageType *fixed,
+                              const ImageType *moving,
+                              const itk::Transform<double, 3> *transform,
+                              const StitchingSettings &settings,
+                              const CancelToken &cancel,
+                              const ProgressCallback &progress);
+
+} // namespace dicomstitcher
+
+#endif // STITCHINGENGINE_H
@@ -0,0 +1,512 @@
+﻿#include "volumecache.h"
+#include "dicomindex.h"
+
+#include <itkImportImageContainer.h>
+#include <itkMetaDataObject.h>
+#include <itksys/Directory.hxx>
+#include <itksys/SystemTools.hxx>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <sstream>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <itksys/Encoding.hxx>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace dicomstitcher {
+
+namespace {
+
+constexpr char CacheMagic[16] = "DSVOLCACHE";
+constexpr std::uint32_t CacheVersion = 1;
+constexpr std::uint64_t Alignment = std::uint64_t(64) << 10;
+constexpr unsigned int MaximumLevels = 8;
+
+struct LevelRecord
+{
+    std::uint32_t factor;
+    std::uint32_t reserved;
+    std::uint64_t size[3];
+    double spacing[3];
+    double origin[3];
+    double direction[9];
+    std::uint64_t dataOffset;
+    std::uint64_t dataBytes;
+};
+
+struct CacheHeader
+{
+    char magic[16];
+    std::uint32_t version;
+    std::uint32_t levelCount;
+    std::uint64_t dictionaryOffset;
+    std::uint64_t dictionaryBytes;
+    std::uint64_t fileBytes;
+    char key[1024];
+    LevelRecord levels[MaximumLevels];
+};
+
+std::uint64_t AlignUp(std::uint64_t value)
+{
+    return (value + Alignment - 1) / Alignment * Alignment;
+}
+
+std::uint64_t HashText(const std::string &text)
+{
+    std::uint64_t hash = 1469598103934665603ull; // FNV-1a
+    for (const char c : text) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+std::string CacheDirectory(const VolumeCacheSettings &settings)
+{
+    return settings.directory.empty() ? DefaultVolumeCacheDirectory() : settings.directory;
+}
+
+std::string CachePath(const VolumeCacheSettings &settings, const std::string &key)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "/%016llx.vol", static_cast<unsigned long long>(HashText(key)));
+    return CacheDirectory(settings) + name;
+}
+
+// 只读打开、写时复制映射：像素可以被原地修改（只影响本进程），未修改的页与其他进程共享
+class MappedFile
+{
+public:
+    static std::shared_ptr<MappedFile> Open(const std::string &path)
+    {
+        std::shared_ptr<MappedFile> mapped(new MappedFile());
+#if defined(_WIN32)
+        mapped->m_file = CreateFileW(itksys::Encoding::ToWide(path).c_str(), GENERIC_READ,
+                                     FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                                     FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (mapped->m_file == INVALID_HANDLE_VALUE) {
+            return nullptr;
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(mapped->m_file, &size) || size.QuadPart <= 0) {
+            return nullptr;
+        }
+        mapped->m_mapping = CreateFileMappingW(mapped->m_file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+        if (!mapped->m_mapping) {
+            return nullptr;
+        }
+        mapped->m_data = MapViewOfFile(mapped->m_mapping, FILE_MAP_COPY, 0, 0, 0);
+        if (!mapped->m_data) {
+            return nullptr;
+        }
+        mapped->m_size = static_cast<std::size_t>(size.QuadPart);
+#else
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return nullptr;
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0 || info.st_size <= 0) {
+            ::close(fd);
+            return nullptr;
+        }
+        void *data = ::mmap(nullptr, static_cast<std::size_t>(info.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd); // 映射保持对文件的引用
+        if (data == MAP_FAILED) {
+            return nullptr;
+        }
+        mapped->m_data = data;
+        mapped->m_size = static_cast<std::size_t>(info.st_size);
+#endif
+        return mapped;
+    }
+
+    ~MappedFile()
+    {
+#if defined(_WIN32)
+        if (m_data) {
+            UnmapViewOfFile(m_data);
+        }
+        if (m_mapping) {
+            CloseHandle(m_mapping);
+        }
+        if (m_file != INVALID_HANDLE_VALUE) {
+            CloseHandle(m_file);
+        }
+#else
+        if (m_data) {
+            ::munmap(m_data, m_size);
+        }
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    unsigned char *Data() const { return static_cast<unsigned char *>(m_data); }
+    std::size_t Size() const { return m_size; }
+
+private:
+    MappedFile() = default;
+
+#if defined(_WIN32)
+    HANDLE m_file{INVALID_HANDLE_VALUE};
+    HANDLE m_mapping{nullptr};
+#endif
+    void *m_data{nullptr};
+    std::size_t m_size{0};
+};
+
+// 像素缓冲指向映射区域，持有映射的引用；容器释放时（最后一个图像析构）映射随之解除
+class MappedPixelContainer : public itk::ImportImageContainer<itk::SizeValueType, PixelType>
+{
+public:
+    ITK_DISALLOW_COPY_AND_MOVE(MappedPixelContainer);
+
+    using Self = MappedPixelContainer;
+    using Superclass = itk::ImportImageContainer<itk::SizeValueType, PixelType>;
+    using Pointer = itk::SmartPointer<Self>;
+    using ConstPointer = itk::SmartPointer<const Self>;
+
+    itkNewMacro(Self);
+
+    void SetMapping(std::shared_ptr<MappedFile> file, PixelType *pixels, itk::SizeValueType count)
+    {
+        m_file = std::move(file);
+        SetImportPointer(pixels, count, false);
+    }
+
+protected:
+    MappedPixelContainer() = default;
+    ~MappedPixelContainer() override = default;
+
+private:
+    std::shared_ptr<MappedFile> m_file;
+};
+
+std::string Escape(const std::string &text)
+{
+    std::string out;
+    for (const char c : text) {
+        switch (c) {
+        case '\\': out += "\\\\"; break;
+        case '\t': out += "\\t"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        default: out += c;
+        }
+    }
+    return out;
+}
+
+std::string Unescape(const std::string &text)
+{
+    std::string out;
+    for (std::size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '\\' && i + 1 < text.size()) {
+            const char c = text[++i];
+            out += c == 't' ? '\t' : c == 'n' ? '\n' : c == 'r' ? '\r' : c;
+        } else {
+            out += text[i];
+        }
+    }
+    return out;
+}
+
+std::string SerializeDictionary(const itk::MetaDataDictionary &dictionary)
+{
+    std::string out;
+    for (const std::string &key : dictionary.GetKeys()) {
+        std::string value;
+        if (itk::ExposeMetaData<std::string>(dictionary, key, value)) {
+            out += Escape(key) + "\t" + Escape(value) + "\n";
+        }
+    }
+    return out;
+}
+
+itk::MetaDataDictionary ParseDictionary(const char *data, std::size_t length)
+{
+    itk::MetaDataDictionary dictionary;
+    std::stringstream stream(std::string(data, length));
+    std::string line;
+    while (std::getline(stream, line)) {
+        const std::size_t tab = line.find('\t');
+        if (tab != std::string::npos) {
+            itk::EncapsulateMetaData<std::string>(dictionary, Unescape(line.substr(0, tab)),
+                                                  Unescape(line.substr(tab + 1)));
+        }
+    }
+    return dictionary;
+}
+
+LevelRecord RecordOf(unsigned int factor, const ImageType *image)
+{
+    LevelRecord record{};
+    record.factor = factor;
+    const auto size = image->GetBufferedRegion().GetSize();
+    for (unsigned int i = 0; i < 3; ++i) {
+        record.size[i] = size[i];
+        record.spacing[i] = image->GetSpacing()[i];
+        record.origin[i] = image->GetOrigin()[i];
+        for (unsigned int j = 0; j < 3; ++j) {
+            record.direction[3 * i + j] = image->GetDirection()[i][j];
+        }
+    }
+    record.dataBytes = static_cast<std::uint64_t>(size[0]) * size[1] * size[2] * sizeof(PixelType);
+    return record;
+}
+
+ImageType::Pointer MapLevel(const std::shared_ptr<MappedFile> &file, const LevelRecord &record)
+{
+    auto image = ImageType::New();
+    ImageType::RegionType region;
+    ImageType::SpacingType spacing;
+    ImageType::PointType origin;
+    ImageType::DirectionType direction;
+    for (unsigned int i = 0; i < 3; ++i) {
+        region.SetSize(i, static_cast<itk::SizeValueType>(record.size[i]));
+        spacing[i] = record.spacing[i];
+        origin[i] = record.origin[i];
+        for (unsigned int j = 0; j < 3; ++j) {
+            direction[i][j] = record.direction[3 * i + j];
+        }
+    }
+    image->SetRegions(region);
+    image->SetSpacing(spacing);
+    image->SetOrigin(origin);
+    image->SetDirection(direction);
+
+    auto container = MappedPixelContainer::New();
+    container->SetMapping(file, reinterpret_cast<PixelType *>(file->Data() + record.dataOffset),
+                          static_cast<itk::SizeValueType>(record.dataBytes / sizeof(PixelType)));
+    image->SetPixelContainer(container);
+    return image;
+}
+
+bool WriteZeros(std::FILE *file, std::uint64_t count)
+{
+    static const char zeros[4096] = {};
+    while (count > 0) {
+        const std::size_t chunk = static_cast<std::size_t>(std::min<std::uint64_t>(count, sizeof(zeros)));
+        if (std::fwrite(zeros, 1, chunk, file) != chunk) {
+            return false;
+        }
+        count -= chunk;
+    }
+    return true;
+}
+
+// 按修改时间（命中时会刷新）从旧到新删除，直到总大小不超过上限；正在被映射的文件在 Windows 上删除失败，跳过即可
+void PruneCache(const VolumeCacheSettings &settings, const std::string &keep)
+{
+    const std::string directory = CacheDirectory(settings);
+    itksys::Directory listing;
+    if (!listing.Load(directory)) {
+        return;
+    }
+    struct Entry
+    {
+        std::string path;
+        std::uint64_t bytes;
+        long mtime;
+    };
+    std::vector<Entry> entries;
+    std::uint64_t total = 0;
+    for (unsigned long i = 0; i < listing.GetNumberOfFiles(); ++i) {
+        const std::string name = listing.GetFile(i);
+        if (name.size() < 4 || name.compare(name.size() - 4, 4, ".vol") != 0) {
+            continue;
+        }
+        const std::string path = directory + "/" + name;
+        Entry entry{path, itksys::SystemTools::FileLength(path), itksys::SystemTools::ModifiedTime(path)};
+        total += entry.bytes;
+        entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.mtime < b.mtime; });
+    for (const Entry &entry : entries) {
+        if (total <= settings.maximumBytes) {
+            break;
+        }
+        if (entry.path != keep && itksys::SystemTools::RemoveFile(entry.path)) {
+            total -= entry.bytes;
+        }
+    }
+}
+
+} // namespace
+
+std::string DefaultVolumeCacheDirectory()
+{
+    return ApplicationCacheDirectory() + "/volumes";
+}
+
+std::string MakeVolumeCacheKey(const std::string &seriesUID,
+                               const std::vector<std::string> &files,
+                               const SpacingPolicy &policy,
+                               const std::vector<unsigned int> &pyramidFactors)
+{
+    if (seriesUID.empty() || files.empty()) {
+        return std::string();
+    }
+    std::string names;
+    for (const std::string &file : files) {
+        names += itksys::SystemTools::GetFilenameName(file);
+        names += '\n';
+    }
+    std::ostringstream key;
+    key.precision(17);
+    key << seriesUID << "|n=" << files.size() << "|names=" << std::hex << HashText(names) << std::dec;
+    for (const std::string *file : {&files.front(), &files.back()}) {
+        key << "|" << itksys::SystemTools::FileLength(*file) << ":" << itksys::SystemTools::ModifiedTime(*file);
+    }
+    key << "|mode=" << static_cast<int>(policy.mode);
+    if (policy.mode == SpacingMode::ThroughPlane || policy.mode == SpacingMode::Isotropic) {
+        key << "|spacing=" << policy.spacing;
+    } else if (policy.mode == SpacingMode::MemoryBudget) {
+        key << "|budget=" << policy.memoryBudgetBytes;
+    }
+    key << "|pyramid=";
+    for (unsigned int factor : pyramidFactors) {
+        key << factor << ",";
+    }
+    return key.str();
+}
+
+bool LoadCachedVolume(const VolumeCacheSettings &settings, const std::string &key, CachedVolume &volume)
+{
+    if (!settings.enabled || key.empty() || key.size() >= sizeof(CacheHeader::key)) {
+        return false;
+    }
+    const std::string path = CachePath(settings, key);
+    if (!itksys::SystemTools::FileExists(path, true)) {
+        return false;
+    }
+    try {
+        std::shared_ptr<MappedFile> file = MappedFile::Open(path);
+        if (!file || file->Size() < sizeof(CacheHeader)) {
+            return false;
+        }
+        CacheHeader header;
+        std::memcpy(&header, file->Data(), sizeof(header));
+        header.key[sizeof(header.key) - 1] = '\0';
+        if (std::memcmp(header.magic, CacheMagic, sizeof(CacheMagic)) != 0 || header.version != CacheVersion
+            || header.fileBytes != file->Size() || key != header.key || header.levelCount == 0
+            || header.levelCount > MaximumLevels
+            || header.dictionaryOffset + header.dictionaryBytes > file->Size()) {
+            return false;
+        }
+        std::vector<std::pair<unsigned int, ImageType::Pointer>> levels;
+        ImageType::Pointer base;
+        for (std::uint32_t i = 0; i < header.levelCount; ++i) {
+            const LevelRecord &record = header.levels[i];
+            const std::uint64_t expected =
+                record.size[0] * record.size[1] * record.size[2] * sizeof(PixelType);
+            if (record.dataBytes != expected || record.dataOffset % Alignment != 0
+                || record.dataOffset + record.dataBytes > file->Size()) {
+                return false;
+            }
+            ImageType::Pointer image = MapLevel(file, record);
+            if (record.factor <= 1) {
+                base = image;
+            } else {
+                levels.emplace_back(record.factor, image);
+            }
+        }
+        if (!base) {
+            return false;
+        }
+        volume.image = base;
+        volume.pyramid = ImagePyramid::FromLevels(base.GetPointer(), levels);
+        volume.dictionary = ParseDictionary(reinterpret_cast<const char *>(file->Data() + header.dictionaryOffset),
+                                            static_cast<std::size_t>(header.dictionaryBytes));
+        itksys::SystemTools::Touch(path, false); // 刷新最近使用时间，供淘汰排序
+        return true;
+    } catch (const std::exception &) {
+        return false;
+    }
+}
+
+bool StoreCachedVolume(const VolumeCacheSettings &settings,
+                       const std::string &key,
+                       const ImageType *image,
+                       const ImagePyramid *pyramid,
+                       const itk::MetaDataDictionary &dictionary)
+{
+    if (!settings.enabled || key.empty() || key.size() >= sizeof(CacheHeader::key) || !image) {
+        return false;
+    }
+    std::vector<std::pair<unsigned int, const ImageType *>> levels{{1u, image}};
+    if (pyramid) {
+        for (unsigned int factor : pyramid->GetFactors()) {
+            if (factor <= 1) {
+                continue; // 原图即 image；分块原图的金字塔取 factor 1 会读出整个体数据
+            }
+            ImageType::ConstPointer level = pyramid->GetLevel(factor);
+            if (level && levels.size() < MaximumLevels) {
+                levels.emplace_back(factor, level.GetPointer());
+            }
+        }
+    }
+    const std::string tags = SerializeDictionary(dictionary);
+
+    CacheHeader header{};
+    std::memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+    header.version = CacheVersion;
+    header.levelCount = static_cast<std::uint32_t>(levels.size());
+    std::memcpy(header.key, key.c_str(), key.size() + 1);
+    header.dictionaryOffset = sizeof(CacheHeader);
+    header.dictionaryBytes = tags.size();
+    std::uint64_t offset = AlignUp(header.dictionaryOffset + header.dictionaryBytes);
+    for (std::size_t i = 0; i < levels.size(); ++i) {
+        header.levels[i] = RecordOf(levels[i].first, levels[i].second);
+        header.levels[i].dataOffset = offset;
+        offset = AlignUp(offset + header.levels[i].dataBytes);
+    }
+    header.fileBytes = offset;
+
+    const std::string directory = CacheDirectory(settings);
+    const std::string path = CachePath(settings, key);
+    if (!itksys::SystemTools::MakeDirectory(directory)) {
+        return false;
+    }
+    std::random_device random;
+    const std::string temporary = path + "." + std::to_string(random()) + ".tmp";
+    std::FILE *file = itksys::SystemTools::Fopen(temporary, "wb");
+    if (!file) {
+        return false;
+    }
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1
+           && std::fwrite(tags.data(), 1, tags.size(), file) == tags.size();
+    std::uint64_t written = header.dictionaryOffset + header.dictionaryBytes;
+    for (std::size_t i = 0; ok && i < levels.size(); ++i) {
+        const LevelRecord &record = header.levels[i];
+        ok = WriteZeros(file, record.dataOffset - written)
+          && std::fwrite(levels[i].second->GetBufferPointer(), 1, static_cast<std::size_t>(record.dataBytes), file)
+                 == record.dataBytes;
+        written = record.dataOffset + record.dataBytes;
+    }
+    ok = ok && WriteZeros(file, header.fileBytes - written);
+    ok = std::fclose(file) == 0 && ok;
+    if (!ok || !itksys::SystemTools::RenameFile(temporary, path)) {
+        // 写入失败，或另一个进程已写好同一键且正在映射（Windows 上无法替换）
+        itksys::SystemTools::RemoveFile(temporary);
+        return ok && itksys::SystemTools::FileExists(path, true);
+    }
+    PruneCache(settings, path);
+    return true;
+}
+
+} // namespace dicomstitcher
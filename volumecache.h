@@ -0,0 +1,55 @@
+﻿#ifndef VOLUMECACHE_H
+#define VOLUMECACHE_H
+
+#include "pipelinecommon.h"
+#include "imagepreprocessing.h"
+#include "imagepyramid.h"
+
+#include <itkMetaDataDictionary.h>
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace dicomstitcher {
+
+struct VolumeCacheSettings
+{
+    bool enabled{true};
+    std::string directory;                          // 为空时使用 DefaultVolumeCacheDirectory()
+    std::uint64_t maximumBytes{std::uint64_t(16) << 30}; // 超出后按最近使用时间淘汰
+};
+
+// ApplicationCacheDirectory() 下的 volumes
+std::string DefaultVolumeCacheDirectory();
+
+// 缓存键：序列 UID + 输入文件（数量、文件名、首末文件的大小与修改时间）+ 预处理参数 + 金字塔倍数。
+// seriesUID 为空时返回空串（不缓存）
+std::string MakeVolumeCacheKey(const std::string &seriesUID,
+                               const std::vector<std::string> &files,
+                               const SpacingPolicy &policy,
+                               const std::vector<unsigned int> &pyramidFactors);
+
+struct CachedVolume
+{
+    ImageType::Pointer image;
+    ImagePyramid::Pointer pyramid;
+    itk::MetaDataDictionary dictionary; // 只保存字符串类型的标签
+};
+
+// 命中时把缓存文件整体映射（写时复制）为各层级的像素缓冲，不读取、不复制像素；
+// 多个进程映射同一文件时共享系统页缓存。映射在最后一个引用它的图像释放时解除。
+// 未命中、文件损坏或键不符时返回 false，不抛异常。
+bool LoadCachedVolume(const VolumeCacheSettings &settings, const std::string &key, CachedVolume &volume);
+
+// 写入缓存：固定头 + 标签 + 各层级的原始 short 数据，每段按 64 KiB 对齐（满足各平台的映射粒度）。
+// 先写临时文件再改名，并发写同一键时保留先完成的一份；写入后按 maximumBytes 淘汰旧文件。失败返回 false。
+bool StoreCachedVolume(const VolumeCacheSettings &settings,
+                       const std::string &key,
+                       const ImageType *image,
+                       const ImagePyramid *pyramid,
+                       const itk::MetaDataDictionary &dictionary);
+
+} // namespace dicomstitcher
+
+#endif // VOLUMECACHE_H
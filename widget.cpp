@@ -5,12 +5,26 @@
 # pragma execution_character_set("utf-8")
 #endif
 
+#include <QComboBox>
+#include <QDoubleSpinBox>
 #include <QFileDialog>
+#include <QFileInfo>
+#include <QInputDialog>
+#include <QKeyEvent>
 #include <QMessageBox>
+#include <QMouseEvent>
+#include <QWheelEvent>
+#include <QPushButton>
 #include <QRadioButton>
+#include <QScrollBar>
+#include <QCheckBox>
 #include <QString>
+#include <QStringList>
+#include <QtConcurrent/QtConcurrentRun>
 
 #include <algorithm>
+#include <chrono>
+#include <cstdio>
 #include <cstring>
 #include <cmath>
 
@@ -23,35 +37,51 @@ VTK_MODULE_INIT(vtkRenderingFreeType);
 #include <QVTKOpenGLNativeWidget.h>
 #include <vtkGenericOpenGLRenderWindow.h>
 #include <vtkRenderer.h>
+#include <vtkCamera.h>
 #include <vtkCommand.h>
 #include <vtkCornerAnnotation.h>
 #include <vtkTextProperty.h>
 #include <vtkCellPicker.h>
 #include <vtkInteractorStyleImage.h>
 #include <vtkRenderWindowInteractor.h>
-#include <vtkImageBlend.h>
-
-#include <itkImageSeriesReader.h>
-#include <itkGDCMImageIO.h>
-#include <itkGDCMSeriesFileNames.h>
-#include <itkOrientImageFilter.h>
-#include <itkResampleImageFilter.h>
-#include <itkLinearInterpolateImageFunction.h>
+
 #include <itkTranslationTransform.h>
 #include <itkTransform.h>
 #include <itkMetaDataObject.h>
 
+#include "brickedvolume.h"
+#include "imagepreprocessing.h"
+#include "instrumentation.h"
+
+namespace {
+
+QString StageDisplayName(const std::string &name)
+{
+    if (name == "load.scan") return QString::fromUtf8("扫描");
+    if (name == "load.cache") return QString::fromUtf8("缓存");
+    if (name == "load.cache_store") return QString::fromUtf8("写入缓存");
+    if (name == "load.decode") return QString::fromUtf8("读取");
+    if (name == "load.preview") return QString::fromUtf8("预览");
+    if (name == "load.resample") return QString::fromUtf8("重采样");
+    if (name == "load.pyramid") return QString::fromUtf8("金字塔");
+    if (name == "load.bricks") return QString::fromUtf8("分块");
+    if (name == "load.vtk") return QString::fromUtf8("显示数据");
+    return QString::fromStdString(name);
+}
+
+} // namespace
+
 Widget::Widget(QWidget *parent)
     : QWidget(parent)
     , ui(new Ui::Widget)
     , view_fixed(nullptr)
     , view_moving(nullptr)
     , view_fusion(nullptr)
+    , view_difference(nullptr)
     , renderWindow_main(nullptr)
     , renderWindow_moving(nullptr)
     , renderWindow_fusion(nullptr)
-    , m_sliceObserverTag(0)
-    , m_sliceObserverTagMoving(0)
+    , renderWindow_difference(nullptr)
     , m_fusionOpacity(0.5)
     , m_patientName("N/A")
     , m_patientID("N/A")
@@ -61,13 +91,45 @@ Widget::Widget(QWidget *parent)
     , m_movingLoaded(false)
 {
     ui->setupUi(this);
+    m_tracePath = qEnvironmentVariable("DICOMSTITCHER_TRACE");
+    if (m_tracePath == "0") {
+        m_tracePath.clear();
+    }
+    // 分块体数据的常驻内存预算，环境变量 DICOMSTITCHER_RESIDENT_MB 可覆盖默认的 1024 MB；
+    // 分块临时文件的目录由 DICOMSTITCHER_BRICK_DIR 指定，默认为用户缓存目录下的 bricks
+    bool residentOk = false;
+    const qulonglong residentMB = qEnvironmentVariable("DICOMSTITCHER_RESIDENT_MB").toULongLong(&residentOk);
+    m_brickPool = dicomstitcher::BrickPool::Create(std::size_t(residentOk && residentMB > 0 ? residentMB : 1024) << 20,
+                                                   qEnvironmentVariable("DICOMSTITCHER_BRICK_DIR").toStdString());
     connect(ui->btn_load_fixed, &QPushButton::clicked, this, &Widget::onOpenDicom);
     connect(ui->btn_load_moving, &QPushButton::clicked, this, &Widget::onOpenMoving);
+    connect(ui->btn_cancel_load, &QPushButton::clicked, this, &Widget::onCancelLoad);
+    connect(ui->btn_start_stitching, &QPushButton::clicked, this, &Widget::onStartStitching);
+    connect(ui->btn_export_result, &QPushButton::clicked, this, &Widget::onExportResult);
+    ui->btn_cancel_load->setEnabled(false);
+
+    // 默认各向同性 1 mm，与以往行为一致
+    ui->combo_spacing_mode->setCurrentIndex(static_cast<int>(dicomstitcher::SpacingMode::Isotropic));
+    connect(ui->combo_spacing_mode, QOverload<int>::of(&QComboBox::currentIndexChanged),
+            this, &Widget::onSpacingModeChanged);
+    onSpacingModeChanged(ui->combo_spacing_mode->currentIndex());
+    // "按内存自动"时单个体数据的上限，环境变量 DICOMSTITCHER_AUTO_SPACING_MB 可覆盖默认的 1024 MB
+    bool budgetOk = false;
+    const qulonglong budgetMB = qEnvironmentVariable("DICOMSTITCHER_AUTO_SPACING_MB").toULongLong(&budgetOk);
+    if (budgetOk && budgetMB > 0) {
+        m_spacingMemoryBudget = static_cast<std::size_t>(budgetMB) << 20;
+    }
+
+    // 粗对齐默认按骨骼匹配；切换方式后对已加载的两组数据重新计算
+    ui->combo_coarse_mode->setCurrentIndex(static_cast<int>(dicomstitcher::CoarseAlignmentMode::Bone));
+    connect(ui->combo_coarse_mode, QOverload<int>::of(&QComboBox::currentIndexChanged),
+            this, &Widget::onCoarseModeChanged);
     
     // 获取 UI 中的 QVTKOpenGLNativeWidget（单视图）
     view_fixed = ui->view_fixed;
     view_moving = ui->view_moving;
     view_fusion = ui->view_fusion;
+    view_difference = ui->view_difference;
     
     // 单视图渲染窗口与 viewer
     renderWindow_main = vtkGenericOpenGLRenderWindow::New();
@@ -141,14 +203,96 @@ Widget::Widget(QWidget *parent)
     m_annotFusion->SetMaximumFontSize(14);
     m_viewerFusion->GetRenderer()->AddViewProp(m_annotFusion);
 
+    // 差值视图（|Fixed − Moving|，已映射为 8 位灰度）
+    renderWindow_difference = vtkGenericOpenGLRenderWindow::New();
+    view_difference->setRenderWindow(renderWindow_difference);
+    m_viewerDifference = vtkSmartPointer<vtkResliceImageViewer>::New();
+    m_viewerDifference->SetRenderWindow(renderWindow_difference);
+    m_viewerDifference->SetupInteractor(renderWindow_difference->GetInteractor());
+    m_viewerDifference->SetSliceOrientationToXY();
+    {
+        auto dummy = vtkSmartPointer<vtkImageData>::New();
+        dummy->SetDimensions(1, 1, 1);
+        dummy->AllocateScalars(VTK_UNSIGNED_CHAR, 1);
+        std::memset(dummy->GetScalarPointer(), 0, sizeof(unsigned char));
+        m_viewerDifference->SetInputData(dummy);
+        m_viewerDifference->SetSlice(0);
+        m_viewerDifference->SetColorWindow(255.0);
+        m_viewerDifference->SetColorLevel(127.5);
+    }
+    m_annotDifference = vtkSmartPointer<vtkCornerAnnotation>::New();
+    m_annotDifference->GetTextProperty()->SetColor(1.0, 1.0, 0.0);
+    m_annotDifference->SetMaximumFontSize(12);
+    m_viewerDifference->GetRenderer()->AddViewProp(m_annotDifference);
+
+    // 各视图的重绘统一经调度器合并，每帧最多渲染一次
+    m_renderMain = m_renders.addView("Fixed", renderWindow_main, [this]() { m_viewerMain->Render(); });
+    m_renderMoving = m_renders.addView("Moving", renderWindow_moving, [this]() { m_viewerMoving->Render(); });
+    m_renderFusion = m_renders.addView("Fusion", renderWindow_fusion, [this]() { m_viewerFusion->Render(); });
+    m_renderDifference = m_renders.addView("Difference", renderWindow_difference,
+                                           [this]() { m_viewerDifference->Render(); });
+    m_showFrameStats = qEnvironmentVariableIntValue("DICOMSTITCHER_FRAME_STATS") != 0;
+
+    // 融合切片已是窗宽窗位映射后的 RGB，fusion viewer 保持恒等映射；
+    // 在 Fixed 视图调整窗宽窗位时同步刷新融合切片（优先级低于 viewer 自身的回调，读到的是新值）
+    m_windowLevelCallback = vtkSmartPointer<vtkCallbackCommand>::New();
+    m_windowLevelCallback->SetCallback(Widget::WindowLevelChangedCallback);
+    m_windowLevelCallback->SetClientData(this);
+    if (auto *style = m_viewerMain->GetInteractorStyle()) {
+        style->AddObserver(vtkCommand::WindowLevelEvent, m_windowLevelCallback, -1.0f);
+        style->AddObserver(vtkCommand::ResetWindowLevelEvent, m_windowLevelCallback, -1.0f);
+    }
+
+    // 不透明度与融合方式只重新混合当前切片
+    connect(ui->scroll_opacity, &QScrollBar::valueChanged, this, &Widget::onFusionOpacityChanged);
+    connect(ui->chk_fusion_overlay, &QCheckBox::toggled, this, &Widget::onFusionModeToggled);
+    onFusionOpacityChanged(ui->scroll_opacity->value());
+    // 融合视图的键盘 / 鼠标微调先于 VTK 交互器处理
+    view_fusion->setFocusPolicy(Qt::StrongFocus);
+    view_fusion->installEventFilter(this);
+
+    // 勾选后差值视图与统计只看骨骼，软组织的形变不干扰对齐判断
+    connect(ui->chk_check_alignment, &QCheckBox::toggled, this, &Widget::onCheckAlignmentToggled);
+    m_fusionSlices.SetDifferenceBoneOnly(ui->chk_check_alignment->isChecked());
+
     // 单选框切换方向
     connect(ui->radio_orient_axial, &QRadioButton::toggled, this, &Widget::onOrientationToggled);
     connect(ui->radio_orient_coronal, &QRadioButton::toggled, this, &Widget::onOrientationToggled);
     connect(ui->radio_orient_sagittal, &QRadioButton::toggled, this, &Widget::onOrientationToggled);
+
+    // Fixed / Moving 视图的输入只有当前一层，VTK 的滚轮翻页在这一层内无处可翻，改为在 eventFilter 中翻页
+    view_fixed->installEventFilter(this);
+    view_moving->installEventFilter(this);
 }
 
 Widget::~Widget()
 {
+    // 先停掉后台任务，避免工作线程在 Widget 析构后回调
+    for (LoadTarget target : {LoadTarget::Fixed, LoadTarget::Moving}) {
+        LoadTask &task = loadTask(target);
+        task.cancel.Cancel();
+        if (task.indexWatcher) {
+            task.indexWatcher->disconnect(this);
+        }
+        if (task.watcher) {
+            task.watcher->disconnect(this);
+        }
+    }
+    m_coarseCancel.Cancel();
+    if (m_coarseWatcher) {
+        m_coarseWatcher->disconnect(this);
+    }
+    m_registrationCancel.Cancel();
+    if (m_registrationWatcher) {
+        m_registrationWatcher->disconnect(this);
+    }
+    m_exportCancel.Cancel();
+    if (m_exportWatcher) {
+        m_exportWatcher->disconnect(this);
+    }
+    // 包括已被取代、仍在收尾的旧任务
+    m_taskPool.waitForDone();
+
     if (renderWindow_main) {
         renderWindow_main->Delete();
     }
@@ -158,6 +302,9 @@ Widget::~Widget()
     if (renderWindow_fusion) {
         renderWindow_fusion->Delete();
     }
+    if (renderWindow_difference) {
+        renderWindow_difference->Delete();
+    }
     delete ui;
 }
 
@@ -168,238 +315,1099 @@ void Widget::onOpenDicom()
     if (dirPath.isEmpty()) {
         return;
     }
+    startIndexScan(LoadTarget::Fixed, dirPath);
+}
 
-    UpdateStatus(QString::fromUtf8("读取 Fixed 序列..."), 5);
+void Widget::onOpenMoving()
+{
+    const QString dirPath =
+        QFileDialog::getExistingDirectory(this, QString::fromUtf8("选择 DICOM 目录"));
+    if (dirPath.isEmpty()) {
+        return;
+    }
+    startIndexScan(LoadTarget::Moving, dirPath);
+}
 
-    using ReaderType = itk::ImageSeriesReader<ImageType>;
-    auto reader = ReaderType::New();
-    auto gdcmIO = itk::GDCMImageIO::New();
-    auto fileNames = itk::GDCMSeriesFileNames::New();
+void Widget::onCancelLoad()
+{
+    for (LoadTarget target : {LoadTarget::Fixed, LoadTarget::Moving}) {
+        LoadTask &task = loadTask(target);
+        if ((task.watcher && task.watcher->isRunning()) || (task.indexWatcher && task.indexWatcher->isRunning())) {
+            task.cancel.Cancel();
+        }
+    }
+    if (m_coarseWatcher && m_coarseWatcher->isRunning()) {
+        m_coarseCancel.Cancel();
+    }
+    if (m_registrationWatcher && m_registrationWatcher->isRunning()) {
+        m_registrationCancel.Cancel();
+    }
+    if (m_exportWatcher && m_exportWatcher->isRunning()) {
+        m_exportCancel.Cancel();
+    }
+    UpdateStatus(QString::fromUtf8("正在取消..."));
+}
 
-    fileNames->SetUseSeriesDetails(true);
-    fileNames->AddSeriesRestriction("0008|0021");
-    fileNames->SetDirectory(dirPath.toStdString());
+void Widget::onSpacingModeChanged(int index)
+{
+    const auto mode = static_cast<dicomstitcher::SpacingMode>(index);
+    ui->spin_target_spacing->setEnabled(mode == dicomstitcher::SpacingMode::ThroughPlane
+                                        || mode == dicomstitcher::SpacingMode::Isotropic);
+}
+
+void Widget::onFusionOpacityChanged(int value)
+{
+    const int maximum = std::max(1, ui->scroll_opacity->maximum());
+    m_fusionOpacity = static_cast<double>(value) / maximum;
+    m_fusionSlices.SetOpacity(m_fusionOpacity);
+    updateFusionView(false);
+}
 
-    const auto &seriesUIDs = fileNames->GetSeriesUIDs();
-    if (seriesUIDs.empty()) {
+void Widget::onFusionModeToggled(bool overlay)
+{
+    m_fusionSlices.SetMode(overlay ? dicomstitcher::FusionMode::Overlay
+                                   : dicomstitcher::FusionMode::Blend);
+    updateFusionView(false);
+}
+
+void Widget::onCheckAlignmentToggled(bool boneOnly)
+{
+    m_fusionSlices.SetDifferenceBoneOnly(boneOnly);
+    updateDifferenceView(false);
+}
+
+dicomstitcher::SpacingPolicy Widget::currentSpacingPolicy() const
+{
+    dicomstitcher::SpacingPolicy policy;
+    policy.mode = static_cast<dicomstitcher::SpacingMode>(ui->combo_spacing_mode->currentIndex());
+    policy.spacing = ui->spin_target_spacing->value();
+    policy.memoryBudgetBytes = m_spacingMemoryBudget;
+    return policy;
+}
+
+Widget::LoadTask &Widget::loadTask(LoadTarget target)
+{
+    return target == LoadTarget::Fixed ? m_fixedLoad : m_movingLoad;
+}
+
+bool Widget::isLoading() const
+{
+    return (m_fixedLoad.watcher && m_fixedLoad.watcher->isRunning())
+        || (m_movingLoad.watcher && m_movingLoad.watcher->isRunning())
+        || (m_fixedLoad.indexWatcher && m_fixedLoad.indexWatcher->isRunning())
+        || (m_movingLoad.indexWatcher && m_movingLoad.indexWatcher->isRunning())
+        || (m_coarseWatcher && m_coarseWatcher->isRunning())
+        || (m_registrationWatcher && m_registrationWatcher->isRunning())
+        || (m_exportWatcher && m_exportWatcher->isRunning());
+}
+
+void Widget::startIndexScan(LoadTarget target, const QString &dirPath)
+{
+    LoadTask &task = loadTask(target);
+
+    // 重新选择目录：取消旧的扫描或加载，旧结果到达后按 generation 丢弃
+    task.cancel.Cancel();
+    task.cancel = dicomstitcher::CancelToken();
+    const quint64 generation = ++task.generation;
+    discardPreview(target);
+
+    if (!task.indexWatcher) {
+        task.indexWatcher = new QFutureWatcher<dicomstitcher::DicomIndexResult>(this);
+    }
+    task.indexWatcher->disconnect(this);
+    connect(task.indexWatcher, &QFutureWatcherBase::finished, this, [this, target, generation, dirPath]() {
+        onIndexFinished(target, generation, dirPath);
+    });
+
+    // 进度在工作线程中产生，排队到 GUI 线程后再刷新状态栏；ProgressRange 只在整数百分比变化时回调
+    const QString label = target == LoadTarget::Fixed ? "Fixed" : "Moving";
+    dicomstitcher::ProgressCallback progress =
+        [this, target, generation](const std::string &text, int value) {
+            const QString message = QString::fromStdString(text);
+            QMetaObject::invokeMethod(this, [this, target, generation, message, value]() {
+                if (loadTask(target).generation == generation) {
+                    UpdateStatus(message, value);
+                }
+            }, Qt::QueuedConnection);
+        };
+    const dicomstitcher::ProgressRange range(progress, "扫描 " + label.toStdString() + " 目录...", 0, 100);
+
+    const std::string directory = dirPath.toStdString();
+    const dicomstitcher::DicomIndexSettings settings;
+    const dicomstitcher::CancelToken cancel = task.cancel;
+    beginTraceRun();
+    range.Update(0.0);
+    task.indexWatcher->setFuture(QtConcurrent::run(&m_taskPool, [directory, settings, cancel, range]() {
+        dicomstitcher::ScopedStage stage("index.scan");
+        return dicomstitcher::ScanDicomDirectory(directory, settings, cancel, range.AsCallback());
+    }));
+    ui->btn_cancel_load->setEnabled(true);
+}
+
+void Widget::onIndexFinished(LoadTarget target, quint64 generation, const QString &dirPath)
+{
+    LoadTask &task = loadTask(target);
+    if (task.generation != generation || !task.indexWatcher) {
+        return;
+    }
+    const dicomstitcher::DicomIndexResult index = task.indexWatcher->result();
+    ui->btn_cancel_load->setEnabled(isLoading());
+
+    using Status = dicomstitcher::DicomIndexResult::Status;
+    if (index.status == Status::Cancelled) {
+        finishTraceRun();
+        UpdateStatus(QString::fromUtf8("加载已取消"), 0);
+        return;
+    }
+    if (index.status == Status::Failed) {
+        finishTraceRun();
+        QMessageBox::critical(this, QString::fromUtf8("错误"),
+                              QString::fromUtf8("扫描目录失败：%1")
+                                  .arg(QString::fromLocal8Bit(index.errorMessage.c_str())));
+        return;
+    }
+    if (index.series.empty()) {
+        finishTraceRun();
         QMessageBox::warning(this, QString::fromUtf8("提示"), QString::fromUtf8("未找到 DICOM 序列。"));
         return;
     }
 
-    reader->SetImageIO(gdcmIO);
-    reader->SetFileNames(fileNames->GetFileNames(seriesUIDs.front()));
+    // 多个序列时让用户选择；列表按层数降序，默认项为层数最多的序列
+    std::size_t chosen = 0;
+    if (index.series.size() > 1) {
+        QStringList items;
+        for (const auto &series : index.series) {
+            const QString description = series.description.empty()
+                                            ? QString::fromUtf8("（无描述）")
+                                            : QString::fromLocal8Bit(series.description.c_str());
+            items << QString::fromUtf8("%1 %2 | %3 层 | %4×%5 | %6×%7×%8 mm | 范围 %9×%10×%11 mm")
+                         .arg(QString::fromStdString(series.modality), description)
+                         .arg(series.files.size())
+                         .arg(series.columns)
+                         .arg(series.rows)
+                         .arg(series.spacing[0], 0, 'f', 2)
+                         .arg(series.spacing[1], 0, 'f', 2)
+                         .arg(series.spacing[2], 0, 'f', 2)
+                         .arg(series.extent[0], 0, 'f', 0)
+                         .arg(series.extent[1], 0, 'f', 0)
+                         .arg(series.extent[2], 0, 'f', 0);
+        }
+        bool ok = false;
+        const QString item = QInputDialog::getItem(
+            this, QString::fromUtf8("选择序列"),
+            QString::fromUtf8("目录中有 %1 个序列（%2 个文件取自索引缓存）：")
+                .arg(index.series.size())
+                .arg(index.filesCached),
+            items, 0, false, &ok);
+        // 对话框期间可能又选择了新目录
+        if (!ok || task.generation != generation) {
+            if (!ok) {
+                finishTraceRun();
+                UpdateStatus(QString::fromUtf8("加载已取消"), 0);
+            }
+            return;
+        }
+        chosen = static_cast<std::size_t>(std::max(0, items.indexOf(item)));
+    }
+    startLoad(target, dirPath, index.series[chosen]);
+}
 
-    try {
-        reader->Update();
-    } catch (const itk::ExceptionObject &ex) {
-        QMessageBox::critical(this, QString::fromUtf8("错误"),
-                              QString::fromUtf8("读取失败：%1").arg(QString::fromLocal8Bit(ex.what())));
+void Widget::startLoad(LoadTarget target, const QString &dirPath, const dicomstitcher::DicomSeriesInfo &series)
+{
+    LoadTask &task = loadTask(target);
+
+    // 开始新的加载即作废同一侧之前的任务，旧结果到达后按 generation 丢弃
+    task.cancel.Cancel();
+    task.cancel = dicomstitcher::CancelToken();
+    const quint64 generation = ++task.generation;
+    discardPreview(target);
+
+    // 粗对齐与配准依赖两侧数据，任一侧重新加载都会使进行中的计算失效
+    cancelCoarseAlignment();
+    cancelRegistration();
+
+    if (!task.watcher) {
+        task.watcher = new QFutureWatcher<dicomstitcher::SeriesLoadResult>(this);
+    }
+    task.watcher->disconnect(this);
+    connect(task.watcher, &QFutureWatcherBase::finished, this, [this, target, generation]() {
+        onLoadFinished(target, generation);
+    });
+
+    dicomstitcher::SeriesLoadRequest request;
+    request.directory = dirPath.toStdString();
+    request.fileNames = series.files;
+    request.seriesUID = series.seriesUID;
+    request.label = target == LoadTarget::Fixed ? "Fixed" : "Moving";
+    request.spacing = currentSpacingPolicy();
+    request.readerThreads = m_readerThreads;
+    request.brickPool = m_brickPool;
+
+    // 进度在工作线程中产生，排队到 GUI 线程后再刷新状态栏
+    dicomstitcher::ProgressCallback progress =
+        [this, target, generation](const std::string &text, int value) {
+            const QString message = QString::fromStdString(text);
+            QMetaObject::invokeMethod(this, [this, target, generation, message, value]() {
+                if (loadTask(target).generation == generation) {
+                    UpdateStatus(message, value);
+                }
+            }, Qt::QueuedConnection);
+        };
+
+    // 渐进加载：预览与细化通知同样排队到 GUI 线程，被新加载取代后按 generation 丢弃
+    request.preview = [this, target, generation](const dicomstitcher::SeriesPreview &preview) {
+        QMetaObject::invokeMethod(this, [this, target, generation, preview]() {
+            if (loadTask(target).generation == generation) {
+                applyPreview(target, preview);
+            }
+        }, Qt::QueuedConnection);
+    };
+
+    const dicomstitcher::CancelToken cancel = task.cancel;
+    task.watcher->setFuture(QtConcurrent::run(&m_taskPool, [request, cancel, progress]() {
+        return dicomstitcher::LoadSeries(request, cancel, progress);
+    }));
+    ui->btn_cancel_load->setEnabled(true);
+}
+
+void Widget::onLoadFinished(LoadTarget target, quint64 generation)
+{
+    LoadTask &task = loadTask(target);
+    if (task.generation != generation || !task.watcher) {
         return;
     }
+    dicomstitcher::SeriesLoadResult result = task.watcher->result();
+    ui->btn_cancel_load->setEnabled(isLoading());
+    finishTraceRun();
+
+    // 成功时最终结果接替预览（网格相同）；失败或取消时换回加载前显示的数据
+    const bool previewed = static_cast<bool>(task.preview.vtkImage);
+    if (result.status != dicomstitcher::SeriesLoadResult::Status::Ok) {
+        discardPreview(target);
+    }
+    task.preview = dicomstitcher::SeriesPreview();
+    task.previewGrid = dicomstitcher::ImageGrid();
 
-    UpdateStatus(QString::fromUtf8("方向标准化 (Fixed) ..."), 15);
-    ImageType::Pointer oriented = OrientToRAS(reader->GetOutput());
+    using Status = dicomstitcher::SeriesLoadResult::Status;
+    switch (result.status) {
+    case Status::Cancelled:
+        UpdateStatus(QString::fromUtf8("加载已取消"), 0);
+        return;
+    case Status::NoSeries:
+        QMessageBox::warning(this, QString::fromUtf8("提示"), QString::fromUtf8("未找到 DICOM 序列。"));
+        return;
+    case Status::Failed:
+        if (result.errorMessage.empty()) {
+            QMessageBox::warning(this, QString::fromUtf8("提示"), QString::fromUtf8("转换图像失败。"));
+        } else {
+            QMessageBox::critical(this, QString::fromUtf8("错误"),
+                                  QString::fromUtf8("读取失败：%1")
+                                      .arg(QString::fromLocal8Bit(result.errorMessage.c_str())));
+        }
+        return;
+    case Status::Ok:
+        break;
+    }
+
+    if (target == LoadTarget::Fixed) {
+        applyFixedResult(result, previewed);
+    } else {
+        applyMovingResult(result, previewed);
+    }
+}
+
+void Widget::applyPreview(LoadTarget target, const dicomstitcher::SeriesPreview &preview)
+{
+    LoadTask &task = loadTask(target);
+    const bool fixed = target == LoadTarget::Fixed;
+    vtkResliceImageViewer *viewer = fixed ? m_viewerMain.GetPointer() : m_viewerMoving.GetPointer();
+    if (!viewer || !preview.vtkImage) {
+        return;
+    }
+
+    if (task.preview.vtkImage == preview.vtkImage) {
+        // 细化：工作线程已原位改写像素，标记修改后显示管线重新取数；各分块完成的通知可能乱序到达。
+        // 渲染时其他分块可能仍在写入，画面只会是新旧像素的混合，下一次通知时重画
+        task.preview.refined = std::max(task.preview.refined, preview.refined);
+        preview.vtkImage->Modified();
+        m_renders.requestRender(fixed ? m_renderMain : m_renderMoving);
+        UpdateAnnotations();
+        return;
+    }
+
+    // 预览期间视图显示整个预览体数据（updateSliceView），加载完成后换回按切片读取分块
+    task.preview = preview;
+    task.previewGrid = dicomstitcher::GridOf(preview.image.GetPointer());
+    viewer->SetColorWindow(2000.0);
+    viewer->SetColorLevel(40.0);
+
+    // 与加载完成时相同的定位点与方向；最终结果到达后沿用，不再重置
+    if (fixed) {
+        m_cursor = dicomstitcher::ComputeCenter(task.previewGrid);
+        m_cursorValid = true;
+        m_scrollDirection = 0;
+        setOrientation(Orientation::Axial);
+        if (ui->radio_orient_axial) {
+            ui->radio_orient_axial->setChecked(true);
+        }
+    } else {
+        if (!m_cursorValid) {
+            m_cursor = dicomstitcher::ComputeCenter(task.previewGrid);
+            m_cursorValid = true;
+        }
+        setOrientation(m_orientation);
+    }
+    UpdateAnnotations();
+}
+
+void Widget::discardPreview(LoadTarget target)
+{
+    LoadTask &task = loadTask(target);
+    if (!task.preview.vtkImage) {
+        return;
+    }
+    task.preview = dicomstitcher::SeriesPreview();
+    task.previewGrid = dicomstitcher::ImageGrid();
+
+    // 此前已有数据时由 setOrientation 换回分块中的当前切片
+    const bool fixed = target == LoadTarget::Fixed;
+    vtkResliceImageViewer *viewer = fixed ? m_viewerMain.GetPointer() : m_viewerMoving.GetPointer();
+    if (!(fixed ? m_fixedLoaded : m_movingLoaded)) {
+        // 此前没有数据：回到启动时的占位空图
+        auto dummy = vtkSmartPointer<vtkImageData>::New();
+        dummy->SetDimensions(1, 1, 1);
+        dummy->AllocateScalars(VTK_UNSIGNED_CHAR, 1);
+        std::memset(dummy->GetScalarPointer(), 0, sizeof(unsigned char));
+        viewer->SetInputData(dummy);
+        viewer->SetSlice(0);
+        viewer->SetColorWindow(255.0);
+        viewer->SetColorLevel(127.0);
+        (fixed ? m_annotMain : m_annotMoving)->ClearAllTexts();
+        if (!m_fixedLoaded && !m_movingLoaded) {
+            m_cursorValid = false;
+        }
+    }
+    setOrientation(m_orientation);
+    UpdateAnnotations();
+}
 
-    UpdateStatus(QString::fromUtf8("各向同性重采样 1mm (Fixed) ..."), 35);
-    m_fixedResampled = ResampleToIsotropic(oriented.GetPointer(), 1.0);
+void Widget::applyFixedResult(dicomstitcher::SeriesLoadResult &result, bool previewed)
+{
+    // 加载结果只保留分块，视图按切片读取，配准与导出按区域读取
+    m_fixedBricks = result.bricks;
+    m_fixedSlice = SliceView();
+    m_fixedDictionary = result.dictionary;
+    m_fixedPyramid = result.pyramid ? result.pyramid : dicomstitcher::ImagePyramid::WithBrickedBase(result.bricks, nullptr);
 
     // 不读取患者元信息，避免中文编码带来的潜在崩溃
     m_patientName = "N/A";
     m_patientID   = "N/A";
 
-    m_vtkFixed = ItkToVtkImage(m_fixedResampled.GetPointer());
-    if (!m_vtkFixed) {
-        QMessageBox::warning(this, QString::fromUtf8("提示"), QString::fromUtf8("转换图像失败。"));
-        return;
-    }
-    m_movingCoarseOnFixed = nullptr;
     m_vtkFusion = nullptr;
+    m_fixedLoaded = true;
+    updateFusionSource();
 
-    if (m_viewerMain) {
-        m_viewerMain->SetInputData(nullptr);
-    }
-    m_viewerMain->SetInputData(m_vtkFixed);
     if (m_viewerFusion) {
-        m_viewerFusion->SetInputData(m_vtkFixed);
-        m_viewerFusion->SetSlice(0);
-        m_viewerFusion->Render();
+        m_viewerFusion->SetColorWindow(255.0);
+        m_viewerFusion->SetColorLevel(127.5);
     }
-    m_fixedLoaded = true;
 
-    // 计算各个方向的中间切片索引
-    const auto region = m_fixedResampled->GetLargestPossibleRegion();
-    const auto size = region.GetSize();
-    const int axialMax = std::max<int>(0, static_cast<int>(size[2]) - 1);
-    const int sagittalMax = std::max<int>(0, static_cast<int>(size[0]) - 1);
-    const int coronalMax = std::max<int>(0, static_cast<int>(size[1]) - 1);
+    if (previewed) {
+        // 预览阶段已设置定位点、窗宽窗位与方向，用户在预览上的调整保持不变，只换数据并同步其余视图；
+        // 融合视图此前没有显示，单独设置方向与相机（融合切片有缓存，不会重复计算）
+        syncViewsToCursor();
+        updateFusionView(true);
+        m_renders.requestAll();
+    } else {
+        // 定位点放在 Fixed 的几何中心
+        m_cursor = dicomstitcher::ComputeCenter(m_fixedBricks->Grid());
+        m_cursorValid = true;
+        m_scrollDirection = 0;
+
+        // 默认窗宽/窗位
+        m_viewerMain->SetColorWindow(2000.0);
+        m_viewerMain->SetColorLevel(40.0);
+
+        // 默认方向：Axial，更新 viewer
+        setOrientation(Orientation::Axial);
+        if (ui->radio_orient_axial) {
+            ui->radio_orient_axial->setChecked(true);
+        }
+    }
+    UpdateAnnotations();
+    showStageTimings(QString::fromUtf8("Fixed 加载完成"), result.stages);
+}
+
+void Widget::applyMovingResult(dicomstitcher::SeriesLoadResult &result, bool previewed)
+{
+    m_movingBricks = result.bricks;
+    m_movingSlice = SliceView();
+    m_movingPyramid = result.pyramid ? result.pyramid : dicomstitcher::ImagePyramid::WithBrickedBase(result.bricks, nullptr);
 
-    m_sliceAxial = std::clamp(static_cast<int>(size[2] / 2), 0, axialMax);
-    m_sliceSagittal = std::clamp(static_cast<int>(size[0] / 2), 0, sagittalMax);
-    m_sliceCoronal = std::clamp(static_cast<int>(size[1] / 2), 0, coronalMax);
+    m_patientNameMoving = "N/A";
+    m_patientIDMoving   = "N/A";
 
-    // 默认窗宽/窗位
-    m_viewerMain->SetColorWindow(2000.0);
-    m_viewerMain->SetColorLevel(40.0);
+    // 还没有 Fixed 时定位点暂取 Moving 的几何中心（此时没有融合变换，两者坐标相同）
+    if (!m_cursorValid) {
+        m_cursor = dicomstitcher::ComputeCenter(m_movingBricks->Grid());
+        m_cursorValid = true;
+    }
 
-    // 默认方向：Axial，更新 viewer
-    setOrientation(Orientation::Axial);
-    if (ui->radio_orient_axial) {
-        ui->radio_orient_axial->setChecked(true);
+    if (!previewed) {
+        m_viewerMoving->SetColorWindow(2000.0);
+        m_viewerMoving->SetColorLevel(40.0);
     }
 
-    // 注册 VTK -> Qt 的交互回调，实现滚轮同步（仅固定视图）
-    registerSliceObserver(m_viewerMain, m_sliceCallback, m_sliceObserverTag);
+    m_movingLoaded = true;
+    updateFusionSource();
+
+    if (previewed) {
+        // 方向、窗宽窗位与相机沿用预览阶段的设置
+        syncViewsToCursor();
+        updateFusionView(true);
+        m_renders.requestAll();
+    } else {
+        setOrientation(m_orientation); // 同步当前方向到 moving / fusion
+    }
     UpdateAnnotations();
-    UpdateStatus(QString::fromUtf8("Fixed 加载完成"), 50);
+    showStageTimings(QString::fromUtf8("Moving 加载完成"), result.stages);
 }
 
-void Widget::onOpenMoving()
+void Widget::onCoarseModeChanged(int)
 {
-    const QString dirPath =
-        QFileDialog::getExistingDirectory(this, QString::fromUtf8("选择 DICOM 目录"));
-    if (dirPath.isEmpty()) {
+    if (!m_fixedLoaded || !m_movingLoaded) {
         return;
     }
+    // 配准结果以旧的粗对齐为起点，切换方式后一并作废
+    cancelRegistration();
+    updateFusionSource();
+    syncViewsToCursor();
+}
 
-    using ReaderType = itk::ImageSeriesReader<ImageType>;
-    auto reader = ReaderType::New();
-    auto gdcmIO = itk::GDCMImageIO::New();
-    auto fileNames = itk::GDCMSeriesFileNames::New();
+void Widget::updateFusionSource()
+{
+    cancelCoarseAlignment();
+    m_fusionTransform = nullptr;
+    resetManualAlignment();
+    if (!m_fixedLoaded || !m_fixedBricks) {
+        m_fusionSlices.SetBrickedImages(nullptr, nullptr);
+        return;
+    }
+    if (!m_movingLoaded || !m_movingBricks) {
+        m_fusionSlices.SetBrickedImages(m_fixedBricks, nullptr);
+        return;
+    }
 
-    fileNames->SetUseSeriesDetails(true);
-    fileNames->AddSeriesRestriction("0008|0021");
-    fileNames->SetDirectory(dirPath.toStdString());
+    // 先用几何中心平移（Fixed → Moving）立即显示，其余方式在后台计算完成后替换
+    using TranslationType = itk::TranslationTransform<double, 3>;
+    auto transform = TranslationType::New();
+    const auto centerF = dicomstitcher::ComputeCenter(m_fixedBricks->Grid());
+    const auto centerM = dicomstitcher::ComputeCenter(m_movingBricks->Grid());
+    TranslationType::OutputVectorType delta;
+    delta[0] = centerM[0] - centerF[0];
+    delta[1] = centerM[1] - centerF[1];
+    delta[2] = centerM[2] - centerF[2];
+    transform->Translate(delta);
+    m_fusionTransform = transform.GetPointer();
+    resetManualAlignment();
+
+    m_fusionSlices.SetBrickedImages(m_fixedBricks, m_movingBricks);
+    m_fusionSlices.SetTransform(m_fusionTransform);
+
+    if (ui->combo_coarse_mode->currentIndex()
+        != static_cast<int>(dicomstitcher::CoarseAlignmentMode::GeometricCenter)) {
+        startCoarseAlignment();
+    }
+}
 
-    const auto &seriesUIDs = fileNames->GetSeriesUIDs();
-    if (seriesUIDs.empty()) {
-        QMessageBox::warning(this, QString::fromUtf8("提示"), QString::fromUtf8("未找到 DICOM 序列。"));
+const itk::Transform<double, 3> *Widget::displayedTransform() const
+{
+    return m_previewTransform ? m_previewTransform.GetPointer() : m_fusionTransform.GetPointer();
+}
+
+void Widget::resetManualAlignment()
+{
+    m_manual.Reset(m_fusionTransform);
+    m_previewTransform = nullptr;
+    m_alignDragButton = Qt::NoButton;
+}
+
+bool Widget::canAdjustAlignment() const
+{
+    return m_fixedLoaded && m_movingLoaded && m_manual.IsValid();
+}
+
+bool Widget::eventFilter(QObject *watched, QEvent *event)
+{
+    if ((watched == view_fixed || watched == view_moving) && event->type() == QEvent::Wheel) {
+        return handleSliceWheel(watched == view_fixed ? LoadTarget::Fixed : LoadTarget::Moving,
+                                static_cast<QWheelEvent *>(event));
+    }
+    if (watched == view_fusion && canAdjustAlignment()) {
+        switch (event->type()) {
+        case QEvent::KeyPress:
+            if (handleAlignmentKey(static_cast<QKeyEvent *>(event))) {
+                return true;
+            }
+            break;
+        case QEvent::MouseButtonPress:
+        case QEvent::MouseMove:
+        case QEvent::MouseButtonRelease:
+            if (handleAlignmentMouse(static_cast<QMouseEvent *>(event))) {
+                return true;
+            }
+            break;
+        default:
+            break;
+        }
+    }
+    return QWidget::eventFilter(watched, event);
+}
+
+bool Widget::handleAlignmentKey(QKeyEvent *event)
+{
+    // 方向键：沿屏幕方向平移 1 mm；PageUp / PageDown：沿视线方向平移；Q / E：绕定位点逆 / 顺时针旋转 0.5°。
+    // 按住 Shift 步长 ×5；Enter 提交，Esc 撤销
+    const bool coarse = event->modifiers() & Qt::ShiftModifier;
+    const double step = coarse ? 5.0 : 1.0;
+    const double angle = coarse ? 2.5 : 0.5;
+    itk::Vector<double, 3> right;
+    itk::Vector<double, 3> up;
+    itk::Vector<double, 3> normal;
+    fusionScreenAxes(right, up, normal);
+
+    switch (event->key()) {
+    case Qt::Key_Left:
+        nudgeTranslation(right * -step);
+        return true;
+    case Qt::Key_Right:
+        nudgeTranslation(right * step);
+        return true;
+    case Qt::Key_Up:
+        nudgeTranslation(up * step);
+        return true;
+    case Qt::Key_Down:
+        nudgeTranslation(up * -step);
+        return true;
+    case Qt::Key_PageUp:
+        nudgeTranslation(normal * step);
+        return true;
+    case Qt::Key_PageDown:
+        nudgeTranslation(normal * -step);
+        return true;
+    case Qt::Key_Q:
+        nudgeRotation(angle);
+        return true;
+    case Qt::Key_E:
+        nudgeRotation(-angle);
+        return true;
+    case Qt::Key_Return:
+    case Qt::Key_Enter:
+        commitManualAlignment();
+        return true;
+    case Qt::Key_Escape:
+        discardManualAlignment();
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool Widget::handleAlignmentMouse(QMouseEvent *event)
+{
+    // Ctrl + 左键拖动平移，Ctrl + 右键左右拖动旋转；其余鼠标操作交给 VTK（窗宽窗位、缩放等）
+    if (event->type() == QEvent::MouseButtonPress) {
+        if (!(event->modifiers() & Qt::ControlModifier)
+            || (event->button() != Qt::LeftButton && event->button() != Qt::RightButton)) {
+            return false;
+        }
+        m_alignDragButton = event->button();
+        m_alignDragPos = event->pos();
+        view_fusion->setFocus();
+        return true;
+    }
+    if (m_alignDragButton == Qt::NoButton) {
+        return false;
+    }
+    if (event->type() == QEvent::MouseButtonRelease) {
+        if (event->button() == m_alignDragButton) {
+            m_alignDragButton = Qt::NoButton;
+        }
+        return true;
+    }
+
+    const QPoint delta = event->pos() - m_alignDragPos;
+    if (delta.isNull()) {
+        return true;
+    }
+    m_alignDragPos = event->pos();
+    if (m_alignDragButton == Qt::RightButton) {
+        nudgeRotation(-0.25 * delta.x());
+        return true;
+    }
+    // 平行投影下视口高度对应 2 * ParallelScale（mm）
+    vtkCamera *camera = m_viewerFusion->GetRenderer()->GetActiveCamera();
+    const double pixel = 2.0 * camera->GetParallelScale() / std::max(1, view_fusion->height());
+    itk::Vector<double, 3> right;
+    itk::Vector<double, 3> up;
+    itk::Vector<double, 3> normal;
+    fusionScreenAxes(right, up, normal);
+    nudgeTranslation(right * (pixel * delta.x()) - up * (pixel * delta.y()));
+    return true;
+}
+
+void Widget::fusionScreenAxes(itk::Vector<double, 3> &right,
+                              itk::Vector<double, 3> &up,
+                              itk::Vector<double, 3> &normal) const
+{
+    // 相机坐标在 VTK 图像空间（原点 + 索引 × 间距，不含方向矩阵），乘方向矩阵得到物理方向
+    vtkCamera *camera = m_viewerFusion->GetRenderer()->GetActiveCamera();
+    const double *viewUp = camera->GetViewUp();
+    const double *projection = camera->GetDirectionOfProjection();
+    const double screenRight[3] = {projection[1] * viewUp[2] - projection[2] * viewUp[1],
+                                   projection[2] * viewUp[0] - projection[0] * viewUp[2],
+                                   projection[0] * viewUp[1] - projection[1] * viewUp[0]};
+    const auto &direction = m_fixedBricks->Grid().direction;
+    for (unsigned int r = 0; r < 3; ++r) {
+        right[r] = up[r] = normal[r] = 0.0;
+        for (unsigned int c = 0; c < 3; ++c) {
+            right[r] += direction[r][c] * screenRight[c];
+            up[r] += direction[r][c] * viewUp[c];
+            normal[r] -= direction[r][c] * projection[c]; // 指向观察者
+        }
+    }
+    right.Normalize();
+    up.Normalize();
+    normal.Normalize();
+}
+
+void Widget::nudgeTranslation(const itk::Vector<double, 3> &delta)
+{
+    if (!m_manual.IsModified()) {
+        // 后台粗对齐的结果晚到会覆盖微调
+        cancelCoarseAlignment();
+    }
+    m_manual.Translate(delta);
+    applyManualAlignment();
+}
+
+void Widget::nudgeRotation(double degrees)
+{
+    if (!m_manual.IsModified()) {
+        cancelCoarseAlignment();
+    }
+    itk::Vector<double, 3> right;
+    itk::Vector<double, 3> up;
+    itk::Vector<double, 3> normal;
+    fusionScreenAxes(right, up, normal);
+    m_manual.Rotate(normal, degrees * 3.14159265358979323846 / 180.0, m_cursor);
+    applyManualAlignment();
+}
+
+void Widget::applyManualAlignment()
+{
+    // 只替换融合切片的变换：当前切片（及差值）同步重采样，Moving 视图跟随定位点，体数据不重采样
+    const auto begin = dicomstitcher::Profiler::Clock::now();
+    m_previewTransform = m_manual.Transform();
+    m_fusionSlices.SetTransform(m_previewTransform);
+    syncViewsToCursor();
+    const auto end = dicomstitcher::Profiler::Clock::now();
+    dicomstitcher::Profiler &profiler = dicomstitcher::Profiler::Instance();
+    if (profiler.IsEnabled()) {
+        profiler.AddEvent("interaction", "align.nudge", begin, end);
+    }
+
+    const auto shift = m_manual.Translation(m_cursor);
+    UpdateStatus(QString::fromUtf8("手动对齐：平移 (%1, %2, %3) mm，旋转 %4°，重采样 %5 ms（Enter 提交，Esc 撤销）")
+                     .arg(shift[0], 0, 'f', 1)
+                     .arg(shift[1], 0, 'f', 1)
+                     .arg(shift[2], 0, 'f', 1)
+                     .arg(m_manual.RotationDegrees(), 0, 'f', 1)
+                     .arg(std::chrono::duration<double, std::milli>(end - begin).count(), 0, 'f', 1));
+}
+
+void Widget::commitManualAlignment()
+{
+    if (!m_previewTransform) {
         return;
     }
+    // 进行中的配准以旧变换为初值，结果不再适用
+    cancelRegistration();
+    m_fusionTransform = m_previewTransform;
+    resetManualAlignment(); // 融合切片已在使用该变换，不必重新设置
+    UpdateStatus(QString::fromUtf8("手动对齐已提交，将作为配准与导出的变换"), 100);
+}
 
-    reader->SetImageIO(gdcmIO);
-    reader->SetFileNames(fileNames->GetFileNames(seriesUIDs.front()));
+void Widget::discardManualAlignment()
+{
+    if (!m_previewTransform) {
+        return;
+    }
+    resetManualAlignment();
+    m_fusionSlices.SetTransform(m_fusionTransform);
+    syncViewsToCursor();
+    UpdateStatus(QString::fromUtf8("已撤销手动对齐"), 100);
+}
 
-    try {
-        reader->Update();
-    } catch (const itk::ExceptionObject &ex) {
-        QMessageBox::critical(this, QString::fromUtf8("错误"),
-                              QString::fromUtf8("读取失败：%1").arg(QString::fromLocal8Bit(ex.what())));
+void Widget::startCoarseAlignment()
+{
+    const quint64 generation = m_coarseGeneration;
+    if (!m_coarseWatcher) {
+        m_coarseWatcher = new QFutureWatcher<dicomstitcher::CoarseAlignmentResult>(this);
+    }
+    m_coarseWatcher->disconnect(this);
+    connect(m_coarseWatcher, &QFutureWatcherBase::finished, this, [this, generation]() {
+        onCoarseAlignmentFinished(generation);
+    });
+
+    dicomstitcher::CoarseAlignmentSettings settings;
+    settings.mode = static_cast<dicomstitcher::CoarseAlignmentMode>(ui->combo_coarse_mode->currentIndex());
+    dicomstitcher::ImagePyramid::Pointer fixed = m_fixedPyramid;
+    dicomstitcher::ImagePyramid::Pointer moving = m_movingPyramid;
+    const dicomstitcher::CancelToken cancel = m_coarseCancel;
+    beginTraceRun();
+    m_coarseWatcher->setFuture(QtConcurrent::run(&m_taskPool, [fixed, moving, settings, cancel]() {
+        try {
+            return dicomstitcher::ComputeCoarseAlignment(*fixed, *moving, settings, cancel);
+        } catch (const itk::ExceptionObject &) {
+            // 取消（ProcessAborted）或其他 ITK 异常：保留几何中心结果
+            return dicomstitcher::CoarseAlignmentResult();
+        } catch (const std::exception &) {
+            return dicomstitcher::CoarseAlignmentResult();
+        }
+    }));
+    UpdateStatus(QString::fromUtf8("正在计算粗对齐..."));
+    ui->btn_cancel_load->setEnabled(true);
+}
+
+void Widget::cancelCoarseAlignment()
+{
+    m_coarseCancel.Cancel();
+    m_coarseCancel = dicomstitcher::CancelToken();
+    ++m_coarseGeneration;
+}
+
+void Widget::onCoarseAlignmentFinished(quint64 generation)
+{
+    if (generation != m_coarseGeneration || !m_coarseWatcher) {
+        return;
+    }
+    dicomstitcher::CoarseAlignmentResult result = m_coarseWatcher->result();
+    ui->btn_cancel_load->setEnabled(isLoading());
+    finishTraceRun();
+    if (!result.ok || !result.transform) {
+        UpdateStatus(QString::fromUtf8("粗对齐未找到可靠匹配，使用几何中心"), 100);
         return;
     }
 
-    UpdateStatus(QString::fromUtf8("方向标准化 (Moving) ..."), 70);
-    ImageType::Pointer oriented = OrientToRAS(reader->GetOutput());
+    m_fusionTransform = result.transform;
+    resetManualAlignment();
+    m_fusionSlices.SetTransform(m_fusionTransform);
+    syncViewsToCursor();
+    UpdateStatus(QString::fromUtf8("粗对齐完成（z 偏移 %1 mm，旋转 %2°）")
+                     .arg(result.zShift, 0, 'f', 1)
+                     .arg(result.rotation * 180.0 / 3.14159265358979323846, 0, 'f', 1),
+                 100);
+}
 
-    UpdateStatus(QString::fromUtf8("各向同性重采样 1mm (Moving) ..."), 80);
-    m_movingResampled = ResampleToIsotropic(oriented.GetPointer(), 1.0);
+void Widget::onStartStitching()
+{
+    if (!m_fixedLoaded || !m_movingLoaded) {
+        QMessageBox::warning(this, QString::fromUtf8("提示"), QString::fromUtf8("请先加载 Fixed 与 Moving 图像。"));
+        return;
+    }
 
-    m_patientNameMoving = "N/A";
-    m_patientIDMoving   = "N/A";
+    dicomstitcher::RegistrationSettings settings;
+    switch (ui->combo_reg_mode->currentIndex()) {
+    case 0:
+        settings.mode = dicomstitcher::RegistrationMode::Rigid;
+        break;
+    case 1:
+        settings.mode = dicomstitcher::RegistrationMode::Affine;
+        break;
+    default:
+        QMessageBox::information(this, QString::fromUtf8("提示"), QString::fromUtf8("B-Spline 配准尚未实现。"));
+        return;
+    }
+
+    // 以当前融合变换为初值；未完成的粗对齐不再等待，避免结果晚到覆盖配准
+    cancelCoarseAlignment();
+    cancelRegistration();
+    const quint64 generation = m_registrationGeneration;
+    if (!m_registrationWatcher) {
+        m_registrationWatcher = new QFutureWatcher<dicomstitcher::RegistrationResult>(this);
+    }
+    m_registrationWatcher->disconnect(this);
+    connect(m_registrationWatcher, &QFutureWatcherBase::finished, this, [this, generation]() {
+        onRegistrationFinished(generation);
+    });
+
+    dicomstitcher::ProgressCallback progress =
+        [this, generation](const std::string &text, int value) {
+            const QString message = QString::fromStdString(text);
+            QMetaObject::invokeMethod(this, [this, generation, message, value]() {
+                if (m_registrationGeneration == generation) {
+                    UpdateStatus(message, value);
+                }
+            }, Qt::QueuedConnection);
+        };
+
+    dicomstitcher::ImagePyramid::Pointer fixed = m_fixedPyramid;
+    dicomstitcher::ImagePyramid::Pointer moving = m_movingPyramid;
+    itk::Transform<double, 3>::ConstPointer initial = m_fusionTransform.GetPointer();
+    const dicomstitcher::CancelToken cancel = m_registrationCancel;
+    beginTraceRun();
+    m_registrationWatcher->setFuture(QtConcurrent::run(&m_taskPool, [fixed, moving, initial, settings, cancel, progress]() {
+        return dicomstitcher::RegisterImages(*fixed, *moving, initial.GetPointer(),
+                                             settings, cancel, progress);
+    }));
+    ui->btn_start_stitching->setEnabled(false);
+    ui->btn_cancel_load->setEnabled(true);
+}
 
-    m_vtkMoving = ItkToVtkImage(m_movingResampled.GetPointer());
-    if (!m_vtkMoving) {
-        QMessageBox::warning(this, QString::fromUtf8("提示"), QString::fromUtf8("转换图像失败。"));
+void Widget::cancelRegistration()
+{
+    m_registrationCancel.Cancel();
+    m_registrationCancel = dicomstitcher::CancelToken();
+    ++m_registrationGeneration;
+    ui->btn_start_stitching->setEnabled(true);
+}
+
+void Widget::onRegistrationFinished(quint64 generation)
+{
+    if (generation != m_registrationGeneration || !m_registrationWatcher) {
         return;
     }
+    dicomstitcher::RegistrationResult result = m_registrationWatcher->result();
+    ui->btn_start_stitching->setEnabled(true);
+    ui->btn_cancel_load->setEnabled(isLoading());
+    finishTraceRun();
+
+    using Status = dicomstitcher::RegistrationResult::Status;
+    switch (result.status) {
+    case Status::Cancelled:
+        UpdateStatus(QString::fromUtf8("配准已取消"), 0);
+        return;
+    case Status::NoOverlap:
+        QMessageBox::warning(this, QString::fromUtf8("提示"), QString::fromUtf8("粗对齐后两组图像没有重叠区域。"));
+        return;
+    case Status::Failed:
+        QMessageBox::critical(this, QString::fromUtf8("错误"),
+                              QString::fromUtf8("配准失败：%1")
+                                  .arg(QString::fromLocal8Bit(result.errorMessage.c_str())));
+        return;
+    case Status::Ok:
+        break;
+    }
 
-    if (m_viewerMoving) {
-        m_viewerMoving->SetInputData(nullptr);
+    m_fusionTransform = result.transform;
+    resetManualAlignment();
+    m_fusionSlices.SetTransform(m_fusionTransform);
+    syncViewsToCursor();
+    UpdateStatus(QString::fromUtf8("配准完成（迭代 %1 次，MI %2）")
+                     .arg(result.iterations)
+                     .arg(result.metricValue, 0, 'f', 4),
+                 100);
+}
+
+void Widget::onExportResult()
+{
+    if (!m_fixedLoaded || !m_movingLoaded) {
+        QMessageBox::warning(this, QString::fromUtf8("提示"), QString::fromUtf8("请先加载 Fixed 与 Moving 图像。"));
+        return;
+    }
+    if (m_exportWatcher && m_exportWatcher->isRunning()) {
+        QMessageBox::information(this, QString::fromUtf8("提示"), QString::fromUtf8("导出正在进行。"));
+        return;
     }
-    m_viewerMoving->SetInputData(m_vtkMoving);
 
-    // 只使用轴向方向，取中间切片
-    const auto region = m_movingResampled->GetLargestPossibleRegion();
-    const auto size = region.GetSize();
-    const int axialMax = std::max<int>(0, static_cast<int>(size[2]) - 1);
-    int axialMid = std::clamp(static_cast<int>(size[2] / 2), 0, axialMax);
-    const int sagittalMax = std::max<int>(0, static_cast<int>(size[0]) - 1);
-    const int coronalMax  = std::max<int>(0, static_cast<int>(size[1]) - 1);
-    m_movingSliceAxial    = axialMid;
-    m_movingSliceSagittal = std::clamp(static_cast<int>(size[0] / 2), 0, sagittalMax);
-    m_movingSliceCoronal  = std::clamp(static_cast<int>(size[1] / 2), 0, coronalMax);
+    const QString dicomFilter = QString::fromUtf8("DICOM 序列 (*.dcm)");
+    const QString nrrdFilter = QString::fromUtf8("NRRD (*.nrrd)");
+    const QString niftiFilter = QString::fromUtf8("NIfTI (*.nii.gz *.nii)");
+    QString selectedFilter = dicomFilter;
+    QString path = QFileDialog::getSaveFileName(this, QString::fromUtf8("导出拼接结果"), QString(),
+                                                dicomFilter + ";;" + nrrdFilter + ";;" + niftiFilter,
+                                                &selectedFilter);
+    if (path.isEmpty()) {
+        return;
+    }
 
-    m_viewerMoving->SetSliceOrientationToXY();
-    m_viewerMoving->SetSlice(m_movingSliceAxial);
-    m_viewerMoving->SetColorWindow(2000.0);
-    m_viewerMoving->SetColorLevel(40.0);
-    if (auto *renderer = m_viewerMoving->GetRenderer()) {
-        renderer->ResetCamera();
+    dicomstitcher::ExportRequest request;
+    if (selectedFilter == nrrdFilter) {
+        request.format = dicomstitcher::ExportFormat::Nrrd;
+        if (!path.endsWith(".nrrd", Qt::CaseInsensitive)) {
+            path += ".nrrd";
         }
-    m_viewerMoving->Render();
-
-    // 标记已加载，注册切片观察者
-    m_movingLoaded = true;
-    registerSliceObserver(m_viewerMoving, m_sliceCallback, m_sliceObserverTagMoving);
-
-    // 若已加载 fixed，则做几何中心粗对齐并生成融合视图
-    if (m_fixedLoaded && m_fixedResampled) {
-        UpdateStatus(QString::fromUtf8("粗对齐（几何中心）并生成融合..."), 90);
-        using TranslationType = itk::TranslationTransform<double, 3>;
-        auto transform = TranslationType::New();
-        auto centerF = ComputeCenter(m_fixedResampled.GetPointer());
-        auto centerM = ComputeCenter(m_movingResampled.GetPointer());
-        TranslationType::OutputVectorType delta;
-        delta[0] = centerF[0] - centerM[0];
-        delta[1] = centerF[1] - centerM[1];
-        delta[2] = centerF[2] - centerM[2];
-        transform->Translate(delta);
-
-        m_movingCoarseOnFixed = ResampleToReference(m_movingResampled.GetPointer(),
-                                                    m_fixedResampled.GetPointer(),
-                                                    transform.GetPointer());
-
-        auto vtkMovingCoarse = ItkToVtkImage(m_movingCoarseOnFixed.GetPointer());
-        if (vtkMovingCoarse && m_vtkFixed) {
-            auto blender = vtkSmartPointer<vtkImageBlend>::New();
-            blender->SetBlendModeToNormal();
-            blender->AddInputData(m_vtkFixed);
-            blender->AddInputData(vtkMovingCoarse);
-            blender->SetOpacity(0, 1.0);
-            blender->SetOpacity(1, m_fusionOpacity);
-            blender->Update();
-            m_vtkFusion = blender->GetOutput();
-
-            if (m_viewerFusion) {
-                m_viewerFusion->SetInputData(m_vtkFusion);
-                m_viewerFusion->SetSlice(m_sliceAxial);
-                if (auto *rendererFusion = m_viewerFusion->GetRenderer()) {
-                    rendererFusion->ResetCamera();
-                }
-                m_viewerFusion->Render();
-            }
+    } else if (selectedFilter == niftiFilter) {
+        request.format = dicomstitcher::ExportFormat::Nifti;
+        if (!path.endsWith(".nii.gz", Qt::CaseInsensitive) && !path.endsWith(".nii", Qt::CaseInsensitive)) {
+            path += ".nii.gz";
         }
+        request.compress = path.endsWith(".gz", Qt::CaseInsensitive);
+    } else {
+        // DICOM 序列写到以所选文件名命名的目录中
+        request.format = dicomstitcher::ExportFormat::DicomSeries;
+        const QFileInfo info(path);
+        path = info.path() + "/" + info.completeBaseName();
+    }
+    request.path = path.toStdString();
+    request.referenceDictionary = m_fixedDictionary;
+
+    m_exportCancel.Cancel();
+    m_exportCancel = dicomstitcher::CancelToken();
+    const quint64 generation = ++m_exportGeneration;
+    if (!m_exportWatcher) {
+        m_exportWatcher = new QFutureWatcher<dicomstitcher::ExportResult>(this);
     }
+    m_exportWatcher->disconnect(this);
+    connect(m_exportWatcher, &QFutureWatcherBase::finished, this, [this, generation]() {
+        onExportFinished(generation);
+    });
+
+    dicomstitcher::ProgressCallback progress =
+        [this, generation](const std::string &text, int value) {
+            const QString message = QString::fromStdString(text);
+            QMetaObject::invokeMethod(this, [this, generation, message, value]() {
+                if (m_exportGeneration == generation) {
+                    UpdateStatus(message, value);
+                }
+            }, Qt::QueuedConnection);
+        };
+
+    // 使用当前融合变换（粗对齐或配准结果）
+    std::shared_ptr<const dicomstitcher::BrickedVolume> fixed = m_fixedBricks;
+    std::shared_ptr<const dicomstitcher::BrickedVolume> moving = m_movingBricks;
+    itk::Transform<double, 3>::ConstPointer transform = m_fusionTransform.GetPointer();
+    const dicomstitcher::CancelToken cancel = m_exportCancel;
+    beginTraceRun();
+    m_exportWatcher->setFuture(QtConcurrent::run(&m_taskPool, [fixed, moving, transform, request, cancel, progress]() {
+        return dicomstitcher::ExportStitchedVolume(*fixed, *moving, transform.GetPointer(),
+                                                   request, cancel, progress);
+    }));
+    ui->btn_export_result->setEnabled(false);
+    ui->btn_cancel_load->setEnabled(true);
+}
 
-    setOrientation(m_orientation); // 同步当前方向到 moving / fusion
-    UpdateAnnotations();
-    UpdateStatus(QString::fromUtf8("Moving 加载完成"), m_fixedLoaded ? 100 : 90);
+void Widget::onExportFinished(quint64 generation)
+{
+    if (generation != m_exportGeneration || !m_exportWatcher) {
+        return;
+    }
+    dicomstitcher::ExportResult result = m_exportWatcher->result();
+    ui->btn_export_result->setEnabled(true);
+    ui->btn_cancel_load->setEnabled(isLoading());
+    finishTraceRun();
+
+    using Status = dicomstitcher::ExportResult::Status;
+    switch (result.status) {
+    case Status::Cancelled:
+        UpdateStatus(QString::fromUtf8("导出已取消"), 0);
+        return;
+    case Status::NoInverse:
+        QMessageBox::warning(this, QString::fromUtf8("提示"), QString::fromUtf8("当前变换不可逆，无法计算输出范围。"));
+        return;
+    case Status::Failed:
+        QMessageBox::critical(this, QString::fromUtf8("错误"),
+                              QString::fromUtf8("导出失败：%1")
+                                  .arg(QString::fromLocal8Bit(result.errorMessage.c_str())));
+        return;
+    case Status::Ok:
+        break;
+    }
+    UpdateStatus(QString::fromUtf8("导出完成（%1 层）").arg(result.slices), 100);
 }
 
-vtkSmartPointer<vtkImageData> Widget::ItkToVtkImage(ImageType *image)
+void Widget::updateFusionView(bool orientationChanged)
 {
-    if (!image) {
-        return nullptr;
+    if (!m_viewerFusion || !m_fusionSlices.HasFixed()) {
+        return;
     }
 
-    const auto region = image->GetLargestPossibleRegion();
-    const auto size = region.GetSize();
-    const auto spacing = image->GetSpacing();
-    const auto origin = image->GetOrigin();
+    const dicomstitcher::SliceOrientation orientation = currentSliceOrientation();
 
-    auto vtkImage = vtkSmartPointer<vtkImageData>::New();
-    vtkImage->SetDimensions(static_cast<int>(size[0]),
-                            static_cast<int>(size[1]),
-                            static_cast<int>(size[2]));
-    vtkImage->SetSpacing(spacing[0], spacing[1], spacing[2]);
-    vtkImage->SetOrigin(origin[0], origin[1], origin[2]);
-    vtkImage->AllocateScalars(VTK_SHORT, 1);
+    // 只生成当前切片：viewer 的输入就是这一层，切换切片时替换输入
+    m_fusionSlices.SetWindowLevel(m_viewerMain->GetColorWindow(), m_viewerMain->GetColorLevel());
+    const int slice = fixedSliceAtCursor();
+    auto fused = m_fusionSlices.GetSlice(orientation, slice);
+    if (!fused) {
+        return;
+    }
+    m_vtkFusion = fused;
+    m_viewerFusion->SetInputData(m_vtkFusion);
+
+    if (orientationChanged) {
+        switch (m_orientation) {
+        case Orientation::Axial:
+            m_viewerFusion->SetSliceOrientationToXY();
+            break;
+        case Orientation::Coronal:
+            m_viewerFusion->SetSliceOrientationToXZ();
+            break;
+        case Orientation::Sagittal:
+            m_viewerFusion->SetSliceOrientationToYZ();
+            break;
+        }
+    }
+    m_viewerFusion->SetSlice(slice);
+    if (orientationChanged) {
+        if (auto *rendererFusion = m_viewerFusion->GetRenderer()) {
+            rendererFusion->ResetCamera();
+        }
+    }
+    m_renders.requestRender(m_renderFusion);
+
+    // 差值与融合共用同一张重采样切片，放在预取之前以免排在后台任务后面
+    updateDifferenceView(orientationChanged);
+    m_fusionSlices.Prefetch(orientation, slice, 2, m_scrollDirection);
+}
+
+void Widget::updateDifferenceView(bool orientationChanged)
+{
+    if (!m_viewerDifference || !m_fusionSlices.HasFixed()) {
+        return;
+    }
 
-    const size_t pixelCount = region.GetNumberOfPixels();
-    std::memcpy(vtkImage->GetScalarPointer(),
-                image->GetBufferPointer(),
-                pixelCount * sizeof(PixelType));
+    const int slice = fixedSliceAtCursor();
+    dicomstitcher::DifferenceStatistics statistics;
+    auto difference = m_fusionSlices.GetDifferenceSlice(currentSliceOrientation(), slice, &statistics);
+    if (!difference) {
+        return;
+    }
+    const bool firstSlice = !m_vtkDifference;
+    m_vtkDifference = difference;
+    m_viewerDifference->SetInputData(m_vtkDifference);
+
+    if (orientationChanged || firstSlice) {
+        switch (m_orientation) {
+        case Orientation::Axial:
+            m_viewerDifference->SetSliceOrientationToXY();
+            break;
+        case Orientation::Coronal:
+            m_viewerDifference->SetSliceOrientationToXZ();
+            break;
+        case Orientation::Sagittal:
+            m_viewerDifference->SetSliceOrientationToYZ();
+            break;
+        }
+    }
+    m_viewerDifference->SetSlice(slice);
+    if (orientationChanged || firstSlice) {
+        if (auto *renderer = m_viewerDifference->GetRenderer()) {
+            renderer->ResetCamera();
+        }
+    }
 
-    return vtkImage;
+    const bool boneOnly = ui->chk_check_alignment->isChecked();
+    m_annotDifference->SetText(0, boneOnly ? "Difference (bone)" : "Difference");
+    std::string readout = "MAD: -  NCC: -";
+    if (statistics.pixels > 0) {
+        char buffer[64];
+        std::snprintf(buffer, sizeof(buffer), "MAD: %.1f HU  NCC: %.3f",
+                      statistics.meanAbsoluteDifference, statistics.normalizedCrossCorrelation);
+        readout = buffer;
+    }
+    m_annotDifference->SetText(1, readout.c_str());
+    m_renders.requestRender(m_renderDifference);
 }
 
 std::string Widget::GetDicomValue(const itk::MetaDataDictionary &dict,
@@ -421,91 +1429,44 @@ std::string Widget::GetDicomValue(const itk::MetaDataDictionary &dict,
     return value;
 }
 
-Widget::ImageType::Pointer Widget::OrientToRAS(ImageType *image)
-{
-    using OrientFilter = itk::OrientImageFilter<ImageType, ImageType>;
-    auto orient = OrientFilter::New();
-    orient->UseImageDirectionOn();
-    orient->SetDesiredCoordinateOrientation(itk::SpatialOrientation::ITK_COORDINATE_ORIENTATION_RAS);
-    orient->SetInput(image);
-    orient->Update();
-    return orient->GetOutput();
-}
-
-Widget::ImageType::Pointer Widget::ResampleToIsotropic(ImageType *image, double spacing)
+void Widget::beginTraceRun()
 {
-    using ResampleFilter = itk::ResampleImageFilter<ImageType, ImageType>;
-    using Interpolator = itk::LinearInterpolateImageFunction<ImageType, double>;
-    auto resample = ResampleFilter::New();
-    auto interp = Interpolator::New();
-    resample->SetInput(image);
-    resample->SetInterpolator(interp);
-    resample->SetDefaultPixelValue(0);
-
-    ImageType::SpacingType newSpacing;
-    newSpacing.Fill(spacing);
-    resample->SetOutputSpacing(newSpacing);
-    resample->SetOutputOrigin(image->GetOrigin());
-    resample->SetOutputDirection(image->GetDirection());
-
-    const auto region = image->GetLargestPossibleRegion();
-    const auto size = region.GetSize();
-    const auto oldSpacing = image->GetSpacing();
-
-    ImageType::SizeType newSize;
-    for (unsigned int i = 0; i < 3; ++i) {
-        const double physicalLength = oldSpacing[i] * static_cast<double>(size[i] - 1);
-        newSize[i] = static_cast<ImageType::SizeType::SizeValueType>(
-            std::floor(physicalLength / newSpacing[i] + 0.5)) + 1;
+    // 一次"运行"为一段连续的后台活动：没有任务在运行时才清空，并发的加载 / 配准记入同一段
+    if (!isLoading()) {
+        dicomstitcher::Profiler::Instance().BeginRun();
     }
-    resample->SetSize(newSize);
-    resample->UpdateLargestPossibleRegion();
-    return resample->GetOutput();
 }
 
-Widget::ImageType::Pointer Widget::ResampleToReference(ImageType *image,
-                                                       ImageType *reference,
-                                                       itk::Transform<double, 3> *transform)
+void Widget::finishTraceRun()
 {
-    using ResampleFilter = itk::ResampleImageFilter<ImageType, ImageType>;
-    using Interpolator = itk::LinearInterpolateImageFunction<ImageType, double>;
-    auto resample = ResampleFilter::New();
-    auto interp = Interpolator::New();
-    resample->SetInput(image);
-    resample->SetInterpolator(interp);
-    resample->SetDefaultPixelValue(0);
-    resample->SetTransform(transform);
-
-    resample->SetOutputSpacing(reference->GetSpacing());
-    resample->SetOutputOrigin(reference->GetOrigin());
-    resample->SetOutputDirection(reference->GetDirection());
-    resample->SetSize(reference->GetLargestPossibleRegion().GetSize());
-    resample->UpdateLargestPossibleRegion();
-    return resample->GetOutput();
+    if (m_tracePath.isEmpty() || isLoading()) {
+        return;
+    }
+    dicomstitcher::Profiler::Instance().WriteChromeTrace(m_tracePath.toStdString());
 }
 
-itk::Point<double, 3> Widget::ComputeCenter(ImageType *image) const
+void Widget::showStageTimings(const QString &text, const std::vector<dicomstitcher::StageTiming> &stages)
 {
-    itk::Point<double, 3> center;
-    if (!image) {
-        center.Fill(0.0);
-        return center;
-    }
-    const auto region = image->GetLargestPossibleRegion();
-    const auto size = region.GetSize();
-    const auto spacing = image->GetSpacing();
-    const auto origin = image->GetOrigin();
-    const auto direction = image->GetDirection();
-
-    itk::Vector<double, 3> halfExtent;
-    for (unsigned int i = 0; i < 3; ++i) {
-        halfExtent[i] = spacing[i] * static_cast<double>(size[i] - 1) * 0.5;
+    // 状态栏给出主要阶段耗时，悬停提示给出完整的耗时与内存
+    QStringList summary;
+    QStringList details;
+    for (const auto &stage : stages) {
+        const QString name = StageDisplayName(stage.name);
+        if (stage.seconds >= 0.05) {
+            summary << QString::fromUtf8("%1 %2 s").arg(name).arg(stage.seconds, 0, 'f', 1);
+        }
+        details << QString::fromUtf8("%1：%2 s，内存 %3%4 MB（峰值 %5 MB）")
+                       .arg(name)
+                       .arg(stage.seconds, 0, 'f', 2)
+                       .arg(stage.rssDeltaBytes >= 0 ? "+" : "")
+                       .arg(stage.rssDeltaBytes / (1024.0 * 1024.0), 0, 'f', 0)
+                       .arg(stage.peakRssBytes / (1024.0 * 1024.0), 0, 'f', 0);
     }
-    itk::Vector<double, 3> dirHalf = direction * halfExtent;
-    for (unsigned int i = 0; i < 3; ++i) {
-        center[i] = origin[i] + dirHalf[i];
+    UpdateStatus(summary.isEmpty() ? text : QString::fromUtf8("%1（%2）").arg(text, summary.join(QString::fromUtf8("，"))),
+                 100);
+    if (ui->lbl_status_message) {
+        ui->lbl_status_message->setToolTip(details.join("\n"));
     }
-    return center;
 }
 
 void Widget::UpdateStatus(const QString &text, int progress)
@@ -518,72 +1479,122 @@ void Widget::UpdateStatus(const QString &text, int progress)
     }
 }
 
-void Widget::registerSliceObserver(vtkResliceImageViewer *viewer,
-                                   vtkSmartPointer<vtkCallbackCommand> &callback,
-                                   unsigned long &observerTag)
+bool Widget::handleSliceWheel(LoadTarget target, QWheelEvent *event)
 {
-    if (!viewer) {
-        return;
+    // 与 QVTKInteractorAdapter 相同按 120 为一格累计，触控板的细小增量凑满一格才翻页
+    m_wheelDelta += event->angleDelta().y();
+    const int steps = m_wheelDelta / 120;
+    m_wheelDelta -= steps * 120;
+    if (steps != 0) {
+        stepSlice(target, steps);
     }
+    return true;
+}
 
-    if (!callback) {
-        callback = vtkSmartPointer<vtkCallbackCommand>::New();
-        callback->SetCallback(Widget::SliceChangedCallback);
+void Widget::stepSlice(LoadTarget target, int steps)
+{
+    const bool fixed = target == LoadTarget::Fixed;
+    const dicomstitcher::ImageGrid *grid = fixed ? fixedViewGrid() : movingViewGrid();
+    if (!grid || !m_cursorValid) {
+        return;
     }
 
-    callback->SetClientData(this);
-
-    if (observerTag != 0) {
-        viewer->RemoveObserver(observerTag);
+    const dicomstitcher::SliceOrientation orientation = currentSliceOrientation();
+    const int current = sliceAtCursor(*grid, fixed ? nullptr : movingViewTransform());
+    const int slice = std::clamp(current + steps, 0, dicomstitcher::SliceCount(*grid, orientation) - 1);
+    if (slice == current) {
+        return;
     }
 
-    observerTag = viewer->AddObserver(vtkResliceImageViewer::SliceChangedEvent, callback);
+    const int before = fixedSliceAtCursor();
+    if (fixed) {
+        setCursorFromFixedSlice(slice);
+    } else {
+        setCursorFromMovingSlice(slice);
+    }
+    const int after = fixedSliceAtCursor();
+    if (after != before) {
+        m_scrollDirection = after > before ? 1 : -1;
+    }
+    syncViewsToCursor();
 }
 
-void Widget::handleSliceInteraction(vtkObject *caller)
+void Widget::updateSliceView(LoadTarget target, bool orientationChanged)
 {
-    if (!caller) {
+    const bool fixed = target == LoadTarget::Fixed;
+    vtkResliceImageViewer *viewer = fixed ? m_viewerMain.GetPointer() : m_viewerMoving.GetPointer();
+    const dicomstitcher::ImageGrid *grid = fixed ? fixedViewGrid() : movingViewGrid();
+    if (!viewer || !grid) {
         return;
     }
 
-    auto *viewerCaller = vtkResliceImageViewer::SafeDownCast(caller);
-    if (!viewerCaller) {
-        return;
+    const dicomstitcher::SliceOrientation orientation = currentSliceOrientation();
+    const int slice = sliceAtCursor(*grid, fixed ? nullptr : movingViewTransform());
+
+    // 预览体数据较小，整体作为输入；加载完成后只从分块读出当前这一层
+    const LoadTask &task = loadTask(target);
+    vtkImageData *input = task.preview.vtkImage.GetPointer();
+    if (!task.preview.image) {
+        SliceView &view = fixed ? m_fixedSlice : m_movingSlice;
+        if (!view.image || view.orientation != orientation || view.index != slice) {
+            const dicomstitcher::BrickedVolume &bricks = fixed ? *m_fixedBricks : *m_movingBricks;
+            view.image = dicomstitcher::ExtractSliceImage(bricks, orientation, slice);
+            view.orientation = orientation;
+            view.index = slice;
+        }
+        input = view.image.GetPointer();
     }
 
-    if (viewerCaller == m_viewerMain) {
-        const int slice = viewerCaller->GetSlice();
-        setStoredSlice(m_orientation, slice);
-    } else if (m_movingLoaded && viewerCaller == m_viewerMoving) {
-        const int slice = viewerCaller->GetSlice();
-        setStoredMovingSlice(m_orientation, slice);
+    if (viewer->GetInput() != input) {
+        // SetInputData 会按新输入的值域重置窗宽窗位，换层时保持用户的设置
+        const double window = viewer->GetColorWindow();
+        const double level = viewer->GetColorLevel();
+        viewer->SetInputData(input);
+        viewer->SetColorWindow(window);
+        viewer->SetColorLevel(level);
     }
-    UpdateAnnotations();
+
+    if (orientationChanged) {
+        switch (m_orientation) {
+        case Orientation::Axial:
+            viewer->SetSliceOrientationToXY();
+            break;
+        case Orientation::Coronal:
+            viewer->SetSliceOrientationToXZ();
+            break;
+        case Orientation::Sagittal:
+            viewer->SetSliceOrientationToYZ();
+            break;
+        }
+    }
+    viewer->SetSlice(slice);
+    if (orientationChanged) {
+        if (auto *renderer = viewer->GetRenderer()) {
+            renderer->ResetCamera();
+        }
+    }
+    m_renders.requestRender(fixed ? m_renderMain : m_renderMoving);
 }
 
-void Widget::SliceChangedCallback(vtkObject* caller,
-                                  unsigned long /*eventId*/,
-                                  void* clientData,
-                                  void* /*callData*/)
+void Widget::WindowLevelChangedCallback(vtkObject* /*caller*/,
+                                        unsigned long /*eventId*/,
+                                        void* clientData,
+                                        void* /*callData*/)
 {
     auto *self = static_cast<Widget*>(clientData);
     if (!self) {
         return;
     }
-    self->handleSliceInteraction(caller);
+    self->updateFusionView(false);
 }
 
 void Widget::UpdateAnnotations()
 {
     // Fixed viewer 注释（仅在已加载后）
-    if (m_fixedLoaded && m_viewerMain && m_annotMain) {
-        int sliceMin = m_viewerMain->GetSliceMin();
-        int sliceMax = m_viewerMain->GetSliceMax();
-        int totalSlices = sliceMax - sliceMin + 1;
-        if (totalSlices < 1) totalSlices = 1;
-
-        int slice = m_viewerMain->GetSlice() - sliceMin + 1; // 1-based
-        slice = std::clamp(slice, 1, totalSlices);
+    // viewer 的输入只有当前一层，层号与总层数按网格计算
+    if (const dicomstitcher::ImageGrid *grid = fixedViewGrid(); grid && m_viewerMain && m_annotMain) {
+        const int totalSlices = std::max(1, dicomstitcher::SliceCount(*grid, currentSliceOrientation()));
+        const int slice = std::clamp(sliceAtCursor(*grid, nullptr) + 1, 1, totalSlices); // 1-based
 
         const char *orientationLabel = "Axial";
         if (m_orientation == Orientation::Coronal) {
@@ -593,6 +1604,9 @@ void Widget::UpdateAnnotations()
         }
 
         std::string topLeft = "View: " + std::string(orientationLabel);
+        if (m_fixedLoad.preview.image) {
+            topLeft += "  Preview " + std::to_string(static_cast<int>(m_fixedLoad.preview.refined * 100.0)) + "%";
+        }
         m_annotMain->SetText(0, topLeft.c_str());
 
         std::string bottomLeft = "Slice: " + std::to_string(slice) +
@@ -604,19 +1618,15 @@ void Widget::UpdateAnnotations()
         std::string bottomRight = "W: " + std::to_string(static_cast<int>(w)) +
                                   "  L: " + std::to_string(static_cast<int>(l));
         m_annotMain->SetText(2, bottomRight.c_str());
+        m_annotMain->SetText(3, m_showFrameStats ? m_renders.summary().toStdString().c_str() : "");
 
-        m_viewerMain->Render();
+        m_renders.requestRender(m_renderMain);
     }
 
     // Moving viewer 注释（仅在加载后）
-    if (m_movingLoaded && m_viewerMoving && m_annotMoving) {
-        int sliceMin = m_viewerMoving->GetSliceMin();
-        int sliceMax = m_viewerMoving->GetSliceMax();
-        int totalSlices = sliceMax - sliceMin + 1;
-        if (totalSlices < 1) totalSlices = 1;
-
-        int slice = m_viewerMoving->GetSlice() - sliceMin + 1;
-        slice = std::clamp(slice, 1, totalSlices);
+    if (const dicomstitcher::ImageGrid *grid = movingViewGrid(); grid && m_viewerMoving && m_annotMoving) {
+        const int totalSlices = std::max(1, dicomstitcher::SliceCount(*grid, currentSliceOrientation()));
+        const int slice = std::clamp(sliceAtCursor(*grid, movingViewTransform()) + 1, 1, totalSlices);
 
         const char *orientationLabel = "Axial";
         if (m_orientation == Orientation::Coronal) {
@@ -626,6 +1636,9 @@ void Widget::UpdateAnnotations()
         }
 
         std::string topLeft = "View: " + std::string(orientationLabel);
+        if (m_movingLoad.preview.image) {
+            topLeft += "  Preview " + std::to_string(static_cast<int>(m_movingLoad.preview.refined * 100.0)) + "%";
+        }
         m_annotMoving->SetText(0, topLeft.c_str());
 
         std::string bottomLeft = "Slice: " + std::to_string(slice) +
@@ -638,7 +1651,7 @@ void Widget::UpdateAnnotations()
                                   "  L: " + std::to_string(static_cast<int>(l));
         m_annotMoving->SetText(2, bottomRight.c_str());
 
-        m_viewerMoving->Render();
+        m_renders.requestRender(m_renderMoving);
     }
 }
 
@@ -661,141 +1674,99 @@ void Widget::setOrientation(Orientation orientation)
 
     m_orientation = orientation;
 
-    switch (orientation) {
-    case Orientation::Axial:
-        m_viewerMain->SetSliceOrientationToXY();
-        if (m_movingLoaded) m_viewerMoving->SetSliceOrientationToXY();
-        if (m_vtkFusion && m_viewerFusion) m_viewerFusion->SetSliceOrientationToXY();
-        break;
+    // 切换方向不移动定位点：新方向的各视图仍经过同一个物理点，翻页方向重新计
+    m_scrollDirection = 0;
+    syncViewsToCursor(true);
+    m_renders.requestAll();
+}
+
+dicomstitcher::SliceOrientation Widget::currentSliceOrientation() const
+{
+    switch (m_orientation) {
     case Orientation::Coronal:
-        m_viewerMain->SetSliceOrientationToXZ();
-        if (m_movingLoaded) m_viewerMoving->SetSliceOrientationToXZ();
-        if (m_vtkFusion && m_viewerFusion) m_viewerFusion->SetSliceOrientationToXZ();
-        break;
+        return dicomstitcher::SliceOrientation::Coronal;
     case Orientation::Sagittal:
-        m_viewerMain->SetSliceOrientationToYZ();
-        if (m_movingLoaded) m_viewerMoving->SetSliceOrientationToYZ();
-        if (m_vtkFusion && m_viewerFusion) m_viewerFusion->SetSliceOrientationToYZ();
-        break;
-    }
-
-    applySliceForCurrentOrientation(storedSlice(orientation));
-    int baseSlice = storedSlice(orientation);
-    if (m_movingLoaded) {
-        int movingSlice = storedMovingSlice(orientation);
-        movingSlice = clampSliceForViewer(m_viewerMoving, movingSlice);
-        m_viewerMoving->SetSlice(movingSlice);
-        if (auto *renderer = m_viewerMoving->GetRenderer()) {
-            renderer->ResetCamera();
-        }
-        m_viewerMoving->Render();
-    }
-    if (m_vtkFusion && m_viewerFusion) {
-        int fusionSlice = clampSliceForViewer(m_viewerFusion, baseSlice);
-        m_viewerFusion->SetSlice(fusionSlice);
-        if (auto *rendererFusion = m_viewerFusion->GetRenderer()) {
-            rendererFusion->ResetCamera();
-        }
-        m_viewerFusion->Render();
+        return dicomstitcher::SliceOrientation::Sagittal;
+    case Orientation::Axial:
+    default:
+        return dicomstitcher::SliceOrientation::Axial;
     }
+}
 
-    if (auto *renderer = m_viewerMain->GetRenderer()) {
-        renderer->ResetCamera();
+const dicomstitcher::ImageGrid *Widget::fixedViewGrid() const
+{
+    if (m_fixedLoad.preview.image) {
+        return &m_fixedLoad.previewGrid;
     }
-    m_viewerMain->Render();
-    UpdateAnnotations();
+    return m_fixedBricks ? &m_fixedBricks->Grid() : nullptr;
 }
 
-void Widget::applySliceForCurrentOrientation(int slice)
+const dicomstitcher::ImageGrid *Widget::movingViewGrid() const
 {
-    if (!m_viewerMain) {
-        return;
+    if (m_movingLoad.preview.image) {
+        return &m_movingLoad.previewGrid;
     }
-    const int clamped = clampSliceForCurrentViewer(slice);
-    setStoredSlice(m_orientation, clamped);
-    m_viewerMain->SetSlice(clamped);
-    m_viewerMain->Render();
-    UpdateAnnotations();
+    return m_movingBricks ? &m_movingBricks->Grid() : nullptr;
 }
 
-int Widget::clampSliceForViewer(vtkResliceImageViewer *viewer, int slice) const
+const itk::Transform<double, 3> *Widget::movingViewTransform() const
 {
-    if (!viewer) {
-        return slice;
-    }
-    int minVal = viewer->GetSliceMin();
-    int maxVal = viewer->GetSliceMax();
-    if (slice < minVal) return minVal;
-    if (slice > maxVal) return maxVal;
-    return slice;
+    return m_movingLoad.preview.image ? nullptr : displayedTransform();
 }
 
-int Widget::clampSliceForCurrentViewer(int slice) const
+int Widget::sliceAtCursor(const dicomstitcher::ImageGrid &grid, const itk::Transform<double, 3> *transform) const
 {
-    if (!m_viewerMain) {
-        return slice;
+    if (!m_cursorValid) {
+        return 0;
     }
-    int minVal = m_viewerMain->GetSliceMin();
-    int maxVal = m_viewerMain->GetSliceMax();
-    if (slice < minVal) return minVal;
-    if (slice > maxVal) return maxVal;
-    return slice;
+    const ImageType::PointType point = transform ? transform->TransformPoint(m_cursor) : m_cursor;
+    return dicomstitcher::NearestSlice(grid, currentSliceOrientation(), point);
 }
 
-void Widget::setStoredSlice(Orientation orientation, int slice)
+int Widget::fixedSliceAtCursor() const
 {
-    switch (orientation) {
-    case Orientation::Axial:
-        m_sliceAxial = slice;
-        break;
-    case Orientation::Coronal:
-        m_sliceCoronal = slice;
-        break;
-    case Orientation::Sagittal:
-        m_sliceSagittal = slice;
-        break;
-    }
+    return m_fixedBricks ? sliceAtCursor(m_fixedBricks->Grid(), nullptr) : 0;
 }
 
-int Widget::storedSlice(Orientation orientation) const
+void Widget::setCursorFromFixedSlice(int slice)
 {
-    switch (orientation) {
-    case Orientation::Axial:
-        return m_sliceAxial;
-    case Orientation::Coronal:
-        return m_sliceCoronal;
-    case Orientation::Sagittal:
-        return m_sliceSagittal;
-    default:
-        return 0;
+    const dicomstitcher::ImageGrid *grid = fixedViewGrid();
+    if (!grid || !m_cursorValid) {
+        return;
     }
+    m_cursor = dicomstitcher::SliceToWorld(*grid, currentSliceOrientation(), slice, m_cursor);
 }
 
-void Widget::setStoredMovingSlice(Orientation orientation, int slice)
+void Widget::setCursorFromMovingSlice(int slice)
 {
-    switch (orientation) {
-    case Orientation::Axial:
-        m_movingSliceAxial = slice;
-        break;
-    case Orientation::Coronal:
-        m_movingSliceCoronal = slice;
-        break;
-    case Orientation::Sagittal:
-        m_movingSliceSagittal = slice;
-        break;
+    const dicomstitcher::ImageGrid *grid = movingViewGrid();
+    if (!grid || !m_cursorValid) {
+        return;
+    }
+    const itk::Transform<double, 3> *transform = movingViewTransform();
+    if (!transform) {
+        m_cursor = dicomstitcher::SliceToWorld(*grid, currentSliceOrientation(), slice, m_cursor);
+        return;
     }
+    // 在 Moving 空间移到目标层，再用逆变换映射回 Fixed；变换不可逆时定位点不动，Moving 视图随后被拉回
+    const auto inverse = transform->GetInverseTransform();
+    if (!inverse) {
+        return;
+    }
+    const ImageType::PointType moved =
+        dicomstitcher::SliceToWorld(*grid, currentSliceOrientation(), slice, transform->TransformPoint(m_cursor));
+    m_cursor = inverse->TransformPoint(moved);
 }
 
-int Widget::storedMovingSlice(Orientation orientation) const
+void Widget::syncViewsToCursor(bool orientationChanged)
 {
-    switch (orientation) {
-    case Orientation::Axial:
-        return m_movingSliceAxial;
-    case Orientation::Coronal:
-        return m_movingSliceCoronal;
-    case Orientation::Sagittal:
-        return m_movingSliceSagittal;
-    default:
-        return 0;
+    if (m_syncingViews) {
+        return;
     }
+    m_syncingViews = true;
+    updateSliceView(LoadTarget::Fixed, orientationChanged);
+    updateSliceView(LoadTarget::Moving, orientationChanged);
+    updateFusionView(orientationChanged);
+    m_syncingViews = false;
+    UpdateAnnotations();
 }
@@ -2,6 +2,9 @@
 #define WIDGET_H
 
 #include <QWidget>
+#include <QFutureWatcher>
+#include <QPoint>
+#include <QThreadPool>
 
 #include <vtkSmartPointer.h>
 #include <vtkResliceImageViewer.h>
@@ -14,6 +17,17 @@
 #include <itkMetaDataObject.h>
 #include <itkTransform.h>
 
+#include "pipelinecommon.h"
+#include "dicomindex.h"
+#include "seriesloader.h"
+#include "fusionsliceprovider.h"
+#include "registration.h"
+#include "coarsealignment.h"
+#include "resultexporter.h"
+#include "renderscheduler.h"
+#include "manualalignment.h"
+
+#include <memory>
 #include <string>
 
 QT_BEGIN_NAMESPACE
@@ -27,6 +41,9 @@ class QVTKOpenGLNativeWidget;
 class vtkGenericOpenGLRenderWindow;
 class vtkRenderer;
 class vtkObject;
+class QKeyEvent;
+class QMouseEvent;
+class QWheelEvent;
 
 class Widget : public QWidget
 {
@@ -36,35 +53,93 @@ public:
     Widget(QWidget *parent = nullptr);
     ~Widget();
 
+protected:
+    bool eventFilter(QObject *watched, QEvent *event) override;
+
 private slots:
     void onOpenDicom();
     void onOpenMoving();
     void onOrientationToggled();
+    void onCancelLoad();
+    void onSpacingModeChanged(int index);
+    void onFusionOpacityChanged(int value);
+    void onFusionModeToggled(bool overlay);
+    void onStartStitching();
+    void onCoarseModeChanged(int index);
+    void onExportResult();
+    void onCheckAlignmentToggled(bool boneOnly);
 
 private:
     enum class Orientation { Axial, Coronal, Sagittal };
+    enum class LoadTarget { Fixed, Moving };
+
+    using PixelType = dicomstitcher::PixelType;
+    static constexpr unsigned int Dimension = dicomstitcher::Dimension;
+    using ImageType = dicomstitcher::ImageType;
+
+    // 后台加载任务（目录索引 → 选择序列 → 加载）：generation 用于丢弃被重新选择目录所取代的旧结果
+    struct LoadTask
+    {
+        QFutureWatcher<dicomstitcher::DicomIndexResult> *indexWatcher{nullptr};
+        QFutureWatcher<dicomstitcher::SeriesLoadResult> *watcher{nullptr};
+        dicomstitcher::CancelToken cancel;
+        quint64 generation{0};
+        dicomstitcher::SeriesPreview preview; // 正在显示的渐进加载预览，加载结束时清空
+        dicomstitcher::ImageGrid previewGrid;
+    };
+
+    // Fixed / Moving 视图当前显示的一张切片（从分块读取），方向与层号不变时复用
+    struct SliceView
+    {
+        vtkSmartPointer<vtkImageData> image;
+        dicomstitcher::SliceOrientation orientation{dicomstitcher::SliceOrientation::Axial};
+        int index{-1};
+    };
 
-    using PixelType = short;
-    static constexpr unsigned int Dimension = 3;
-    using ImageType = itk::Image<PixelType, Dimension>;
-
-    vtkSmartPointer<vtkImageData> ItkToVtkImage(ImageType *image);
     std::string GetDicomValue(const itk::MetaDataDictionary &dict,
                               const std::string &tagKey) const;
-    ImageType::Pointer OrientToRAS(ImageType *image);
-    ImageType::Pointer ResampleToIsotropic(ImageType *image, double spacing = 1.0);
-    ImageType::Pointer ResampleToReference(ImageType *image,
-                                           ImageType *reference,
-                                           itk::Transform<double, 3> *transform);
-    itk::Point<double, 3> ComputeCenter(ImageType *image) const;
-    void registerSliceObserver(vtkResliceImageViewer *viewer,
-                               vtkSmartPointer<vtkCallbackCommand> &callback,
-                               unsigned long &observerTag);
-    void handleSliceInteraction(vtkObject *caller);
-    static void SliceChangedCallback(vtkObject* caller,
-                                     unsigned long eventId,
-                                     void* clientData,
-                                     void* callData);
+    dicomstitcher::SpacingPolicy currentSpacingPolicy() const;
+    LoadTask &loadTask(LoadTarget target);
+    void startIndexScan(LoadTarget target, const QString &dirPath);
+    void onIndexFinished(LoadTarget target, quint64 generation, const QString &dirPath);
+    void startLoad(LoadTarget target, const QString &dirPath, const dicomstitcher::DicomSeriesInfo &series);
+    void onLoadFinished(LoadTarget target, quint64 generation);
+    void applyPreview(LoadTarget target, const dicomstitcher::SeriesPreview &preview);
+    void discardPreview(LoadTarget target);
+    // previewed：本次加载已显示过预览，沿用预览时的定位点、窗宽窗位与相机
+    void applyFixedResult(dicomstitcher::SeriesLoadResult &result, bool previewed);
+    void applyMovingResult(dicomstitcher::SeriesLoadResult &result, bool previewed);
+    void updateFusionSource();
+    const itk::Transform<double, 3> *displayedTransform() const;
+    bool handleAlignmentKey(QKeyEvent *event);
+    bool handleAlignmentMouse(QMouseEvent *event);
+    bool canAdjustAlignment() const;
+    void fusionScreenAxes(itk::Vector<double, 3> &right, itk::Vector<double, 3> &up, itk::Vector<double, 3> &normal) const;
+    void nudgeTranslation(const itk::Vector<double, 3> &delta);
+    void nudgeRotation(double degrees);
+    void applyManualAlignment();
+    void commitManualAlignment();
+    void discardManualAlignment();
+    void resetManualAlignment();
+    void startCoarseAlignment();
+    void cancelCoarseAlignment();
+    void onCoarseAlignmentFinished(quint64 generation);
+    void cancelRegistration();
+    void onRegistrationFinished(quint64 generation);
+    void onExportFinished(quint64 generation);
+    void beginTraceRun();
+    void finishTraceRun();
+    void showStageTimings(const QString &text, const std::vector<dicomstitcher::StageTiming> &stages);
+    void updateSliceView(LoadTarget target, bool orientationChanged);
+    void updateFusionView(bool orientationChanged);
+    void updateDifferenceView(bool orientationChanged);
+    bool isLoading() const;
+    bool handleSliceWheel(LoadTarget target, QWheelEvent *event);
+    void stepSlice(LoadTarget target, int steps);
+    static void WindowLevelChangedCallback(vtkObject* caller,
+                                           unsigned long eventId,
+                                           void* clientData,
+                                           void* callData);
     void UpdateStatus(const QString &text, int progress = -1);
 
     Ui::Widget *ui;
@@ -73,34 +148,48 @@ private:
     QVTKOpenGLNativeWidget *view_fixed;
     QVTKOpenGLNativeWidget *view_moving;
     QVTKOpenGLNativeWidget *view_fusion;
+    QVTKOpenGLNativeWidget *view_difference;
     vtkGenericOpenGLRenderWindow *renderWindow_main;
     vtkGenericOpenGLRenderWindow *renderWindow_moving;
     vtkGenericOpenGLRenderWindow *renderWindow_fusion;
+    vtkGenericOpenGLRenderWindow *renderWindow_difference;
     vtkSmartPointer<vtkResliceImageViewer> m_viewerMain;
     vtkSmartPointer<vtkResliceImageViewer> m_viewerMoving;
     vtkSmartPointer<vtkResliceImageViewer> m_viewerFusion;
+    vtkSmartPointer<vtkResliceImageViewer> m_viewerDifference;
+
+    // 重绘请求经调度器合并，每个视图每帧最多渲染一次
+    RenderScheduler m_renders;
+    int m_renderMain{-1};
+    int m_renderMoving{-1};
+    int m_renderFusion{-1};
+    int m_renderDifference{-1};
+    bool m_showFrameStats{false}; // 环境变量 DICOMSTITCHER_FRAME_STATS：Fixed 视图右上角显示各视图平均帧耗时
 
     // 角标
     vtkSmartPointer<vtkCornerAnnotation> m_annotMain;
     vtkSmartPointer<vtkCornerAnnotation> m_annotMoving;
     vtkSmartPointer<vtkCornerAnnotation> m_annotFusion;
+    vtkSmartPointer<vtkCornerAnnotation> m_annotDifference; // 当前切片的 MAD / NCC
 
     // 回调
-    vtkSmartPointer<vtkCallbackCommand> m_sliceCallback;
-    unsigned long m_sliceObserverTag;
-    unsigned long m_sliceObserverTagMoving;
+    vtkSmartPointer<vtkCallbackCommand> m_windowLevelCallback; // Fixed 窗宽窗位 → 融合视图
 
     // 当前状态
     Orientation m_orientation{Orientation::Axial};
-    int m_sliceAxial{0};
-    int m_sliceCoronal{0};
-    int m_sliceSagittal{0};
-    int m_movingSliceAxial{0};
-    int m_movingSliceCoronal{0};
-    int m_movingSliceSagittal{0};
+    // 各视图共享的定位点（Fixed 物理坐标）：Fixed / 融合视图显示它所在的层，
+    // Moving 视图显示它经融合变换映射后所在的层；任一视图翻页都先更新定位点再同步其余视图
+    ImageType::PointType m_cursor;
+    bool m_cursorValid{false};
+    int m_scrollDirection{0}; // 最近一次翻页在 Fixed 上的方向（±1），融合视图沿该方向预取
+    int m_wheelDelta{0};      // Fixed / Moving 视图累计的滚轮角度，满一格翻一层
+    bool m_syncingViews{false};
     bool m_fixedLoaded{false};
     bool m_movingLoaded{false};
     double m_fusionOpacity{0.5};
+    unsigned int m_readerThreads{0}; // 切片并行解码线程数，0 表示 ITK 默认
+    std::size_t m_spacingMemoryBudget{std::size_t(1) << 30}; // "按内存自动"时单个体数据上限，见构造函数
+    QString m_tracePath; // 环境变量 DICOMSTITCHER_TRACE：每次后台任务全部结束后把跟踪写到该文件
 
     // DICOM 元数据缓存
     std::string m_patientName;
@@ -108,22 +197,58 @@ private:
     std::string m_patientNameMoving;
     std::string m_patientIDMoving;
 
-    // 预处理结果缓存
-    ImageType::Pointer m_fixedResampled;
-    ImageType::Pointer m_movingResampled;
-    ImageType::Pointer m_movingCoarseOnFixed;
-    vtkSmartPointer<vtkImageData> m_vtkFixed;
-    vtkSmartPointer<vtkImageData> m_vtkMoving;
-    vtkSmartPointer<vtkImageData> m_vtkFusion;
+    // 预处理结果：体数据只以分块形式保存，各视图按切片读取、配准与导出按区域读取，
+    // 常驻量受 m_brickPool 的预算限制；金字塔的降采样层级常驻内存
+    std::shared_ptr<dicomstitcher::BrickPool> m_brickPool;
+    std::shared_ptr<dicomstitcher::BrickedVolume> m_fixedBricks;
+    std::shared_ptr<dicomstitcher::BrickedVolume> m_movingBricks;
+    dicomstitcher::ImagePyramid::Pointer m_fixedPyramid;  // 原图为分块；配准 / 粗对齐共享
+    dicomstitcher::ImagePyramid::Pointer m_movingPyramid;
+    itk::MetaDataDictionary m_fixedDictionary; // 导出 DICOM 时沿用的 Fixed 标签
+    SliceView m_fixedSlice;
+    SliceView m_movingSlice;
+    vtkSmartPointer<vtkImageData> m_vtkFusion; // 当前显示的融合切片
+    vtkSmartPointer<vtkImageData> m_vtkDifference; // 当前显示的差值切片
+
+    // 后台任务：全部在 m_taskPool 中运行。被新任务取代的旧任务只取消不等待，
+    // 析构时等待池中所有任务结束，工作线程才不会再向已析构的 Widget 排队回调
+    QThreadPool m_taskPool;
+    LoadTask m_fixedLoad;
+    LoadTask m_movingLoad;
+
+    QFutureWatcher<dicomstitcher::CoarseAlignmentResult> *m_coarseWatcher{nullptr};
+    dicomstitcher::CancelToken m_coarseCancel;
+    quint64 m_coarseGeneration{0};
+
+    QFutureWatcher<dicomstitcher::RegistrationResult> *m_registrationWatcher{nullptr};
+    dicomstitcher::CancelToken m_registrationCancel;
+    quint64 m_registrationGeneration{0};
+
+    QFutureWatcher<dicomstitcher::ExportResult> *m_exportWatcher{nullptr};
+    dicomstitcher::CancelToken m_exportCancel;
+    quint64 m_exportGeneration{0};
+
+    // 融合视图按需生成切片；m_fusionTransform 为当前 Fixed → Moving 变换（粗对齐或配准结果）
+    dicomstitcher::FusionSliceProvider m_fusionSlices;
+    itk::Transform<double, 3>::Pointer m_fusionTransform;
+    // 手动对齐：在融合视图中微调 Moving，未提交前只重采样当前显示的切片；
+    // 配准与导出只使用提交后的 m_fusionTransform
+    dicomstitcher::ManualAlignment m_manual;
+    itk::Transform<double, 3>::Pointer m_previewTransform; // 未提交的微调结果，为空时显示 m_fusionTransform
+    Qt::MouseButton m_alignDragButton{Qt::NoButton};
+    QPoint m_alignDragPos;
 
     void UpdateAnnotations();
     void setOrientation(Orientation orientation);
-    void applySliceForCurrentOrientation(int slice);
-    int clampSliceForCurrentViewer(int slice) const;
-    int clampSliceForViewer(vtkResliceImageViewer *viewer, int slice) const;
-    void setStoredSlice(Orientation orientation, int slice);
-    int storedSlice(Orientation orientation) const;
-    void setStoredMovingSlice(Orientation orientation, int slice);
-    int storedMovingSlice(Orientation orientation) const;
+    dicomstitcher::SliceOrientation currentSliceOrientation() const;
+    // 主视图 / Moving 视图正在显示的网格：渐进加载期间为预览，否则为已加载的数据；都没有时为空
+    const dicomstitcher::ImageGrid *fixedViewGrid() const;
+    const dicomstitcher::ImageGrid *movingViewGrid() const;
+    const itk::Transform<double, 3> *movingViewTransform() const; // 预览阶段新数据还没有融合变换
+    int sliceAtCursor(const dicomstitcher::ImageGrid &grid, const itk::Transform<double, 3> *transform) const;
+    int fixedSliceAtCursor() const;  // 融合视图所用的 Fixed 网格
+    void setCursorFromFixedSlice(int slice);
+    void setCursorFromMovingSlice(int slice);
+    void syncViewsToCursor(bool orientationChanged = false);
 };
 #endif // WIDGET_H